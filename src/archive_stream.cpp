@@ -0,0 +1,852 @@
+/*** archive_stream.cpp -- single pass reader of tar and zip archives
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+
+#include "archive_stream.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "file_buf.h"
+#include "util.h"
+
+#if defined HAVE_ZLIB_H && defined HAVE_LIBZ
+# include <zlib.h>
+# define USE_ZLIB 1
+#endif
+
+#if defined HAVE_LZMA_H && defined HAVE_LIBLZMA
+# include <lzma.h>
+# define USE_LZMA 1
+#endif
+
+#if !defined O_BINARY
+# define O_BINARY 0
+#endif
+
+
+
+enum stream_format {
+	STREAM_TAR,
+	STREAM_GZIP,
+	STREAM_XZ,
+	STREAM_ZIP
+};
+
+/* bytes of compressed input read at once */
+#define STREAM_IN_SIZE (256 * 1024)
+#define TAR_BLOCK 512
+/* largest single read(), some systems fail on 2 GB and more */
+#define READ_MAX (1L << 30)
+
+#define ZIP_LOCAL 0x04034b50
+#define ZIP_CENTRAL 0x02014b50
+#define ZIP_END 0x06054b50
+#define ZIP_END64 0x06064b50
+#define ZIP_DESCRIPTOR 0x08074b50
+#define ZIP_HAS_DESCRIPTOR 0x08
+#define ZIP_ENCRYPTED 0x01
+
+
+static inline unsigned int get_le16( const unsigned char *p )
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline unsigned long get_le32( const unsigned char *p )
+{
+	return get_le16( p ) | ((unsigned long) get_le16( p + 2 ) << 16);
+}
+
+static inline unsigned long long get_le64( const unsigned char *p )
+{
+	return get_le32( p ) | ((unsigned long long) get_le32( p + 4 ) << 32);
+}
+
+/* format of an archive by its first bytes, -1 if unknown */
+static int detect_format( const unsigned char *p, long len )
+{
+	if( len >= 2 && p[0] == 0x1f && p[1] == 0x8b ) {
+		return STREAM_GZIP;
+	}
+	if( len >= 6 && memcmp( p, "\xfd" "7zXZ\0", 6 ) == 0 ) {
+		return STREAM_XZ;
+	}
+	if( len >= 4 && (get_le32( p ) == ZIP_LOCAL || get_le32( p ) == ZIP_END) ) {
+		return STREAM_ZIP;
+	}
+	if( len >= 263 && memcmp( p + 257, "ustar", 5 ) == 0 ) {
+		return STREAM_TAR;
+	}
+	return -1;
+}
+
+/* numeric tar header field, octal or GNU base-256 */
+static long long tar_number( const char *p, int len )
+{
+	const unsigned char *u = (const unsigned char*) p;
+	long long n = 0;
+	if( u[0] & 0x80 ) {
+		n = u[0] & 0x3f;
+		for( int i = 1; i < len; i++ ) {
+			n = (n << 8) | u[i];
+		}
+		return n;
+	}
+	int i = 0;
+	while( i < len && (p[i] == ' ' || p[i] == '\0') ) {
+		i++;
+	}
+	for( ; i < len && p[i] >= '0' && p[i] <= '7'; i++ ) {
+		n = n * 8 + (p[i] - '0');
+	}
+	return n;
+}
+
+/* checksum of a tar header, the checksum field counts as spaces */
+static bool tar_checksum( const char *hdr )
+{
+	const unsigned char *u = (const unsigned char*) hdr;
+	long long sum = 0;
+	for( int i = 0; i < TAR_BLOCK; i++ ) {
+		sum += (i >= 148 && i < 156) ? ' ' : u[i];
+	}
+	return sum == tar_number( hdr + 148, 8 );
+}
+
+
+ArchiveStream::ArchiveStream() :
+	fd( -1 ),
+	format( -1 ),
+	codec( NULL ),
+	path( NULL ),
+	in( NULL ),
+	in_pos( 0 ),
+	in_len( 0 ),
+	in_eof( false ),
+	out_eof( false ),
+	base( NULL ),
+	size( 0 ),
+	left( 0 ),
+	pad( 0 ),
+	method( 0 ),
+	flags( 0 ),
+	zip64( false ),
+	pending( false ),
+	inflated( false ),
+	members( 0 ),
+	in_bytes( 0 ),
+	out_bytes( 0 ),
+	elapsed( 0.0 )
+{
+	*name = '\0';
+	*error = '\0';
+}
+
+
+ArchiveStream::~ArchiveStream()
+{
+#if defined USE_ZLIB
+	if( codec != NULL && (format == STREAM_GZIP || format == STREAM_ZIP) ) {
+		inflateEnd( (z_stream*) codec );
+		free( codec );
+	}
+#endif
+#if defined USE_LZMA
+	if( codec != NULL && format == STREAM_XZ ) {
+		lzma_end( (lzma_stream*) codec );
+		free( codec );
+	}
+#endif
+	if( fd >= 0 ) {
+		close( fd );
+	}
+	free( in );
+	free( path );
+}
+
+
+/**
+ * True if path starts like a tar, tar.gz, tar.xz or zip archive.
+ */
+bool ArchiveStream::isStream( const char *path )
+{
+	unsigned char buf[TAR_BLOCK];
+	int fd = ::open( path, O_RDONLY | O_BINARY );
+	if( fd < 0 ) {
+		return false;
+	}
+	long n = 0;
+	while( n < TAR_BLOCK ) {
+		long r = ::read( fd, buf + n, TAR_BLOCK - n );
+		if( r <= 0 ) {
+			break;
+		}
+		n += r;
+	}
+	close( fd );
+	return detect_format( buf, n ) >= 0;
+}
+
+
+bool ArchiveStream::open( const char *p )
+{
+	assert( fd < 0 );
+	path = strdup( p );
+	fd = ::open( path, O_RDONLY | O_BINARY );
+	if( fd < 0 ) {
+		setError( path, strerror(errno) );
+		return false;
+	}
+	in = (unsigned char*) malloc( STREAM_IN_SIZE );
+	while( in_len < TAR_BLOCK && !in_eof ) {
+		if( !refill() ) {
+			return false;
+		}
+	}
+	format = detect_format( in, in_len );
+
+	switch( format ) {
+	case STREAM_TAR:
+		return true;
+	case STREAM_GZIP:
+	case STREAM_ZIP: {
+#if defined USE_ZLIB
+		z_stream *z = (z_stream*) calloc( 1, sizeof(z_stream) );
+		/* gzip header resp. raw deflate data of zip members */
+		if( inflateInit2( z, format == STREAM_GZIP ? 15 + 16 : -15 ) != Z_OK ) {
+			free( z );
+			setError( path, "can't init zlib" );
+			return false;
+		}
+		codec = z;
+		return true;
+#else
+		if( format == STREAM_ZIP ) {
+			/* stored members are readable anyway */
+			return true;
+		}
+		setError( path, "gzip not supported" );
+		return false;
+#endif
+	}
+	case STREAM_XZ: {
+#if defined USE_LZMA
+		lzma_stream *l = (lzma_stream*) malloc( sizeof(lzma_stream) );
+		lzma_stream init = LZMA_STREAM_INIT;
+		*l = init;
+		if( lzma_stream_decoder( l, UINT64_MAX, LZMA_CONCATENATED )
+				!= LZMA_OK ) {
+			free( l );
+			setError( path, "can't init lzma" );
+			return false;
+		}
+		codec = l;
+		return true;
+#else
+		setError( path, "xz not supported" );
+		return false;
+#endif
+	}
+	}
+	setError( path, "not a tar or zip archive" );
+	return false;
+}
+
+
+/* read more compressed input behind the unused bytes */
+bool ArchiveStream::refill()
+{
+	if( in_pos > 0 ) {
+		memmove( in, in + in_pos, in_len - in_pos );
+		in_len -= in_pos;
+		in_pos = 0;
+	}
+	long n = ::read( fd, in + in_len, STREAM_IN_SIZE - in_len );
+	if( n < 0 ) {
+		setError( path, strerror(errno) );
+		return false;
+	}
+	if( n == 0 ) {
+		in_eof = true;
+	}
+	in_len += n;
+	in_bytes += n;
+	return true;
+}
+
+
+/**
+ * Get up to len bytes of the (decompressed) archive, 0 at its end and -1 on
+ * errors. Zip archives are read raw here, their members are decompressed
+ * one by one.
+ */
+long ArchiveStream::fill( char *buf, long len )
+{
+	if( out_eof ) {
+		return 0;
+	}
+	if( format == STREAM_TAR || format == STREAM_ZIP ) {
+		if( in_pos == in_len && len >= STREAM_IN_SIZE ) {
+			/* large members go directly to their buffer */
+			long n = in_eof ? 0 : ::read( fd, buf,
+				len < READ_MAX ? len : READ_MAX );
+			if( n < 0 ) {
+				setError( path, strerror(errno) );
+				return -1;
+			}
+			in_eof = n == 0;
+			in_bytes += n;
+			return n;
+		}
+		if( in_pos == in_len ) {
+			if( in_eof ) {
+				return 0;
+			}
+			if( !refill() ) {
+				return -1;
+			}
+		}
+		long n = in_len - in_pos < len ? in_len - in_pos : len;
+		memcpy( buf, in + in_pos, n );
+		in_pos += n;
+		return n;
+	}
+
+	long done = 0;
+	while( done < len && !out_eof ) {
+		if( in_pos == in_len ) {
+			if( in_eof ) {
+				break;
+			}
+			if( !refill() ) {
+				return -1;
+			}
+			continue;
+		}
+#if defined USE_ZLIB
+		if( format == STREAM_GZIP ) {
+			z_stream *z = (z_stream*) codec;
+			z->next_in = in + in_pos;
+			z->avail_in = in_len - in_pos;
+			z->next_out = (unsigned char*) buf + done;
+			z->avail_out = len - done;
+			int ret = inflate( z, Z_NO_FLUSH );
+			in_pos = in_len - z->avail_in;
+			done = len - z->avail_out;
+			if( ret == Z_STREAM_END ) {
+				/* more gzip members may follow */
+				if( in_pos == in_len && !in_eof && !refill() ) {
+					return -1;
+				}
+				if( in_pos == in_len ) {
+					out_eof = true;
+				} else {
+					inflateReset( z );
+				}
+			} else if( ret != Z_OK && ret != Z_BUF_ERROR ) {
+				setError( path, "gzip data corrupt" );
+				return -1;
+			}
+		}
+#endif
+#if defined USE_LZMA
+		if( format == STREAM_XZ ) {
+			lzma_stream *l = (lzma_stream*) codec;
+			l->next_in = in + in_pos;
+			l->avail_in = in_len - in_pos;
+			l->next_out = (uint8_t*) buf + done;
+			l->avail_out = len - done;
+			lzma_ret ret = lzma_code( l, LZMA_RUN );
+			in_pos = in_len - l->avail_in;
+			done = len - l->avail_out;
+			if( ret == LZMA_STREAM_END ) {
+				out_eof = true;
+			} else if( ret != LZMA_OK && ret != LZMA_BUF_ERROR ) {
+				setError( path, "xz data corrupt" );
+				return -1;
+			}
+		}
+#endif
+	}
+#if defined USE_LZMA
+	/* concatenated streams end only when told so */
+	if( format == STREAM_XZ && done < len && !out_eof && in_eof ) {
+		lzma_stream *l = (lzma_stream*) codec;
+		l->next_in = NULL;
+		l->avail_in = 0;
+		l->next_out = (uint8_t*) buf + done;
+		l->avail_out = len - done;
+		lzma_ret ret = lzma_code( l, LZMA_FINISH );
+		done = len - l->avail_out;
+		if( ret == LZMA_STREAM_END ) {
+			out_eof = true;
+		} else if( ret != LZMA_OK ) {
+			setError( path, "xz data corrupt" );
+			return -1;
+		}
+	}
+#endif
+	return done;
+}
+
+
+/* exactly len bytes */
+bool ArchiveStream::fillAll( char *buf, long len )
+{
+	while( len > 0 ) {
+		long n = fill( buf, len );
+		if( n < 0 ) {
+			return false;
+		}
+		if( n == 0 ) {
+			setError( path, "unexpected end of archive" );
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+
+bool ArchiveStream::skip( long long len )
+{
+	if( format == STREAM_TAR || format == STREAM_ZIP ) {
+		/* uncompressed, seek if it's a file */
+		long long buffered = in_len - in_pos;
+		if( len > buffered && !in_eof
+				&& lseek( fd, len - buffered, SEEK_CUR ) >= 0 ) {
+			in_pos = in_len = 0;
+			return true;
+		}
+	}
+	char tmp[16384];
+	while( len > 0 ) {
+		long n = len < (long long) sizeof(tmp) ? len : sizeof(tmp);
+		if( !fillAll( tmp, n ) ) {
+			return false;
+		}
+		len -= n;
+	}
+	return true;
+}
+
+
+/**
+ * Move to the next regular file of the archive, returns its base name or
+ * NULL at the end (lastError() is empty then) and on errors.
+ */
+const char* ArchiveStream::next()
+{
+	double t = wall_time();
+	*error = '\0';
+	const char *ret = format == STREAM_ZIP ? nextZip() : nextTar();
+	elapsed += wall_time() - t;
+	return ret;
+}
+
+
+/* skip what is left of the current member */
+bool ArchiveStream::skipMember()
+{
+	if( !pending ) {
+		return true;
+	}
+	pending = false;
+	if( format != STREAM_ZIP ) {
+		return skip( left + pad );
+	}
+
+	if( method == 8 && left < 0 ) {
+		/* the end is known by decompressing only */
+		char tmp[16384];
+		long n;
+		while( (n = inflateRaw( tmp, sizeof(tmp) )) > 0 ) {
+		}
+		if( n < 0 ) {
+			return false;
+		}
+	} else if( !skip( left ) ) {
+		return false;
+	}
+	left = 0;
+
+	if( flags & ZIP_HAS_DESCRIPTOR ) {
+		/* crc, sizes and an optional signature before them */
+		unsigned char d[24];
+		int len = zip64 ? 20 : 12;
+		if( !fillAll( (char*) d, 4 ) ) {
+			return false;
+		}
+		if( get_le32( d ) != ZIP_DESCRIPTOR ) {
+			len -= 4;
+		}
+		if( !fillAll( (char*) d + 4, len ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+const char* ArchiveStream::nextTar()
+{
+	if( !skipMember() ) {
+		return NULL;
+	}
+
+	bool long_name = false;
+	long long pax_size = -1;
+	while( true ) {
+		char hdr[TAR_BLOCK];
+		long got = 0;
+		while( got < TAR_BLOCK ) {
+			long n = fill( hdr + got, TAR_BLOCK - got );
+			if( n < 0 ) {
+				return NULL;
+			}
+			if( n == 0 ) {
+				break;
+			}
+			got += n;
+		}
+		if( got == 0 ) {
+			return NULL;
+		}
+		if( got < TAR_BLOCK ) {
+			setError( path, "unexpected end of archive" );
+			return NULL;
+		}
+		bool zero = true;
+		for( int i = 0; i < TAR_BLOCK && zero; i++ ) {
+			zero = hdr[i] == '\0';
+		}
+		if( zero ) {
+			/* end of archive, the rest is padding */
+			return NULL;
+		}
+		if( !tar_checksum( hdr ) ) {
+			setError( path, "bad tar header" );
+			return NULL;
+		}
+
+		long long sz = pax_size >= 0 ? pax_size : tar_number( hdr + 124, 12 );
+		long long padded = (sz + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+		char type = hdr[156];
+
+		if( type == 'L' || type == 'x' ) {
+			/* GNU long name resp. pax header of the next member */
+			char *ext = (char*) malloc( sz + 1 );
+			if( !fillAll( ext, sz ) || !skip( padded - sz ) ) {
+				free( ext );
+				return NULL;
+			}
+			ext[sz] = '\0';
+			if( type == 'L' ) {
+				snprintf( name, sizeof(name), "%s", ext );
+				long_name = true;
+			}
+			for( char *p = ext; type == 'x' && p < ext + sz; ) {
+				char *rec = p;
+				long len = strtol( p, &p, 10 );
+				if( len <= 0 || rec + len > ext + sz ) {
+					break;
+				}
+				rec[len - 1] = '\0';
+				if( strncmp( p, " path=", 6 ) == 0 ) {
+					snprintf( name, sizeof(name), "%s", p + 6 );
+					long_name = true;
+				} else if( strncmp( p, " size=", 6 ) == 0 ) {
+					pax_size = strtoll( p + 6, NULL, 10 );
+				}
+				p = rec + len;
+			}
+			free( ext );
+			continue;
+		}
+
+		if( type != '0' && type != '\0' && type != '7' ) {
+			/* directories, links, devices, global pax headers */
+			if( !skip( padded ) ) {
+				return NULL;
+			}
+			long_name = false;
+			pax_size = -1;
+			continue;
+		}
+
+		if( !long_name ) {
+			/* GNU tar ("ustar  ") has no prefix field */
+			if( memcmp( hdr + 257, "ustar", 6 ) == 0 && hdr[345] != '\0' ) {
+				snprintf( name, sizeof(name), "%.155s/%.100s",
+					hdr + 345, hdr );
+			} else {
+				snprintf( name, sizeof(name), "%.100s", hdr );
+			}
+		}
+		const char *slash = strrchr( name, '/' );
+		base = slash != NULL ? slash + 1 : name;
+		size = sz;
+		left = sz;
+		pad = padded - sz;
+		pending = true;
+		members++;
+		return base;
+	}
+}
+
+
+const char* ArchiveStream::nextZip()
+{
+	if( !skipMember() ) {
+		return NULL;
+	}
+
+	while( true ) {
+		unsigned char h[30];
+		long got = fill( (char*) h, 4 );
+		if( got < 0 ) {
+			return NULL;
+		}
+		if( got > 0 && got < 4 && !fillAll( (char*) h + got, 4 - got ) ) {
+			return NULL;
+		}
+		unsigned long sig = got == 0 ? ZIP_END : get_le32( h );
+		if( sig == ZIP_CENTRAL || sig == ZIP_END || sig == ZIP_END64 ) {
+			/* the central directory repeats what we have seen */
+			out_eof = true;
+			return NULL;
+		}
+		if( sig != ZIP_LOCAL ) {
+			setError( path, "bad zip header" );
+			return NULL;
+		}
+		if( !fillAll( (char*) h + 4, 26 ) ) {
+			return NULL;
+		}
+		flags = get_le16( h + 6 );
+		method = get_le16( h + 8 );
+		unsigned long long csize = get_le32( h + 18 );
+		unsigned long long usize = get_le32( h + 22 );
+		int nlen = get_le16( h + 26 );
+		int xlen = get_le16( h + 28 );
+
+		char *buf = (char*) malloc( nlen + xlen + 1 );
+		if( !fillAll( buf, nlen + xlen ) ) {
+			free( buf );
+			return NULL;
+		}
+		snprintf( name, sizeof(name), "%.*s", nlen, buf );
+
+		/* zip64 extra field with the real sizes */
+		zip64 = false;
+		const unsigned char *x = (const unsigned char*) buf + nlen;
+		for( int i = 0; i + 4 <= xlen; ) {
+			int id = get_le16( x + i );
+			int len = get_le16( x + i + 2 );
+			const unsigned char *v = x + i + 4;
+			if( id == 0x0001 && i + 4 + len <= xlen ) {
+				zip64 = true;
+				if( usize == 0xffffffff && len >= 8 ) {
+					usize = get_le64( v );
+					v += 8;
+					len -= 8;
+				}
+				if( csize == 0xffffffff && len >= 8 ) {
+					csize = get_le64( v );
+				}
+			}
+			i += 4 + len;
+		}
+		free( buf );
+
+		if( flags & ZIP_ENCRYPTED ) {
+			setError( path, "encrypted zip members not supported" );
+			return NULL;
+		}
+		if( (flags & ZIP_HAS_DESCRIPTOR) && method != 8 ) {
+			setError( path, "zip member of unknown length" );
+			return NULL;
+		}
+		size = (flags & ZIP_HAS_DESCRIPTOR) ? -1 : (long long) usize;
+		left = (flags & ZIP_HAS_DESCRIPTOR) ? -1 : (long long) csize;
+		pad = 0;
+		inflated = false;
+		pending = true;
+#if defined USE_ZLIB
+		if( method == 8 ) {
+			inflateReset( (z_stream*) codec );
+		}
+#endif
+		const char *slash = strrchr( name, '/' );
+		base = slash != NULL ? slash + 1 : name;
+		if( *base == '\0' ) {
+			/* directory */
+			if( !skipMember() ) {
+				return NULL;
+			}
+			continue;
+		}
+		members++;
+		return base;
+	}
+}
+
+
+/**
+ * Decompress the current deflated zip member, returns the number of bytes
+ * or 0 at its end and -1 on errors.
+ */
+long ArchiveStream::inflateRaw( char *buf, long len )
+{
+#if defined USE_ZLIB
+	z_stream *z = (z_stream*) codec;
+	long done = 0;
+	while( done < len && !inflated ) {
+		if( in_pos == in_len ) {
+			if( in_eof ) {
+				setError( path, "unexpected end of archive" );
+				return -1;
+			}
+			if( !refill() ) {
+				return -1;
+			}
+			continue;
+		}
+		long avail = in_len - in_pos;
+		if( left >= 0 && avail > left ) {
+			avail = left;
+		}
+		z->next_in = in + in_pos;
+		z->avail_in = avail;
+		z->next_out = (unsigned char*) buf + done;
+		z->avail_out = len - done;
+		int ret = inflate( z, Z_NO_FLUSH );
+		long used = avail - z->avail_in;
+		in_pos += used;
+		if( left >= 0 ) {
+			left -= used;
+		}
+		done = len - z->avail_out;
+		if( ret == Z_STREAM_END ) {
+			inflated = true;
+		} else if( (ret != Z_OK && ret != Z_BUF_ERROR)
+				|| (left == 0 && used == 0 && done < len) ) {
+			setError( path, "zip data corrupt" );
+			return -1;
+		}
+	}
+	return done;
+#else
+	(void) buf;
+	(void) len;
+	setError( path, "deflated zip members not supported" );
+	return -1;
+#endif
+}
+
+
+/**
+ * Read the whole current member into file_buf, after next() only.
+ */
+bool ArchiveStream::read( FileBuf *file_buf )
+{
+	assert( pending );
+	double t = wall_time();
+	bool ok = true;
+	long long len = 0;
+
+	if( format != STREAM_ZIP || method == 0 ) {
+		ok = fillAll( file_buf->reserve( size ), size );
+		left = 0;
+		len = size;
+	} else if( method == 8 ) {
+		long cap = size >= 0 ? size + 1 : 64 * 1024;
+		char *buf = file_buf->reserve( cap );
+		long n;
+		while( (n = inflateRaw( buf + len, cap - len )) > 0 ) {
+			len += n;
+			if( len == cap ) {
+				cap *= 2;
+				buf = file_buf->reserve( cap );
+			}
+		}
+		ok = n == 0;
+		file_buf->reserve( len );
+	} else {
+		setError( path, "unsupported zip compression" );
+		ok = false;
+	}
+
+	/* padding resp. data descriptor */
+	ok = ok && skipMember();
+	pending = false;
+	out_bytes += len;
+	elapsed += wall_time() - t;
+	return ok;
+}
+
+
+void ArchiveStream::printStats( FILE *f ) const
+{
+	fprintf( f, "stream: %d members, %llu bytes read, %llu bytes decoded, "
+		"%.3f s, %.1f MB/s\n", members, in_bytes, out_bytes, elapsed,
+		elapsed > 0.0 ? out_bytes / elapsed / 1e6 : 0.0 );
+}
+
+
+const char* ArchiveStream::lastError() const
+{
+	return error;
+}
+
+
+void ArchiveStream::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_STREAM, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_STREAM, "%s: %s", e1, e2 );
+	}
+}
@@ -0,0 +1,117 @@
+/*** archive_stream.h -- single pass reader of tar and zip archives
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+
+#ifndef ATEM_ARCHIVE_STREAM_H
+#define ATEM_ARCHIVE_STREAM_H
+
+#include <stdio.h>
+
+class FileBuf;
+
+
+#define ERROR_LENGTH_STREAM 256
+
+/**
+ * Reads the regular files of a tar archive (plain, gzip or xz compressed)
+ * or a zip archive front to back, without seeking and without extracting
+ * anything to disk. next() moves to the following member and returns its
+ * base name, read() decodes it. Members which are not read are skipped.
+ */
+class ArchiveStream
+{
+	public:
+		ArchiveStream();
+		~ArchiveStream();
+
+		static bool isStream( const char *path );
+
+		bool open( const char *path );
+		const char* next();
+		bool read( FileBuf *file_buf );
+
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+	private:
+		bool refill();
+		long fill( char *buf, long len );
+		bool fillAll( char *buf, long len );
+		bool skip( long long len );
+		bool skipMember();
+		const char* nextTar();
+		const char* nextZip();
+		bool readRaw( char *buf, long len );
+		long inflateRaw( char *buf, long len );
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		int fd;
+		int format;
+		void *codec;
+		char *path;
+
+		/* compressed input */
+		unsigned char *in;
+		long in_pos;
+		long in_len;
+		bool in_eof;
+		bool out_eof;
+
+		/* current member */
+		char name[4096];
+		const char *base;
+		long long size;
+		long long left;
+		long long pad;
+		int method;
+		int flags;
+		bool zip64;
+		bool pending;
+		bool inflated;
+
+		int members;
+		unsigned long long in_bytes;
+		unsigned long long out_bytes;
+		double elapsed;
+
+		mutable char error[ERROR_LENGTH_STREAM];
+};
+
+
+
+
+#endif
@@ -36,11 +36,26 @@
  ***/
 
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <assert.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include "atem_ggo.h"
+#include "catalog.h"
 #include "config.h"
+#include "exporter.h"
+#include "follow.h"
 #include "metastock.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#if defined HAVE_WORKING_FORK
+# include <unistd.h>
+# include <sys/wait.h>
+#endif
 
 #ifdef _WIN32
 	#include <fcntl.h>
@@ -78,7 +93,7 @@ License: BSD 3-Clause\n"
 static void check_display_args()
 {
 	if( args_info.full_help_given || args_info.help_given ) {
-		gengetopt_args_info_usage = "Usage: " PACKAGE " [OPTION]... [DATA_DIR]";
+		gengetopt_args_info_usage = "Usage: " PACKAGE " [OPTION]... [DATA_DIR]...";
 		if( args_info.full_help_given ) {
 			cmdline_parser_print_full_help();
 		} else {
@@ -103,6 +118,10 @@ static void gengetopt_free()
 
 
 static int ms2csv( const char *ms_dirp );
+static int catalog( const char *file );
+static int run_batch( Metastock &ms, const char *ms_dirp );
+static int export_dirs();
+static int data_fd_job();
 
 
 int main(int argc, char *argv[])
@@ -127,14 +146,21 @@ int main(int argc, char *argv[])
 
 	if( args_info.inputs_num == 1 ) {
 		ms_dirp = args_info.inputs[0];
-	} else if( args_info.inputs_num > 1 ) {
+	}
+
+	if( args_info.lookup_given && !args_info.catalog_given ) {
 		fprintf( stderr, "error: bad usage\n" );
 		ret = 2;
-		goto end;
+	} else if( args_info.data_fd_given ) {
+		ret = data_fd_job();
+	} else if( args_info.catalog_given ) {
+		ret = catalog( args_info.catalog_arg );
+	} else if( args_info.inputs_num > 1 || args_info.recursive_given ) {
+		ret = export_dirs();
+	} else {
+		ret = ms2csv( ms_dirp );
 	}
 
-	ret = ms2csv( ms_dirp );
-
 end:
 	/* TODO teach Metastock::setError() to distinguish usage and other errors */
 	if( ret == 2 ) {
@@ -144,88 +170,869 @@ end:
 }
 
 
-static int ms2csv( const char *ms_dirp )
+/**
+ * The data file number of --fdat LIST if it is a single number, 0 otherwise.
+ */
+static int single_fdat( const char *list )
 {
-	Metastock ms;
-	bool dumpdata = true;
+	char *end;
+	long n = strtol( list, &end, 10 );
+	if( end != list && *end == '\0' && n > 0 && n <= USHRT_MAX ) {
+		return n;
+	}
+	return 0;
+}
 
-	if( args_info.output_given ) {
-		if( ! ms.set_outfile( args_info.output_arg ) ) {
-			goto ms_error;
+
+/**
+ * A single data file selected by one --fdat number or by --symbol can be
+ * resolved without scanning and parsing the whole DATA_DIR.
+ */
+static bool lazy_job( const gengetopt_args_info &args, int *fdat )
+{
+	*fdat = 0;
+	if( args.symbols_from_given || args.symbol_regex_given
+			|| args.dump_master_given || args.dump_emaster_given
+			|| args.dump_xmaster_given || args.archive_given
+			|| args.extract_given ) {
+		return false;
+	}
+	if( args.symbol_given ) {
+		return !args.fdat_given;
+	}
+	if( args.fdat_given ) {
+		*fdat = single_fdat( args.fdat_arg );
+	}
+	return *fdat > 0;
+}
+
+
+/**
+ * Apply the output options of args: threads, memory limit, io order, page
+ * cache mode, output file and compression.
+ */
+static bool setup_output( Metastock &ms, const gengetopt_args_info &args )
+{
+	if( args.threads_given ) {
+		if( ! ms.setThreads( args.threads_arg ) ) {
+			return false;
 		}
 	}
 
-	if( ! ms.setDir( ms_dirp ) ) {
-		goto ms_error;
+	if( args.max_memory_given ) {
+		if( ! ms.setMaxMemory( args.max_memory_arg ) ) {
+			return false;
+		}
 	}
 
-	if( args_info.field_separator_given ) {
-		if( ! ms.set_field_sep(args_info.field_separator_arg) ) {
-			goto ms_error;
+	if( args.io_order_given ) {
+		if( ! ms.setIoOrder( args.io_order_arg ) ) {
+			return false;
 		}
 	}
 
-	ms.set_skip_header( args_info.skip_header_given );
+	if( args.page_cache_given ) {
+		if( ! ms.setPageCache( args.page_cache_arg ) ) {
+			return false;
+		}
+	}
+
+	ms.setStats( args.stats_given );
+
+	if( args.output_given ) {
+		if( ! ms.set_outfile( args.output_arg ) ) {
+			return false;
+		}
+	}
+
+	if( args.compress_given ) {
+		if( ! ms.set_compress( args.compress_arg ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Apply the print settings of args.
+ */
+static bool setup_printer( Metastock &ms, const gengetopt_args_info &args )
+{
+	if( args.field_separator_given ) {
+		if( ! ms.set_field_sep(args.field_separator_arg) ) {
+			return false;
+		}
+	}
+
+	ms.set_skip_header( args.skip_header_given );
 
 	if( !ms.set_out_format(
-		  args_info.format_given ? args_info.format_arg : NULL) ) {
-		goto ms_error;
+		  args.format_given ? args.format_arg : NULL) ) {
+		return false;
 	}
 
 	if( !ms.setForceFloat(
-			args_info.float_openint_given, args_info.float_volume_given) ) {
-		goto ms_error;
+			args.float_openint_given, args.float_volume_given) ) {
+		return false;
 	}
 
-	if( args_info.fdat_given ) {
-		if( ! ms.incudeFile( args_info.fdat_arg ) ) {
-			goto ms_error;
+	if( args.date_from_given ) {
+		if( !ms.setPrintDateFrom( args.date_from_arg ) ) {
+			return false;
 		}
 	}
 
-	if( args_info.date_from_given ) {
-		if( !ms.setPrintDateFrom( args_info.date_from_arg ) ) {
-			goto ms_error;
+	if( args.tail_given ) {
+		if( !ms.setTail( args.tail_arg ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Select the data files of the directory of ms as specified by args.
+ */
+static bool select_files( Metastock &ms, const gengetopt_args_info &args )
+{
+	if( args.fdat_given ) {
+		if( ! ms.includeFiles( args.fdat_arg ) ) {
+			return false;
+		}
+	}
+
+	if( args.symbol_given ) {
+		if( ! ms.includeSymbol( args.symbol_arg ) ) {
+			return false;
+		}
+	}
+
+	if( args.symbols_from_given ) {
+		if( ! ms.includeSymbols( args.symbols_from_arg ) ) {
+			return false;
+		}
+	}
+
+	if( args.symbol_regex_given ) {
+		if( ! ms.includeRegex( args.symbol_regex_arg ) ) {
+			return false;
+		}
+	}
+
+	if( args.exclude_older_than_given ) {
+		if( !ms.excludeFiles( args.exclude_older_than_arg ) ) {
+			return false;
+		}
+	}
+
+	if( args.changed_since_given ) {
+		if( !ms.excludeUnchanged( args.changed_since_arg ) ) {
+			return false;
+		}
+	}
+
+	if( args.min_size_given || args.max_size_given ) {
+		if( !ms.excludeSize( args.min_size_given ? args.min_size_arg : NULL,
+				args.max_size_given ? args.max_size_arg : NULL ) ) {
+			return false;
 		}
 	}
+	return true;
+}
+
+
+/* select the files again after the master files have changed */
+static bool follow_reload( Metastock *ms, void *arg )
+{
+	return ms->rescan()
+		&& select_files( *ms, *(const gengetopt_args_info*) arg );
+}
+
+/**
+ * Print the selected files and keep printing what is appended to them.
+ */
+static bool follow_files( Metastock &ms, const gengetopt_args_info &args,
+	const char *ctx )
+{
+	Follower fl( &ms );
+	fl.setReload( follow_reload, (void*) &args );
+	bool ok = fl.run();
+	if( args.stats_given ) {
+		fl.printStats( stderr );
+	}
+	if( !ok ) {
+		fprintf( stderr, "error: %s%s\n", ctx, fl.lastError() );
+	}
+	return ok;
+}
+
+
+/**
+ * Run one job as specified by args. If ms_dirp is NULL the directory has
+ * been set already (batch mode).
+ */
+static int run_job( Metastock &ms, const gengetopt_args_info &args,
+	const char *ms_dirp, const char *ctx )
+{
+	bool dumpdata = true;
+
+	if( !setup_output( ms, args ) ) {
+		goto ms_error;
+	}
 
-	if( args_info.exclude_older_than_given ) {
-		if( !ms.excludeFiles( args_info.exclude_older_than_arg ) ) {
+	if( args.data_fd_given ) {
+		if( ! ms.setDataFd( args.data_fd_arg, args.data_master_arg,
+				args.fdat_given ? single_fdat( args.fdat_arg ) : 1 ) ) {
 			goto ms_error;
 		}
+	} else if( ms_dirp != NULL ) {
+		int fdat;
+		if( lazy_job( args, &fdat ) ) {
+			if( ! ms.setDirLazy( ms_dirp, fdat,
+					args.symbol_given ? args.symbol_arg : NULL ) ) {
+				goto ms_error;
+			}
+		} else if( ! ms.setDir( ms_dirp ) ) {
+			goto ms_error;
+		}
+
+		if( args.cache_dir_given ) {
+			if( ! ms.setCacheDir( args.cache_dir_arg ) ) {
+				goto ms_error;
+			}
+		}
+
+		if( args.output_cache_given ) {
+			if( ! ms.setOutputCache( args.output_cache_arg ) ) {
+				goto ms_error;
+			}
+		}
+	}
+
+	if( !setup_printer( ms, args ) || !select_files( ms, args ) ) {
+		goto ms_error;
 	}
 
-	if( args_info.dump_master_given ) {
+	if( args.dump_master_given ) {
 		dumpdata = false;
 		ms.dumpMaster();
 	}
-	if( args_info.dump_emaster_given ) {
+	if( args.dump_emaster_given ) {
 		dumpdata = false;
 		ms.dumpEMaster();
 	}
-	if( args_info.dump_xmaster_given ) {
+	if( args.dump_xmaster_given ) {
 		dumpdata = false;
 		if( ms.hasXMaster() ) {
 			ms.dumpXMaster();
 		}
 	}
 
-	if( args_info.symbols_given ) {
+	if( args.archive_given ) {
+		dumpdata = false;
+		if( ! ms.writeArchive( args.archive_arg ) ) {
+			goto ms_error;
+		}
+	}
+	if( args.extract_given ) {
+		dumpdata = false;
+		if( ! ms.extractFiles( args.extract_arg ) ) {
+			goto ms_error;
+		}
+	}
+
+	if( args.symbols_given ) {
 		dumpdata = false;
 		if( ! ms.dumpSymbolInfo() ) {
 			goto ms_error;
 		}
 	}
 
+	if( args.inventory_given ) {
+		dumpdata = false;
+		if( ! ms.dumpInventory() ) {
+			goto ms_error;
+		}
+	}
+
 	if( dumpdata ) {
-		if( ! ms.dumpData() ) {
+		if( args.follow_given ) {
+			if( !follow_files( ms, args, ctx ) ) {
+				ms.closeOutput();
+				return 2;
+			}
+		} else if( ! ms.dumpData() ) {
 			goto ms_error;
 		}
 	}
 
+	if( ! ms.closeOutput() ) {
+		goto ms_error;
+	}
+
 	return 0;
 
 ms_error:
-	fprintf( stderr, "error: %s\n", ms.lastError() );
+	fprintf( stderr, "error: %s%s\n", ctx, ms.lastError() );
 	return 2;
 }
+
+
+static int ms2csv( const char *ms_dirp )
+{
+	Metastock ms;
+
+	if( args_info.batch_given ) {
+		return run_batch( ms, ms_dirp );
+	}
+	return run_job( ms, args_info, ms_dirp, "" );
+}
+
+
+struct batch_job
+{
+	int line;
+	int key; /* (first) data file number to group jobs by, INT_MAX for all */
+	gengetopt_args_info args;
+};
+
+static int cmp_batch_job( const void *a, const void *b )
+{
+	const batch_job *x = (const batch_job*) a;
+	const batch_job *y = (const batch_job*) b;
+	if( x->key != y->key ) {
+		return x->key < y->key ? -1 : 1;
+	}
+	return x->line - y->line;
+}
+
+/**
+ * Split s in place into shell like words, '...' and "..." quote, backslash
+ * escapes and '#' starts a comment. Returns the number of words or -1.
+ */
+static int split_args( char *s, char **argv, int max )
+{
+	int argc = 0;
+	char *d = s;
+
+	while( true ) {
+		while( *s == ' ' || *s == '\t' ) {
+			s++;
+		}
+		if( *s == '\0' || *s == '#' ) {
+			break;
+		}
+		if( argc == max ) {
+			return -1;
+		}
+		argv[argc++] = d;
+
+		char quote = '\0';
+		for( ; *s != '\0'; s++ ) {
+			if( quote != '\0' ) {
+				if( *s == quote ) {
+					quote = '\0';
+				} else if( *s == '\\' && quote == '"' && s[1] != '\0' ) {
+					*d++ = *++s;
+				} else {
+					*d++ = *s;
+				}
+			} else if( *s == '\'' || *s == '"' ) {
+				quote = *s;
+			} else if( *s == '\\' && s[1] != '\0' ) {
+				*d++ = *++s;
+			} else if( *s == ' ' || *s == '\t' ) {
+				s++;
+				break;
+			} else {
+				*d++ = *s;
+			}
+		}
+		if( quote != '\0' ) {
+			return -1;
+		}
+		*d++ = '\0';
+	}
+	return argc;
+}
+
+static bool read_batch( const char *file, batch_job **jobs, int *njobs )
+{
+	char line[4096];
+	char *argv[256];
+	bool ok = true;
+	*jobs = NULL;
+	*njobs = 0;
+
+	FILE *f = fopen( file, "r" );
+	if( f == NULL ) {
+		fprintf( stderr, "error: %s: %s\n", file, strerror(errno) );
+		return false;
+	}
+
+	for( int lno = 1; ok && fgets( line, sizeof(line), f ) != NULL; lno++ ) {
+		int len = strlen( line );
+		if( len > 0 && line[len - 1] == '\n' ) {
+			line[--len] = '\0';
+		} else if( !feof( f ) ) {
+			fprintf( stderr, "error: %s:%d: line too long\n", file, lno );
+			ok = false;
+			break;
+		}
+
+		argv[0] = (char*) PACKAGE;
+		int argc = split_args( line, argv + 1, 255 );
+		if( argc < 0 ) {
+			fprintf( stderr, "error: %s:%d: bad job\n", file, lno );
+			ok = false;
+			break;
+		} else if( argc == 0 ) {
+			continue;
+		}
+
+		*jobs = (batch_job*) realloc( *jobs, (*njobs + 1) * sizeof(batch_job) );
+		batch_job *job = &(*jobs)[*njobs];
+		if( cmdline_parser( argc + 1, argv, &job->args ) != 0 ) {
+			cmdline_parser_free( &job->args );
+			fprintf( stderr, "error: %s:%d: bad job\n", file, lno );
+			ok = false;
+			break;
+		}
+		(*njobs)++;
+
+		if( job->args.inputs_num > 0 || job->args.batch_given
+				|| job->args.cache_dir_given
+				|| job->args.output_cache_given ) {
+			fprintf( stderr, "error: %s:%d: DATA_DIR, --batch and caches "
+				"are not allowed in batch jobs\n", file, lno );
+			ok = false;
+		} else if( job->args.follow_given ) {
+			fprintf( stderr, "error: %s:%d: --follow is not allowed in batch "
+				"jobs\n", file, lno );
+			ok = false;
+		} else if( job->args.data_fd_given ) {
+			fprintf( stderr, "error: %s:%d: --data-fd is not allowed in batch "
+				"jobs\n", file, lno );
+			ok = false;
+		}
+		job->line = lno;
+		job->key = job->args.fdat_given ? atoi( job->args.fdat_arg ) : INT_MAX;
+	}
+
+	fclose( f );
+	return ok;
+}
+
+static int run_batch_jobs( Metastock &ms, batch_job *jobs, int njobs )
+{
+	int failed = 0;
+	for( int i = 0; i < njobs; i++ ) {
+		char ctx[strlen(args_info.batch_arg) + 16];
+		sprintf( ctx, "%s:%d: ", args_info.batch_arg, jobs[i].line );
+		ms.resetSettings();
+		if( run_job( ms, jobs[i].args, NULL, ctx ) != 0 ) {
+			failed++;
+		}
+	}
+	return failed;
+}
+
+#if defined HAVE_WORKING_FORK
+static int count_file_jobs( const batch_job *jobs, int njobs )
+{
+	int n = 0;
+	for( int i = 0; i < njobs; i++ ) {
+		if( jobs[i].args.output_given ) {
+			n++;
+		}
+	}
+	return n;
+}
+#endif
+
+/**
+ * Run all jobs of the batch file against the once parsed directory. Jobs are
+ * ordered by data file to keep the page cache hot. With --threads N > 1 jobs
+ * writing to --output files are split among N forked processes while jobs
+ * printing to stdout run in order in the main process.
+ */
+static int run_batch( Metastock &ms, const char *ms_dirp )
+{
+	batch_job *jobs;
+	int njobs;
+	int failed = 0;
+	int nprocs = args_info.threads_given ? args_info.threads_arg : 1;
+	double t0 = wall_time();
+
+	if( !read_batch( args_info.batch_arg, &jobs, &njobs ) ) {
+		failed = -1;
+		goto end;
+	}
+	if( ! ms.setDir( ms_dirp ) ) {
+		fprintf( stderr, "error: %s\n", ms.lastError() );
+		failed = -1;
+		goto end;
+	}
+
+	qsort( jobs, njobs, sizeof(batch_job), cmp_batch_job );
+
+#if defined HAVE_WORKING_FORK
+	/* jobs printing to stdout run here anyway, nothing to fork without
+	   output file jobs */
+	if( nprocs > 1 && count_file_jobs( jobs, njobs ) > 0 ) {
+		/* move output file jobs to the front, keeping the order */
+		batch_job *sorted = (batch_job*) malloc( njobs * sizeof(batch_job) );
+		int nfile = 0;
+		int nout = 0;
+		for( int i = 0; i < njobs; i++ ) {
+			if( jobs[i].args.output_given ) {
+				sorted[nfile++] = jobs[i];
+			}
+		}
+		for( int i = 0; i < njobs; i++ ) {
+			if( !jobs[i].args.output_given ) {
+				sorted[nfile + nout++] = jobs[i];
+			}
+		}
+		free( jobs );
+		jobs = sorted;
+
+		if( nprocs > nfile ) {
+			nprocs = nfile;
+		}
+		pid_t pids[nprocs];
+		fflush( NULL );
+		for( int p = 0; p < nprocs; p++ ) {
+			int beg = (long) nfile * p / nprocs;
+			int end = (long) nfile * (p + 1) / nprocs;
+			pids[p] = fork();
+			if( pids[p] == 0 ) {
+				int n = run_batch_jobs( ms, jobs + beg, end - beg );
+				fflush( NULL );
+				_exit( n > 255 ? 255 : n );
+			} else if( pids[p] < 0 ) {
+				/* no more processes, run the rest here */
+				fprintf( stderr, "warning: fork: %s\n", strerror(errno) );
+				failed += run_batch_jobs( ms, jobs + beg, nfile - beg );
+				nprocs = p;
+				break;
+			}
+		}
+
+		failed += run_batch_jobs( ms, jobs + nfile, nout );
+
+		for( int p = 0; p < nprocs; p++ ) {
+			int status;
+			if( waitpid( pids[p], &status, 0 ) < 0 || !WIFEXITED(status) ) {
+				failed++;
+			} else {
+				failed += WEXITSTATUS(status);
+			}
+		}
+	} else
+#endif
+	{
+		nprocs = 1;
+		failed = run_batch_jobs( ms, jobs, njobs );
+	}
+
+	if( args_info.stats_given ) {
+		fprintf( stderr, "batch: %d jobs, %d failed, %d processes, %.3f s\n",
+			njobs, failed, nprocs, wall_time() - t0 );
+	}
+
+end:
+	for( int i = 0; i < njobs; i++ ) {
+		cmdline_parser_free( &jobs[i].args );
+	}
+	free( jobs );
+	return failed < 0 ? 2 : failed > 0 ? 1 : 0;
+}
+
+
+static int cmp_str( const void *a, const void *b )
+{
+	return strcmp( *(const char**) a, *(const char**) b );
+}
+
+/**
+ * Append path and all its subdirectories which contain master files to dirs,
+ * sorted by name. Symbolic links are not followed.
+ */
+static bool find_ms_dirs( const char *path, char ***dirs, int *ndirs )
+{
+	DIR *dirh = opendir( path );
+	if( dirh == NULL ) {
+		fprintf( stderr, "error: %s: %s\n", path, strerror(errno) );
+		return false;
+	}
+
+	char **subs = NULL;
+	int nsubs = 0;
+	bool masters = false;
+	int plen = strlen( path );
+	for( struct dirent *d = readdir(dirh); d != NULL; d = readdir(dirh) ) {
+		if( strcasecmp( d->d_name, "MASTER" ) == 0
+				|| strcasecmp( d->d_name, "EMASTER" ) == 0
+				|| strcasecmp( d->d_name, "XMASTER" ) == 0 ) {
+			masters = true;
+			continue;
+		}
+		if( strcmp( d->d_name, "." ) == 0 || strcmp( d->d_name, ".." ) == 0 ) {
+			continue;
+		}
+		char *sub = (char*) malloc( plen + strlen(d->d_name) + 2 );
+		sprintf( sub, "%s%s%s", path,
+			plen > 0 && path[plen - 1] == '/' ? "" : "/", d->d_name );
+		struct stat st;
+		if( lstat( sub, &st ) == 0 && S_ISDIR( st.st_mode ) ) {
+			subs = (char**) realloc( subs, (nsubs + 1) * sizeof(char*) );
+			subs[nsubs++] = sub;
+		} else {
+			free( sub );
+		}
+	}
+	closedir( dirh );
+
+	if( masters ) {
+		*dirs = (char**) realloc( *dirs, (*ndirs + 1) * sizeof(char*) );
+		(*dirs)[(*ndirs)++] = strdup( path );
+	}
+
+	bool ok = true;
+	qsort( subs, nsubs, sizeof(char*), cmp_str );
+	for( int i = 0; i < nsubs; i++ ) {
+		ok = ok && find_ms_dirs( subs[i], dirs, ndirs );
+		free( subs[i] );
+	}
+	free( subs );
+	return ok;
+}
+
+
+/**
+ * Convert the data files of all DATA_DIRs (resp. of all directories below
+ * them containing master files if --recursive) as one job on a single
+ * thread pool. Each line starts with the directory.
+ */
+static int export_dirs()
+{
+	const char *bad = args_info.batch_given ? "batch"
+		: args_info.symbols_given ? "symbols"
+		: args_info.inventory_given ? "inventory"
+		: args_info.archive_given ? "archive"
+		: args_info.extract_given ? "extract"
+		: args_info.cache_dir_given ? "cache-dir"
+		: args_info.output_cache_given ? "output-cache"
+		: args_info.io_order_given ? "io-order"
+		: args_info.page_cache_given ? "page-cache"
+		: args_info.follow_given ? "follow"
+		: args_info.tail_given ? "tail"
+		: (args_info.dump_master_given || args_info.dump_emaster_given
+			|| args_info.dump_xmaster_given) ? "dump-master"
+		: NULL;
+	if( bad != NULL ) {
+		fprintf( stderr, "error: --%s can't be used with several "
+			"directories\n", bad );
+		return 2;
+	}
+
+	char **dirs = NULL;
+	int ndirs = 0;
+	int ret = 0;
+	Metastock ms;
+	Metastock *dms = NULL;
+	Exporter ex;
+
+	for( unsigned int i = 0; i < args_info.inputs_num; i++ ) {
+		if( args_info.recursive_given ) {
+			if( !find_ms_dirs( args_info.inputs[i], &dirs, &ndirs ) ) {
+				ret = 2;
+				goto end;
+			}
+		} else {
+			dirs = (char**) realloc( dirs, (ndirs + 1) * sizeof(char*) );
+			dirs[ndirs++] = strdup( args_info.inputs[i] );
+		}
+	}
+	if( args_info.inputs_num == 0 && !find_ms_dirs( ".", &dirs, &ndirs ) ) {
+		ret = 2;
+		goto end;
+	}
+	if( ndirs == 0 ) {
+		fprintf( stderr, "error: no metastock directories found\n" );
+		ret = 2;
+		goto end;
+	}
+
+	dms = new Metastock[ndirs];
+	ex.setThreads( args_info.threads_given ? args_info.threads_arg
+		: ThreadPool::onlineCpus() );
+	ex.setStats( args_info.stats_given );
+	if( args_info.max_memory_given ) {
+		if( !ms.setMaxMemory( args_info.max_memory_arg ) ) {
+			fprintf( stderr, "error: %s\n", ms.lastError() );
+			ret = 2;
+			goto end;
+		}
+		ex.setMaxMemory( parse_size( args_info.max_memory_arg ) );
+	}
+	for( int i = 0; i < ndirs; i++ ) {
+		struct stat st;
+		if( stat( dirs[i], &st ) == 0 && !S_ISDIR( st.st_mode ) ) {
+			fprintf( stderr, "error: %s: Not a directory\n", dirs[i] );
+			ret = 2;
+			goto end;
+		}
+		if( !dms[i].setDir( dirs[i] ) ) {
+			fprintf( stderr, "error: %s\n", dms[i].lastError() );
+			ret = 2;
+			goto end;
+		}
+		if( !select_files( dms[i], args_info ) ) {
+			fprintf( stderr, "error: %s: %s\n", dirs[i], dms[i].lastError() );
+			ret = 2;
+			goto end;
+		}
+		ex.addDir( &dms[i], dirs[i] );
+	}
+
+	/* after setDir() which resets the output file */
+	if( !setup_output( ms, args_info ) || !setup_printer( ms, args_info ) ) {
+		fprintf( stderr, "error: %s\n", ms.lastError() );
+		ret = 2;
+		goto end;
+	}
+
+	if( !ex.run() ) {
+		fprintf( stderr, "error: %s\n", ex.lastError() );
+		ret = 2;
+		goto end;
+	}
+	if( !ms.closeOutput() ) {
+		fprintf( stderr, "error: %s\n", ms.lastError() );
+		ret = 2;
+	}
+
+end:
+	delete[] dms;
+	for( int i = 0; i < ndirs; i++ ) {
+		free( dirs[i] );
+	}
+	free( dirs );
+	return ret;
+}
+
+
+/**
+ * Update the catalog with all DATA_DIRs and/or print the entries matching
+ * --lookup. Returns 1 if nothing was found.
+ */
+static int catalog( const char *file )
+{
+	Catalog cat;
+	char sep = '\t';
+	int ret = 0;
+
+	if( args_info.field_separator_given ) {
+		const char *s = args_info.field_separator_arg;
+		if( s[0] == '\0' || s[1] != '\0' ) {
+			fprintf( stderr, "error: bad field separator\n" );
+			return 2;
+		}
+		sep = *s;
+	}
+
+	if( !cat.open( file ) ) {
+		goto cat_error;
+	}
+	for( unsigned int i = 0; i < args_info.inputs_num; i++ ) {
+		if( !cat.update( args_info.inputs[i] ) ) {
+			goto cat_error;
+		}
+	}
+	if( args_info.inputs_num > 0 && !cat.write() ) {
+		goto cat_error;
+	}
+
+	if( args_info.lookup_given ) {
+		const char *key = args_info.lookup_arg;
+		int n = cat.lookup( key, NULL, 0 );
+		catalog_record *recs =
+			(catalog_record*) malloc( (n + 1) * sizeof(catalog_record) );
+		cat.lookup( key, recs, n );
+
+		if( !args_info.skip_header_given ) {
+			printf( "directory%csymbol%clong_name%cfile_number%ckind"
+				"%cfield_bitset%cfrom_date%cto_date\n",
+				sep, sep, sep, sep, sep, sep, sep );
+		}
+		for( int i = 0; i < n; i++ ) {
+			char from[16], to[16];
+			from[itodatestr( from, recs[i].from_date )] = '\0';
+			to[itodatestr( to, recs[i].to_date )] = '\0';
+			printf( "%s%c%s%c%s%c%d%c%c%c%d%c%s%c%s\n",
+				recs[i].dir, sep, recs[i].symbol, sep, recs[i].long_name, sep,
+				recs[i].file_number, sep, recs[i].kind, sep,
+				recs[i].field_bitset, sep, from, sep, to );
+		}
+		free( recs );
+		ret = n > 0 ? 0 : 1;
+	}
+
+	if( args_info.stats_given ) {
+		cat.printStats( stderr );
+	}
+	return ret;
+
+cat_error:
+	fprintf( stderr, "error: %s\n", cat.lastError() );
+	return 2;
+}
+
+
+/**
+ * Convert the single data file read from --data-fd. There is no DATA_DIR,
+ * so everything which needs one or the whole file in advance is refused.
+ */
+static int data_fd_job()
+{
+	const char *bad = args_info.catalog_given ? "catalog"
+		: args_info.batch_given ? "batch"
+		: args_info.recursive_given ? "recursive"
+		: args_info.inventory_given ? "inventory"
+		: args_info.archive_given ? "archive"
+		: args_info.extract_given ? "extract"
+		: args_info.cache_dir_given ? "cache-dir"
+		: args_info.output_cache_given ? "output-cache"
+		: args_info.io_order_given ? "io-order"
+		: args_info.page_cache_given ? "page-cache"
+		: args_info.follow_given ? "follow"
+		: args_info.exclude_older_than_given ? "exclude-older-than"
+		: args_info.changed_since_given ? "changed-since"
+		: (args_info.min_size_given || args_info.max_size_given) ? "min-size"
+		: (args_info.dump_master_given || args_info.dump_emaster_given
+			|| args_info.dump_xmaster_given) ? "dump-master"
+		: NULL;
+	if( bad != NULL ) {
+		fprintf( stderr, "error: --%s can't be used with --data-fd\n", bad );
+		return 2;
+	}
+	if( args_info.inputs_num > 0 ) {
+		fprintf( stderr, "error: DATA_DIR can't be used with --data-fd\n" );
+		return 2;
+	}
+	if( !args_info.data_master_given ) {
+		fprintf( stderr, "error: --data-fd needs --data-master\n" );
+		return 2;
+	}
+	if( args_info.fdat_given && single_fdat( args_info.fdat_arg ) == 0 ) {
+		fprintf( stderr, "error: bad usage\n" );
+		return 2;
+	}
+
+	Metastock ms;
+	return run_job( ms, args_info, NULL, "" );
+}
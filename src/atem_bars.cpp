@@ -0,0 +1,102 @@
+/*** atem_bars.cpp -- dump all bars through libatem
+ *
+ * Copyright (C) 2010-2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include <stdio.h>
+
+#include "libatem.h"
+
+
+
+
+static bool dump_symbol( const AtemDir &dir, int i )
+{
+	atem_symbol sym;
+	AtemBars bars;
+	atem_bar bar;
+
+	dir.getSymbol( i, &sym );
+	if( !dir.openBars( i, &bars ) ) {
+		fprintf( stderr, "error: %s\n", bars.lastError() );
+		return false;
+	}
+	printf( "%s %d\n", sym.symbol, bars.count() );
+	while( bars.next( &bar ) ) {
+		printf( "%d,%g,%g,%g,%g,%g\n", bar.date, bar.open, bar.high,
+			bar.low, bar.close, bar.volume );
+	}
+	return true;
+}
+
+
+/**
+ * Print all bars of a metastock directory, or of the given symbols only.
+ * Used by the test suite to compare the iterator with atem's output.
+ */
+int main( int argc, char *argv[] )
+{
+	if( argc < 2 ) {
+		fprintf( stderr, "usage: atem-bars DATA_DIR [SYMBOL]...\n" );
+		return 1;
+	}
+
+	AtemDir dir;
+	if( !dir.open( argv[1] ) ) {
+		fprintf( stderr, "error: %s\n", dir.lastError() );
+		return 1;
+	}
+
+	if( argc == 2 ) {
+		for( int i = 0; i < dir.countSymbols(); i++ ) {
+			if( !dump_symbol( dir, i ) ) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	for( int a = 2; a < argc; a++ ) {
+		int i = dir.findSymbol( argv[a] );
+		if( i < 0 ) {
+			fprintf( stderr, "error: symbol not found: %s\n", argv[a] );
+			return 1;
+		}
+		if( !dump_symbol( dir, i ) ) {
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,1131 @@
+/*** atemd.cpp -- query daemon for metastock directories
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <math.h>
+#include <assert.h>
+
+#include "atemd_ggo.h"
+#include "config.h"
+#include "libatem.h"
+#include "ms_file.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#if defined HAVE_SYS_UN_H
+# include <fcntl.h>
+# include <poll.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/un.h>
+#endif
+
+#if defined HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+#include "atemd_ggo.c"
+
+
+
+
+static gengetopt_args_info args_info;
+
+
+#define REQUEST_HELP_MSG "\
+Without --request or --load atemd serves DATA_DIR on the socket. It reads\n\
+the master files once and answers requests until SIGINT or SIGTERM.\n\
+\n\
+A request is one line: SYMBOL [from=DATE] [to=DATE] [columns=LIST] [sep=CHAR]\n\
+DATE is YYYY-MM-DD, LIST a comma separated list of data columns like\n\
+'date,close' (default all). The reply is either 'OK N' followed by N data\n\
+lines or 'ERR MESSAGE'. Connections may send any number of requests.\n\
+\n\
+Report bugs to sweet_f_a@gmx.de\n\
+Homepage: https://github.com/rudimeier/atem/\n"
+
+#define VERSION_MSG \
+"atemd - metastock query daemon (" PACKAGE_VERSION ")\n\
+Copyright (C) 2013 Ruediger Meier <sweet_f_a@gmx.de>\n\
+License: BSD 3-Clause\n"
+
+
+static void check_display_args()
+{
+	if( args_info.help_given ) {
+		gengetopt_args_info_usage =
+			"Usage: atemd [OPTION]... --socket=PATH [DATA_DIR]";
+		cmdline_parser_print_help();
+		printf( "\n" REQUEST_HELP_MSG );
+	} else if( args_info.usage_given ) {
+		printf( "%s\n", gengetopt_args_info_usage );
+	} else if( args_info.version_given ) {
+		printf( VERSION_MSG );
+	} else {
+		return;
+	}
+
+	exit(0);
+}
+
+static void gengetopt_free()
+{
+	cmdline_parser_free( &args_info );
+}
+
+
+#if defined HAVE_SYS_UN_H
+
+#define MAX_LEN_REQUEST 1024
+
+/* set by signal handlers, checked by everything which may block */
+static volatile sig_atomic_t quit = 0;
+
+static void on_quit( int )
+{
+	quit = 1;
+}
+
+
+/* buffered line reader on a socket */
+struct line_reader
+{
+	int fd;
+	int beg;
+	int end;
+	char buf[64 * 1024];
+};
+
+static void lr_init( line_reader *lr, int fd )
+{
+	lr->fd = fd;
+	lr->beg = lr->end = 0;
+}
+
+/* wait for input but wake up regularly to notice quit */
+static bool wait_readable( int fd )
+{
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while( !quit ) {
+		int r = poll( &pfd, 1, 200 );
+		if( r > 0 ) {
+			return true;
+		} else if( r < 0 && errno != EINTR ) {
+			return false;
+		}
+	}
+	return false;
+}
+
+static bool lr_has_line( const line_reader *lr )
+{
+	return memchr( lr->buf + lr->beg, '\n', lr->end - lr->beg ) != NULL;
+}
+
+/**
+ * Next buffered line without '\n' or NULL if there is no complete one. The
+ * line is valid until the next call.
+ */
+static char* lr_next_line( line_reader *lr )
+{
+	char *nl = (char*) memchr( lr->buf + lr->beg, '\n', lr->end - lr->beg );
+	if( nl != NULL ) {
+		char *line = lr->buf + lr->beg;
+		*nl = '\0';
+		lr->beg = nl + 1 - lr->buf;
+		return line;
+	}
+
+	if( lr->beg > 0 ) {
+		memmove( lr->buf, lr->buf + lr->beg, lr->end - lr->beg );
+		lr->end -= lr->beg;
+		lr->beg = 0;
+	}
+	return NULL;
+}
+
+/**
+ * Read what is available without waiting, false on EOF, errors or if the
+ * buffer is full of a line too long. Nothing to read on a non-blocking
+ * socket is fine.
+ */
+static bool lr_fill( line_reader *lr )
+{
+	if( lr->end == (int) sizeof(lr->buf) ) {
+		return false;
+	}
+	ssize_t n;
+	do {
+		n = read( lr->fd, lr->buf + lr->end, sizeof(lr->buf) - lr->end );
+	} while( n < 0 && errno == EINTR );
+	if( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) {
+		return true;
+	} else if( n <= 0 ) {
+		return false;
+	}
+	lr->end += n;
+	return true;
+}
+
+/**
+ * Next line without '\n' or NULL on EOF, error or lines longer than the
+ * buffer. The line is valid until the next call.
+ */
+static char* lr_read_line( line_reader *lr )
+{
+	char *line;
+	while( (line = lr_next_line( lr )) == NULL ) {
+		if( !wait_readable( lr->fd ) || !lr_fill( lr ) ) {
+			return NULL;
+		}
+	}
+	return line;
+}
+
+
+static bool set_sockaddr( struct sockaddr_un *sa, const char *path )
+{
+	memset( sa, 0, sizeof(*sa) );
+	sa->sun_family = AF_UNIX;
+	if( strlen(path) >= sizeof(sa->sun_path) ) {
+		fprintf( stderr, "error: socket path too long: %s\n", path );
+		return false;
+	}
+	strcpy( sa->sun_path, path );
+	return true;
+}
+
+
+
+
+/*** server ***/
+
+#if defined HAVE_PTHREAD
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+# define DIR_RDLOCK() pthread_rwlock_rdlock( &dir_lock )
+# define DIR_WRLOCK() pthread_rwlock_wrlock( &dir_lock )
+# define DIR_UNLOCK() pthread_rwlock_unlock( &dir_lock )
+# define HOT_LOCK() pthread_mutex_lock( &hot_lock )
+# define HOT_UNLOCK() pthread_mutex_unlock( &hot_lock )
+# define POLL_TRYLOCK() (pthread_mutex_trylock( &poll_lock ) == 0)
+# define POLL_UNLOCK() pthread_mutex_unlock( &poll_lock )
+#else
+# define DIR_RDLOCK()
+# define DIR_WRLOCK()
+# define DIR_UNLOCK()
+# define HOT_LOCK()
+# define HOT_UNLOCK()
+# define POLL_TRYLOCK() true
+# define POLL_UNLOCK()
+#endif
+
+/* decoded data files shared by all connections */
+struct hot_slot
+{
+	int sym;
+	AtemBars *bars;
+	int refs;
+	unsigned long used;
+};
+
+static const char *ms_dirp;
+static AtemDir *ms_dir;
+static char default_sep = '\t';
+static hot_slot *hot;
+static int hot_len;
+static unsigned long hot_clock;
+static double poll_interval = 1.0;
+static double last_poll;
+
+
+static void hot_clear()
+{
+	for( int i = 0; i < hot_len; i++ ) {
+		assert( hot[i].refs == 0 );
+		delete hot[i].bars;
+		hot[i].sym = -1;
+		hot[i].bars = NULL;
+		hot[i].used = 0;
+	}
+}
+
+/**
+ * Get decoded bars of symbol sym, from the hot set if possible. Returns the
+ * slot to be released by hot_put() or -1 if *own must be deleted by the
+ * caller. On failure *bars is NULL and err holds the error.
+ */
+static int hot_get( int sym, const AtemBars **bars, AtemBars **own,
+	char *err )
+{
+	HOT_LOCK();
+	for( int i = 0; i < hot_len; i++ ) {
+		if( hot[i].sym == sym ) {
+			hot[i].refs++;
+			hot[i].used = ++hot_clock;
+			*bars = hot[i].bars;
+			HOT_UNLOCK();
+			return i;
+		}
+	}
+	HOT_UNLOCK();
+
+	AtemBars *b = new AtemBars();
+	if( !ms_dir->openBars( sym, b ) ) {
+		snprintf( err, ERROR_LENGTH_BARS, "%s", b->lastError() );
+		delete b;
+		*bars = NULL;
+		return -1;
+	}
+
+	HOT_LOCK();
+	int victim = -1;
+	for( int i = 0; i < hot_len; i++ ) {
+		if( hot[i].refs == 0 && (victim < 0 || hot[i].used < hot[victim].used) ) {
+			victim = i;
+		}
+	}
+	if( victim < 0 ) {
+		HOT_UNLOCK();
+		*bars = *own = b;
+		return -1;
+	}
+	delete hot[victim].bars;
+	hot[victim].sym = sym;
+	hot[victim].bars = b;
+	hot[victim].refs = 1;
+	hot[victim].used = ++hot_clock;
+	HOT_UNLOCK();
+	*bars = b;
+	return victim;
+}
+
+static void hot_put( int slot )
+{
+	if( slot >= 0 ) {
+		HOT_LOCK();
+		hot[slot].refs--;
+		HOT_UNLOCK();
+	}
+}
+
+
+/**
+ * Reload the directory if the master files have changed. Only one thread
+ * checks, the others don't wait for it.
+ */
+static void check_masters()
+{
+	if( poll_interval < 0 || !POLL_TRYLOCK() ) {
+		return;
+	}
+	double now = wall_time();
+	if( now - last_poll < poll_interval ) {
+		POLL_UNLOCK();
+		return;
+	}
+	last_poll = now;
+
+	DIR_RDLOCK();
+	bool changed = ms_dir->changed();
+	DIR_UNLOCK();
+
+	if( changed ) {
+		AtemDir *d = new AtemDir();
+		if( d->open( ms_dirp ) ) {
+			DIR_WRLOCK();
+			hot_clear();
+			delete ms_dir;
+			ms_dir = d;
+			DIR_UNLOCK();
+		} else {
+			/* keep serving the old state, maybe caught in mid-update */
+			fprintf( stderr, "warning: reload: %s\n", d->lastError() );
+			delete d;
+		}
+	}
+	POLL_UNLOCK();
+}
+
+
+struct request
+{
+	const char *symbol;
+	int from;
+	int to;
+	unsigned int columns;
+	char sep;
+};
+
+static const char* parse_request( char *line, request *rq )
+{
+	static const char *ws = " \t\r";
+	char *save;
+
+	rq->symbol = strtok_r( line, ws, &save );
+	rq->from = 0;
+	rq->to = 0;
+	rq->columns = 0xff;
+	rq->sep = default_sep;
+	if( rq->symbol == NULL ) {
+		return "empty request";
+	}
+
+	char *tok;
+	while( (tok = strtok_r( NULL, ws, &save )) != NULL ) {
+		char *val = strchr( tok, '=' );
+		if( val == NULL ) {
+			return "bad request";
+		}
+		*val++ = '\0';
+		if( strcmp( tok, "from" ) == 0 ) {
+			if( (rq->from = str2date( val )) < 0 ) {
+				return "bad date";
+			}
+		} else if( strcmp( tok, "to" ) == 0 ) {
+			if( (rq->to = str2date( val )) < 0 ) {
+				return "bad date";
+			}
+		} else if( strcmp( tok, "columns" ) == 0 ) {
+			char *csave;
+			rq->columns = 0;
+			for( char *c = strtok_r( val, ",", &csave ); c != NULL;
+					c = strtok_r( NULL, ",", &csave ) ) {
+				unsigned int f = str_to_data_field( c );
+				if( f == 0 ) {
+					return "bad column";
+				}
+				rq->columns |= f;
+			}
+		} else if( strcmp( tok, "sep" ) == 0 ) {
+			if( val[0] == '\0' || val[1] != '\0' ) {
+				return "bad separator";
+			}
+			rq->sep = *val;
+		} else {
+			return "bad request";
+		}
+	}
+	return NULL;
+}
+
+
+/* growing reply buffer of a connection */
+struct reply
+{
+	char *buf;
+	int len;
+	int size;
+};
+
+static char* reply_reserve( reply *r, int n )
+{
+	if( r->len + n > r->size ) {
+		r->size = (r->len + n) * 2;
+		r->buf = (char*) realloc( r->buf, r->size );
+	}
+	return r->buf + r->len;
+}
+
+#define PRINT_FIELD( _func_, _field_, _var_ ) \
+	if( rq->columns & _field_) { \
+		s += _func_( s, _var_ ); \
+		*s++ = rq->sep; \
+	}
+
+static void format_bars( reply *r, const request *rq, const AtemBars *bars,
+	int begin, int end )
+{
+	char *s = reply_reserve( r, 32 );
+	r->len += sprintf( s, "OK %d\n", end - begin );
+
+	atem_bar bar;
+	for( int i = begin; i < end; i++ ) {
+		bars->get( i, &bar );
+		s = reply_reserve( r, 256 );
+		char *line = s;
+		PRINT_FIELD( itodatestr, D_DAT, bar.date );
+		PRINT_FIELD( itotimestr, D_TIM, bar.time );
+		PRINT_FIELD( ftoa, D_OPE, bar.open );
+		PRINT_FIELD( ftoa, D_HIG, bar.high );
+		PRINT_FIELD( ftoa, D_LOW, bar.low );
+		PRINT_FIELD( ftoa, D_CLO, bar.close );
+		PRINT_FIELD( ftoa_prec_f0, D_VOL, bar.volume );
+		PRINT_FIELD( ftoa_prec_f0, D_OPI, bar.openint );
+		if( s != line ) {
+			s--;
+		}
+		*s++ = '\n';
+		r->len += s - line;
+	}
+}
+
+#undef PRINT_FIELD
+
+static void reply_error( reply *r, const char *msg )
+{
+	char *s = reply_reserve( r, strlen(msg) + 6 );
+	r->len += sprintf( s, "ERR %s\n", msg );
+}
+
+
+static void serve_request( char *line, reply *r, AtemBars *conn_bars )
+{
+	request rq;
+	const char *err = parse_request( line, &rq );
+	if( err != NULL ) {
+		reply_error( r, err );
+		return;
+	}
+
+	check_masters();
+
+	DIR_RDLOCK();
+	int sym = ms_dir->findSymbol( rq.symbol );
+	if( sym < 0 ) {
+		DIR_UNLOCK();
+		reply_error( r, "symbol not found" );
+		return;
+	}
+
+	const AtemBars *bars = conn_bars;
+	AtemBars *own = NULL;
+	int slot = -1;
+	char bars_err[ERROR_LENGTH_BARS];
+	if( hot_len > 0 ) {
+		slot = hot_get( sym, &bars, &own, bars_err );
+	} else if( !ms_dir->openBars( sym, conn_bars ) ) {
+		snprintf( bars_err, ERROR_LENGTH_BARS, "%s",
+			conn_bars->lastError() );
+		bars = NULL;
+	}
+	if( bars == NULL ) {
+		reply_error( r, bars_err );
+		DIR_UNLOCK();
+		return;
+	}
+
+	atem_symbol info;
+	ms_dir->getSymbol( sym, &info );
+	int begin = 0;
+	int end = bars->count();
+	if( info.field_bitset & D_DAT ) {
+		if( rq.from > 0 ) {
+			begin = bars->find( rq.from );
+		}
+		if( rq.to > 0 ) {
+			end = bars->find( rq.to + 1 );
+		}
+		if( end < begin ) {
+			end = begin;
+		}
+	}
+	format_bars( r, &rq, bars, begin, end );
+
+	hot_put( slot );
+	delete own;
+	DIR_UNLOCK();
+}
+
+
+/**
+ * A client connection, owned by the poll loop unless busy. The socket is
+ * non-blocking, r.buf[sent] to r.buf[r.len] is a reply the client did not
+ * take yet.
+ */
+struct connection
+{
+	line_reader lr;
+	reply r;
+	int sent;
+	AtemBars bars;
+	bool busy;
+	bool failed;
+};
+
+/* workers hand served connections back to the poll loop through this pipe */
+static int done_pipe[2];
+
+static connection* connection_new( int fd )
+{
+	connection *c = new connection();
+	fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) | O_NONBLOCK );
+	lr_init( &c->lr, fd );
+	c->r.buf = NULL;
+	c->r.len = c->r.size = 0;
+	c->sent = 0;
+	c->busy = false;
+	c->failed = false;
+	return c;
+}
+
+static void connection_delete( connection *c )
+{
+	close( c->lr.fd );
+	free( c->r.buf );
+	delete c;
+}
+
+/**
+ * Write as much of the pending reply as the socket takes. False on errors,
+ * the reply is done when r.len is 0 again.
+ */
+static bool connection_flush( connection *c )
+{
+	while( c->sent < c->r.len ) {
+		ssize_t n = write( c->lr.fd, c->r.buf + c->sent,
+			c->r.len - c->sent );
+		if( n < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		c->sent += n;
+	}
+	c->r.len = c->sent = 0;
+	return true;
+}
+
+/**
+ * Answer the complete requests buffered for a connection. Workers never wait
+ * for clients, neither to send requests nor to take replies. Connections
+ * with nothing to read or a reply left over are watched by serve().
+ */
+static void connection_job( void *arg )
+{
+	connection *c = (connection*) arg;
+	char *line;
+
+	while( c->r.len == 0 && (line = lr_next_line( &c->lr )) != NULL ) {
+		if( strlen(line) > MAX_LEN_REQUEST ) {
+			reply_error( &c->r, "request too long" );
+		} else {
+			serve_request( line, &c->r, &c->bars );
+		}
+		if( !connection_flush( c ) ) {
+			c->failed = true;
+			break;
+		}
+	}
+
+	/* a pointer is written atomically to a pipe */
+	write_all( done_pipe[1], (const char*) &c, sizeof(c) );
+}
+
+
+static int listen_on( const char *path )
+{
+	struct sockaddr_un sa;
+	struct stat st;
+
+	if( !set_sockaddr( &sa, path ) ) {
+		return -1;
+	}
+	/* remove a stale socket of a previous run but nothing else */
+	if( lstat( path, &st ) == 0 && S_ISSOCK( st.st_mode ) ) {
+		unlink( path );
+	}
+
+	int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( fd < 0 || bind( fd, (struct sockaddr*) &sa, sizeof(sa) ) < 0
+			|| listen( fd, 128 ) < 0 ) {
+		fprintf( stderr, "error: %s: %s\n", path, strerror(errno) );
+		if( fd >= 0 ) {
+			close( fd );
+		}
+		return -1;
+	}
+	return fd;
+}
+
+
+/**
+ * Accept connections and watch the idle ones until quit. A connection with
+ * complete requests is handed to a pool worker and not watched until the
+ * worker has answered them, so the pool is busy only while serving. Replies
+ * a client does not take at once are finished here when it is writable.
+ */
+static void poll_connections( int lfd, ThreadPool *pool )
+{
+	connection **conns = NULL;
+	int nconns = 0;
+	struct pollfd *pfds = NULL;
+	int *polled = NULL;
+
+	while( !quit ) {
+		pfds = (struct pollfd*) realloc( pfds,
+			(nconns + 2) * sizeof(struct pollfd) );
+		polled = (int*) realloc( polled, (nconns + 2) * sizeof(int) );
+		pfds[0].fd = lfd;
+		pfds[1].fd = done_pipe[0];
+		pfds[0].events = pfds[1].events = POLLIN;
+		int n = 2;
+		for( int i = 0; i < nconns; i++ ) {
+			if( !conns[i]->busy ) {
+				polled[n] = i;
+				pfds[n].fd = conns[i]->lr.fd;
+				pfds[n++].events = conns[i]->r.len > 0 ? POLLOUT : POLLIN;
+			}
+		}
+		for( int k = 0; k < n; k++ ) {
+			pfds[k].revents = 0;
+		}
+
+		int r = poll( pfds, n, 200 );
+		if( r < 0 && errno != EINTR ) {
+			fprintf( stderr, "error: poll: %s\n", strerror(errno) );
+			break;
+		} else if( r <= 0 ) {
+			continue;
+		}
+
+		for( int k = 2; k < n; k++ ) {
+			if( pfds[k].revents == 0 ) {
+				continue;
+			}
+			connection *c = conns[polled[k]];
+			bool ok = c->r.len > 0 ?
+				connection_flush( c ) : lr_fill( &c->lr );
+			if( !ok ) {
+				connection_delete( c );
+				conns[polled[k]] = NULL;
+			} else if( c->r.len == 0 && lr_has_line( &c->lr ) ) {
+				c->busy = true;
+				pool->submit( connection_job, c );
+			}
+		}
+
+		connection *c;
+		while( read( done_pipe[0], &c, sizeof(c) ) == sizeof(c) ) {
+			c->busy = false;
+			if( c->failed ) {
+				for( int i = 0; i < nconns; i++ ) {
+					if( conns[i] == c ) {
+						conns[i] = NULL;
+					}
+				}
+				connection_delete( c );
+			}
+		}
+
+		if( pfds[0].revents != 0 ) {
+			int cfd = accept( lfd, NULL, NULL );
+			if( cfd >= 0 ) {
+				conns = (connection**) realloc( conns,
+					(nconns + 1) * sizeof(connection*) );
+				conns[nconns++] = connection_new( cfd );
+			} else if( errno != EINTR && errno != ECONNABORTED ) {
+				fprintf( stderr, "error: accept: %s\n", strerror(errno) );
+				break;
+			}
+		}
+
+		/* drop closed connections */
+		int k = 0;
+		for( int i = 0; i < nconns; i++ ) {
+			if( conns[i] != NULL ) {
+				conns[k++] = conns[i];
+			}
+		}
+		nconns = k;
+	}
+
+	/* busy connections are released after the workers are done */
+	pool->wait();
+	for( int i = 0; i < nconns; i++ ) {
+		connection_delete( conns[i] );
+	}
+	free( conns );
+	free( polled );
+	free( pfds );
+}
+
+
+static int serve( const char *sock_path, const char *dir )
+{
+	int nthreads = args_info.threads_given ?
+		args_info.threads_arg : ThreadPool::onlineCpus();
+
+	if( args_info.field_separator_given ) {
+		const char *sep = args_info.field_separator_arg;
+		if( sep[0] == '\0' || sep[1] != '\0' ) {
+			fprintf( stderr, "error: bad field separator\n" );
+			return 2;
+		}
+		default_sep = *sep;
+	}
+	if( args_info.poll_given ) {
+		poll_interval = args_info.poll_arg;
+	}
+
+	ms_dirp = dir;
+	ms_dir = new AtemDir();
+	if( !ms_dir->open( ms_dirp ) ) {
+		fprintf( stderr, "error: %s\n", ms_dir->lastError() );
+		delete ms_dir;
+		return 2;
+	}
+	last_poll = wall_time();
+
+	hot_len = args_info.hot_given && args_info.hot_arg > 0 ?
+		args_info.hot_arg : 0;
+	hot = (hot_slot*) calloc( hot_len + 1, sizeof(hot_slot) );
+	for( int i = 0; i < hot_len; i++ ) {
+		hot[i].sym = -1;
+	}
+
+	int lfd = listen_on( sock_path );
+	if( lfd < 0 ) {
+		free( hot );
+		delete ms_dir;
+		return 2;
+	}
+
+	struct sigaction sa;
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = on_quit;
+	sigaction( SIGINT, &sa, NULL );
+	sigaction( SIGTERM, &sa, NULL );
+	signal( SIGPIPE, SIG_IGN );
+
+	if( pipe( done_pipe ) < 0 ) {
+		fprintf( stderr, "error: pipe: %s\n", strerror(errno) );
+		close( lfd );
+		free( hot );
+		delete ms_dir;
+		return 2;
+	}
+	fcntl( done_pipe[0], F_SETFL, O_NONBLOCK );
+
+	{
+		ThreadPool pool( nthreads );
+		poll_connections( lfd, &pool );
+	}
+
+	close( done_pipe[0] );
+	close( done_pipe[1] );
+	close( lfd );
+	unlink( sock_path );
+	hot_clear();
+	free( hot );
+	delete ms_dir;
+	return 0;
+}
+
+
+
+
+/*** clients ***/
+
+static int connect_to( const char *path )
+{
+	struct sockaddr_un sa;
+	if( !set_sockaddr( &sa, path ) ) {
+		return -1;
+	}
+
+	int fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( fd < 0 || connect( fd, (struct sockaddr*) &sa, sizeof(sa) ) < 0 ) {
+		fprintf( stderr, "error: %s: %s\n", path, strerror(errno) );
+		if( fd >= 0 ) {
+			close( fd );
+		}
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Send one request and read the whole reply, data lines are printed to out
+ * if not NULL. Returns 0 on success, 1 if the server replied ERR and -1 on
+ * connection errors.
+ */
+static int query( int fd, line_reader *lr, const char *req, FILE *out )
+{
+	int len = strlen( req );
+	char buf[len + 1];
+	memcpy( buf, req, len );
+	buf[len] = '\n';
+	if( !write_all( fd, buf, len + 1 ) ) {
+		return -1;
+	}
+
+	char *line = lr_read_line( lr );
+	if( line == NULL ) {
+		return -1;
+	} else if( strncmp( line, "ERR ", 4 ) == 0 ) {
+		if( out != NULL ) {
+			fprintf( stderr, "error: %s\n", line + 4 );
+		}
+		return 1;
+	}
+
+	int n;
+	if( sscanf( line, "OK %d", &n ) != 1 ) {
+		return -1;
+	}
+	while( n-- > 0 ) {
+		if( (line = lr_read_line( lr )) == NULL ) {
+			return -1;
+		}
+		if( out != NULL ) {
+			fputs( line, out );
+			fputc( '\n', out );
+		}
+	}
+	return 0;
+}
+
+static int request_one( const char *sock_path, const char *req )
+{
+	int fd = connect_to( sock_path );
+	if( fd < 0 ) {
+		return 2;
+	}
+	line_reader *lr = (line_reader*) malloc( sizeof(line_reader) );
+	lr_init( lr, fd );
+
+	int ret = query( fd, lr, req, stdout );
+	if( ret < 0 ) {
+		fprintf( stderr, "error: connection lost\n" );
+		ret = 2;
+	}
+
+	free( lr );
+	close( fd );
+	return ret;
+}
+
+
+struct load_conn
+{
+	const char *sock_path;
+	char **reqs;
+	int nreqs;
+	int first;
+	int step;
+	int count;
+	double *lat;
+	int errors;
+	bool failed;
+};
+
+static void load_job( void *arg )
+{
+	load_conn *lc = (load_conn*) arg;
+	int fd = connect_to( lc->sock_path );
+	if( fd < 0 ) {
+		lc->failed = true;
+		return;
+	}
+	line_reader *lr = (line_reader*) malloc( sizeof(line_reader) );
+	lr_init( lr, fd );
+
+	for( int i = lc->first; i < lc->count; i += lc->step ) {
+		double t0 = wall_time();
+		int r = query( fd, lr, lc->reqs[i % lc->nreqs], NULL );
+		lc->lat[i] = wall_time() - t0;
+		if( r < 0 ) {
+			fprintf( stderr, "error: connection lost\n" );
+			lc->failed = true;
+			break;
+		}
+		lc->errors += r;
+	}
+
+	free( lr );
+	close( fd );
+}
+
+static int cmp_double( const void *a, const void *b )
+{
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank percentile of sorted v */
+static double percentile( const double *v, int n, double p )
+{
+	int rank = (int) ceil( p * n );
+	return v[rank > 0 ? rank - 1 : 0];
+}
+
+static int load( const char *sock_path, const char *file )
+{
+	FILE *f = fopen( file, "r" );
+	if( f == NULL ) {
+		fprintf( stderr, "error: %s: %s\n", file, strerror(errno) );
+		return 2;
+	}
+	char **reqs = NULL;
+	int nreqs = 0;
+	char line[MAX_LEN_REQUEST + 2];
+	while( fgets( line, sizeof(line), f ) != NULL ) {
+		line[strcspn( line, "\r\n" )] = '\0';
+		if( *line == '\0' ) {
+			continue;
+		}
+		reqs = (char**) realloc( reqs, (nreqs + 1) * sizeof(char*) );
+		reqs[nreqs++] = strdup( line );
+	}
+	fclose( f );
+	if( nreqs == 0 ) {
+		fprintf( stderr, "error: %s: no requests\n", file );
+		return 2;
+	}
+
+	int count = args_info.count_given ? args_info.count_arg : nreqs;
+	int nconns = args_info.threads_given ? args_info.threads_arg : 1;
+	if( count < 1 || nconns < 1 ) {
+		fprintf( stderr, "error: bad usage\n" );
+		return 2;
+	}
+	if( nconns > count ) {
+		nconns = count;
+	}
+
+	double *lat = (double*) calloc( count, sizeof(double) );
+	load_conn *lcs = (load_conn*) calloc( nconns, sizeof(load_conn) );
+	double t0 = wall_time();
+	{
+		ThreadPool pool( nconns );
+		for( int c = 0; c < nconns; c++ ) {
+			load_conn *lc = &lcs[c];
+			lc->sock_path = sock_path;
+			lc->reqs = reqs;
+			lc->nreqs = nreqs;
+			lc->first = c;
+			lc->step = nconns;
+			lc->count = count;
+			lc->lat = lat;
+			pool.submit( load_job, lc );
+		}
+		pool.wait();
+	}
+	double secs = wall_time() - t0;
+
+	int ret = 0;
+	int errors = 0;
+	for( int c = 0; c < nconns; c++ ) {
+		errors += lcs[c].errors;
+		if( lcs[c].failed ) {
+			ret = 2;
+		}
+	}
+
+	if( ret == 0 ) {
+		qsort( lat, count, sizeof(double), cmp_double );
+		printf( "requests: %d, errors: %d, connections: %d\n",
+			count, errors, nconns );
+		printf( "latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			percentile( lat, count, 0.50 ) * 1e6,
+			percentile( lat, count, 0.99 ) * 1e6, lat[count - 1] * 1e6 );
+		printf( "throughput: %.0f requests/s\n", secs > 0 ? count / secs : 0 );
+	}
+
+	for( int i = 0; i < nreqs; i++ ) {
+		free( reqs[i] );
+	}
+	free( reqs );
+	free( lcs );
+	free( lat );
+	return ret;
+}
+
+#endif /* HAVE_SYS_UN_H */
+
+
+
+
+int main(int argc, char *argv[])
+{
+	int ret = 0;
+	const char *dirp = ".";
+
+	atexit( gengetopt_free );
+
+	if( cmdline_parser(argc, argv, &args_info) != 0 ) {
+		ret = 2;
+		goto end;
+	}
+
+	check_display_args();
+
+	if( args_info.inputs_num == 1 ) {
+		dirp = args_info.inputs[0];
+	} else if( args_info.inputs_num > 1 ) {
+		fprintf( stderr, "error: bad usage\n" );
+		ret = 2;
+		goto end;
+	}
+
+	if( !args_info.socket_given ) {
+		fprintf( stderr, "error: missing --socket\n" );
+		ret = 2;
+		goto end;
+	}
+
+#if defined HAVE_SYS_UN_H
+	if( args_info.request_given ) {
+		ret = request_one( args_info.socket_arg, args_info.request_arg );
+	} else if( args_info.load_given ) {
+		ret = load( args_info.socket_arg, args_info.load_arg );
+	} else {
+		ret = serve( args_info.socket_arg, dirp );
+	}
+#else
+	fprintf( stderr, "error: unix domain sockets not supported\n" );
+	ret = 1;
+#endif
+
+end:
+	if( ret == 2 ) {
+		fprintf( stderr, "Try `%s --help' for more information.\n", argv[0] );
+	}
+	return ret;
+}
@@ -0,0 +1,623 @@
+/*** catalog.cpp -- symbol index over many metastock directories
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "catalog.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "metastock.h"
+#include "ms_file.h"
+#include "util.h"
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+# define USE_MMAP 1
+#endif
+
+#if !defined O_BINARY
+# define O_BINARY 0
+#endif
+
+
+
+/* bump the last byte whenever the layout changes */
+#define CAT_MAGIC "ATEMCAT\001"
+#define CAT_HEADER_LEN 32
+#define CAT_DIR_LEN 32
+#define CAT_ENTRY_LEN 24
+#define CAT_SLOT_LEN 8
+
+struct cat_dir
+{
+	char *path;
+	char *masters[3]; /* MASTER, EMASTER, XMASTER file names or NULL */
+	long long stamp;
+	int first; /* entries of a directory are contiguous */
+	int count;
+};
+
+struct cat_entry
+{
+	int dir;
+	char *symbol;
+	char *long_name;
+	int file_number;
+	char kind;
+	unsigned char field_bitset;
+	int from_date;
+	int to_date;
+};
+
+
+static char* xstrdup( const char *s )
+{
+	return strdup( s != NULL ? s : "" );
+}
+
+/**
+ * Modification times of the directory itself (new or removed files) and
+ * of its master files folded into one number. Archives have a stamp too.
+ */
+static bool dir_stamp( const char *dir, char * const masters[3],
+	long long *stamp )
+{
+	struct stat st;
+	if( stat( dir, &st ) < 0 ) {
+		return false;
+	}
+	*stamp = (long long) st.st_mtime * 1000000000LL
+#if defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+		+ st.st_mtim.tv_nsec
+#endif
+		;
+	if( S_ISREG( st.st_mode ) ) {
+		return true;
+	}
+
+	for( int i = 0; i < 3; i++ ) {
+		if( masters[i] == NULL ) {
+			continue;
+		}
+		char path[strlen(dir) + strlen(masters[i]) + 2];
+		sprintf( path, "%s/%s", dir, masters[i] );
+		if( stat( path, &st ) < 0 ) {
+			return false;
+		}
+		*stamp = *stamp * 31 + (long long) st.st_mtime * 1000000000LL
+#if defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+			+ st.st_mtim.tv_nsec
+#endif
+			;
+	}
+	return true;
+}
+
+
+
+
+Catalog::Catalog() :
+	path( NULL ),
+	map( NULL ),
+	map_len( 0 ),
+	ndirs( 0 ),
+	nentries( 0 ),
+	nslots( 0 ),
+	strings_len( 0 ),
+	loaded( false ),
+	dirs( NULL ),
+	dirs_len( 0 ),
+	entries( NULL ),
+	entries_len( 0 ),
+	updated( 0 ),
+	elapsed( 0.0 )
+{
+	error[0] = '\0';
+}
+
+
+Catalog::~Catalog()
+{
+	for( int i = 0; i < entries_len; i++ ) {
+		free( entries[i].symbol );
+		free( entries[i].long_name );
+	}
+	free( entries );
+	for( int i = 0; i < dirs_len; i++ ) {
+		free( dirs[i].path );
+		for( int k = 0; k < 3; k++ ) {
+			free( dirs[i].masters[k] );
+		}
+	}
+	free( dirs );
+
+	if( map != NULL ) {
+#if defined USE_MMAP
+		munmap( map, map_len );
+#else
+		free( map );
+#endif
+	}
+	free( path );
+}
+
+
+/**
+ * Map the catalog file. A missing file is an empty catalog.
+ */
+bool Catalog::open( const char *p )
+{
+	assert( path == NULL );
+	path = strdup( p );
+
+	int fd = ::open( path, O_RDONLY | O_BINARY );
+	if( fd < 0 ) {
+		if( errno == ENOENT ) {
+			return true;
+		}
+		setError( path, strerror(errno) );
+		return false;
+	}
+	struct stat st;
+	if( fstat( fd, &st ) < 0 ) {
+		setError( path, strerror(errno) );
+		close( fd );
+		return false;
+	}
+	map_len = st.st_size;
+
+#if defined USE_MMAP
+	map = mmap( NULL, map_len, PROT_READ, MAP_SHARED, fd, 0 );
+	if( map == MAP_FAILED ) {
+		map = NULL;
+	}
+#else
+	map = malloc( map_len );
+	if( map != NULL && !read_all( fd, (char*)map, map_len ) ) {
+		free( map );
+		map = NULL;
+	}
+#endif
+	if( map == NULL ) {
+		setError( path, strerror(errno) );
+		close( fd );
+		return false;
+	}
+	close( fd );
+
+	const unsigned char *p8 = (const unsigned char*) map;
+	if( map_len < CAT_HEADER_LEN || memcmp( p8, CAT_MAGIC, 8 ) != 0 ) {
+		setError( path, "not an atem catalog" );
+		return false;
+	}
+	ndirs = get_u32( p8 + 8 );
+	nentries = get_u32( p8 + 12 );
+	nslots = get_u32( p8 + 16 );
+	strings_len = get_u32( p8 + 20 );
+
+	unsigned long long len = CAT_HEADER_LEN
+		+ (unsigned long long) ndirs * CAT_DIR_LEN
+		+ (unsigned long long) nentries * CAT_ENTRY_LEN
+		+ (unsigned long long) nslots * CAT_SLOT_LEN + strings_len;
+	if( len != map_len || strings_len == 0 || p8[map_len - 1] != '\0'
+			|| (nslots & (nslots - 1)) != 0 ) {
+		setError( path, "corrupt catalog" );
+		return false;
+	}
+	return true;
+}
+
+
+#define CAT_DIRS ((const unsigned char*) map + CAT_HEADER_LEN)
+#define CAT_ENTRIES (CAT_DIRS + (unsigned long long) ndirs * CAT_DIR_LEN)
+#define CAT_SLOTS (CAT_ENTRIES + (unsigned long long) nentries * CAT_ENTRY_LEN)
+#define CAT_STRINGS ((const char*) CAT_SLOTS \
+	+ (unsigned long long) nslots * CAT_SLOT_LEN)
+#define CAT_STR( _off_ ) \
+	(CAT_STRINGS + ((_off_) < strings_len ? (_off_) : 0))
+
+
+/**
+ * Find all entries whose symbol or long name is key. Up to max of them are
+ * stored in recs, the return value is the number of all matches.
+ */
+int Catalog::lookup( const char *key, catalog_record *recs, int max ) const
+{
+	if( nslots == 0 ) {
+		return 0;
+	}
+
+	unsigned long long h = fnv1a_hash( key, strlen(key) );
+	uint32_t tag = h >> 32;
+	unsigned int mask = nslots - 1;
+	int n = 0;
+
+	for( unsigned int i = h & mask, probes = 0; probes < nslots;
+			i = (i + 1) & mask, probes++ ) {
+		const unsigned char *slot = CAT_SLOTS + (unsigned long long) i
+			* CAT_SLOT_LEN;
+		uint32_t ref = get_u32( slot + 4 );
+		if( ref == 0 ) {
+			break;
+		}
+		uint32_t e = (ref - 1) >> 1;
+		if( get_u32( slot ) != tag || e >= nentries ) {
+			continue;
+		}
+		const unsigned char *rec = CAT_ENTRIES + (unsigned long long) e
+			* CAT_ENTRY_LEN;
+		bool by_name = (ref - 1) & 1;
+		if( strcmp( CAT_STR( get_u32( rec + (by_name ? 8 : 4) ) ), key ) != 0 ) {
+			continue;
+		}
+
+		if( n < max ) {
+			catalog_record *r = &recs[n];
+			uint32_t d = get_u32( rec );
+			r->dir = d < ndirs ?
+				CAT_STR( get_u32( CAT_DIRS + d * CAT_DIR_LEN ) ) : "";
+			r->symbol = CAT_STR( get_u32( rec + 4 ) );
+			r->long_name = CAT_STR( get_u32( rec + 8 ) );
+			r->file_number = get_u16( rec + 12 );
+			r->kind = rec[14];
+			r->field_bitset = rec[15];
+			r->from_date = (int32_t) get_u32( rec + 16 );
+			r->to_date = (int32_t) get_u32( rec + 20 );
+		}
+		n++;
+	}
+	return n;
+}
+
+
+/**
+ * Copy the mapped catalog into memory before it gets modified.
+ */
+void Catalog::load()
+{
+	if( loaded ) {
+		return;
+	}
+	loaded = true;
+
+	dirs = (cat_dir*) calloc( ndirs + 1, sizeof(cat_dir) );
+	for( unsigned int i = 0; i < ndirs; i++ ) {
+		const unsigned char *rec = CAT_DIRS + i * CAT_DIR_LEN;
+		cat_dir *d = &dirs[i];
+		d->path = xstrdup( CAT_STR( get_u32( rec ) ) );
+		d->first = get_u32( rec + 4 );
+		d->count = get_u32( rec + 8 );
+		for( int k = 0; k < 3; k++ ) {
+			uint32_t off = get_u32( rec + 12 + 4 * k );
+			d->masters[k] = off != 0 ? xstrdup( CAT_STR( off ) ) : NULL;
+		}
+		d->stamp = (long long) get_u64( rec + 24 );
+	}
+	dirs_len = ndirs;
+
+	entries = (cat_entry*) calloc( nentries + 1, sizeof(cat_entry) );
+	for( unsigned int i = 0; i < nentries; i++ ) {
+		const unsigned char *rec = CAT_ENTRIES + i * CAT_ENTRY_LEN;
+		cat_entry *e = &entries[i];
+		e->dir = get_u32( rec );
+		e->symbol = xstrdup( CAT_STR( get_u32( rec + 4 ) ) );
+		e->long_name = xstrdup( CAT_STR( get_u32( rec + 8 ) ) );
+		e->file_number = get_u16( rec + 12 );
+		e->kind = rec[14];
+		e->field_bitset = rec[15];
+		e->from_date = (int32_t) get_u32( rec + 16 );
+		e->to_date = (int32_t) get_u32( rec + 20 );
+	}
+	entries_len = nentries;
+}
+
+#undef CAT_STR
+#undef CAT_STRINGS
+#undef CAT_SLOTS
+#undef CAT_ENTRIES
+#undef CAT_DIRS
+
+
+/**
+ * Add or refresh the symbols of a metastock directory. Nothing is parsed if
+ * the master files have not been modified since the last update.
+ */
+bool Catalog::update( const char *ms_dir )
+{
+	double t0 = wall_time();
+	load();
+
+	char *real = NULL;
+#if defined HAVE_REALPATH
+	real = realpath( ms_dir, NULL );
+#endif
+	if( real == NULL ) {
+		real = strdup( ms_dir );
+	}
+
+	int d;
+	for( d = 0; d < dirs_len; d++ ) {
+		if( strcmp( dirs[d].path, real ) == 0 ) {
+			break;
+		}
+	}
+	long long stamp;
+	if( d < dirs_len && dir_stamp( real, dirs[d].masters, &stamp )
+			&& stamp == dirs[d].stamp ) {
+		free( real );
+		elapsed += wall_time() - t0;
+		return true;
+	}
+
+	Metastock ms;
+	char *masters[3];
+	if( !ms.setDir( real ) ) {
+		setError( ms_dir, ms.lastError() );
+		free( real );
+		return false;
+	}
+	for( int k = 0; k < 3; k++ ) {
+		const char *name = ms.masterName( k );
+		masters[k] = name != NULL ? strdup( name ) : NULL;
+	}
+	if( !dir_stamp( real, masters, &stamp ) ) {
+		setError( ms_dir, strerror(errno) );
+		for( int k = 0; k < 3; k++ ) {
+			free( masters[k] );
+		}
+		free( real );
+		return false;
+	}
+
+	if( d < dirs_len ) {
+		/* drop the old entries, the new ones are appended */
+		cat_dir *old = &dirs[d];
+		for( int i = old->first; i < old->first + old->count; i++ ) {
+			free( entries[i].symbol );
+			free( entries[i].long_name );
+		}
+		memmove( entries + old->first, entries + old->first + old->count,
+			(entries_len - old->first - old->count) * sizeof(cat_entry) );
+		entries_len -= old->count;
+		for( int i = 0; i < dirs_len; i++ ) {
+			if( dirs[i].first > old->first ) {
+				dirs[i].first -= old->count;
+			}
+		}
+		free( old->path );
+		for( int k = 0; k < 3; k++ ) {
+			free( old->masters[k] );
+		}
+	} else {
+		dirs = (cat_dir*) realloc( dirs, (dirs_len + 1) * sizeof(cat_dir) );
+		dirs_len++;
+	}
+
+	cat_dir *dir = &dirs[d];
+	dir->path = real;
+	for( int k = 0; k < 3; k++ ) {
+		dir->masters[k] = masters[k];
+	}
+	dir->stamp = stamp;
+	dir->first = entries_len;
+	dir->count = 0;
+
+	for( int n = 1; n <= ms.maxFileNumber(); n++ ) {
+		const master_record *mr = ms.getRecord( n );
+		if( mr == NULL ) {
+			continue;
+		}
+		entries = (cat_entry*) realloc( entries,
+			(entries_len + 1) * sizeof(cat_entry) );
+		cat_entry *e = &entries[entries_len++];
+		e->dir = d;
+		e->symbol = xstrdup( mr->c_symbol );
+		e->long_name = xstrdup( mr->c_long_name );
+		e->file_number = mr->file_number;
+		e->kind = mr->kind;
+		e->field_bitset = mr->field_bitset;
+		e->from_date = mr->from_date;
+		e->to_date = mr->to_date;
+		dir->count++;
+	}
+
+	updated++;
+	elapsed += wall_time() - t0;
+	return true;
+}
+
+
+/* string table of the file being written, offset 0 is "" */
+struct cat_strings
+{
+	char *buf;
+	unsigned int len;
+	unsigned int size;
+};
+
+static uint32_t add_string( cat_strings *st, const char *s )
+{
+	if( s == NULL || *s == '\0' ) {
+		return 0;
+	}
+	unsigned int n = strlen( s ) + 1;
+	if( st->len + n > st->size ) {
+		st->size = (st->len + n) * 2;
+		st->buf = (char*) realloc( st->buf, st->size );
+	}
+	memcpy( st->buf + st->len, s, n );
+	st->len += n;
+	return st->len - n;
+}
+
+static void add_slot( unsigned char *slots, unsigned int nslots,
+	const char *key, uint32_t ref )
+{
+	unsigned long long h = fnv1a_hash( key, strlen(key) );
+	unsigned int mask = nslots - 1;
+	unsigned int i = h & mask;
+	while( get_u32( slots + (unsigned long long) i * CAT_SLOT_LEN + 4 ) != 0 ) {
+		i = (i + 1) & mask;
+	}
+	put_u32( slots + (unsigned long long) i * CAT_SLOT_LEN, h >> 32 );
+	put_u32( slots + (unsigned long long) i * CAT_SLOT_LEN + 4, ref );
+}
+
+
+/**
+ * Write the updated catalog to a temporary file and rename it, readers see
+ * either the old or the new one.
+ */
+bool Catalog::write()
+{
+	double t0 = wall_time();
+	load();
+
+	cat_strings st = { (char*) malloc( 4096 ), 1, 4096 };
+	st.buf[0] = '\0';
+
+	int nkeys = 0;
+	for( int i = 0; i < entries_len; i++ ) {
+		nkeys += *entries[i].symbol != '\0';
+		nkeys += *entries[i].long_name != '\0'
+			&& strcmp( entries[i].long_name, entries[i].symbol ) != 0;
+	}
+	/* at most half full, so probe sequences stay short */
+	unsigned int slots_cnt = nkeys > 0 ? 8 : 0;
+	while( slots_cnt > 0 && slots_cnt < 2U * nkeys ) {
+		slots_cnt *= 2;
+	}
+
+	unsigned long long fixed_len = CAT_HEADER_LEN
+		+ (unsigned long long) dirs_len * CAT_DIR_LEN
+		+ (unsigned long long) entries_len * CAT_ENTRY_LEN
+		+ (unsigned long long) slots_cnt * CAT_SLOT_LEN;
+	unsigned char *buf = (unsigned char*) calloc( fixed_len, 1 );
+	unsigned char *p = buf + CAT_HEADER_LEN;
+
+	for( int i = 0; i < dirs_len; i++, p += CAT_DIR_LEN ) {
+		put_u32( p, add_string( &st, dirs[i].path ) );
+		put_u32( p + 4, dirs[i].first );
+		put_u32( p + 8, dirs[i].count );
+		for( int k = 0; k < 3; k++ ) {
+			put_u32( p + 12 + 4 * k, add_string( &st, dirs[i].masters[k] ) );
+		}
+		put_u64( p + 24, dirs[i].stamp );
+	}
+
+	unsigned char *slots = p + (unsigned long long) entries_len * CAT_ENTRY_LEN;
+	for( int i = 0; i < entries_len; i++, p += CAT_ENTRY_LEN ) {
+		const cat_entry *e = &entries[i];
+		put_u32( p, e->dir );
+		put_u32( p + 4, add_string( &st, e->symbol ) );
+		put_u32( p + 8, add_string( &st, e->long_name ) );
+		put_u16( p + 12, e->file_number );
+		p[14] = e->kind;
+		p[15] = e->field_bitset;
+		put_u32( p + 16, e->from_date );
+		put_u32( p + 20, e->to_date );
+
+		if( *e->symbol != '\0' ) {
+			add_slot( slots, slots_cnt, e->symbol, 2 * i + 1 );
+		}
+		if( *e->long_name != '\0' && strcmp( e->long_name, e->symbol ) != 0 ) {
+			add_slot( slots, slots_cnt, e->long_name, 2 * i + 2 );
+		}
+	}
+
+	memcpy( buf, CAT_MAGIC, 8 );
+	put_u32( buf + 8, dirs_len );
+	put_u32( buf + 12, entries_len );
+	put_u32( buf + 16, slots_cnt );
+	put_u32( buf + 20, st.len );
+
+	char tmp_path[strlen(path) + 32];
+	sprintf( tmp_path, "%s.tmp%ld", path, (long) getpid() );
+	int fd = ::open( tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666 );
+	bool ok = fd >= 0 && write_all( fd, (const char*) buf, fixed_len )
+		&& write_all( fd, st.buf, st.len );
+	if( !ok ) {
+		setError( tmp_path, strerror(errno) );
+	}
+	if( fd >= 0 && close( fd ) < 0 && ok ) {
+		setError( tmp_path, strerror(errno) );
+		ok = false;
+	}
+	if( ok && rename( tmp_path, path ) < 0 ) {
+		setError( path, strerror(errno) );
+		ok = false;
+	}
+	if( !ok ) {
+		unlink( tmp_path );
+	}
+
+	free( st.buf );
+	free( buf );
+	elapsed += wall_time() - t0;
+	return ok;
+}
+
+
+void Catalog::printStats( FILE *f ) const
+{
+	int ndir = loaded ? dirs_len : (int) ndirs;
+	int nsym = loaded ? entries_len : (int) nentries;
+	fprintf( f, "catalog: %d directories (%d updated), %d symbols, %.3f s\n",
+		ndir, updated, nsym, elapsed );
+}
+
+
+void Catalog::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_CAT, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_CAT, "%s: %s", e1, e2 );
+	}
+}
+
+
+const char* Catalog::lastError() const
+{
+	return error;
+}
@@ -0,0 +1,111 @@
+/*** catalog.h -- symbol index over many metastock directories
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_CATALOG_H
+#define ATEM_CATALOG_H
+
+#include <stdio.h>
+
+struct cat_dir;
+struct cat_entry;
+
+
+/* one catalog hit, strings are owned by the Catalog */
+struct catalog_record
+{
+	const char *dir;
+	const char *symbol;
+	const char *long_name;
+	int file_number;
+	char kind;
+	unsigned char field_bitset;
+	int from_date;
+	int to_date;
+};
+
+#define ERROR_LENGTH_CAT 256
+
+/**
+ * Symbol index over any number of metastock directories in a single file.
+ * Symbols and long names are keys of an open addressing hash table, so a
+ * lookup is one probe sequence within the mapped file. update() parses a
+ * directory again only if its master files have changed (mtime).
+ */
+class Catalog
+{
+	public:
+		Catalog();
+		~Catalog();
+
+		bool open( const char *path );
+		int lookup( const char *key, catalog_record *recs, int max ) const;
+
+		bool update( const char *ms_dir );
+		bool write();
+
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+	private:
+		void load();
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		char *path;
+		void *map;
+		unsigned long long map_len;
+		unsigned int ndirs;
+		unsigned int nentries;
+		unsigned int nslots;
+		unsigned int strings_len;
+
+		/* in memory copy for updates */
+		bool loaded;
+		cat_dir *dirs;
+		int dirs_len;
+		cat_entry *entries;
+		int entries_len;
+
+		int updated;
+		double elapsed;
+
+		mutable char error[ERROR_LENGTH_CAT];
+};
+
+
+
+
+#endif
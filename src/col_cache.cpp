@@ -0,0 +1,407 @@
+/*** col_cache.cpp -- persistent cache of decoded data files
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "col_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "ms_file.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+# define USE_MMAP 1
+#endif
+
+#if defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+# define ST_MTIME_NS( _st_ ) ((_st_).st_mtim.tv_nsec)
+#else
+# define ST_MTIME_NS( _st_ ) 0
+#endif
+
+#if !defined O_BINARY
+# define O_BINARY 0
+#endif
+
+
+
+/* bump the last byte whenever the layout changes */
+#define COL_MAGIC "ATEMCOL\001"
+#define COL_BYTE_ORDER 0x01020304
+
+/* raw data copies waiting for the background writer */
+#define MAX_PENDING_REBUILDS 4
+
+/* 64 bytes header, followed by 8 columns of count 32 bit values each:
+   date, time (int) and open, high, low, close, volume, openint (float) */
+struct col_header
+{
+	char magic[8];
+	uint32_t byte_order;
+	uint32_t count;
+	uint64_t src_size;
+	int64_t src_mtime;
+	int64_t src_mtime_ns;
+	uint64_t src_hash;
+	uint32_t field_bitset;
+	uint32_t reserved[3];
+};
+
+#define COL_DATA_LEN( _cnt_ ) ( sizeof(col_header) + 8 * 4 * (size_t)(_cnt_) )
+
+
+struct col_job
+{
+	char *path;
+	char *raw;
+	long size;
+	unsigned char fields;
+	long long src_size;
+	long long src_mtime;
+	long src_mtime_ns;
+};
+
+
+ColCache::ColCache() :
+	ms_dir( NULL ),
+	dir( NULL ),
+	pool( NULL ),
+	map( NULL ),
+	map_len( 0 ),
+	src_size( -1 ),
+	src_mtime( 0 ),
+	src_mtime_ns( 0 ),
+	hits( 0 ),
+	misses( 0 )
+{
+	error[0] = '\0';
+}
+
+
+ColCache::~ColCache()
+{
+	/* let pending rebuilds finish */
+	delete pool;
+	close();
+	free( dir );
+	free( ms_dir );
+}
+
+
+bool ColCache::setDir( const char *cache_dir, const char *_ms_dir )
+{
+	free( dir );
+	dir = cache_subdir( cache_dir, _ms_dir );
+	if( dir == NULL ) {
+		setError( cache_dir, strerror(errno) );
+		return false;
+	}
+
+	ms_dir = (char*) realloc( ms_dir, strlen(_ms_dir) + 1 );
+	strcpy( ms_dir, _ms_dir );
+
+	delete pool;
+	pool = new ThreadPool( 1 );
+	return true;
+}
+
+
+char* ColCache::entryPath( const char *file_name ) const
+{
+	size_t len = strlen( dir ) + strlen( file_name ) + 5;
+	char *path = (char*) malloc( len );
+	snprintf( path, len, "%s%s.col", dir, file_name );
+	return path;
+}
+
+
+/**
+ * Map the entry for file_name if it is still valid. Otherwise remember the
+ * source's stat() so that a following rebuild() can use it.
+ */
+bool ColCache::open( const char *file_name, unsigned char fields,
+	ms_columns *cols )
+{
+	assert( map == NULL );
+
+	char src[strlen(ms_dir) + strlen(file_name) + 1];
+	strcpy( src, ms_dir );
+	strcat( src, file_name );
+
+	struct stat st;
+	src_size = -1;
+	if( stat( src, &st ) < 0 ) {
+		return false;
+	}
+	src_size = st.st_size;
+	src_mtime = st.st_mtime;
+	src_mtime_ns = ST_MTIME_NS( st );
+
+	char *path = entryPath( file_name );
+	int fd = ::open( path, O_RDONLY | O_BINARY );
+	free( path );
+	if( fd < 0 ) {
+		misses++;
+		return false;
+	}
+
+	col_header hdr;
+	if( fstat( fd, &st ) < 0 || (size_t)st.st_size < sizeof(hdr)
+			|| !read_all( fd, (char*)&hdr, sizeof(hdr) )
+			|| memcmp( hdr.magic, COL_MAGIC, 8 ) != 0
+			|| hdr.byte_order != COL_BYTE_ORDER
+			|| (long long)hdr.src_size != src_size
+			|| hdr.src_mtime != src_mtime
+			|| hdr.src_mtime_ns != src_mtime_ns
+			|| hdr.field_bitset != fields
+			|| (size_t)st.st_size != COL_DATA_LEN( hdr.count ) ) {
+		::close( fd );
+		misses++;
+		return false;
+	}
+
+	map_len = st.st_size;
+#if defined USE_MMAP
+	map = mmap( NULL, map_len, PROT_READ, MAP_SHARED, fd, 0 );
+	if( map == MAP_FAILED ) {
+		map = NULL;
+	}
+#else
+	map = malloc( map_len );
+	if( lseek( fd, 0, SEEK_SET ) != 0
+			|| !read_all( fd, (char*)map, map_len ) ) {
+		free( map );
+		map = NULL;
+	}
+#endif
+	::close( fd );
+	if( map == NULL ) {
+		misses++;
+		return false;
+	}
+
+	const int *data = (const int*)( (const char*)map + sizeof(col_header) );
+	int cnt = hdr.count;
+	cols->count = cnt;
+	cols->field_bitset = fields;
+	cols->date = data;
+	cols->time = data + cnt;
+	cols->open = (const float*)( data + 2 * cnt );
+	cols->high = (const float*)( data + 3 * cnt );
+	cols->low = (const float*)( data + 4 * cnt );
+	cols->close = (const float*)( data + 5 * cnt );
+	cols->volume = (const float*)( data + 6 * cnt );
+	cols->openint = (const float*)( data + 7 * cnt );
+
+	hits++;
+	return true;
+}
+
+
+void ColCache::close()
+{
+	if( map == NULL ) {
+		return;
+	}
+#if defined USE_MMAP
+	munmap( map, map_len );
+#else
+	free( map );
+#endif
+	map = NULL;
+	map_len = 0;
+}
+
+
+/**
+ * Schedule writing a new entry for file_name from its raw contents. Must be
+ * called after an unsuccessful open() for the same file.
+ */
+void ColCache::rebuild( const char *file_name, unsigned char fields,
+	const char *buf, long size )
+{
+	if( src_size != size ) {
+		/* changed since open() or not stat'able, try again next time */
+		return;
+	}
+
+	/* bound the memory used by copies waiting for the writer */
+	pool->wait( MAX_PENDING_REBUILDS );
+
+	col_job *job = (col_job*) malloc( sizeof(col_job) );
+	job->path = entryPath( file_name );
+	job->raw = (char*) malloc( size );
+	memcpy( job->raw, buf, size );
+	job->size = size;
+	job->fields = fields;
+	job->src_size = src_size;
+	job->src_mtime = src_mtime;
+	job->src_mtime_ns = src_mtime_ns;
+
+	pool->submit( rebuild_job, job );
+}
+
+
+void ColCache::rebuild_job( void *arg )
+{
+	col_job *job = (col_job*) arg;
+	FDat dat( job->raw, job->size, job->fields );
+	int cnt = dat.countRecords();
+
+	col_header hdr;
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, COL_MAGIC, 8 );
+	hdr.byte_order = COL_BYTE_ORDER;
+	hdr.count = cnt;
+	hdr.src_size = job->src_size;
+	hdr.src_mtime = job->src_mtime;
+	hdr.src_mtime_ns = job->src_mtime_ns;
+	hdr.src_hash = fnv1a_hash( job->raw, job->size );
+	hdr.field_bitset = job->fields;
+
+	if( cnt < 0 ) {
+		goto end;
+	}
+
+	/* Only touched (e.g. copied without preserving mtime)? Then the columns
+	   are still good and we just refresh the header. */
+	{
+		int fd = ::open( job->path, O_RDWR | O_BINARY );
+		if( fd >= 0 ) {
+			col_header old;
+			struct stat st;
+			bool same = fstat( fd, &st ) == 0
+				&& read_all( fd, (char*)&old, sizeof(old) )
+				&& memcmp( old.magic, COL_MAGIC, 8 ) == 0
+				&& old.byte_order == COL_BYTE_ORDER
+				&& old.src_hash == hdr.src_hash
+				&& old.src_size == hdr.src_size
+				&& old.count == hdr.count
+				&& old.field_bitset == hdr.field_bitset
+				&& (size_t)st.st_size == COL_DATA_LEN( cnt );
+			if( same && lseek( fd, 0, SEEK_SET ) == 0
+					&& write_all( fd, (const char*)&hdr, sizeof(hdr) ) ) {
+				::close( fd );
+				goto end;
+			}
+			::close( fd );
+		}
+	}
+
+	{
+		size_t len = COL_DATA_LEN( cnt );
+		char *data = (char*) malloc( len );
+		memcpy( data, &hdr, sizeof(hdr) );
+
+		int *date = (int*)( data + sizeof(hdr) );
+		int *time = date + cnt;
+		float *open = (float*)( date + 2 * cnt );
+		float *high = (float*)( date + 3 * cnt );
+		float *low = (float*)( date + 4 * cnt );
+		float *close = (float*)( date + 5 * cnt );
+		float *volume = (float*)( date + 6 * cnt );
+		float *openint = (float*)( date + 7 * cnt );
+
+		ms_bar bar;
+		for( int i = 0; i < cnt; i++ ) {
+			dat.getBar( i + 1, &bar );
+			date[i] = bar.date;
+			time[i] = bar.time;
+			open[i] = bar.open;
+			high[i] = bar.high;
+			low[i] = bar.low;
+			close[i] = bar.close;
+			volume[i] = bar.volume;
+			openint[i] = bar.openint;
+		}
+
+		/* write a temp file and rename it so that readers never see partial
+		   entries, pid avoids clashes with concurrent atem processes */
+		size_t tmp_len = strlen( job->path ) + 32;
+		char tmp[tmp_len];
+		snprintf( tmp, tmp_len, "%s.%ld.tmp", job->path, (long)getpid() );
+
+		int fd = ::open( tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666 );
+		if( fd >= 0 ) {
+			bool ok = write_all( fd, data, len );
+			ok = (::close( fd ) == 0) && ok;
+#if defined _WIN32
+			unlink( job->path );
+#endif
+			if( !ok || rename( tmp, job->path ) != 0 ) {
+				unlink( tmp );
+			}
+		}
+		free( data );
+	}
+
+end:
+	free( job->raw );
+	free( job->path );
+	free( job );
+}
+
+
+void ColCache::printStats( FILE *f ) const
+{
+	fprintf( f, "cache: %d hits, %d misses\n", hits, misses );
+}
+
+
+const char* ColCache::lastError() const
+{
+	return error;
+}
+
+
+void ColCache::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_CC, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_CC, "%s: %s", e1, e2 );
+	}
+}
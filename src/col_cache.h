@@ -0,0 +1,102 @@
+/*** col_cache.h -- persistent cache of decoded data files
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_COL_CACHE_H
+#define ATEM_COL_CACHE_H
+
+#include <stdio.h>
+
+struct ms_columns;
+class ThreadPool;
+
+
+#define ERROR_LENGTH_CC 256
+
+/**
+ * Directory of pre-decoded data files. Each Fxx file gets one entry holding
+ * IEEE columns (date, time, open, high, low, close, volume, openint) behind a
+ * header which records size, mtime and content hash of the source file.
+ * Valid entries are checked by stat() only and mapped directly into the
+ * formatter. Stale entries are rebuilt by a background thread from the data
+ * which has been read anyway.
+ */
+class ColCache
+{
+	public:
+		ColCache();
+		~ColCache();
+
+		bool setDir( const char *cache_dir, const char *ms_dir );
+
+		bool open( const char *file_name, unsigned char fields,
+			ms_columns *cols );
+		void close();
+		void rebuild( const char *file_name, unsigned char fields,
+			const char *buf, long size );
+
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+	private:
+		char* entryPath( const char *file_name ) const;
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		static void rebuild_job( void *arg );
+
+		char *ms_dir;
+		char *dir;
+		ThreadPool *pool;
+
+		/* currently opened entry */
+		void *map;
+		unsigned long map_len;
+
+		/* stat() of the source file checked by the last open() */
+		long long src_size;
+		long long src_mtime;
+		long src_mtime_ns;
+
+		int hits;
+		int misses;
+
+		mutable char error[ERROR_LENGTH_CC];
+};
+
+
+
+
+#endif
@@ -0,0 +1,408 @@
+/*** compress.cpp -- parallel block compression of output streams
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "config.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#if defined HAVE_ZLIB_H && defined HAVE_LIBZ
+# include <zlib.h>
+# define HAVE_GZIP 1
+#endif
+#if defined HAVE_ZSTD_H && defined HAVE_LIBZSTD
+# include <zstd.h>
+# define HAVE_ZSTD 1
+#endif
+
+
+
+/* same as pigz, large enough to not lose much ratio with independent blocks */
+#define CMP_BLCKSZ (128 * 1024)
+
+/* size of the FILE* buffer in front of our block buffer */
+#define CMP_STDIO_BUFSZ (64 * 1024)
+
+
+struct compress_block
+{
+	compress_method method;
+	int level;
+
+	char *in;
+	size_t in_len;
+	char *out;
+	size_t out_size;
+	size_t out_len;
+	bool ok;
+
+	PoolEvent done;
+};
+
+
+CompressOut::CompressOut() :
+	method( CM_NONE ),
+	level( 0 ),
+	nthreads( 1 ),
+	out( NULL ),
+	pool( NULL ),
+	blocks( NULL ),
+	nblocks( 0 ),
+	head( 0 ),
+	count( 0 ),
+	total_in( 0 ),
+	total_out( 0 ),
+	start_time( 0.0 ),
+	elapsed( 0.0 )
+{
+	error[0] = '\0';
+}
+
+
+CompressOut::~CompressOut()
+{
+	/* finish() has waited for all jobs unless open() was never called */
+	delete pool;
+	for( int i = 0; i < nblocks; i++ ) {
+		free( blocks[i].in );
+		free( blocks[i].out );
+	}
+	delete[] blocks;
+}
+
+
+bool CompressOut::setMethod( const char *spec )
+{
+	const char *colon = strchr( spec, ':' );
+	size_t name_len = colon ? (size_t)(colon - spec) : strlen( spec );
+	int max_level;
+
+	if( name_len == 4 && strncasecmp( spec, "gzip", 4 ) == 0 ) {
+#if defined HAVE_GZIP
+		method = CM_GZIP;
+		level = 6;
+		max_level = 9;
+#else
+		setError( "gzip compression not supported by this build" );
+		return false;
+#endif
+	} else if( name_len == 4 && strncasecmp( spec, "zstd", 4 ) == 0 ) {
+#if defined HAVE_ZSTD
+		method = CM_ZSTD;
+		level = 3;
+		max_level = ZSTD_maxCLevel();
+#else
+		setError( "zstd compression not supported by this build" );
+		return false;
+#endif
+	} else {
+		setError( "unknown compression method", spec );
+		return false;
+	}
+
+	if( colon != NULL ) {
+		char *end;
+		long l = strtol( colon + 1, &end, 10 );
+		if( *end != '\0' || end == colon + 1 || l < 1 || l > max_level ) {
+			setError( "bad compression level", colon + 1 );
+			return false;
+		}
+		level = (int) l;
+	}
+	return true;
+}
+
+
+void CompressOut::setThreads( int n )
+{
+	nthreads = n > 0 ? n : 1;
+}
+
+
+#if defined HAVE_FOPENCOOKIE
+static ssize_t cmp_cookie_write( void *c, const char *data, size_t len )
+{
+	return ((CompressOut*)c)->write( data, len ) ? (ssize_t)len : -1;
+}
+
+static int cmp_cookie_close( void *c )
+{
+	return ((CompressOut*)c)->finish() ? 0 : -1;
+}
+#elif defined HAVE_FUNOPEN
+static int cmp_cookie_write( void *c, const char *data, int len )
+{
+	return ((CompressOut*)c)->write( data, len ) ? len : -1;
+}
+
+static int cmp_cookie_close( void *c )
+{
+	return ((CompressOut*)c)->finish() ? 0 : -1;
+}
+#endif
+
+
+FILE* CompressOut::open( FILE *sink )
+{
+	assert( method != CM_NONE && out == NULL );
+	FILE *f = NULL;
+
+#if defined HAVE_FOPENCOOKIE
+	cookie_io_functions_t io;
+	memset( &io, 0, sizeof(io) );
+	io.write = cmp_cookie_write;
+	io.close = cmp_cookie_close;
+	f = fopencookie( this, "w", io );
+#elif defined HAVE_FUNOPEN
+	f = funopen( this, NULL, cmp_cookie_write, NULL, cmp_cookie_close );
+#else
+	setError( "compressed output not supported on this platform" );
+	return NULL;
+#endif
+	if( f == NULL ) {
+		setError( "compressed output", strerror(errno) );
+		return NULL;
+	}
+	setvbuf( f, NULL, _IOFBF, CMP_STDIO_BUFSZ );
+
+	/* 2 blocks per thread keeps all workers busy while we wait for the
+	   oldest one, plus the one we are currently filling */
+	nblocks = 2 * nthreads + 1;
+	blocks = new compress_block[nblocks];
+	for( int i = 0; i < nblocks; i++ ) {
+		compress_block *b = &blocks[i];
+		b->method = method;
+		b->level = level;
+		b->in = (char*) malloc( CMP_BLCKSZ );
+		b->in_len = 0;
+		b->out = NULL;
+		b->out_size = 0;
+		b->out_len = 0;
+		b->ok = false;
+	}
+	pool = new ThreadPool( nthreads );
+
+	out = sink;
+	start_time = wall_time();
+	return f;
+}
+
+
+FILE* CompressOut::sink() const
+{
+	return out;
+}
+
+
+void CompressOut::compress_job( void *arg )
+{
+	compress_block *b = (compress_block*) arg;
+	b->ok = false;
+	b->out_len = 0;
+
+	switch( b->method ) {
+#if defined HAVE_GZIP
+	case CM_GZIP: {
+		z_stream zs;
+		memset( &zs, 0, sizeof(zs) );
+		/* windowBits 15 + 16 makes deflate write a gzip wrapper */
+		if( deflateInit2( &zs, b->level, Z_DEFLATED, 15 + 16, 8,
+				Z_DEFAULT_STRATEGY ) != Z_OK ) {
+			break;
+		}
+		size_t bound = deflateBound( &zs, b->in_len );
+		if( b->out_size < bound ) {
+			b->out = (char*) realloc( b->out, bound );
+			b->out_size = bound;
+		}
+		zs.next_in = (Bytef*) b->in;
+		zs.avail_in = b->in_len;
+		zs.next_out = (Bytef*) b->out;
+		zs.avail_out = b->out_size;
+		if( deflate( &zs, Z_FINISH ) == Z_STREAM_END ) {
+			b->out_len = zs.total_out;
+			b->ok = true;
+		}
+		deflateEnd( &zs );
+		break;
+	}
+#endif
+#if defined HAVE_ZSTD
+	case CM_ZSTD: {
+		size_t bound = ZSTD_compressBound( b->in_len );
+		if( b->out_size < bound ) {
+			b->out = (char*) realloc( b->out, bound );
+			b->out_size = bound;
+		}
+		size_t len = ZSTD_compress( b->out, b->out_size, b->in, b->in_len,
+			b->level );
+		if( !ZSTD_isError(len) ) {
+			b->out_len = len;
+			b->ok = true;
+		}
+		break;
+	}
+#endif
+	default:
+		assert( false );
+	}
+
+	b->done.set();
+}
+
+
+bool CompressOut::submitBlock()
+{
+	assert( count < nblocks );
+	compress_block *b = &blocks[(head + count) % nblocks];
+
+	total_in += b->in_len;
+	b->done.reset();
+	count++;
+	pool->submit( compress_job, b );
+
+	/* all blocks in flight, we need the oldest one back to go on */
+	if( count == nblocks ) {
+		return writeOldest();
+	}
+	return true;
+}
+
+
+bool CompressOut::writeOldest()
+{
+	assert( count > 0 );
+	compress_block *b = &blocks[head];
+
+	b->done.wait();
+	head = (head + 1) % nblocks;
+	count--;
+	b->in_len = 0;
+
+	if( !b->ok ) {
+		setError( "compression failed" );
+		return false;
+	}
+	if( fwrite( b->out, 1, b->out_len, out ) != b->out_len ) {
+		setError( "writing compressed output", strerror(errno) );
+		return false;
+	}
+	total_out += b->out_len;
+	return true;
+}
+
+
+bool CompressOut::write( const char *data, size_t len )
+{
+	while( len > 0 ) {
+		compress_block *b = &blocks[(head + count) % nblocks];
+		size_t n = CMP_BLCKSZ - b->in_len;
+		if( n > len ) {
+			n = len;
+		}
+		memcpy( b->in + b->in_len, data, n );
+		b->in_len += n;
+		data += n;
+		len -= n;
+
+		if( b->in_len == CMP_BLCKSZ && !submitBlock() ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+bool CompressOut::finish()
+{
+	bool ok = true;
+	compress_block *b = &blocks[(head + count) % nblocks];
+
+	/* an empty member at least, zero bytes are not a valid stream */
+	if( b->in_len > 0 || total_in == 0 ) {
+		ok = submitBlock();
+	}
+	while( count > 0 ) {
+		/* keep draining on errors, jobs still reference our blocks */
+		if( !writeOldest() ) {
+			ok = false;
+		}
+	}
+	pool->wait();
+
+	if( fflush( out ) != 0 ) {
+		setError( "writing compressed output", strerror(errno) );
+		ok = false;
+	}
+	elapsed = wall_time() - start_time;
+	return ok;
+}
+
+
+void CompressOut::printStats( FILE *f ) const
+{
+	const char *name = method == CM_GZIP ? "gzip" : "zstd";
+	double ratio = total_out > 0 ? (double)total_in / total_out : 0.0;
+	double mbs = elapsed > 0.0 ? total_in / elapsed / 1e6 : 0.0;
+
+	fprintf( f, "compress: %s:%d, %d threads, %llu -> %llu bytes, "
+		"ratio %.2f, %.3f s, %.1f MB/s\n",
+		name, level, nthreads, total_in, total_out, ratio, elapsed, mbs );
+}
+
+
+const char* CompressOut::lastError() const
+{
+	return error;
+}
+
+
+void CompressOut::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_CMP, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_CMP, "%s: %s", e1, e2 );
+	}
+}
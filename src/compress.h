@@ -0,0 +1,109 @@
+/*** compress.h -- parallel block compression of output streams
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_COMPRESS_H
+#define ATEM_COMPRESS_H
+
+#include <stdio.h>
+
+class ThreadPool;
+struct compress_block;
+
+
+enum compress_method {
+	CM_NONE = 0,
+	CM_GZIP,
+	CM_ZSTD
+};
+
+#define ERROR_LENGTH_CMP 256
+
+/**
+ * Wraps an output FILE* into another FILE* which compresses everything
+ * written to it. The data is cut into fixed size blocks which are compressed
+ * independently on a thread pool and written to the sink in order. Each block
+ * becomes one gzip member resp. zstd frame, so the result is a standard
+ * multi-member stream readable by gzip -d or zstd -d.
+ */
+class CompressOut
+{
+	public:
+		CompressOut();
+		~CompressOut();
+
+		bool setMethod( const char *spec );
+		void setThreads( int n );
+
+		FILE* open( FILE *sink );
+		FILE* sink() const;
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+		/* called by the FILE* returned from open() */
+		bool write( const char *data, size_t len );
+		bool finish();
+
+	private:
+		bool submitBlock();
+		bool writeOldest();
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		static void compress_job( void *arg );
+
+		compress_method method;
+		int level;
+		int nthreads;
+
+		FILE *out;
+		ThreadPool *pool;
+		compress_block *blocks;
+		int nblocks;
+		int head;
+		int count;
+
+		unsigned long long total_in;
+		unsigned long long total_out;
+		double start_time;
+		double elapsed;
+
+		mutable char error[ERROR_LENGTH_CMP];
+};
+
+
+
+
+#endif
@@ -0,0 +1,459 @@
+/*** exporter.cpp -- parallel export of many metastock directories
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "exporter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "file_buf.h"
+#include "metastock.h"
+#include "ms_file.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#if !defined O_BINARY
+# define O_BINARY 0
+#endif
+
+/* data bytes per slice if memory is not limited, larger files are split
+   even on one thread */
+#define EXPORT_SLICE_SIZE (16 * 1024 * 1024)
+/* data bytes dealt per round if memory is not limited, their text takes
+   about three times as much */
+#define EXPORT_WINDOW (256 * 1024 * 1024)
+
+
+
+/**
+ * A data file shared by its slices, read by the first one which runs. Files
+ * which are streamed are never read as a whole, each slice reads its own
+ * records.
+ */
+struct export_file
+{
+	const Metastock *ms;
+	const char *dir;
+	int fno;
+	bool streamed;
+
+	PoolMutex mtx;
+	bool loaded;
+	FileBuf *buf;
+	int pending;
+	char error[ERROR_LENGTH_EX];
+};
+
+/* one slice of records, whole files are just one slice */
+struct export_job
+{
+	export_file *file;
+	int first;
+	int last;
+	long long size;
+	int index;
+
+	text_buf text;
+	PoolEvent done;
+	char error[ERROR_LENGTH_EX];
+};
+
+
+Exporter::Exporter() :
+	dirs( NULL ),
+	ndirs( 0 ),
+	first( NULL ),
+	jobs( NULL ),
+	njobs( 0 ),
+	nfiles( 0 ),
+	nthreads( ThreadPool::onlineCpus() ),
+	max_memory( 0 ),
+	print_stats( false )
+{
+	*error = '\0';
+}
+
+
+Exporter::~Exporter()
+{
+	for( int i = 0; i < njobs; i++ ) {
+		export_job *job = jobs[i];
+		if( i + 1 == njobs || jobs[i + 1]->file != job->file ) {
+			delete job->file->buf;
+			delete job->file;
+		}
+		free( job->text.buf );
+		delete job;
+	}
+	free( jobs );
+	for( int i = 0; i < ndirs; i++ ) {
+		free( dirs[i] );
+	}
+	free( dirs );
+}
+
+
+void Exporter::setThreads( int n )
+{
+	nthreads = n > 0 ? n : 1;
+}
+
+
+/**
+ * Limit data and text in flight to about bytes. Files are streamed slice by
+ * slice then like Metastock does with a memory limit.
+ */
+void Exporter::setMaxMemory( long long bytes )
+{
+	max_memory = bytes;
+}
+
+
+void Exporter::setStats( bool stats )
+{
+	print_stats = stats;
+}
+
+
+/**
+ * Queue all selected data files of ms, dir is the value of the directory
+ * column. The Metastock must live until run() is done. Files are split
+ * according to the number of threads and the memory limit, so call
+ * setThreads() and setMaxMemory() first.
+ */
+void Exporter::addDir( const Metastock *ms, const char *dir )
+{
+	if( first == NULL ) {
+		first = ms;
+	}
+	dirs = (char**) realloc( dirs, (ndirs + 1) * sizeof(char*) );
+	dirs[ndirs] = strdup( dir );
+
+	for( int i = 1; i <= ms->maxFileNumber(); i++ ) {
+		if( !ms->isSelected( i ) ) {
+			continue;
+		}
+		const master_record *mr = ms->getRecord( i );
+		export_file *file = new export_file;
+		file->ms = ms;
+		file->dir = dirs[ndirs];
+		file->fno = i;
+		file->streamed = false;
+		file->loaded = false;
+		file->buf = NULL;
+		*file->error = '\0';
+
+		/* unknown sizes are scheduled first, errors are reported later */
+		char path[strlen(ms->dirName()) + strlen(mr->file_name) + 1];
+		strcpy( path, ms->dirName() );
+		strcat( path, mr->file_name );
+		struct stat st;
+		long long size = stat( path, &st ) == 0 ? st.st_size : LLONG_MAX;
+
+		/* split large files into record ranges */
+		int rec_len = count_bits( mr->field_bitset ) * 4;
+		long long recs = size < LLONG_MAX && rec_len > 0 ?
+			size / rec_len - 1 : 0;
+		int cnt = recs > INT_MAX ? INT_MAX : (int) recs;
+		int len = FDat::sliceRecords( cnt, nthreads );
+		long long max_len = rec_len > 0 ? (max_memory > 0 ?
+			max_memory / 8 : EXPORT_SLICE_SIZE) / rec_len : len;
+		if( len > max_len ) {
+			len = max_len > 0 ? (int) max_len : 1;
+		}
+		int n = cnt > len ? (cnt + len - 1) / len : 1;
+		file->streamed = max_memory > 0 || size > FDAT_STREAM_SIZE;
+		file->pending = n;
+
+		for( int k = 0; k < n; k++ ) {
+			export_job *job = new export_job;
+			job->file = file;
+			job->first = k * len + 1;
+			job->last = k == n - 1 ? INT_MAX : (k + 1) * len;
+			job->size = n > 1 ? (long long) len * rec_len : size;
+			job->index = njobs;
+			job->text.buf = NULL;
+			job->text.len = job->text.size = 0;
+			*job->error = '\0';
+
+			if( (njobs & (njobs - 1)) == 0 ) {
+				jobs = (export_job**) realloc( jobs,
+					(njobs ? 2 * njobs : 1) * sizeof(export_job*) );
+			}
+			jobs[njobs++] = job;
+		}
+		nfiles++;
+	}
+	ndirs++;
+}
+
+
+/* largest first, equal sizes in output order */
+static int cmp_job_size( const void *a, const void *b )
+{
+	const export_job *ja = *(const export_job**) a;
+	const export_job *jb = *(const export_job**) b;
+	if( ja->size != jb->size ) {
+		return ja->size > jb->size ? -1 : 1;
+	}
+	return ja->index - jb->index;
+}
+
+
+/* read the data file of a slice if not done yet */
+static void load_file( export_file *f )
+{
+	const master_record *mr = f->ms->getRecord( f->fno );
+	const char *dir = f->ms->dirName();
+	char path[strlen(dir) + strlen(mr->file_name) + 1];
+	strcpy( path, dir );
+	strcat( path, mr->file_name );
+
+	f->loaded = true;
+	if( *mr->file_name == '\0' ) {
+		snprintf( f->error, ERROR_LENGTH_EX, "no fdat found: %sF%d",
+			dir, f->fno );
+		return;
+	}
+	int fd = open( path, O_RDONLY | O_BINARY );
+	f->buf = new FileBuf();
+	if( fd < 0 || f->buf->readFile( fd ) < 0 ) {
+		snprintf( f->error, ERROR_LENGTH_EX, "%s: %s", path, strerror(errno) );
+	} else if( FDat( f->buf->constBuf(), f->buf->len(),
+			mr->field_bitset ).countRecords() < 0 ) {
+		snprintf( f->error, ERROR_LENGTH_EX, "fdat file unusable: %s", path );
+	}
+	if( fd >= 0 ) {
+		close( fd );
+	}
+}
+
+
+/* read and format just the records of a slice of a streamed file */
+static void format_streamed( export_job *job )
+{
+	export_file *f = job->file;
+	const master_record *mr = f->ms->getRecord( f->fno );
+	const char *dir = f->ms->dirName();
+	char path[strlen(dir) + strlen(mr->file_name) + 1];
+	strcpy( path, dir );
+	strcat( path, mr->file_name );
+
+	if( *mr->file_name == '\0' ) {
+		snprintf( job->error, ERROR_LENGTH_EX, "no fdat found: %sF%d",
+			dir, f->fno );
+		return;
+	}
+	int fd = open( path, O_RDONLY | O_BINARY );
+	if( fd < 0 ) {
+		snprintf( job->error, ERROR_LENGTH_EX, "%s: %s", path, strerror(errno) );
+		return;
+	}
+	FDatReader r( fd, mr->field_bitset );
+	if( !r.open() ) {
+		if( errno != 0 ) {
+			snprintf( job->error, ERROR_LENGTH_EX, "%s: %s", path,
+				strerror(errno) );
+		} else {
+			snprintf( job->error, ERROR_LENGTH_EX,
+				"fdat file unusable: %s", path );
+		}
+		return;
+	}
+
+	int last = r.countRecords();
+	if( job->last < last ) {
+		last = job->last;
+	}
+	if( job->first > last ) {
+		return;
+	}
+	int cnt = last - job->first + 1;
+	int rl = r.recordLength();
+	char *buf = (char*) malloc( (cnt + 1) * (long)rl );
+	r.seek( job->first );
+	if( r.read( buf, cnt ) != cnt ) {
+		snprintf( job->error, ERROR_LENGTH_EX, "%s: %s", path,
+			errno != 0 ? strerror(errno) : "unexpected end of file" );
+	} else {
+		FDat datfile( buf, (cnt + 1) * (long)rl, mr->field_bitset, cnt );
+		char pfx[MAX_SIZE_MR_STRING + strlen(f->dir) + 2];
+		f->ms->dataPrefix( f->fno, pfx, f->dir );
+		datfile.format( pfx, 1, cnt, &job->text );
+	}
+	free( buf );
+}
+
+
+void Exporter::format_job( void *arg )
+{
+	export_job *job = (export_job*) arg;
+	export_file *f = job->file;
+
+	if( f->streamed ) {
+		format_streamed( job );
+		job->done.set();
+		return;
+	}
+
+	f->mtx.lock();
+	if( !f->loaded ) {
+		load_file( f );
+	}
+	f->mtx.unlock();
+
+	if( *f->error != '\0' ) {
+		strcpy( job->error, f->error );
+	} else {
+		const master_record *mr = f->ms->getRecord( f->fno );
+		FDat datfile( f->buf->constBuf(), f->buf->len(), mr->field_bitset );
+		int last = datfile.countRecords();
+		if( job->last < last ) {
+			last = job->last;
+		}
+		if( job->first <= last ) {
+			char pfx[MAX_SIZE_MR_STRING + strlen(f->dir) + 2];
+			f->ms->dataPrefix( f->fno, pfx, f->dir );
+			datfile.format( pfx, job->first, last, &job->text );
+		}
+	}
+
+	/* the last slice frees the data */
+	f->mtx.lock();
+	if( --f->pending == 0 ) {
+		delete f->buf;
+		f->buf = NULL;
+	}
+	f->mtx.unlock();
+	job->done.set();
+}
+
+
+/**
+ * Format all queued files and write them to the output of the Metastock
+ * settings, i.e. stdout or --output.
+ */
+bool Exporter::run()
+{
+	if( first == NULL ) {
+		setError( "no data directories" );
+		return false;
+	}
+	if( !first->printDataHeader( "directory" ) ) {
+		setError( first->lastError() );
+		return false;
+	}
+
+	double t = wall_time();
+	export_job **order = (export_job**) malloc(
+		(njobs + 1) * sizeof(export_job*) );
+	long long window = max_memory > 0 ? max_memory / 4 : EXPORT_WINDOW;
+
+	StealPool pool( nthreads );
+	bool ok = true;
+	unsigned long long bytes = 0;
+	int rounds = 0;
+	for( int i = 0; ok && i < njobs; rounds++ ) {
+		/* the next slices in output order up to window data bytes, so no
+		   more text than theirs waits for the writer */
+		int n = 1;
+		long long dealt = jobs[i]->size;
+		while( i + n < njobs && jobs[i + n]->size <= window - dealt ) {
+			dealt += jobs[i + n]->size;
+			n++;
+		}
+		memcpy( order, jobs + i, n * sizeof(export_job*) );
+		qsort( order, n, sizeof(export_job*), cmp_job_size );
+		for( int k = 0; k < n; k++ ) {
+			pool.add( format_job, order[k] );
+		}
+		pool.start();
+
+		/* the main thread is the writer, files are written as soon as all
+		   previous ones are done */
+		for( int k = i; k < i + n; k++ ) {
+			export_job *job = jobs[k];
+			job->done.wait();
+			if( ok && *job->error != '\0' ) {
+				setError( job->error );
+				ok = false;
+			} else if( ok && FDat::write( &job->text ) < 0 ) {
+				setError( "writing interrupted" );
+				ok = false;
+			}
+			bytes += job->text.len;
+			free( job->text.buf );
+			job->text.buf = NULL;
+		}
+		pool.wait();
+		i += n;
+	}
+	free( order );
+
+	if( print_stats ) {
+		t = wall_time() - t;
+		fprintf( stderr, "export: %d dirs, %d files, %d slices, %d rounds, "
+			"%d threads, %d steals, %llu bytes, %.3f s, %.1f MB/s\n", ndirs,
+			nfiles, njobs, rounds, pool.threads(), pool.steals(), bytes, t,
+			t > 0.0 ? bytes / t / 1e6 : 0.0 );
+	}
+	return ok;
+}
+
+
+const char* Exporter::lastError() const
+{
+	return error;
+}
+
+
+void Exporter::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_EX, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_EX, "%s: %s", e1, e2 );
+	}
+}
@@ -0,0 +1,90 @@
+/*** exporter.h -- parallel export of many metastock directories
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_EXPORTER_H
+#define ATEM_EXPORTER_H
+
+class Metastock;
+struct export_job;
+
+
+#define ERROR_LENGTH_EX 256
+
+/**
+ * Converts the selected data files of many directories as one job. Files are
+ * split into record ranges (slices) and formatted into memory by a
+ * work-stealing pool, largest first, and written in order of directories and
+ * file numbers. Slices are dealt in rounds of limited size so that the text
+ * waiting for the writer is bounded. Each line starts with the directory
+ * column.
+ */
+class Exporter
+{
+	public:
+		Exporter();
+		~Exporter();
+
+		void setThreads( int n );
+		void setMaxMemory( long long bytes );
+		void setStats( bool stats );
+		void addDir( const Metastock *ms, const char *dir );
+		bool run();
+
+		const char* lastError() const;
+
+	private:
+		static void format_job( void *arg );
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		char **dirs;
+		int ndirs;
+		const Metastock *first;
+		export_job **jobs;
+		int njobs;
+		int nfiles;
+
+		int nthreads;
+		long long max_memory;
+		bool print_stats;
+
+		mutable char error[ERROR_LENGTH_EX];
+};
+
+
+
+
+#endif
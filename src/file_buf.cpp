@@ -0,0 +1,215 @@
+/*** file_buf.cpp -- named buffer holding a whole file
+ *
+ * Copyright (C) 2010-2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "file_buf.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "config.h"
+
+
+
+#define READ_BLCKSZ 16384
+/* largest single read(), some systems fail on 2 GB and more */
+#define READ_MAX (1L << 30)
+
+
+FileBuf::FileBuf() :
+	buf( NULL ),
+	buf_len(0),
+	buf_size(0)
+{
+	*name = 0;
+}
+
+FileBuf::~FileBuf()
+{
+	free(buf);
+}
+
+bool FileBuf::hasName() const
+{
+	return (*name != 0);
+}
+
+const char* FileBuf::constName() const
+{
+	return name;
+}
+
+const char* FileBuf::constBuf() const
+{
+	return buf;
+}
+
+long FileBuf::len() const
+{
+	return buf_len;
+}
+
+void FileBuf::setName( const char* file_name )
+{
+	buf_len = 0;
+	strcpy( name, file_name );
+}
+
+/**
+ * Make buf hold size bytes to be filled by the caller.
+ */
+char* FileBuf::reserve( long size )
+{
+	if( size > buf_size ) {
+		resize( size );
+	}
+	buf_len = size;
+	return buf;
+}
+
+/**
+ * Read the whole file. Regular files are read into a buffer of their size
+ * at once, others into a buffer growing by factor 2.
+ */
+int FileBuf::readFile( int fildes )
+{
+	struct stat st;
+	if( fstat( fildes, &st ) == 0 && S_ISREG( st.st_mode )
+			&& st.st_size + READ_BLCKSZ > buf_size ) {
+		/* one block more to see EOF without resizing */
+		if( !resize( st.st_size + READ_BLCKSZ ) ) {
+			return -1;
+		}
+	}
+
+	buf_len = 0;
+	long tmp_len;
+	do {
+		if( buf_len + READ_BLCKSZ > buf_size
+				&& !resize( 2 * buf_size + READ_BLCKSZ ) ) {
+			return -1;
+		}
+		long n = buf_size - buf_len;
+		tmp_len = read( fildes, buf + buf_len, n < READ_MAX ? n : READ_MAX );
+		if( tmp_len > 0 ) {
+			buf_len += tmp_len;
+		}
+	} while( tmp_len > 0 );
+
+	// tmp_len < 0 is an error with errno set
+	return tmp_len < 0 ? -1 : 0;
+}
+
+
+/* alignment of buffer, offsets and sizes for O_DIRECT */
+#define DIRECT_ALIGN 4096
+
+/**
+ * Read the whole file opened with O_DIRECT. Buffer and reads are aligned
+ * to DIRECT_ALIGN, -1 with errno EINVAL if the file system wants more.
+ */
+int FileBuf::readDirect( int fildes )
+{
+#if defined HAVE_POSIX_MEMALIGN
+	struct stat st;
+	if( fstat( fildes, &st ) < 0 ) {
+		return -1;
+	}
+	/* one block more to see EOF */
+	long size = (st.st_size / DIRECT_ALIGN + 1) * DIRECT_ALIGN;
+	if( size > buf_size || (uintptr_t) buf % DIRECT_ALIGN != 0 ) {
+		void *p;
+		if( posix_memalign( &p, DIRECT_ALIGN, size ) != 0 ) {
+			errno = ENOMEM;
+			return -1;
+		}
+		free( buf );
+		buf = (char*) p;
+		buf_size = size;
+	}
+
+	buf_len = 0;
+	while( true ) {
+		if( buf_len == buf_size ) {
+			/* the file has grown, keep the alignment */
+			void *p;
+			if( posix_memalign( &p, DIRECT_ALIGN, 2 * buf_size ) != 0 ) {
+				errno = ENOMEM;
+				return -1;
+			}
+			memcpy( p, buf, buf_len );
+			free( buf );
+			buf = (char*) p;
+			buf_size *= 2;
+		}
+		long n = buf_size - buf_len;
+		if( n > READ_MAX ) {
+			n = READ_MAX;
+		}
+		long tmp_len = read( fildes, buf + buf_len, n );
+		if( tmp_len < 0 ) {
+			return -1;
+		}
+		buf_len += tmp_len;
+		/* a short read is the end, the offset is not aligned anymore */
+		if( tmp_len < n ) {
+			return 0;
+		}
+	}
+#else
+	(void) fildes;
+	errno = EINVAL;
+	return -1;
+#endif
+}
+
+
+/* false with errno set if there is not enough memory, buf is unchanged then */
+bool FileBuf::resize( long size )
+{
+	char *p = (char*) realloc( buf, size );
+	if( p == NULL ) {
+		errno = ENOMEM;
+		return false;
+	}
+	buf = p;
+	buf_size = size;
+	return true;
+}
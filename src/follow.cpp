@@ -0,0 +1,405 @@
+/*** follow.cpp -- print records appended to data files as they come
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+
+#include "follow.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "file_buf.h"
+#include "metastock.h"
+#include "ms_file.h"
+#include "util.h"
+
+#if defined HAVE_SYS_INOTIFY_H
+# include <poll.h>
+# include <sys/inotify.h>
+#endif
+
+
+
+/* records per read of a growing file */
+#define FOLLOW_WINDOW 16384
+
+
+Follower::Follower( Metastock *_ms ) :
+	ms( _ms ),
+	reload( NULL ),
+	reload_arg( NULL ),
+	fd( -1 ),
+	known( NULL ),
+	known_len( 0 ),
+	window( new FileBuf() ),
+	text( (text_buf*) calloc( 1, sizeof(text_buf) ) ),
+	updates( 0 ),
+	records( 0 ),
+	reloads( 0 ),
+	latency_sum( 0.0 ),
+	latency_max( 0.0 )
+{
+	*error = '\0';
+}
+
+
+Follower::~Follower()
+{
+	if( fd >= 0 ) {
+		close( fd );
+	}
+	free( known );
+	delete window;
+	free( text->buf );
+	free( text );
+}
+
+
+void Follower::setReload( follow_reload_func func, void *arg )
+{
+	reload = func;
+	reload_arg = arg;
+}
+
+
+/**
+ * Print the records of data file fno which have not been printed yet. Errors
+ * are fatal only for the initial print, later the file may just be in the
+ * middle of being rewritten and the next event will tell.
+ */
+bool Follower::update( int fno, bool initial )
+{
+	FDatReader *r = ms->openData( fno );
+	if( r == NULL ) {
+		if( initial ) {
+			setError( ms->lastError() );
+		}
+		return !initial;
+	}
+
+	int from = known[fno] < 0 ? 0 : known[fno];
+	int cnt = r->countRecords();
+	if( initial && ms->tailRecords() > 0 && cnt > ms->tailRecords() ) {
+		from = cnt - ms->tailRecords();
+	}
+	if( cnt <= from ) {
+		/* unchanged or rewritten shorter, continue from there */
+		known[fno] = cnt;
+		delete r;
+		return true;
+	}
+
+	char pfx[MAX_SIZE_MR_STRING + 2];
+	ms->dataPrefix( fno, pfx, NULL );
+	unsigned char fields = ms->getRecord( fno )->field_bitset;
+	int rl = r->recordLength();
+	char *buf = window->reserve( (long)(FOLLOW_WINDOW + 1) * rl );
+
+	bool ok = true;
+	int n;
+	r->seek( from + 1 );
+	while( (n = r->read( buf, FOLLOW_WINDOW )) > 0 ) {
+		FDat datfile( buf, (n + 1) * (long)rl, fields, n );
+		text->len = 0;
+		datfile.format( pfx, 1, n, text );
+		if( FDat::write( text ) < 0 ) {
+			setError( "writing interrupted" );
+			ok = false;
+			break;
+		}
+		from += n;
+	}
+	if( n < 0 && initial ) {
+		setError( ms->getRecord( fno )->file_name,
+			errno != 0 ? strerror(errno) : "unexpected end of file" );
+		ok = false;
+	}
+	if( FDat::flush() != 0 && ok ) {
+		setError( "writing interrupted" );
+		ok = false;
+	}
+
+	if( !initial && from > known[fno] ) {
+		/* time from the last write to the file until we have written */
+		double latency = wall_time() - r->modified();
+		if( latency < 0.0 ) {
+			latency = 0.0;
+		}
+		latency_sum += latency;
+		if( latency > latency_max ) {
+			latency_max = latency;
+		}
+		updates++;
+		records += from - (known[fno] < 0 ? 0 : known[fno]);
+	}
+	known[fno] = from;
+	delete r;
+	return ok;
+}
+
+
+/**
+ * Print all selected files, initially everything, later only the files not
+ * known yet (new symbols) and the new records of the others.
+ */
+bool Follower::printAll( bool initial )
+{
+	int len = ms->maxFileNumber() + 1;
+	if( len > known_len ) {
+		known = (int*) realloc( known, len * sizeof(int) );
+		for( int i = known_len; i < len; i++ ) {
+			known[i] = -1;
+		}
+		known_len = len;
+	}
+	for( int fno = 1; fno < known_len; fno++ ) {
+		if( ms->isSelected( fno ) && !update( fno, initial ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+#if defined HAVE_SYS_INOTIFY_H
+
+static volatile sig_atomic_t follow_stop = 0;
+
+static void on_stop( int )
+{
+	follow_stop = 1;
+}
+
+
+/* file number of data file name, 0 if it isn't one */
+static int data_number( const char *name )
+{
+	if( (name[0] != 'F' && name[0] != 'f') || name[1] < '1' || name[1] > '9' ) {
+		return 0;
+	}
+	char *end;
+	long n = strtol( name + 1, &end, 10 );
+	if( strcasecmp( end, ".DAT" ) != 0 && strcasecmp( end, ".MWD" ) != 0 ) {
+		return 0;
+	}
+	return n <= 0xFFFF ? n : 0;
+}
+
+static bool is_master( const char *name )
+{
+	return strcasecmp( name, "MASTER" ) == 0
+		|| strcasecmp( name, "EMASTER" ) == 0
+		|| strcasecmp( name, "XMASTER" ) == 0;
+}
+
+
+/**
+ * Watch the directory for data files being written and master files being
+ * replaced. Master files are only looked at when they are complete (closed
+ * or renamed into place), data files on every write to be fast.
+ */
+bool Follower::watch()
+{
+	fd = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+	if( fd < 0 ) {
+		setError( "inotify", strerror(errno) );
+		return false;
+	}
+	if( inotify_add_watch( fd, ms->dirName(), IN_MODIFY | IN_CLOSE_WRITE
+			| IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR ) < 0 ) {
+		setError( ms->dirName(), strerror(errno) );
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * Read the pending events and update the data files written meanwhile, sets
+ * follow_stop if the directory is gone.
+ */
+bool Follower::handleEvents( bool *do_reload )
+{
+	char buf[64 * 1024] __attribute__ ((aligned(__alignof__(inotify_event))));
+	int dirty[1024];
+	int ndirty = 0;
+
+	ssize_t len;
+	while( (len = read( fd, buf, sizeof(buf) )) > 0 ) {
+		for( char *p = buf; p < buf + len; ) {
+			const inotify_event *ev = (const inotify_event*) p;
+			p += sizeof(inotify_event) + ev->len;
+
+			if( ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED) ) {
+				follow_stop = 1;
+				continue;
+			}
+			if( ev->len == 0 ) {
+				continue;
+			}
+			if( is_master( ev->name ) ) {
+				if( ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) ) {
+					*do_reload = true;
+				}
+				continue;
+			}
+			int fno = data_number( ev->name );
+			if( fno <= 0 || fno >= known_len || !ms->isSelected( fno ) ) {
+				continue;
+			}
+			int i = 0;
+			while( i < ndirty && dirty[i] != fno ) {
+				i++;
+			}
+			if( i == ndirty ) {
+				if( ndirty == 1024 ) {
+					/* too many at once, just look at all of them */
+					*do_reload = true;
+				} else {
+					dirty[ndirty++] = fno;
+				}
+			}
+		}
+	}
+	if( len < 0 && errno != EAGAIN && errno != EINTR ) {
+		setError( "inotify", strerror(errno) );
+		return false;
+	}
+
+	for( int i = 0; i < ndirty; i++ ) {
+		if( !update( dirty[i], false ) ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Print and follow the selected files until SIGINT, SIGTERM or until the
+ * directory is removed.
+ */
+bool Follower::run()
+{
+	/* watch first to miss nothing written while printing initially */
+	if( !watch() ) {
+		return false;
+	}
+	if( !ms->printDataHeader( NULL ) || !printAll( true ) ) {
+		if( *error == '\0' ) {
+			setError( ms->lastError() );
+		}
+		return false;
+	}
+
+	struct sigaction sa, old_int, old_term;
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = on_stop;
+	sigaction( SIGINT, &sa, &old_int );
+	sigaction( SIGTERM, &sa, &old_term );
+	follow_stop = 0;
+
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	bool ok = true;
+	while( ok && !follow_stop ) {
+		int r = poll( &pfd, 1, 200 );
+		if( r < 0 && errno != EINTR ) {
+			setError( "poll", strerror(errno) );
+			ok = false;
+		}
+		if( r <= 0 ) {
+			continue;
+		}
+
+		bool do_reload = false;
+		ok = handleEvents( &do_reload );
+		if( ok && do_reload ) {
+			reloads++;
+			if( reload != NULL && !reload( ms, reload_arg ) ) {
+				/* maybe not completely written, wait for the next change */
+				fprintf( stderr, "warning: %s\n", ms->lastError() );
+			} else {
+				ok = printAll( false );
+			}
+		}
+	}
+
+	sigaction( SIGINT, &old_int, NULL );
+	sigaction( SIGTERM, &old_term, NULL );
+	return ok;
+}
+
+#else
+
+bool Follower::run()
+{
+	setError( "follow", "not supported on this system" );
+	return false;
+}
+
+#endif
+
+
+void Follower::printStats( FILE *f ) const
+{
+	fprintf( f, "follow: %d updates, %lld records, %d reloads, "
+		"latency avg %.3f ms, max %.3f ms\n", updates, records, reloads,
+		updates > 0 ? 1000.0 * latency_sum / updates : 0.0,
+		1000.0 * latency_max );
+}
+
+
+const char* Follower::lastError() const
+{
+	return error;
+}
+
+
+void Follower::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_FOLLOW, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_FOLLOW, "%s: %s", e1, e2 );
+	}
+}
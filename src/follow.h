@@ -0,0 +1,102 @@
+/*** follow.h -- print records appended to data files as they come
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+
+#ifndef ATEM_FOLLOW_H
+#define ATEM_FOLLOW_H
+
+#include <stdio.h>
+
+class Metastock;
+class FileBuf;
+struct text_buf;
+
+
+#define ERROR_LENGTH_FOLLOW 256
+
+/* called after the master files have changed, should rescan and select */
+typedef bool (*follow_reload_func)( Metastock *ms, void *arg );
+
+/**
+ * Prints the selected data files of a directory and then keeps watching the
+ * directory using inotify. Whenever a data file grows only its new records
+ * are printed. A change of the master files triggers the reload function,
+ * new data files selected thereafter are printed completely.
+ */
+class Follower
+{
+	public:
+		Follower( Metastock *ms );
+		~Follower();
+
+		void setReload( follow_reload_func func, void *arg );
+		bool run();
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+	private:
+		bool watch();
+		bool printAll( bool initial );
+		bool update( int fno, bool initial );
+		bool handleEvents( bool *reload );
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		Metastock *ms;
+		follow_reload_func reload;
+		void *reload_arg;
+		int fd;
+
+		/* records printed per file number, -1 if not printed yet */
+		int *known;
+		int known_len;
+
+		FileBuf *window;
+		text_buf *text;
+
+		int updates;
+		long long records;
+		int reloads;
+		double latency_sum;
+		double latency_max;
+
+		mutable char error[ERROR_LENGTH_FOLLOW];
+};
+
+
+
+
+#endif
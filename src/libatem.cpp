@@ -0,0 +1,294 @@
+/*** libatem.cpp -- library interface to metastock directories
+ *
+ * Copyright (C) 2010-2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "libatem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "file_buf.h"
+#include "metastock.h"
+#include "ms_file.h"
+
+
+
+
+AtemBars::AtemBars() :
+	buf( new FileBuf() ),
+	fdat( NULL ),
+	pos( 0 ),
+	cnt( 0 )
+{
+	*error = '\0';
+}
+
+
+AtemBars::~AtemBars()
+{
+	delete fdat;
+	delete buf;
+}
+
+
+int AtemBars::count() const
+{
+	return cnt;
+}
+
+
+/**
+ * Decode the next bar into *bar, false at the end.
+ */
+bool AtemBars::next( atem_bar *bar )
+{
+	if( pos >= cnt ) {
+		return false;
+	}
+	fdat->getBar( ++pos, bar );
+	return true;
+}
+
+
+void AtemBars::rewind()
+{
+	pos = 0;
+}
+
+
+/**
+ * Decode bar i (0 based) without touching the iterator position.
+ */
+bool AtemBars::get( int i, atem_bar *bar ) const
+{
+	if( i < 0 || i >= cnt ) {
+		return false;
+	}
+	fdat->getBar( i + 1, bar );
+	return true;
+}
+
+
+/**
+ * Index of the first bar dated date or later, count() if there is none.
+ * Bars are expected in chronological order like metastock writes them.
+ */
+int AtemBars::find( int date ) const
+{
+	int lo = 0, hi = cnt;
+	atem_bar bar;
+
+	while( lo < hi ) {
+		int mid = lo + (hi - lo) / 2;
+		fdat->getBar( mid + 1, &bar );
+		if( bar.date < date ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+
+/**
+ * Error of the last failed AtemDir::openBars() on this iterator.
+ */
+const char* AtemBars::lastError() const
+{
+	return error;
+}
+
+
+
+
+struct atem_sym_key
+{
+	const char *symbol;
+	int i;
+};
+
+/* by name, equal names in symbol order */
+static int cmp_sym_key( const void *a, const void *b )
+{
+	const atem_sym_key *x = (const atem_sym_key*) a;
+	const atem_sym_key *y = (const atem_sym_key*) b;
+	int c = strcmp( x->symbol, y->symbol );
+	return c != 0 ? c : x->i - y->i;
+}
+
+
+AtemDir::AtemDir() :
+	ms( NULL ),
+	index( NULL ),
+	by_name( NULL ),
+	nsymbols( 0 ),
+	stamp( 0 )
+{
+}
+
+
+AtemDir::~AtemDir()
+{
+	free( by_name );
+	free( index );
+	delete ms;
+}
+
+
+bool AtemDir::open( const char *dir )
+{
+	delete ms;
+	ms = new Metastock();
+	nsymbols = 0;
+
+	if( !ms->setDir( dir ) || !ms->mastersTime( &stamp ) ) {
+		return false;
+	}
+
+	int max = ms->maxFileNumber();
+	index = (int*) realloc( index, (max + 1) * sizeof(int) );
+	for( int n = 1; n <= max; n++ ) {
+		if( ms->getRecord( n ) != NULL ) {
+			index[nsymbols++] = n;
+		}
+	}
+
+	by_name = (atem_sym_key*) realloc( by_name,
+		(nsymbols + 1) * sizeof(atem_sym_key) );
+	for( int i = 0; i < nsymbols; i++ ) {
+		by_name[i].symbol = ms->getRecord( index[i] )->c_symbol;
+		by_name[i].i = i;
+	}
+	qsort( by_name, nsymbols, sizeof(atem_sym_key), cmp_sym_key );
+	return true;
+}
+
+
+int AtemDir::countSymbols() const
+{
+	return nsymbols;
+}
+
+
+bool AtemDir::getSymbol( int i, atem_symbol *sym ) const
+{
+	if( i < 0 || i >= nsymbols ) {
+		return false;
+	}
+	const master_record *mr = ms->getRecord( index[i] );
+	sym->file_number = mr->file_number;
+	sym->symbol = mr->c_symbol;
+	sym->long_name = mr->c_long_name;
+	sym->file_name = mr->file_name;
+	sym->kind = mr->kind;
+	sym->barsize = mr->barsize;
+	sym->field_bitset = mr->field_bitset;
+	sym->from_date = mr->from_date;
+	sym->to_date = mr->to_date;
+	return true;
+}
+
+
+/**
+ * Index of the first symbol named symbol or -1.
+ */
+int AtemDir::findSymbol( const char *symbol ) const
+{
+	int lo = 0, hi = nsymbols;
+
+	while( lo < hi ) {
+		int mid = lo + (hi - lo) / 2;
+		if( strcmp( by_name[mid].symbol, symbol ) < 0 ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if( lo < nsymbols && strcmp( by_name[lo].symbol, symbol ) == 0 ) {
+		return by_name[lo].i;
+	}
+	return -1;
+}
+
+
+/**
+ * Read the data file of symbol i and position bars before its first record.
+ * On failure bars->lastError() tells why, so threads may open bars
+ * concurrently.
+ */
+bool AtemDir::openBars( int i, AtemBars *bars ) const
+{
+	assert( i >= 0 && i < nsymbols );
+	const master_record *mr = ms->getRecord( index[i] );
+
+	delete bars->fdat;
+	bars->fdat = NULL;
+	bars->pos = bars->cnt = 0;
+
+	if( !ms->readData( index[i], bars->buf, bars->error ) ) {
+		return false;
+	}
+	bars->fdat = new FDat( bars->buf->constBuf(), bars->buf->len(),
+		mr->field_bitset );
+	bars->cnt = bars->fdat->countRecords();
+	if( bars->cnt < 0 ) {
+		bars->cnt = 0;
+		snprintf( bars->error, ERROR_LENGTH_BARS, "fdat file unusable: %s",
+			bars->buf->constName() );
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * True if any master file has been modified since open(). The caller should
+ * open() the directory again then.
+ */
+bool AtemDir::changed() const
+{
+	long long now;
+	return ms != NULL && (!ms->mastersTime( &now ) || now != stamp);
+}
+
+
+const char* AtemDir::lastError() const
+{
+	return ms != NULL ? ms->lastError() : "";
+}
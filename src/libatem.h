@@ -0,0 +1,144 @@
+/*** libatem.h -- library interface to metastock directories
+ *
+ * Copyright (C) 2010-2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_LIBATEM_H
+#define ATEM_LIBATEM_H
+
+class Metastock;
+class FileBuf;
+class FDat;
+
+#define ERROR_LENGTH_BARS 256
+
+
+/* one decoded data record, fields not present in the file stay 0 resp. -0.0 */
+struct atem_bar
+{
+	int date; /* YYYYMMDD */
+	int time; /* HHMMSS */
+	float open;
+	float high;
+	float low;
+	float close;
+	float volume;
+	float openint;
+};
+
+/* master file info of one symbol, strings are owned by the AtemDir */
+struct atem_symbol
+{
+	int file_number;
+	const char *symbol;
+	const char *long_name;
+	const char *file_name;
+	char kind; /* (M)aster, (E)master, (X)Master */
+	char barsize;
+	unsigned char field_bitset;
+	int from_date;
+	int to_date;
+};
+
+
+/**
+ * Forward iterator over the bars of one data file. The file is read once by
+ * AtemDir::openBars(), next() decodes records on demand into the caller's
+ * struct. The buffer is reused when the iterator is opened again.
+ */
+class AtemBars
+{
+	public:
+		AtemBars();
+		~AtemBars();
+
+		int count() const;
+		bool next( atem_bar *bar );
+		void rewind();
+
+		/* random access, safe to share between threads */
+		bool get( int i, atem_bar *bar ) const;
+		int find( int date ) const;
+		const char* lastError() const;
+
+	private:
+		friend class AtemDir;
+		AtemBars( const AtemBars& );
+		AtemBars& operator=( const AtemBars& );
+
+		FileBuf *buf;
+		FDat *fdat;
+		int pos;
+		int cnt;
+
+		/* set by AtemDir::openBars(), not shared with other iterators */
+		char error[ERROR_LENGTH_BARS];
+};
+
+
+/**
+ * A metastock directory (or archive). Symbols are numbered 0 to
+ * countSymbols() - 1 in order of their data file numbers.
+ */
+class AtemDir
+{
+	public:
+		AtemDir();
+		~AtemDir();
+
+		bool open( const char *dir );
+		int countSymbols() const;
+		bool getSymbol( int i, atem_symbol *sym ) const;
+		int findSymbol( const char *symbol ) const;
+		bool openBars( int i, AtemBars *bars ) const;
+		bool changed() const;
+		const char* lastError() const;
+
+	private:
+		AtemDir( const AtemDir& );
+		AtemDir& operator=( const AtemDir& );
+
+		Metastock *ms;
+		int *index;
+		/* symbols sorted by name for findSymbol() */
+		struct atem_sym_key *by_name;
+		int nsymbols;
+		long long stamp;
+};
+
+
+
+
+#endif
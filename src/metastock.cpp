@@ -51,130 +51,193 @@
 #include <fcntl.h>
 #include <time.h>
 #include <limits.h>
-
+#include <ctype.h>
+
+#include "config.h"
+#include "archive_stream.h"
+#include "col_cache.h"
+#include "compress.h"
+#include "file_buf.h"
+#include "ms_archive.h"
 #include "ms_file.h"
+#include "out_cache.h"
+#include "pipeline.h"
+#include "thread_pool.h"
 #include "util.h"
 
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
+#if defined HAVE_LINUX_FIEMAP_H
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+# include <linux/fiemap.h>
+#endif
 
-#define READ_BLCKSZ 16384
-
+#if defined HAVE_REGEX_H
+# include <regex.h>
+#endif
 
-class FileBuf
-{
-	public:
-		FileBuf();
-		~FileBuf();
 
-		bool hasName() const;
-		const char* constName() const;
-		const char* constBuf() const;
-		int len() const;
 
-		void setName( const char* file_name );
+/* what tar and zip archives can't do */
+#define STREAM_ONE_PASS "tar and zip archives are read in one pass only"
 
-		int readFile( int fildes );
+/* page cache modes, see setPageCache() */
+#define PAGE_CACHE_KEEP 0
+#define PAGE_CACHE_DROP 1
+#define PAGE_CACHE_DIRECT 2
 
-	private:
-		void resize( int size );
 
-		char name[MAX_LEN_MR_FILENAME + 1];
-		char *buf;
-		int buf_len;
-		int buf_size;
-};
+bool Metastock::print_header = true;
+char Metastock::print_sep = '\t';
+unsigned short Metastock::prnt_master_fields = 0xFFFF;
+unsigned char Metastock::prnt_data_fields = 0xFF;
+unsigned short Metastock::prnt_data_mr_fields = M_SYM;
 
-FileBuf::FileBuf() :
-	buf( NULL ),
-	buf_len(0),
-	buf_size(0)
-{
-	*name = 0;
-}
 
-FileBuf::~FileBuf()
-{
-	free(buf);
-}
+/* skipped data files are kept as one bit per file number */
+#define SKIP_MAP_WORDS( _len_ ) (((_len_) + 63) / 64)
 
-bool FileBuf::hasName() const
+static inline bool is_skipped( const uint64_t *map, int i )
 {
-	return (*name != 0);
+	return (map[i / 64] >> (i % 64)) & 1;
 }
 
-const char* FileBuf::constName() const
+static inline void set_skip( uint64_t *map, int i, bool skip )
 {
-	return name;
+	if( skip ) {
+		map[i / 64] |= (uint64_t)1 << (i % 64);
+	} else {
+		map[i / 64] &= ~((uint64_t)1 << (i % 64));
+	}
 }
 
-const char* FileBuf::constBuf() const
-{
-	return buf;
-}
 
-int FileBuf::len() const
+/**
+ * Open dir for the *at() functions below, -1 if not supported. It is kept
+ * open only while many files are looked at, an open directory would delay
+ * inotify's IN_DELETE_SELF for --follow.
+ */
+static int open_dir( const char *dir )
 {
-	return buf_len;
+#if defined HAVE_OPENAT && defined O_DIRECTORY
+	return open( dir, O_RDONLY | O_DIRECTORY );
+#else
+	return -1;
+#endif
 }
 
-void FileBuf::setName( const char* file_name )
+/**
+ * Open file name of dir, relative to the already opened dir_fd if possible
+ * so the path is not resolved again for each file. flags are added to
+ * O_RDONLY.
+ */
+static int open_at( int dir_fd, const char *dir, const char *name,
+	int flags = 0 )
 {
-	buf_len = 0;
-	strcpy( name, file_name );
+#if defined HAVE_OPENAT
+	if( dir_fd >= 0 ) {
+		return openat( dir_fd, name, O_RDONLY | flags );
+	}
+#endif
+	char path[strlen(dir) + strlen(name) + 1];
+	strcpy( path, dir );
+	strcat( path, name );
+#if defined _WIN32
+	return open( path, _O_RDONLY | _O_BINARY | flags );
+#else
+	return open( path, O_RDONLY | flags );
+#endif
 }
 
-int FileBuf::readFile( int fildes )
+/**
+ * Fill the metadata of mr from its data file, returns 0 or errno.
+ */
+static int stat_data( int dir_fd, const char *dir, master_record *mr )
 {
-	char *cp = buf;
-	buf_len = 0;
-	int tmp_len;
-	do {
-		if( buf_len + READ_BLCKSZ > buf_size ) {
-			resize( buf_size + READ_BLCKSZ );
-			cp = buf + buf_len;
+#if defined HAVE_STATX
+	if( dir_fd >= 0 ) {
+		struct statx stx;
+		if( statx( dir_fd, mr->file_name, 0, STATX_SIZE | STATX_MTIME,
+				&stx ) < 0 ) {
+			return errno;
 		}
-		tmp_len = read( fildes, cp, READ_BLCKSZ );
-		buf_len += tmp_len;
-		cp += tmp_len;
-	} while( tmp_len > 0 );
-
-	// tmp_len < 0 is an error with errno set
-	return tmp_len;
-}
-
-
-void FileBuf::resize( int size )
-{
-	buf = (char*) realloc( buf, size );
-	buf_size = size;
+		mr->file_size = stx.stx_size;
+		mr->file_ino = stx.stx_ino;
+		mr->file_mtime = stx.stx_mtime.tv_sec;
+		mr->file_mtime_ns = stx.stx_mtime.tv_nsec;
+		mr->has_stat = true;
+		return 0;
+	}
+#endif
+	struct stat st;
+#if defined HAVE_FSTATAT
+	if( dir_fd >= 0 ) {
+		if( fstatat( dir_fd, mr->file_name, &st, 0 ) < 0 ) {
+			return errno;
+		}
+	} else
+#endif
+	{
+		char path[strlen(dir) + strlen(mr->file_name) + 1];
+		strcpy( path, dir );
+		strcat( path, mr->file_name );
+		if( stat( path, &st ) < 0 ) {
+			return errno;
+		}
+	}
+	mr->file_ino = st.st_ino;
+	mr->file_size = st.st_size;
+	mr->file_mtime = st.st_mtime;
+#if defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	mr->file_mtime_ns = st.st_mtim.tv_nsec;
+#else
+	mr->file_mtime_ns = 0;
+#endif
+	mr->has_stat = true;
+	return 0;
 }
 
 
-
-
-bool Metastock::print_header = true;
-char Metastock::print_sep = '\t';
-unsigned short Metastock::prnt_master_fields = 0xFFFF;
-unsigned char Metastock::prnt_data_fields = 0xFF;
-unsigned short Metastock::prnt_data_mr_fields = M_SYM;
-
-
 Metastock::Metastock() :
 	print_date_from(0),
+	print_tail(0),
 	ms_dir(NULL),
+	archive( NULL ),
+	stream( NULL ),
+	deferred( NULL ),
+	n_deferred( 0 ),
+	stream_read( false ),
+	data_fd( -1 ),
 	m_buf( new FileBuf() ),
 	e_buf( new FileBuf() ),
 	x_buf( new FileBuf() ),
 	fdat_buf( new FileBuf() ),
-	out( stdout )
+	col_cache( NULL ),
+	out_cache( NULL ),
+	nthreads( ThreadPool::onlineCpus() ),
+	max_memory( 0 ),
+	io_physical( false ),
+	page_cache( PAGE_CACHE_KEEP ),
+	io_report( false ),
+	pool( NULL ),
+	print_stats( false ),
+	out( stdout ),
+	zout( NULL )
 {
 	error[0] = '\0';
 /* dat file numbers are unsigned short only */
 #define MAX_DAT_NUM 0xFFFF
 	max_dat_num = 0;
-	mr_len = 0;
 	mr_list = NULL;
-	mr_skip_list = NULL;
+	mr_count = 0;
+	mr_size = 0;
+	mr_len = 0;
+	mr_index = NULL;
+	mr_skip_map = NULL;
+	selecting = false;
 }
 
 
@@ -187,15 +250,32 @@ Metastock::Metastock() :
 
 Metastock::~Metastock()
 {
-	free( mr_skip_list );
+	free( mr_skip_map );
+	free( mr_index );
 	free( mr_list );
 
+	delete( pool );
+	delete( out_cache );
+	delete( col_cache );
 	delete( fdat_buf );
 	delete( x_buf );
 	delete( e_buf );
 	delete( m_buf );
+	for( int k = 0; k < n_deferred; k++ ) {
+		delete deferred[k];
+	}
+	free( deferred );
+	delete( stream );
+	delete( archive );
 	free( ms_dir );
 
+	if( zout != NULL ) {
+		/* flushes and waits for pending compression jobs */
+		fclose( (FILE*)out );
+		out = zout->sink();
+		delete zout;
+	}
+
 	/* out is either stdout or a real file which was opened in set_outfile() */
 	if( out != stdout && out != NULL ) {
 		fclose( (FILE*)out );
@@ -203,14 +283,204 @@ Metastock::~Metastock()
 }
 
 
-#define CHECK_MASTER( _file_buf_, _gen_name_ ) \
-	if( strcasecmp(_gen_name_, dirp->d_name) == 0 ) { \
+#define CHECK_MASTER( _file_buf_ ) \
+	do { \
 		assert( !_file_buf_->hasName() ); \
-		_file_buf_->setName( dirp->d_name ); \
+		_file_buf_->setName( name ); \
+	} while( false )
+
+/* names of directory entries, data files are their positive file number */
+#define NAME_OTHER 0
+#define NAME_MASTER -1
+#define NAME_EMASTER -2
+#define NAME_XMASTER -3
+
+/* case-insensitive s == lower, lower must be lower case */
+static inline bool name_eq( const char *s, const char *lower )
+{
+	for( ; *lower != '\0'; s++, lower++ ) {
+		char c = *s >= 'A' && *s <= 'Z' ? *s + ('a' - 'A') : *s;
+		if( c != *lower ) {
+			return false;
+		}
+	}
+	return *s == '\0';
+}
+
+/**
+ * Classify a file name by looking at each character once, most names are
+ * rejected by the first one.
+ */
+static int classify_name( const char *name )
+{
+	switch( name[0] ) {
+	case 'F':
+	case 'f': {
+		const char *p = name + 1;
+		if( *p < '1' || *p > '9' ) {
+			return NAME_OTHER;
+		}
+		long number = 0;
+		do {
+			number = number * 10 + (*p++ - '0');
+			if( number > MAX_DAT_NUM ) {
+				return NAME_OTHER;
+			}
+		} while( *p >= '0' && *p <= '9' );
+		if( *p++ != '.' ) {
+			return NAME_OTHER;
+		}
+		return name_eq( p, "dat" ) || name_eq( p, "mwd" ) ? number
+			: NAME_OTHER;
+	}
+	case 'M':
+	case 'm':
+		return name_eq( name + 1, "aster" ) ? NAME_MASTER : NAME_OTHER;
+	case 'E':
+	case 'e':
+		return name_eq( name + 1, "master" ) ? NAME_EMASTER : NAME_OTHER;
+	case 'X':
+	case 'x':
+		return name_eq( name + 1, "master" ) ? NAME_XMASTER : NAME_OTHER;
+	}
+	return NAME_OTHER;
+}
+
+/**
+ * Take a directory entry if it is a master or data file, ino is its inode
+ * number or 0.
+ */
+void Metastock::addFile( const char *name, unsigned long long ino )
+{
+	int kind = classify_name( name );
+	switch( kind ) {
+	case NAME_OTHER:
+		break;
+	case NAME_MASTER:
+		CHECK_MASTER( m_buf );
+		break;
+	case NAME_EMASTER:
+		CHECK_MASTER( e_buf );
+		break;
+	case NAME_XMASTER:
+		CHECK_MASTER( x_buf );
+		break;
+	default:
+		add_mr_list_datfile( kind, name );
+		findRecord( kind )->file_ino = ino;
+		break;
+	}
+}
+
+#undef CHECK_MASTER
+
+/* directory entries which can't be master or data files */
+#if defined DT_UNKNOWN
+# define SKIP_DTYPE( _t_ ) \
+	((_t_) != DT_REG && (_t_) != DT_LNK && (_t_) != DT_UNKNOWN)
+#endif
+
+#if defined HAVE_GETDENTS64 && defined SKIP_DTYPE
+/* bytes of directory entries read at once */
+# define DENTS_SIZE (256 * 1024)
+#endif
+
+/**
+ * Read a tar or zip archive up to its last master file. Data files on the
+ * way are kept for dumpStream(), the rest is read by dumpStream() only.
+ */
+bool Metastock::readStream()
+{
+	const char *name;
+	while( (name = stream->next()) != NULL ) {
+		int kind = classify_name( name );
+		FileBuf *fb;
+		switch( kind ) {
+		case NAME_OTHER:
+			continue;
+		case NAME_MASTER:
+			fb = m_buf;
+			break;
+		case NAME_EMASTER:
+			fb = e_buf;
+			break;
+		case NAME_XMASTER:
+			fb = x_buf;
+			break;
+		default:
+			fb = new FileBuf();
+			deferred = (FileBuf**) realloc( deferred,
+				(n_deferred + 1) * sizeof(FileBuf*) );
+			deferred[n_deferred++] = fb;
+			break;
+		}
+		if( kind < 0 && fb->hasName() ) {
+			setError( ms_dir, "archive holds more than one directory" );
+			return false;
+		}
+		fb->setName( name );
+		if( !stream->read( fb ) ) {
+			setError( stream->lastError() );
+			return false;
+		}
+		if( kind > 0 ) {
+			addFile( name, 0 );
+		} else if( m_buf->hasName() && e_buf->hasName()
+				&& x_buf->hasName() ) {
+			/* there are no more masters to wait for */
+			return true;
+		}
+	}
+	if( *stream->lastError() != '\0' ) {
+		setError( stream->lastError() );
+		return false;
 	}
+	return true;
+}
+
 
+/**
+ * Add all master and data files of ms_dir. Large directories are read by
+ * getdents64() batches instead of one readdir() per entry.
+ */
 bool Metastock::findFiles()
 {
+	if( stream != NULL ) {
+		return readStream();
+	}
+	if( archive != NULL ) {
+		for( int i = 0; i < archive->countMembers(); i++ ) {
+			addFile( archive->memberName(i), 0 );
+		}
+		return true;
+	}
+
+#if defined HAVE_GETDENTS64 && defined SKIP_DTYPE
+	int fd = open( ms_dir, O_RDONLY | O_DIRECTORY );
+	if( fd < 0 ) {
+		setError( ms_dir, strerror(errno) );
+		return false;
+	}
+	char *buf = (char*) malloc( DENTS_SIZE );
+	ssize_t n;
+	while( (n = getdents64( fd, buf, DENTS_SIZE )) > 0 ) {
+		for( ssize_t off = 0; off < n; ) {
+			const struct dirent64 *d = (const struct dirent64*)(buf + off);
+			off += d->d_reclen;
+			if( !SKIP_DTYPE( d->d_type ) ) {
+				addFile( d->d_name, d->d_ino );
+			}
+		}
+	}
+	if( n < 0 ) {
+		setError( ms_dir, strerror(errno) );
+	}
+	free( buf );
+	close( fd );
+	if( n < 0 ) {
+		return false;
+	}
+#else
 	DIR *dirh;
 	struct dirent *dirp;
 
@@ -220,29 +490,19 @@ bool Metastock::findFiles()
 	}
 
 	for (dirp = readdir(dirh); dirp != NULL; dirp = readdir(dirh)) {
-		if( ( dirp->d_name[0] == 'F' || dirp->d_name[0] == 'f') &&
-			dirp->d_name[1] >= '1' && dirp->d_name[1] <= '9') {
-			char *c_number = dirp->d_name + 1;
-			char *end;
-			long int number = strtol( c_number, &end, 10 );
-			assert( number > 0 && c_number != end );
-			if( (strcasecmp(end, ".MWD") == 0 || strcasecmp(end, ".DAT") == 0)
-					&& number <= MAX_DAT_NUM ) {
-				add_mr_list_datfile( number, dirp->d_name );
-			}
-		} else {
-			CHECK_MASTER( m_buf, "MASTER" );
-			CHECK_MASTER( e_buf, "EMASTER" );
-			CHECK_MASTER( x_buf, "XMASTER" );
+# if defined SKIP_DTYPE
+		if( SKIP_DTYPE( dirp->d_type ) ) {
+			continue;
 		}
+# endif
+		addFile( dirp->d_name, dirp->d_ino );
 	}
 
 	closedir( dirh );
+#endif
 	return true;
 }
 
-#undef CHECK_MASTER
-
 
 bool Metastock::set_outfile( const char *file )
 {
@@ -264,120 +524,644 @@ bool Metastock::set_outfile( const char *file )
 		return false;
 	}
 
+	FDat::set_outfile( out );
 	return true;
 }
 
 
-bool Metastock::setDir( const char* d )
+bool Metastock::set_compress( const char *spec )
 {
-	// set member ms_dir inclusive trailing '/'
-	int dir_len = strlen(d);
-	ms_dir = (char*) realloc( ms_dir, dir_len + 2 );
-	strcpy( ms_dir, d );
-	if( ms_dir[ dir_len - 1] != '/' ) {
-		ms_dir[dir_len] = '/';
-		ms_dir[dir_len + 1] = '\0';
-	}
+	assert( zout == NULL );
+	CompressOut *z = new CompressOut();
+	z->setThreads( nthreads );
 
-	if( !findFiles() ) {
+	if( !z->setMethod( spec ) ) {
+		setError( "compress", z->lastError() );
+		delete z;
 		return false;
 	}
 
-	if( !readMasters() ){
+	FILE *f = z->open( (FILE*)out );
+	if( f == NULL ) {
+		setError( "compress", z->lastError() );
+		delete z;
 		return false;
 	}
-	if( !parseMasters() ) {
-		return false;
+
+	/* from now on everything printed goes through the compressor */
+	out = f;
+	zout = z;
+	FDat::set_outfile( out );
+	return true;
+}
+
+
+bool Metastock::closeOutput()
+{
+	bool ok = true;
+
+	if( col_cache != NULL && print_stats ) {
+		col_cache->printStats( stderr );
+	}
+	if( out_cache != NULL && print_stats ) {
+		out_cache->printStats( stderr );
+	}
+	if( archive != NULL && print_stats ) {
+		archive->printStats( stderr );
+	}
+	if( stream != NULL && print_stats ) {
+		stream->printStats( stderr );
+	}
+
+	if( zout != NULL ) {
+		if( fclose( (FILE*)out ) != 0 ) {
+			setError( "compress", zout->lastError() );
+			ok = false;
+		} else if( print_stats ) {
+			zout->printStats( stderr );
+		}
+		out = zout->sink();
+		delete zout;
+		zout = NULL;
 	}
 
+	/* back to stdout, Metastock may be used for another job now */
+	if( out != stdout ) {
+		if( fclose( (FILE*)out ) != 0 && ok ) {
+			setError( "output", strerror(errno) );
+			ok = false;
+		}
+		out = stdout;
+	}
 	FDat::set_outfile( out );
+	return ok;
+}
+
+
+bool Metastock::setThreads( int n )
+{
+	if( n < 1 ) {
+		setError( "bad number of threads" );
+		return false;
+	}
+	if( pool != NULL && pool->threads() != n ) {
+		delete pool;
+		pool = NULL;
+	}
+	nthreads = n;
 	return true;
 }
 
 
-bool Metastock::set_field_sep( const char *sep )
+/* smallest --max-memory, enough for two windows of any data file */
+#define MIN_MAX_MEMORY (64 * 1024)
+
+/**
+ * Limit the memory used for data and text buffers while printing data
+ * files. Larger files are streamed, see streamFDat() and Pipeline.
+ */
+bool Metastock::setMaxMemory( const char *size )
 {
-	if( sep[0] == '\0' || sep[1] != '\0' ) {
-		setError( "bad field separator" );
+	long long n = parse_size( size );
+	if( n < 0 ) {
+		setError( "bad memory size", size );
 		return false;
 	}
-	print_sep = *sep;
+	if( n < MIN_MAX_MEMORY ) {
+		setError( "max memory too small", size );
+		return false;
+	}
+	max_memory = n;
 	return true;
 }
 
-void Metastock::set_skip_header( int skipheader )
+
+long long Metastock::maxMemory() const
 {
-	print_header = !skipheader;
+	return max_memory;
 }
 
-void Metastock::set_out_format( int fmt_data )
+
+/**
+ * How reading files treats the page cache: "keep" it as usual, "drop" files
+ * once read (announcing the next files instead), or bypass it by "direct"
+ * io. Direct io falls back to drop where the file system doesn't support it
+ * and for files which are read window by window.
+ */
+bool Metastock::setPageCache( const char *mode )
 {
-	if( fmt_data < 0 ) {
-		/* defaults */
-		prnt_master_fields = 0xFFFF;
-		prnt_data_fields = 0xFF;
-		prnt_data_mr_fields = M_SYM;
+	if( strcmp( mode, "keep" ) == 0 ) {
+		page_cache = PAGE_CACHE_KEEP;
+	} else if( strcmp( mode, "drop" ) == 0 ) {
+		page_cache = PAGE_CACHE_DROP;
+	} else if( strcmp( mode, "direct" ) == 0 ) {
+		page_cache = PAGE_CACHE_DIRECT;
 	} else {
-		prnt_master_fields = fmt_data >> 9;
-		prnt_data_fields = fmt_data;
-		prnt_data_mr_fields = prnt_master_fields;
+		setError( "bad page cache mode", mode );
+		return false;
 	}
+	io_report = true;
+	return true;
 }
 
-void Metastock::format_incl( unsigned int fmt_data )
+
+/**
+ * Order of reading data files, "logical" (by file number) or "physical" (by
+ * position on disk). The output is in file number order anyway.
+ */
+bool Metastock::setIoOrder( const char *order )
 {
-	prnt_master_fields |= ( fmt_data >> 9 );
-	prnt_data_fields |= fmt_data;
-	prnt_data_mr_fields |= ( fmt_data >> 9 );
+	if( strcmp( order, "logical" ) == 0 ) {
+		io_physical = false;
+	} else if( strcmp( order, "physical" ) == 0 ) {
+		io_physical = true;
+	} else {
+		setError( "bad io order", order );
+		return false;
+	}
+	return true;
 }
 
-void Metastock::format_excl( unsigned int fmt_data )
+
+/**
+ * Restore the print settings and file selection which are not necessarily
+ * set again by the next job of a batch.
+ */
+void Metastock::resetSettings()
 {
-	prnt_master_fields &= ~( fmt_data >> 9 );
-	prnt_data_fields &= ~fmt_data;
-	prnt_data_mr_fields &= ~( fmt_data >> 9 );
+	print_sep = '\t';
+	print_date_from = 0;
+	print_tail = 0;
+	max_memory = 0;
+	io_physical = false;
+	setThreads( ThreadPool::onlineCpus() );
+	page_cache = PAGE_CACHE_KEEP;
+	io_report = false;
+	FDat::setPrintDateFrom( 0 );
+	memset( mr_skip_map, '\0', SKIP_MAP_WORDS(mr_len) * sizeof(uint64_t) );
+	selecting = false;
 }
 
 
-static int token2format( const char *token )
+void Metastock::setStats( bool stats )
 {
-	int ret = 0;
-	ret = str_to_data_field(token);
-	if( ret == 0 ) {
-		ret = str_to_master_field(token) << 9;
+	print_stats = stats;
+}
+
+
+bool Metastock::openDir( const char* d )
+{
+	// set member ms_dir inclusive trailing '/'
+	int dir_len = strlen(d);
+	ms_dir = (char*) realloc( ms_dir, dir_len + 2 );
+	strcpy( ms_dir, d );
+	if( ms_dir[ dir_len - 1] != '/' ) {
+		ms_dir[dir_len] = '/';
+		ms_dir[dir_len + 1] = '\0';
 	}
-	if( ret == 0  ) {
-		/* token does not match any valid column - try some "flavour" strings */
-		if( strcasecmp(token, "all") == 0 ) {
-			ret = INT_MAX;
-		} else if( strcasecmp(token, "none") == 0 ) {
-			ret = 0;
-		} else {
-			ret = -1;
+
+	/* a regular file must be a tar or zip archive or one written by
+	   writeArchive() */
+	struct stat st;
+	if( stat( d, &st ) == 0 && S_ISREG( st.st_mode )
+			&& ArchiveStream::isStream( d ) ) {
+		stream = new ArchiveStream();
+		if( !stream->open( d ) ) {
+			setError( stream->lastError() );
+			return false;
+		}
+	} else if( stat( d, &st ) == 0 && S_ISREG( st.st_mode ) ) {
+		archive = new MsArchive();
+		if( !archive->open( d ) ) {
+			setError( archive->lastError() );
+			return false;
 		}
 	}
-	return ret;
+	return true;
 }
 
-bool Metastock::columns2bitset( const char *columns )
+
+bool Metastock::setDir( const char* d )
 {
-	static const char *sepset = ",;: \t\n";
-	char col_split[strlen(columns) + 1];
-	char *token;
+	if( !openDir( d ) ) {
+		return false;
+	}
 
-	strcpy( col_split, columns );
-	token = strtok(col_split, sepset);
+	if( !findFiles() ) {
+		return false;
+	}
 
-	/* if first rule is explicit in/exclude then init defaults else zero */
-	if( token != NULL && (*token == '-' || *token == '+') ) {
-		set_out_format( -1 );
-	} else {
-		set_out_format( 0 );
+	if( !readMasters() ){
+		return false;
+	}
+	if( !parseMasters() ) {
+		return false;
 	}
 
-	while( true ) {
-		int bitset;
-		bool exclude = false;
+	FDat::set_outfile( out );
+	return true;
+}
+
+
+/**
+ * Scan the directory and read the master files again after they have been
+ * changed, e.g. new symbols were added. The file selection is cleared.
+ */
+bool Metastock::rescan()
+{
+	if( archive != NULL || stream != NULL ) {
+		setError( ms_dir, "archives don't change" );
+		return false;
+	}
+	m_buf->setName( "" );
+	e_buf->setName( "" );
+	x_buf->setName( "" );
+	mr_count = 0;
+	memset( mr_index, '\0', mr_len * sizeof(unsigned short) );
+	memset( mr_skip_map, '\0', SKIP_MAP_WORDS(mr_len) * sizeof(uint64_t) );
+	selecting = false;
+	max_dat_num = 0;
+
+	return findFiles() && readMasters() && parseMasters();
+}
+
+
+/**
+ * Find file name in ms_dir, first as given, then in lower case and finally
+ * case-insensitive by scanning the directory. On success name is replaced by
+ * the real file name.
+ */
+bool Metastock::findName( char *name ) const
+{
+	char path[strlen(ms_dir) + strlen(name) + 1];
+	strcpy( path, ms_dir );
+	char *base = path + strlen(ms_dir);
+
+	strcpy( base, name );
+	if( access( path, F_OK ) == 0 ) {
+		return true;
+	}
+	for( char *c = base; *c != '\0'; c++ ) {
+		*c = tolower( *c );
+	}
+	if( access( path, F_OK ) == 0 ) {
+		strcpy( name, base );
+		return true;
+	}
+
+	DIR *dirh = opendir( ms_dir );
+	if( dirh == NULL ) {
+		return false;
+	}
+	bool found = false;
+	for( struct dirent *dirp = readdir(dirh); dirp != NULL;
+			dirp = readdir(dirh) ) {
+		if( strcasecmp( dirp->d_name, name ) == 0 ) {
+			strcpy( name, dirp->d_name );
+			found = true;
+			break;
+		}
+	}
+	closedir( dirh );
+	return found;
+}
+
+
+/* record matches if no symbol is wanted or symbol or long name are equal */
+static bool match_symbol( const master_record *mr, const char *symbol )
+{
+	return symbol == NULL || strcmp( mr->c_symbol, symbol ) == 0
+		|| strcmp( mr->c_long_name, symbol ) == 0;
+}
+
+
+/**
+ * Add master record mr found by setDirLazy() and its data file, if it is
+ * named like usual. Unresolved files are reported by the selection later.
+ */
+void Metastock::addLazyRecord( const master_record *mr )
+{
+	char name[MAX_LEN_MR_FILENAME + 1];
+	int datnum = mr->file_number;
+	snprintf( name, sizeof(name), "F%d.%s", datnum,
+		datnum > 255 ? "MWD" : "DAT" );
+	*addRecord( datnum ) = *mr;
+	if( findName( name ) ) {
+		add_mr_list_datfile( datnum, name );
+	}
+}
+
+
+/**
+ * Like setDir() but resolve only the master record of data file number
+ * fdat (if > 0) or the records of symbol. The master record is probed
+ * directly at its usual position and the data file is opened by its computed
+ * name, so the directory is only scanned if files are not named like usual
+ * or fdat is not in the master files where it would be expected. Archives
+ * are parsed completely.
+ */
+bool Metastock::setDirLazy( const char* d, int fdat, const char *symbol )
+{
+	if( !openDir( d ) ) {
+		return false;
+	}
+	if( archive != NULL || stream != NULL ) {
+		if( !findFiles() || !readMasters() || !parseMasters() ) {
+			return false;
+		}
+		FDat::set_outfile( out );
+		return true;
+	}
+
+	char name[MAX_LEN_MR_FILENAME + 1];
+	if( symbol != NULL || fdat <= 255 ) {
+		strcpy( name, "MASTER" );
+		if( findName( name ) ) {
+			m_buf->setName( name );
+		}
+		strcpy( name, "EMASTER" );
+		if( findName( name ) ) {
+			e_buf->setName( name );
+		}
+	}
+	if( symbol != NULL || fdat > 255 ) {
+		strcpy( name, "XMASTER" );
+		if( findName( name ) ) {
+			x_buf->setName( name );
+		}
+	}
+	if( !m_buf->hasName() && !e_buf->hasName() && !x_buf->hasName() ) {
+		setError( "no *Master files found" );
+		return false;
+	}
+	if( (m_buf->hasName() && !readFile( m_buf ))
+			|| (e_buf->hasName() && !readFile( e_buf ))
+			|| (x_buf->hasName() && !readFile( x_buf )) ) {
+		return false;
+	}
+
+	MasterFile mf( m_buf->constBuf(), m_buf->len() );
+	EMasterFile emf( e_buf->constBuf(), e_buf->len() );
+	XMasterFile xmf( x_buf->constBuf(), x_buf->len() );
+	int cntM = mf.countRecords();
+	int cntE = emf.countRecords();
+	int cntX = xmf.countRecords();
+
+	/* probe record number fdat first, then try all until it is found, a
+	   symbol is looked up in all records like includeSymbol() does */
+	bool all = fdat <= 0;
+	int found = 0;
+	master_record mr;
+	if( cntM > 0 ) {
+		for( int k = 0; k <= cntM && (all || found == 0); k++ ) {
+			int i = (k == 0) ? fdat : k;
+			if( i < 1 || i > cntM || (fdat > 0 && mf.fileNumber(i) != fdat) ) {
+				continue;
+			}
+			memset( &mr, '\0', sizeof(mr) );
+			mf.getRecord( &mr, i );
+			if( cntE == cntM && emf.fileNumber(i) == mr.file_number ) {
+				emf.getLongName( &mr, i );
+			}
+			if( match_symbol( &mr, symbol ) ) {
+				addLazyRecord( &mr );
+				found++;
+			}
+		}
+	} else if( cntE > 0 ) {
+		for( int k = 0; k <= cntE && (all || found == 0); k++ ) {
+			int i = (k == 0) ? fdat : k;
+			if( i < 1 || i > cntE || (fdat > 0 && emf.fileNumber(i) != fdat) ) {
+				continue;
+			}
+			memset( &mr, '\0', sizeof(mr) );
+			emf.getRecord( &mr, i );
+			if( match_symbol( &mr, symbol ) ) {
+				addLazyRecord( &mr );
+				found++;
+			}
+		}
+	}
+	if( cntX > 0 ) {
+		/* XMaster numbers usually start at 256 */
+		for( int k = 0; k <= cntX && (all || found == 0); k++ ) {
+			int i = (k == 0) ? fdat - 255 : k;
+			if( i < 1 || i > cntX || (fdat > 0 && xmf.fileNumber(i) != fdat) ) {
+				continue;
+			}
+			memset( &mr, '\0', sizeof(mr) );
+			xmf.getRecord( &mr, i );
+			if( match_symbol( &mr, symbol ) ) {
+				addLazyRecord( &mr );
+				found++;
+			}
+		}
+	}
+
+	if( found == 0 && !all ) {
+		/* not in the masters we read, e.g. a number <= 255 in XMaster */
+		m_buf->setName( "" );
+		e_buf->setName( "" );
+		x_buf->setName( "" );
+		if( !findFiles() || !readMasters() || !parseMasters() ) {
+			return false;
+		}
+		FDat::set_outfile( out );
+		return true;
+	}
+	sortRecords();
+
+	FDat::set_outfile( out );
+	return true;
+}
+
+
+/**
+ * Instead of a directory take a single data file which dumpData() reads from
+ * descriptor fd. Its master record is given by spec 'FIELDS,SYMBOL' with an
+ * optional ',LONG_NAME' (which may contain commas) where FIELDS is the
+ * field_bitset as printed by dumpSymbolInfo(). A spec '@FILE' is read from
+ * the first line of FILE. The data file gets number fdat.
+ */
+bool Metastock::setDataFd( int fd, const char *spec, int fdat )
+{
+	char line[MAX_SIZE_MR_STRING + 2];
+
+	if( spec[0] == '@' ) {
+		FILE *f = fopen( spec + 1, "r" );
+		if( f == NULL ) {
+			setError( spec + 1, strerror(errno) );
+			return false;
+		}
+		if( fgets( line, sizeof(line), f ) == NULL ) {
+			line[0] = '\0';
+		}
+		fclose( f );
+		line[strcspn( line, "\r\n" )] = '\0';
+		spec = line;
+	}
+
+	char *end;
+	long fields = strtol( spec, &end, 10 );
+	const char *sym = end + 1;
+	const char *name = *end == ',' ? strchr( sym, ',' ) : NULL;
+	int sym_len = name != NULL ? name - sym : strlen( sym );
+	if( end == spec || *end != ',' || fields < 1 || fields > 0xFF
+			|| sym_len < 1 || sym_len > MAX_LEN_MR_SYMBOL
+			|| (name != NULL && strlen( name + 1 ) > MAX_LEN_MR_LNAME) ) {
+		setError( "bad master spec", spec );
+		return false;
+	}
+	if( fdat < 1 || fdat > MAX_DAT_NUM ) {
+		setError( "bad master spec", "file number out of range" );
+		return false;
+	}
+	if( fcntl( fd, F_GETFD ) < 0 ) {
+		setError( "data fd", strerror(errno) );
+		return false;
+	}
+
+	ms_dir = (char*) realloc( ms_dir, 1 );
+	ms_dir[0] = '\0';
+	data_fd = fd;
+
+	master_record *mr = addRecord( fdat );
+	mr->record_number = 1;
+	mr->kind = fdat > 255 ? 'X' : 'M';
+	mr->field_bitset = fields;
+	mr->barsize = 'D';
+	memcpy( mr->c_symbol, sym, sym_len );
+	if( name != NULL ) {
+		strcpy( mr->c_long_name, name + 1 );
+	}
+	snprintf( line, sizeof(line), "F%d.%s", fdat, fdat > 255 ? "MWD" : "DAT" );
+	add_mr_list_datfile( fdat, line );
+	sortRecords();
+
+	FDat::set_outfile( out );
+	return true;
+}
+
+
+bool Metastock::setCacheDir( const char* dir )
+{
+	assert( ms_dir != NULL && col_cache == NULL );
+	if( archive != NULL || stream != NULL ) {
+		setError( "cache", "not supported for archives" );
+		return false;
+	}
+	col_cache = new ColCache();
+	if( !col_cache->setDir( dir, ms_dir ) ) {
+		setError( "cache", col_cache->lastError() );
+		delete col_cache;
+		col_cache = NULL;
+		return false;
+	}
+	return true;
+}
+
+
+bool Metastock::setOutputCache( const char* dir )
+{
+	assert( ms_dir != NULL && out_cache == NULL );
+	if( archive != NULL || stream != NULL ) {
+		setError( "output cache", "not supported for archives" );
+		return false;
+	}
+	out_cache = new OutCache();
+	if( !out_cache->setDir( dir, ms_dir ) ) {
+		setError( "output cache", out_cache->lastError() );
+		delete out_cache;
+		out_cache = NULL;
+		return false;
+	}
+	return true;
+}
+
+
+bool Metastock::set_field_sep( const char *sep )
+{
+	if( sep[0] == '\0' || sep[1] != '\0' ) {
+		setError( "bad field separator" );
+		return false;
+	}
+	print_sep = *sep;
+	return true;
+}
+
+void Metastock::set_skip_header( int skipheader )
+{
+	print_header = !skipheader;
+}
+
+void Metastock::set_out_format( int fmt_data )
+{
+	if( fmt_data < 0 ) {
+		/* defaults */
+		prnt_master_fields = 0xFFFF;
+		prnt_data_fields = 0xFF;
+		prnt_data_mr_fields = M_SYM;
+	} else {
+		prnt_master_fields = fmt_data >> 9;
+		prnt_data_fields = fmt_data;
+		prnt_data_mr_fields = prnt_master_fields;
+	}
+}
+
+void Metastock::format_incl( unsigned int fmt_data )
+{
+	prnt_master_fields |= ( fmt_data >> 9 );
+	prnt_data_fields |= fmt_data;
+	prnt_data_mr_fields |= ( fmt_data >> 9 );
+}
+
+void Metastock::format_excl( unsigned int fmt_data )
+{
+	prnt_master_fields &= ~( fmt_data >> 9 );
+	prnt_data_fields &= ~fmt_data;
+	prnt_data_mr_fields &= ~( fmt_data >> 9 );
+}
+
+
+static int token2format( const char *token )
+{
+	int ret = 0;
+	ret = str_to_data_field(token);
+	if( ret == 0 ) {
+		ret = str_to_master_field(token) << 9;
+	}
+	if( ret == 0  ) {
+		/* token does not match any valid column - try some "flavour" strings */
+		if( strcasecmp(token, "all") == 0 ) {
+			ret = INT_MAX;
+		} else if( strcasecmp(token, "none") == 0 ) {
+			ret = 0;
+		} else {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+bool Metastock::columns2bitset( const char *columns )
+{
+	static const char *sepset = ",;: \t\n";
+	char col_split[strlen(columns) + 1];
+	char *token;
+
+	strcpy( col_split, columns );
+	token = strtok(col_split, sepset);
+
+	/* if first rule is explicit in/exclude then init defaults else zero */
+	if( token != NULL && (*token == '-' || *token == '+') ) {
+		set_out_format( -1 );
+	} else {
+		set_out_format( 0 );
+	}
+
+	while( true ) {
+		int bitset;
+		bool exclude = false;
 
 		if (token == NULL) {
 			break;
@@ -441,65 +1225,227 @@ end:
 
 bool Metastock::setForceFloat( bool opi, bool vol )
 {
-	if( opi ) {
-		FDat::setForceFloat(D_OPI);
-	}
-	if( vol ) {
-		FDat::setForceFloat(D_VOL);
-	}
+	FDat::setForceFloat( D_OPI, opi );
+	FDat::setForceFloat( D_VOL, vol );
 	return true;
 }
 
 
-bool Metastock::readFile( FileBuf *file_buf ) const
+/**
+ * Open a file of ms_dir for reading, see open_at().
+ */
+int Metastock::openFile( const char *name, char *err ) const
+{
+	int fd = open_at( -1, ms_dir, name );
+	if( fd < 0 ) {
+		fileError( name, err );
+	}
+	return fd;
+}
+
+
+/* set errno as error of file name of ms_dir */
+void Metastock::fileError( const char *name, char *err ) const
 {
-	// build file name with full path
-	char puff[strlen(ms_dir) + strlen(file_buf->constName()) + 1];
-	char *file_path = puff;
+	char file_path[strlen(ms_dir) + strlen(name) + 1];
 	strcpy( file_path, ms_dir );
-	strcpy( file_path + strlen(ms_dir), file_buf->constName() );
+	strcat( file_path, name );
+	putError( err, file_path, strerror(errno) );
+}
 
-#if defined _WIN32
-	int fd = open( file_path, _O_RDONLY | _O_BINARY );
-#else
-	int fd = open( file_path, O_RDONLY );
+
+/**
+ * Read a master or data file into file_buf. Errors go to err (ERROR_LENGTH
+ * bytes) if given, so that threads may read files concurrently.
+ */
+bool Metastock::readFile( FileBuf *file_buf, char *err ) const
+{
+	if( stream != NULL ) {
+		/* the masters come with the archive, data files by dumpStream() */
+		if( file_buf == m_buf || file_buf == e_buf || file_buf == x_buf ) {
+			return true;
+		}
+		putError( err, ms_dir, STREAM_ONE_PASS );
+		return false;
+	}
+	if( archive != NULL ) {
+		int i = archive->findMember( file_buf->constName() );
+		assert( i >= 0 );
+		char *buf = file_buf->reserve( archive->memberSize(i) );
+		char arc_err[ERROR_LENGTH_ARC];
+		if( !archive->extract( i, buf, arc_err ) ) {
+			putError( err, ms_dir, arc_err );
+			return false;
+		}
+		return true;
+	}
+
+#if defined O_DIRECT
+	if( page_cache == PAGE_CACHE_DIRECT ) {
+		int fd = open_at( -1, ms_dir, file_buf->constName(), O_DIRECT );
+		if( fd >= 0 ) {
+			int ret = file_buf->readDirect( fd );
+			int direct_errno = errno;
+			close( fd );
+			if( ret >= 0 ) {
+				return true;
+			}
+			if( direct_errno != EINVAL ) {
+				errno = direct_errno;
+				fileError( file_buf->constName(), err );
+				return false;
+			}
+		}
+		/* not supported here, read it as usual */
+	}
 #endif
+
+	int fd = openFile( file_buf->constName(), err );
 	if( fd < 0 ) {
-		setError( file_path, strerror(errno) );
 		return false;
 	}
-	int err = file_buf->readFile( fd );
-	if( err < 0 ) {
-		setError( file_path, strerror(errno) );
+#if defined HAVE_POSIX_FADVISE
+	if( page_cache != PAGE_CACHE_KEEP ) {
+		posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+	}
+#endif
+	int ret = file_buf->readFile( fd );
+	if( ret < 0 ) {
+		fileError( file_buf->constName(), err );
+	}
+#if defined HAVE_POSIX_FADVISE
+	if( page_cache != PAGE_CACHE_KEEP ) {
+		posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
 	}
+#endif
 
 	close( fd );
 
-	return (err >= 0);
+	return (ret >= 0);
 }
 
 
-#define DEBUG_MASTER( _buf_, _cnt_ ) \
-	if( _cnt_ <= 0 && _buf_->hasName() ) { \
-		printWarn( _buf_->constName(), "not usable"); \
-	}
-
-#define SELECT_MR( _master_ ) \
-	do { \
-		int datnum = _master_.fileNumber(i); \
-		if( mr_len <= datnum ) { \
-			resize_mr_list(datnum + 128); \
-		} \
-		mr = &mr_list[ datnum ]; \
-	} while( false )
-
+/* bytes announced per file, large files are streamed anyway */
+#define PREFETCH_BYTES (8 * 1024 * 1024)
+/* number of master records looked ahead */
+#define PREFETCH_FILES 8
 
-bool Metastock::parseMasters()
+/**
+ * With page cache mode drop let the kernel read the selected data files up
+ * to PREFETCH_FILES records after file_number in the background. *ahead is
+ * the index of the next record not announced yet, start with 0.
+ */
+void Metastock::prefetchData( int file_number, int *ahead ) const
 {
-	MasterFile mf( m_buf->constBuf(), m_buf->len() );
-	EMasterFile emf( e_buf->constBuf(), e_buf->len() );
-	XMasterFile xmf( x_buf->constBuf(), x_buf->len() );
-	int cntM = mf.countRecords();
+#if defined HAVE_POSIX_FADVISE
+	const master_record *mr = findRecord( file_number );
+	if( page_cache != PAGE_CACHE_DROP || archive != NULL || mr == NULL ) {
+		return;
+	}
+	int last = (mr - mr_list) + PREFETCH_FILES;
+	for( ; *ahead < mr_count && *ahead <= last; (*ahead)++ ) {
+		const master_record *p = &mr_list[*ahead];
+		if( *p->file_name == '\0' || !isSelected( p->file_number ) ) {
+			continue;
+		}
+		int fd = open_at( -1, ms_dir, p->file_name );
+		if( fd >= 0 ) {
+			posix_fadvise( fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED );
+			close( fd );
+		}
+	}
+#else
+	(void) file_number;
+	(void) ahead;
+#endif
+}
+
+
+/**
+ * Bytes of the selected data files in the page cache, -1 if unknown.
+ */
+long long Metastock::cachedBytes() const
+{
+#if defined HAVE_MINCORE && defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+	long page = sysconf( _SC_PAGESIZE );
+	unsigned char *vec = NULL;
+	long vec_len = 0;
+	long long bytes = 0;
+	for( int k = 0; k < mr_count; k++ ) {
+		const master_record *mr = &mr_list[k];
+		if( *mr->file_name == '\0' || !isSelected( mr->file_number ) ) {
+			continue;
+		}
+		long long size = dataSize( mr->file_number );
+		if( size <= 0 ) {
+			continue;
+		}
+		int fd = open_at( -1, ms_dir, mr->file_name );
+		if( fd < 0 ) {
+			continue;
+		}
+		void *map = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+		close( fd );
+		if( map == MAP_FAILED ) {
+			continue;
+		}
+		long n = (size + page - 1) / page;
+		if( n > vec_len ) {
+			vec = (unsigned char*) realloc( vec, n );
+			vec_len = n;
+		}
+		if( mincore( map, size, vec ) == 0 ) {
+			for( long i = 0; i < n; i++ ) {
+				bytes += (vec[i] & 1) ? page : 0;
+			}
+		}
+		munmap( map, size );
+	}
+	free( vec );
+	return bytes;
+#else
+	return -1;
+#endif
+}
+
+
+/* throughput and page cache footprint of dumpData() */
+void Metastock::printIoStats( double elapsed ) const
+{
+	long long bytes = 0;
+	int files = 0;
+	for( int k = 0; k < mr_count; k++ ) {
+		if( isSelected( mr_list[k].file_number ) ) {
+			long long size = dataSize( mr_list[k].file_number );
+			bytes += size > 0 ? size : 0;
+			files++;
+		}
+	}
+	static const char *mode[] = { "keep", "drop", "direct" };
+	fprintf( stderr, "io: %s, %d files, %lld bytes in %.3f s, %.1f MB/s, "
+		"%lld bytes in page cache\n", mode[page_cache], files, bytes,
+		elapsed, elapsed > 0.0 ? bytes / elapsed / 1e6 : 0.0,
+		cachedBytes() );
+}
+
+
+#define DEBUG_MASTER( _buf_, _cnt_ ) \
+	if( _cnt_ <= 0 && _buf_->hasName() ) { \
+		printWarn( _buf_->constName(), "not usable"); \
+	}
+
+#define SELECT_MR( _master_ ) \
+	do { \
+		mr = addRecord( _master_.fileNumber(i) ); \
+	} while( false )
+
+
+bool Metastock::parseMasters()
+{
+	MasterFile mf( m_buf->constBuf(), m_buf->len() );
+	EMasterFile emf( e_buf->constBuf(), e_buf->len() );
+	XMasterFile xmf( x_buf->constBuf(), x_buf->len() );
+	int cntM = mf.countRecords();
 	int cntE = emf.countRecords();
 	int cntX = xmf.countRecords();
 
@@ -547,6 +1493,7 @@ bool Metastock::parseMasters()
 		}
 	}
 
+	sortRecords();
 	return true;
 }
 
@@ -586,306 +1533,1824 @@ bool Metastock::readMasters()
 	} else if( max_dat_num > 255 ) {
 		printWarn("XMaster file not found");
 	}
-
+
+	return true;
+}
+
+
+const char* Metastock::lastError() const
+{
+	return error;
+}
+
+
+void Metastock::printWarn( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		fprintf( stderr, "warning: %s\n", e1);
+	} else {
+		fprintf( stderr, "warning: %s: %s\n", e1, e2 );
+	}
+}
+
+
+void Metastock::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH, "%s: %s", e1, e2 );
+	}
+}
+
+
+/* like setError() but into err if given, for callers on other threads */
+void Metastock::putError( char *err, const char* e1, const char* e2 ) const
+{
+	if( err == NULL ) {
+		setError( e1, e2 );
+	} else if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( err, ERROR_LENGTH, "%s", e1 );
+	} else {
+		snprintf( err, ERROR_LENGTH, "%s: %s", e1, e2 );
+	}
+}
+
+
+void Metastock::dumpMaster() const
+{
+	MasterFile mf( m_buf->constBuf(), m_buf->len() );
+	mf.check();
+}
+
+
+void Metastock::dumpEMaster() const
+{
+	EMasterFile emf( e_buf->constBuf(), e_buf->len() );
+	emf.check();
+}
+
+
+void Metastock::dumpXMaster() const
+{
+	XMasterFile xmf( x_buf->constBuf(), x_buf->len() );
+	xmf.check();
+}
+
+
+/**
+ * Start a new selection the first time a file is selected explicitly, all
+ * selectors add to it.
+ */
+void Metastock::beginSelection() const
+{
+	if( !selecting ) {
+		memset( mr_skip_map, 0xff, SKIP_MAP_WORDS(mr_len) * sizeof(uint64_t) );
+		selecting = true;
+	}
+}
+
+
+/**
+ * Select data files by number, spec is a comma separated list of numbers or
+ * ranges like "1-255". Single numbers must be referenced by the masters.
+ */
+bool Metastock::includeFiles( const char *spec ) const
+{
+	beginSelection();
+
+	const char *p = spec;
+	while( true ) {
+		char *end;
+		long from = strtol( p, &end, 10 );
+		long to = from;
+		bool range = false;
+		if( end == p ) {
+			setError( "bad file number range", spec );
+			return false;
+		}
+		p = end;
+		if( *p == '-' ) {
+			range = true;
+			to = strtol( ++p, &end, 10 );
+			if( end == p || to < from ) {
+				setError( "bad file number range", spec );
+				return false;
+			}
+			p = end;
+		}
+		if( *p != ',' && *p != '\0' ) {
+			setError( "bad file number range", spec );
+			return false;
+		}
+
+		if( !range && getRecord( from ) == NULL ) {
+			setError("data file not referenced by master files");
+			return false;
+		}
+		for( int k = 0; k < mr_count; k++ ) {
+			int f = mr_list[k].file_number;
+			if( f >= from && f <= to && mr_list[k].record_number != 0 ) {
+				set_skip( mr_skip_map, f, false );
+			}
+		}
+
+		if( *p == '\0' ) {
+			break;
+		}
+		p++;
+	}
+	return true;
+}
+
+
+/**
+ * Select the data file of symbol, which may be a symbol or a long name.
+ */
+bool Metastock::includeSymbol( const char *symbol ) const
+{
+	beginSelection();
+
+	bool found = false;
+	for( int k = 0; k < mr_count; k++ ) {
+		int i = mr_list[k].file_number;
+		if( mr_list[k].record_number != 0
+				&& match_symbol( &mr_list[k], symbol ) ) {
+			set_skip( mr_skip_map, i, false );
+			found = true;
+		}
+	}
+	if( !found ) {
+		setError( "symbol not found", symbol );
+		return false;
+	}
+	return true;
+}
+
+
+/* open addressing set of symbols, size is a power of two */
+struct symbol_set
+{
+	char **keys;
+	bool *found;
+	unsigned int size;
+};
+
+static int symbol_set_find( const symbol_set *set, const char *key )
+{
+	unsigned int mask = set->size - 1;
+	unsigned int i = fnv1a_hash( key, strlen(key) ) & mask;
+	while( set->keys[i] != NULL ) {
+		if( strcmp( set->keys[i], key ) == 0 ) {
+			return i;
+		}
+		i = (i + 1) & mask;
+	}
+	return -1 - (int)i;
+}
+
+
+/**
+ * Select the data files of all symbols listed in file, one symbol or long
+ * name per line. The masters are matched once against a hash set.
+ */
+bool Metastock::includeSymbols( const char *file ) const
+{
+	FILE *f = fopen( file, "r" );
+	if( f == NULL ) {
+		setError( file, strerror(errno) );
+		return false;
+	}
+
+	symbol_set set = { NULL, NULL, 64 };
+	set.keys = (char**) calloc( set.size, sizeof(char*) );
+	unsigned int count = 0;
+	char line[256];
+	bool ok = true;
+
+	while( fgets( line, sizeof(line), f ) != NULL ) {
+		if( strchr( line, '\n' ) == NULL && !feof( f ) ) {
+			/* longer than any symbol or long name anyway */
+			setError( file, "line too long" );
+			ok = false;
+			break;
+		}
+		char *key = line + strspn( line, " \t" );
+		int len = strcspn( key, "\r\n" );
+		while( len > 0 && (key[len - 1] == ' ' || key[len - 1] == '\t') ) {
+			len--;
+		}
+		key[len] = '\0';
+		if( *key == '\0' || *key == '#' ) {
+			continue;
+		}
+
+		if( 2 * (count + 1) > set.size ) {
+			symbol_set bigger = { NULL, NULL, set.size * 2 };
+			bigger.keys = (char**) calloc( bigger.size, sizeof(char*) );
+			for( unsigned int i = 0; i < set.size; i++ ) {
+				if( set.keys[i] != NULL ) {
+					int pos = symbol_set_find( &bigger, set.keys[i] );
+					bigger.keys[-1 - pos] = set.keys[i];
+				}
+			}
+			free( set.keys );
+			set = bigger;
+		}
+		int pos = symbol_set_find( &set, key );
+		if( pos < 0 ) {
+			set.keys[-1 - pos] = strdup( key );
+			count++;
+		}
+	}
+	fclose( f );
+
+	if( !ok ) {
+		for( unsigned int i = 0; i < set.size; i++ ) {
+			free( set.keys[i] );
+		}
+		free( set.keys );
+		return false;
+	}
+
+	beginSelection();
+	set.found = (bool*) calloc( set.size, sizeof(bool) );
+	for( int k = 0; k < mr_count; k++ ) {
+		int i = mr_list[k].file_number;
+		if( mr_list[k].record_number == 0 ) {
+			continue;
+		}
+		int pos = symbol_set_find( &set, mr_list[k].c_symbol );
+		if( pos < 0 ) {
+			pos = symbol_set_find( &set, mr_list[k].c_long_name );
+		}
+		if( pos >= 0 ) {
+			set.found[pos] = true;
+			set_skip( mr_skip_map, i, false );
+		}
+	}
+
+	for( unsigned int i = 0; i < set.size; i++ ) {
+		if( set.keys[i] != NULL && !set.found[i] ) {
+			printWarn( "symbol not found", set.keys[i] );
+		}
+		free( set.keys[i] );
+	}
+	free( set.keys );
+	free( set.found );
+	return true;
+}
+
+
+/**
+ * Select the data files of all symbols or long names matching the extended
+ * regular expression re.
+ */
+bool Metastock::includeRegex( const char *re ) const
+{
+#if defined HAVE_REGEX_H
+	regex_t rx;
+	int err = regcomp( &rx, re, REG_EXTENDED | REG_NOSUB );
+	if( err != 0 ) {
+		char msg[128];
+		regerror( err, &rx, msg, sizeof(msg) );
+		setError( "symbol regex", msg );
+		return false;
+	}
+
+	beginSelection();
+	for( int k = 0; k < mr_count; k++ ) {
+		int i = mr_list[k].file_number;
+		if( mr_list[k].record_number != 0
+				&& (regexec( &rx, mr_list[k].c_symbol, 0, NULL, 0 ) == 0
+				|| regexec( &rx, mr_list[k].c_long_name, 0, NULL, 0 ) == 0) ) {
+			set_skip( mr_skip_map, i, false );
+		}
+	}
+	regfree( &rx );
+	return true;
+#else
+	(void) re;
+	setError( "symbol regex", "not supported" );
+	return false;
+#endif
+}
+
+
+time_t str2time( const char* s)
+{
+	struct tm dt;
+	time_t dt_t;
+	memset( &dt, 0, sizeof(tm) );
+
+	int ret = sscanf( s, "%d-%d-%d %d:%d:%d", &dt.tm_year,
+		&dt.tm_mon, &dt.tm_mday, &dt.tm_hour, &dt.tm_min, &dt.tm_sec );
+
+	if( ret < 0 ) {
+		return -1;
+	} else if( ret != 6  && ret != 3 ) {
+		return -1;
+	}
+
+	dt.tm_year -= 1900;
+	dt.tm_mon -= 1;
+	dt.tm_isdst = -1;
+
+	dt_t = mktime( &dt );
+
+	return dt_t;
+}
+
+
+bool Metastock::setPrintDateFrom( const char *date )
+{
+	int dt = str2date( date );
+	if( dt < 0 ) {
+		setError("parsing date time");
+		return false;
+	}
+	print_date_from = dt;
+	FDat::setPrintDateFrom( dt );
+	return true;
+}
+
+
+/**
+ * Print only the last records of each data file.
+ */
+bool Metastock::setTail( int records )
+{
+	if( records < 1 ) {
+		setError( "bad number of records" );
+		return false;
+	}
+	print_tail = records;
+	return true;
+}
+
+
+int Metastock::tailRecords() const
+{
+	return print_tail;
+}
+
+
+bool Metastock::excludeFiles( const char *stamp ) const
+{
+	bool revert = false;
+	if( *stamp == '-' ) {
+		stamp++;
+		revert = true;
+	}
+	time_t oldest_t = str2time( stamp );
+	if( oldest_t < 0 ) {
+		setError("parsing date time");
+		return false;
+	}
+
+	if( !statFiles() ) {
+		return false;
+	}
+	for( int k = 0; k < mr_count; k++ ) {
+		int i = mr_list[k].file_number;
+		if( *mr_list[k].file_name == '\0' || is_skipped( mr_skip_map, i ) ) {
+			continue;
+		}
+
+		long long mtime = mr_list[k].file_mtime;
+		if( !revert ) {
+			if( oldest_t > mtime ) {
+				set_skip( mr_skip_map, i, true );
+			}
+		} else {
+			if( oldest_t <= mtime ) {
+				set_skip( mr_skip_map, i, true );
+			}
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Select data files modified after since, which is either a date time like
+ * for excludeFiles() or a file whose mtime is taken.
+ */
+bool Metastock::excludeUnchanged( const char *since ) const
+{
+	long long since_t;
+	long since_ns = 0;
+	struct stat st;
+	if( stat( since, &st ) == 0 ) {
+		since_t = st.st_mtime;
+#if defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+		since_ns = st.st_mtim.tv_nsec;
+#endif
+	} else {
+		since_t = str2time( since );
+		if( since_t < 0 ) {
+			setError( "parsing date time", since );
+			return false;
+		}
+	}
+
+	if( !statFiles() ) {
+		return false;
+	}
+	for( int k = 0; k < mr_count; k++ ) {
+		const master_record *mr = &mr_list[k];
+		int i = mr->file_number;
+		if( *mr->file_name == '\0' || is_skipped( mr_skip_map, i ) ) {
+			continue;
+		}
+		if( mr->file_mtime < since_t || (mr->file_mtime == since_t
+				&& mr->file_mtime_ns <= since_ns) ) {
+			set_skip( mr_skip_map, i, true );
+		}
+	}
+	return true;
+}
+
+
+/**
+ * Select data files by size, min and max are sizes like for --max-memory or
+ * NULL.
+ */
+bool Metastock::excludeSize( const char *min, const char *max ) const
+{
+	long long min_size = 0;
+	long long max_size = -1;
+	if( min != NULL && (min_size = parse_size( min )) < 0 ) {
+		setError( "bad file size", min );
+		return false;
+	}
+	if( max != NULL && (max_size = parse_size( max )) < 0 ) {
+		setError( "bad file size", max );
+		return false;
+	}
+
+	if( !statFiles() ) {
+		return false;
+	}
+	for( int k = 0; k < mr_count; k++ ) {
+		const master_record *mr = &mr_list[k];
+		int i = mr->file_number;
+		if( *mr->file_name == '\0' || is_skipped( mr_skip_map, i ) ) {
+			continue;
+		}
+		if( mr->file_size < min_size
+				|| (max_size >= 0 && mr->file_size > max_size) ) {
+			set_skip( mr_skip_map, i, true );
+		}
+	}
+	return true;
+}
+
+
+/* data files stat()ed by one job of statFiles() */
+#define STAT_CHUNK 64
+/* stat() mostly waits for the file system, more threads than CPUs help */
+#define STAT_THREADS 16
+
+struct stat_chunk
+{
+	int dir_fd;
+	const char *dir;
+	master_record *mr_list;
+	const uint64_t *skip_map;
+	int first;
+	int last;
+	int err;
+	int err_rec;
+};
+
+static void stat_job( void *arg )
+{
+	stat_chunk *c = (stat_chunk*) arg;
+	for( int k = c->first; k < c->last; k++ ) {
+		master_record *mr = &c->mr_list[k];
+		if( *mr->file_name == '\0' || mr->has_stat
+				|| is_skipped( c->skip_map, mr->file_number ) ) {
+			continue;
+		}
+		int err = stat_data( c->dir_fd, c->dir, mr );
+		if( err != 0 && c->err == 0 ) {
+			c->err = err;
+			c->err_rec = k;
+		}
+	}
+}
+
+/**
+ * Cache size and mtime of all selected data files in mr_list. The directory
+ * is opened once and the files are stat()ed relative to it, in chunks on
+ * several threads.
+ */
+bool Metastock::statFiles() const
+{
+	if( stream != NULL ) {
+		setError( ms_dir, STREAM_ONE_PASS );
+		return false;
+	}
+	if( archive != NULL ) {
+		for( int i = 0; i < mr_count; i++ ) {
+			master_record *mr = &mr_list[i];
+			if( *mr->file_name == '\0' || mr->has_stat ) {
+				continue;
+			}
+			int k = archive->findMember( mr->file_name );
+			assert( k >= 0 );
+			mr->file_size = archive->memberSize( k );
+			mr->file_mtime = archive->memberMtime( k );
+			mr->file_mtime_ns = 0;
+			mr->has_stat = true;
+		}
+		return true;
+	}
+
+	int dir_fd = open_dir( ms_dir );
+	int n = (mr_count + STAT_CHUNK - 1) / STAT_CHUNK;
+	stat_chunk *chunks = (stat_chunk*) calloc( n, sizeof(stat_chunk) );
+	ThreadPool *sp = NULL;
+	if( nthreads > 1 && n > 1 ) {
+		sp = new ThreadPool( n < STAT_THREADS ? n : STAT_THREADS );
+	}
+	for( int k = 0; k < n; k++ ) {
+		stat_chunk *c = &chunks[k];
+		c->dir_fd = dir_fd;
+		c->dir = ms_dir;
+		c->mr_list = mr_list;
+		c->skip_map = mr_skip_map;
+		c->first = k * STAT_CHUNK;
+		c->last = c->first + STAT_CHUNK < mr_count ? c->first + STAT_CHUNK
+			: mr_count;
+		if( sp != NULL ) {
+			sp->submit( stat_job, c );
+		} else {
+			stat_job( c );
+		}
+	}
+	if( sp != NULL ) {
+		sp->wait();
+		delete sp;
+	}
+	if( dir_fd >= 0 ) {
+		close( dir_fd );
+	}
+
+	bool ok = true;
+	for( int k = 0; k < n && ok; k++ ) {
+		if( chunks[k].err != 0 ) {
+			errno = chunks[k].err;
+			fileError( mr_list[chunks[k].err_rec].file_name );
+			ok = false;
+		}
+	}
+	free( chunks );
+	return ok;
+}
+
+
+bool Metastock::fileTime( const char *name, long long *mtime,
+	long *mtime_ns ) const
+{
+	if( stream != NULL ) {
+		setError( ms_dir, STREAM_ONE_PASS );
+		return false;
+	}
+	if( archive != NULL ) {
+		int i = archive->findMember( name );
+		assert( i >= 0 );
+		*mtime = archive->memberMtime( i );
+		*mtime_ns = 0;
+		return true;
+	}
+
+	char file_path[strlen(ms_dir) + strlen(name) + 1];
+	strcpy( file_path, ms_dir );
+	strcat( file_path, name );
+
+	struct stat s;
+	if( stat( file_path, &s ) < 0 ) {
+		setError( file_path,  strerror(errno) );
+		return false;
+	}
+	*mtime = s.st_mtime;
+#if defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	*mtime_ns = s.st_mtim.tv_nsec;
+#else
+	*mtime_ns = 0;
+#endif
+	return true;
+}
+
+
+/**
+ * Combined modification time of all master files, any change of a master file
+ * changes the stamp.
+ */
+bool Metastock::mastersTime( long long *stamp ) const
+{
+	const FileBuf *bufs[3] = { m_buf, e_buf, x_buf };
+
+	*stamp = 0;
+	for( int i = 0; i < 3; i++ ) {
+		long long mtime;
+		long mtime_ns;
+		if( !bufs[i]->hasName() ) {
+			continue;
+		}
+		if( !fileTime( bufs[i]->constName(), &mtime, &mtime_ns ) ) {
+			return false;
+		}
+		*stamp = *stamp * 31 + mtime * 1000000000LL + mtime_ns;
+	}
+	return true;
+}
+
+
+/**
+ * File name of MASTER (0), EMASTER (1) or XMASTER (2) as found in the
+ * directory, NULL if it does not exist.
+ */
+const char* Metastock::masterName( int i ) const
+{
+	const FileBuf *bufs[3] = { m_buf, e_buf, x_buf };
+	assert( i >= 0 && i < 3 );
+	return bufs[i]->hasName() ? bufs[i]->constName() : NULL;
+}
+
+
+bool Metastock::writeArchive( const char *file ) const
+{
+	MsArchiveWriter aw;
+	long long mtime;
+	long mtime_ns;
+
+	if( !aw.create( file ) ) {
+		setError( "archive", aw.lastError() );
+		return false;
+	}
+
+	const FileBuf *masters[] = { m_buf, e_buf, x_buf };
+	const int rec_lens[] = { MasterFile::record_length,
+		EMasterFile::record_length, XMasterFile::record_length };
+	for( int k = 0; k < 3; k++ ) {
+		const FileBuf *fb = masters[k];
+		if( !fb->hasName() ) {
+			continue;
+		}
+		if( !fileTime( fb->constName(), &mtime, &mtime_ns ) ) {
+			return false;
+		}
+		if( !aw.addTable( fb->constName(), rec_lens[k], fb->constBuf(),
+				fb->len(), mtime, mtime_ns ) ) {
+			setError( "archive", aw.lastError() );
+			return false;
+		}
+	}
+
+	/* all data files, also those not referenced by the masters */
+	for( int i = 0; i < mr_count; i++ ) {
+		if( *mr_list[i].file_name == '\0' ) {
+			continue;
+		}
+		fdat_buf->setName( mr_list[i].file_name );
+		if( !readFile( fdat_buf )
+				|| !fileTime( fdat_buf->constName(), &mtime, &mtime_ns ) ) {
+			return false;
+		}
+		unsigned char fields = mr_list[i].record_number != 0 ?
+			mr_list[i].field_bitset : 0;
+		if( !aw.addSeries( fdat_buf->constName(), fields,
+				fdat_buf->constBuf(), fdat_buf->len(), mtime, mtime_ns ) ) {
+			setError( "archive", aw.lastError() );
+			return false;
+		}
+	}
+
+	if( !aw.finish() ) {
+		setError( "archive", aw.lastError() );
+		return false;
+	}
+	if( print_stats ) {
+		aw.printStats( stderr );
+	}
+	return true;
+}
+
+
+static bool write_file( const char *dir, const char *name, const char *buf,
+	long len, long long mtime, long mtime_ns )
+{
+	char file_path[strlen(dir) + strlen(name) + 2];
+	sprintf( file_path, "%s/%s", dir, name );
+
+	int fd = open( file_path,
+#if defined _WIN32
+		_O_WRONLY | _O_CREAT |O_TRUNC | _O_BINARY
+#else
+		O_WRONLY | O_CREAT | O_TRUNC , 0666
+#endif
+		);
+	if( fd < 0 ) {
+		return false;
+	}
+	bool ok = write_all( fd, buf, len );
+	if( close( fd ) != 0 ) {
+		ok = false;
+	}
+
+#if defined HAVE_UTIMENSAT
+	struct timespec ts[2];
+	ts[0].tv_sec = ts[1].tv_sec = mtime;
+	ts[0].tv_nsec = ts[1].tv_nsec = mtime_ns;
+	utimensat( AT_FDCWD, file_path, ts, 0 );
+#else
+	(void) mtime;
+	(void) mtime_ns;
+#endif
+	return ok;
+}
+
+
+/**
+ * Write all metastock files of ms_dir into dir, mainly to unpack archives.
+ */
+bool Metastock::extractFiles( const char *dir ) const
+{
+	long long mtime;
+	long mtime_ns;
+
+	if( make_dir( dir ) < 0 ) {
+		setError( dir, strerror(errno) );
+		return false;
+	}
+
+	const FileBuf *masters[] = { m_buf, e_buf, x_buf };
+	for( int k = 0; k < 3; k++ ) {
+		const FileBuf *fb = masters[k];
+		if( !fb->hasName() ) {
+			continue;
+		}
+		if( !fileTime( fb->constName(), &mtime, &mtime_ns ) ) {
+			return false;
+		}
+		if( !write_file( dir, fb->constName(), fb->constBuf(), fb->len(),
+				mtime, mtime_ns ) ) {
+			setError( dir, strerror(errno) );
+			return false;
+		}
+	}
+
+	for( int i = 0; i < mr_count; i++ ) {
+		if( *mr_list[i].file_name == '\0' ) {
+			continue;
+		}
+		fdat_buf->setName( mr_list[i].file_name );
+		if( !readFile( fdat_buf )
+				|| !fileTime( fdat_buf->constName(), &mtime, &mtime_ns ) ) {
+			return false;
+		}
+		if( !write_file( dir, fdat_buf->constName(), fdat_buf->constBuf(),
+				fdat_buf->len(), mtime, mtime_ns ) ) {
+			setError( dir, strerror(errno) );
+			return false;
+		}
+	}
+	return true;
+}
+
+
+int Metastock::maxFileNumber() const
+{
+	return mr_count > 0 ? mr_list[mr_count - 1].file_number : 0;
+}
+
+
+/**
+ * Master info of data file number file_number or NULL if it's not
+ * referenced by the master files.
+ */
+const master_record* Metastock::getRecord( int file_number ) const
+{
+	const master_record *mr = findRecord( file_number );
+	if( mr == NULL || mr->record_number == 0 ) {
+		return NULL;
+	}
+	return mr;
+}
+
+
+bool Metastock::readData( int file_number, FileBuf *file_buf,
+	char *err ) const
+{
+	const master_record *mr = getRecord( file_number );
+	if( mr == NULL || *mr->file_name == '\0' ) {
+		putError( err, "no fdat found" );
+		return false;
+	}
+	file_buf->setName( mr->file_name );
+	return readFile( file_buf, err );
+}
+
+
+/**
+ * Size of the data file of file_number, -1 if unknown or not a file of its
+ * own (archive member).
+ */
+long long Metastock::dataSize( int file_number ) const
+{
+	const master_record *mr = getRecord( file_number );
+	if( mr == NULL || *mr->file_name == '\0' || archive != NULL
+			|| stream != NULL ) {
+		return -1;
+	}
+	if( mr->has_stat ) {
+		return mr->file_size;
+	}
+
+	/* not cached, this may run on several threads */
+	master_record tmp = *mr;
+	if( stat_data( -1, ms_dir, &tmp ) != 0 ) {
+		return -1;
+	}
+	return tmp.file_size;
+}
+
+
+/**
+ * Physical offset of the first extent of a data file on disk, 0 if unknown
+ * (no FIEMAP, empty files, archives). Used to sort files before reading.
+ */
+unsigned long long Metastock::diskOrder( int file_number ) const
+{
+	const master_record *mr = getRecord( file_number );
+	if( mr == NULL || *mr->file_name == '\0' || archive != NULL ) {
+		return 0;
+	}
+#if defined HAVE_LINUX_FIEMAP_H
+	int fd = open_at( -1, ms_dir, mr->file_name );
+	if( fd < 0 ) {
+		return 0;
+	}
+	/* struct fiemap followed by space for one extent */
+	uint64_t req[(sizeof(struct fiemap) + sizeof(struct fiemap_extent))
+		/ sizeof(uint64_t) + 1];
+	memset( req, 0, sizeof(req) );
+	struct fiemap *fm = (struct fiemap*) req;
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+	int ret = ioctl( fd, FS_IOC_FIEMAP, fm );
+	close( fd );
+	if( ret == 0 && fm->fm_mapped_extents > 0 ) {
+		return fm->fm_extents[0].fe_physical;
+	}
+#endif
+	return 0;
+}
+
+
+/**
+ * Open the data file of file_number for reading window by window, the
+ * returned reader has read the header already.
+ */
+FDatReader* Metastock::openData( int file_number ) const
+{
+	const master_record *mr = getRecord( file_number );
+	if( mr == NULL || *mr->file_name == '\0' ) {
+		setError( "no fdat found" );
+		return NULL;
+	}
+	if( archive != NULL || stream != NULL ) {
+		setError( ms_dir, "data files of archives can't be streamed" );
+		return NULL;
+	}
+
+	int fd = openFile( mr->file_name );
+	if( fd < 0 ) {
+		return NULL;
+	}
+
+	FDatReader *r = new FDatReader( fd, mr->field_bitset );
+	if( page_cache != PAGE_CACHE_KEEP ) {
+		/* O_DIRECT needs aligned windows, drop them instead */
+		r->dropCache();
+	}
+	if( !r->open() ) {
+		if( errno != 0 ) {
+			fileError( mr->file_name );
+		} else {
+			setError( "fdat file unusable", mr->file_name );
+		}
+		delete r;
+		return NULL;
+	}
+	return r;
+}
+
+
+bool Metastock::dumpSymbolInfo() const
+{
+	char buf[MAX_SIZE_MR_STRING + 1];
+	int len;
+
+	if( prnt_master_fields == 0 ) {
+		setError( "bad output format", "no symbol columns given" );
+		return false;
+	}
+	if( stream != NULL && !scanStream() ) {
+		return false;
+	}
+
+	if( print_header ) {
+		len = mr_header_to_string( buf, prnt_master_fields, print_sep );
+		buf[len++] = '\n';
+		buf[len] = '\0';
+		fputs( buf, (FILE*)out );
+	}
+
+	for( int k = 0; k < mr_count; k++ ) {
+		const master_record *mr = &mr_list[k];
+		if( mr->record_number != 0
+				&& !is_skipped( mr_skip_map, mr->file_number ) ) {
+			len = mr_record_to_string( buf, mr,
+				prnt_master_fields, print_sep );
+			buf[len++] = '\n';
+			buf[len] = '\0';
+			fputs( buf, (FILE*)out );
+		}
+	}
+	return true;
+}
+
+
+/* what dumpInventory() found in one data file */
+struct inv_entry
+{
+	int dir_fd;
+	const char *dir;
+	const master_record *mr;
+	int err; /* errno, -1 if unusable */
+	int records;
+	int first_date;
+	int last_date;
+	long long size;
+	bool size_ok;
+};
+
+/* read the first and last record of the date column */
+static bool inv_dates( FDatReader *r, unsigned char fields, inv_entry *e )
+{
+	int rl = r->recordLength();
+	char buf[2 * rl];
+	FDat dat( buf, 2 * rl, fields, 1 );
+	ms_bar bar;
+
+	if( r->read( buf, 1 ) != 1 ) {
+		return false;
+	}
+	dat.getBar( 1, &bar );
+	e->first_date = bar.date;
+	r->seek( e->records );
+	if( r->read( buf, 1 ) != 1 ) {
+		return false;
+	}
+	dat.getBar( 1, &bar );
+	e->last_date = bar.date;
+	return true;
+}
+
+static void inventory_job( void *arg )
+{
+	inv_entry *e = (inv_entry*) arg;
+	int fd = open_at( e->dir_fd, e->dir, e->mr->file_name );
+	if( fd < 0 ) {
+		e->err = errno;
+		return;
+	}
+
+	FDatReader r( fd, e->mr->field_bitset );
+	if( !r.open() ) {
+		e->err = errno != 0 ? errno : -1;
+		return;
+	}
+	e->size = r.fileSize();
+	e->records = r.countRecords();
+	e->size_ok = e->size == (e->records + 1LL) * r.recordLength();
+	if( e->records > 0 && (e->mr->field_bitset & D_DAT)
+			&& !inv_dates( &r, e->mr->field_bitset, e ) ) {
+		e->err = errno != 0 ? errno : -1;
+	}
+}
+
+/* the same for archive members which are read as a whole */
+static void inventory_buf( const FileBuf *fb, inv_entry *e )
+{
+	FDat dat( fb->constBuf(), fb->len(), e->mr->field_bitset );
+	e->records = dat.countRecords();
+	if( e->records < 0 ) {
+		e->err = -1;
+		return;
+	}
+	e->size = fb->len();
+	e->size_ok = e->size == (e->records + 1LL)
+		* (count_bits( e->mr->field_bitset ) * 4);
+	if( e->records > 0 && (e->mr->field_bitset & D_DAT) ) {
+		ms_bar bar;
+		dat.getBar( 1, &bar );
+		e->first_date = bar.date;
+		dat.getBar( e->records, &bar );
+		e->last_date = bar.date;
+	}
+}
+
+#define INV_HEADER "file_number%csymbol%cfile_name%crecords%cfrom_date%c" \
+	"first_date%cto_date%clast_date%csize%cstatus\n"
+
+static void print_inventory( FILE *f, const inv_entry *e, char sep )
+{
+	const master_record *mr = e->mr;
+	char from[16], first[16], to[16], last[16];
+	char status[64] = "";
+
+	from[itodatestr( from, mr->from_date )] = '\0';
+	to[itodatestr( to, mr->to_date )] = '\0';
+	*first = *last = '\0';
+	if( e->err > 0 ) {
+		snprintf( status, sizeof(status), "%s", strerror(e->err) );
+	} else if( e->err < 0 ) {
+		strcpy( status, "unusable" );
+	} else {
+		if( e->records > 0 && (mr->field_bitset & D_DAT) ) {
+			first[itodatestr( first, e->first_date )] = '\0';
+			last[itodatestr( last, e->last_date )] = '\0';
+			if( e->first_date != mr->from_date ) {
+				strcat( status, ",first_date" );
+			}
+			if( e->last_date != mr->to_date ) {
+				strcat( status, ",last_date" );
+			}
+		}
+		if( e->records == 0 ) {
+			strcat( status, ",empty" );
+		}
+		if( !e->size_ok ) {
+			strcat( status, ",size" );
+		}
+		if( *status == '\0' ) {
+			strcpy( status, ",ok" );
+		}
+	}
+
+	fprintf( f, "%d%c%s%c%s%c", mr->file_number, sep, mr->c_symbol, sep,
+		mr->file_name, sep );
+	if( e->err == 0 ) {
+		fprintf( f, "%d", e->records );
+	}
+	fprintf( f, "%c%s%c%s%c%s%c%s%c", sep, from, sep, first, sep, to, sep,
+		last, sep );
+	if( e->err == 0 ) {
+		fprintf( f, "%lld", e->size );
+	}
+	fprintf( f, "%c%s\n", sep, *status == ',' ? status + 1 : status );
+}
+
+/**
+ * Print one line per selected data file which joins the master record with
+ * what the file really holds: number of records and dates of the first and
+ * last one. Only the header and these two records are read, on all threads.
+ * The status column lists the mismatches or says "ok".
+ */
+bool Metastock::dumpInventory() const
+{
+	if( stream != NULL ) {
+		setError( ms_dir, STREAM_ONE_PASS );
+		return false;
+	}
+	int n = 0;
+	int dir_fd = archive == NULL ? open_dir( ms_dir ) : -1;
+	inv_entry *entries = (inv_entry*) calloc( mr_count, sizeof(inv_entry) );
+
+	if( archive == NULL && pool == NULL ) {
+		pool = new ThreadPool( nthreads );
+	}
+	for( int k = 0; k < mr_count; k++ ) {
+		int i = mr_list[k].file_number;
+		if( mr_list[k].record_number == 0 || is_skipped( mr_skip_map, i )
+				|| *mr_list[k].file_name == '\0' ) {
+			continue;
+		}
+		inv_entry *e = &entries[n++];
+		e->dir_fd = dir_fd;
+		e->dir = ms_dir;
+		e->mr = &mr_list[k];
+		if( archive == NULL ) {
+			pool->submit( inventory_job, e );
+		} else if( readData( i, fdat_buf ) ) {
+			inventory_buf( fdat_buf, e );
+		} else {
+			e->err = -1;
+		}
+	}
+	if( pool != NULL ) {
+		pool->wait();
+	}
+	if( dir_fd >= 0 ) {
+		close( dir_fd );
+	}
+
+	if( print_header ) {
+		fprintf( (FILE*)out, INV_HEADER, print_sep, print_sep, print_sep,
+			print_sep, print_sep, print_sep, print_sep, print_sep, print_sep );
+	}
+	for( int i = 0; i < n; i++ ) {
+		print_inventory( (FILE*)out, &entries[i], print_sep );
+	}
+	free( entries );
 	return true;
 }
 
 
-const char* Metastock::lastError() const
+/**
+ * Grow the per file number maps to hold file numbers below new_len.
+ */
+void Metastock::resize_mr_index( int new_len )
 {
-	return error;
+	mr_index = (unsigned short*) realloc( mr_index,
+		new_len * sizeof(unsigned short) );
+	mr_skip_map = (uint64_t*) realloc( mr_skip_map,
+		SKIP_MAP_WORDS(new_len) * sizeof(uint64_t) );
+
+	memset( mr_index + mr_len, '\0',
+		(new_len - mr_len) * sizeof(unsigned short) );
+	memset( mr_skip_map + SKIP_MAP_WORDS(mr_len), '\0',
+		(SKIP_MAP_WORDS(new_len) - SKIP_MAP_WORDS(mr_len)) * sizeof(uint64_t) );
+
+	mr_len = new_len;
 }
 
 
-void Metastock::printWarn( const char* e1, const char* e2 ) const
+master_record* Metastock::findRecord( int file_number ) const
 {
-	if( e2 == NULL || *e2 == '\0' ) {
-		fprintf( stderr, "warning: %s\n", e1);
-	} else {
-		fprintf( stderr, "warning: %s: %s\n", e1, e2 );
+	if( file_number < 1 || file_number >= mr_len
+			|| mr_index[file_number] == 0 ) {
+		return NULL;
 	}
+	return &mr_list[mr_index[file_number] - 1];
 }
 
 
-void Metastock::setError( const char* e1, const char* e2 ) const
+/**
+ * The record of file_number, a new empty one if it does not exist yet. The
+ * returned pointer is valid until the next call.
+ */
+master_record* Metastock::addRecord( int file_number )
 {
-	if( e2 == NULL || *e2 == '\0' ) {
-		snprintf( error, ERROR_LENGTH, "%s", e1);
-	} else {
-		snprintf( error, ERROR_LENGTH, "%s: %s", e1, e2 );
+	assert( file_number >= 0 && file_number <= MAX_DAT_NUM );
+	master_record *mr = findRecord( file_number );
+	if( mr != NULL ) {
+		return mr;
 	}
+
+	if( mr_len <= file_number ) {
+		/* increase by 128 instead of 1 to avoid some reallocs */
+		resize_mr_index( file_number + 128 <= MAX_DAT_NUM + 1 ?
+			file_number + 128 : MAX_DAT_NUM + 1 );
+	}
+	if( mr_count == mr_size ) {
+		mr_size = mr_size > 0 ? 2 * mr_size : 256;
+		mr_list = (master_record*) realloc( mr_list,
+			mr_size * sizeof(master_record) );
+	}
+	mr = &mr_list[mr_count++];
+	memset( mr, '\0', sizeof(master_record) );
+	mr->file_number = file_number;
+	mr_index[file_number] = mr_count;
+	return mr;
 }
 
 
-void Metastock::dumpMaster() const
+static int cmp_file_number( const void *a, const void *b )
 {
-	MasterFile mf( m_buf->constBuf(), m_buf->len() );
-	mf.check();
+	return ((const master_record*) a)->file_number
+		- ((const master_record*) b)->file_number;
 }
 
-
-void Metastock::dumpEMaster() const
+/**
+ * Order the records by file number, all loops over mr_list rely on it.
+ */
+void Metastock::sortRecords()
 {
-	EMasterFile emf( e_buf->constBuf(), e_buf->len() );
-	emf.check();
+	qsort( mr_list, mr_count, sizeof(master_record), cmp_file_number );
+
+	/* broken masters may have used number 0 which can't be looked up */
+	int k0 = 0;
+	while( k0 < mr_count && mr_list[k0].file_number == 0 ) {
+		k0++;
+	}
+	if( k0 > 0 ) {
+		mr_count -= k0;
+		memmove( mr_list, mr_list + k0, mr_count * sizeof(master_record) );
+		mr_index[0] = 0;
+	}
+	for( int k = 0; k < mr_count; k++ ) {
+		mr_index[mr_list[k].file_number] = k + 1;
+	}
 }
 
 
-void Metastock::dumpXMaster() const
+void Metastock::add_mr_list_datfile(  int datnum, const char* datname )
 {
-	XMasterFile xmf( x_buf->constBuf(), x_buf->len() );
-	xmf.check();
+	if( datnum > max_dat_num ) {
+		max_dat_num = datnum;
+	}
+	strcpy( addRecord( datnum )->file_name, datname );
 }
 
 
-bool Metastock::incudeFile( int f ) const
+
+/**
+ * Print the header line of the time series output, if not disabled. An
+ * optional extra column name is printed first.
+ */
+bool Metastock::printDataHeader( const char *column ) const
 {
-	for( int i = 1; i< mr_len; i++ ) {
-			mr_skip_list[i] = true;
-	}
+	char buf[512];
+	int len = 0;
 
-	if( f > 0 && f < mr_len && mr_list[f].record_number != 0 ) {
-		mr_skip_list[f] = false;
-		return true;
-	} else {
-		setError("data file not referenced by master files");
+	if( prnt_data_fields == 0 && prnt_data_mr_fields == 0 ) {
+		setError( "bad output format", "no columns given" );
 		return false;
 	}
+
+	if( print_header ) {
+		if( column != NULL ) {
+			len = snprintf( buf, 256, "%s%c", column, print_sep );
+		}
+		len += mr_header_to_string( buf + len, prnt_data_mr_fields, print_sep );
+		if( prnt_data_mr_fields != 0 && prnt_data_fields != 0 ) {
+			buf[len++] = print_sep;
+			buf[len] = '\0';
+		}
+		FDat::print_header( buf );
+	}
+	return true;
 }
 
 
-time_t str2time( const char* s)
+/**
+ * Build the line prefix of the time series of data file number fno, i.e. the
+ * symbol columns preceded by an optional extra column value. The size of buf
+ * must be at least MAX_SIZE_MR_STRING + strlen(column) + 2.
+ */
+int Metastock::dataPrefix( int fno, char *buf, const char *column ) const
 {
-	struct tm dt;
-	time_t dt_t;
-	memset( &dt, 0, sizeof(tm) );
-
-	int ret = sscanf( s, "%d-%d-%d %d:%d:%d", &dt.tm_year,
-		&dt.tm_mon, &dt.tm_mday, &dt.tm_hour, &dt.tm_min, &dt.tm_sec );
+	int len = 0;
 
-	if( ret < 0 ) {
-		return -1;
-	} else if( ret != 6  && ret != 3 ) {
-		return -1;
+	if( column != NULL ) {
+		len = strlen( column );
+		memcpy( buf, column, len );
+		buf[len++] = print_sep;
+	}
+	len += mr_record_to_string( buf + len, findRecord( fno ),
+		prnt_data_mr_fields, print_sep );
+	if( prnt_data_mr_fields != 0 && prnt_data_fields != 0 ) {
+		buf[len++] = print_sep;
+		buf[len] = '\0';
 	}
+	return len;
+}
 
-	dt.tm_year -= 1900;
-	dt.tm_mon -= 1;
-	dt.tm_isdst = -1;
 
-	dt_t = mktime( &dt );
+bool Metastock::isSelected( int fno ) const
+{
+	return getRecord( fno ) != NULL
+		&& !is_skipped( mr_skip_map, fno );
+}
 
-	return dt_t;
+
+/**
+ * The directory path inclusive trailing '/'.
+ */
+const char* Metastock::dirName() const
+{
+	return ms_dir;
 }
 
 
-int str2date( const char* s)
+bool Metastock::dumpData() const
 {
-	int y, m, d;
-	y = m = d = 0;
+	char buf[MAX_SIZE_MR_STRING + 2];
+
+	if( max_memory > 0 && (col_cache != NULL || out_cache != NULL) ) {
+		setError( "caches need whole data files, can't limit memory" );
+		return false;
+	}
+	if( io_physical && (max_memory > 0 || col_cache != NULL
+			|| out_cache != NULL || print_tail > 0) ) {
+		setError( "physical io order reads ahead, not possible with "
+			"caches, tails or limited memory" );
+		return false;
+	}
 
-	int ret = sscanf( s, "%d-%d-%d", &y, &m, &d );
+	if( stream != NULL ) {
+		return printDataHeader( NULL ) && dumpStream();
+	}
+	if( data_fd >= 0 ) {
+		return printDataHeader( NULL ) && dumpFd();
+	}
 
-	if( ret != 3 ) {
-		return -1;
+	/* sizes decide how files are read, get them all at once */
+	if( !statFiles() ) {
+		return false;
 	}
 
-	if( !(y>=0 && y<=9999) ||  !(m>=1 && m<=12 ) || !(d>=1 && d<=31) ) {
-		return -1;
+	if( !printDataHeader( NULL ) ) {
+		return false;
+	}
+
+	double t = wall_time();
+	bool ok = true;
+#if defined HAVE_PTHREAD && defined HAVE_ATOMIC_BUILTINS
+	/* tails are read by a few small reads, there is nothing to split,
+	   physical io order needs the pipeline's reader */
+	if( (nthreads > 1 || io_physical) && col_cache == NULL
+			&& out_cache == NULL && print_tail == 0 ) {
+		Pipeline pl( nthreads, max_memory, io_physical );
+		ok = pl.run( this );
+		if( print_stats ) {
+			pl.printStats( stderr );
+		}
+		if( !ok ) {
+			setError( pl.lastError() );
+		}
+	} else
+#endif
+	{
+		int ahead = 0;
+		for( int k = 0; k < mr_count && ok; k++ ) {
+			int i = mr_list[k].file_number;
+			if( isSelected( i ) ) {
+				prefetchData( i, &ahead );
+				dataPrefix( i, buf, NULL );
+				ok = dumpData( i, mr_list[k].field_bitset, buf );
+			}
+		}
 	}
 
-	return 10000 * y + 100 * m + d;
+	/* tails don't read whole files, their throughput says nothing */
+	if( print_stats && io_report && archive == NULL && print_tail == 0 ) {
+		printIoStats( wall_time() - t );
+	}
+	return ok;
 }
 
 
-bool Metastock::setPrintDateFrom( const char *date )
+
+/**
+ * Take the names of the data files behind the last master of a tar or zip
+ * archive, which is read to its end without decoding any member.
+ */
+bool Metastock::scanStream() const
 {
-	int dt = str2date( date );
-	if( dt < 0 ) {
-		setError("parsing date time");
+	if( stream_read ) {
+		return true;
+	}
+	stream_read = true;
+	const char *name;
+	while( (name = stream->next()) != NULL ) {
+		int fno = classify_name( name );
+		master_record *mr = fno > 0 ? findRecord( fno ) : NULL;
+		if( mr != NULL && *mr->file_name == '\0' ) {
+			strcpy( mr->file_name, name );
+		}
+	}
+	if( *stream->lastError() != '\0' ) {
+		setError( stream->lastError() );
 		return false;
 	}
-	print_date_from = dt;
-	FDat::setPrintDateFrom( dt );
 	return true;
 }
 
-
-bool Metastock::excludeFiles( const char *stamp ) const
+/* print data file fno from fdat_buf unless done or not selected */
+bool Metastock::printMember( int fno, uint64_t *done ) const
 {
-	bool revert = false;
-	if( *stamp == '-' ) {
-		stamp++;
-		revert = true;
+	char pfx[MAX_SIZE_MR_STRING + 2];
+	if( fno <= 0 || fno >= mr_len || !isSelected( fno )
+			|| is_skipped( done, fno ) ) {
+		return true;
 	}
-	time_t oldest_t = str2time( stamp );
-	if( oldest_t < 0 ) {
-		setError("parsing date time");
+	set_skip( done, fno, true );
+	dataPrefix( fno, pfx, NULL );
+	return printFDat( findRecord( fno )->field_bitset, pfx );
+}
+
+/**
+ * Print the selected data files of a tar or zip archive in the order of the
+ * archive, those kept by readStream() first. Nothing is extracted, each
+ * member is decoded into fdat_buf and printed. Duplicates (names differing
+ * in case only) are printed once.
+ */
+bool Metastock::dumpStream() const
+{
+	if( stream_read ) {
+		setError( ms_dir, STREAM_ONE_PASS );
 		return false;
 	}
+	stream_read = true;
+
+	uint64_t *done = (uint64_t*) calloc( SKIP_MAP_WORDS(mr_len),
+		sizeof(uint64_t) );
+	bool ok = true;
+	for( int k = 0; k < n_deferred && ok; k++ ) {
+		const FileBuf *fb = deferred[k];
+		fdat_buf->setName( fb->constName() );
+		memcpy( fdat_buf->reserve( fb->len() ), fb->constBuf(), fb->len() );
+		ok = printMember( classify_name( fb->constName() ), done );
+	}
 
-	for( int i = 1; i<mr_len; i++ ) {
-		if( *mr_list[i].file_name == '\0' || mr_skip_list[i] ) {
+	const char *name;
+	while( ok && (name = stream->next()) != NULL ) {
+		int fno = classify_name( name );
+		if( fno <= 0 || fno >= mr_len || !isSelected( fno )
+				|| is_skipped( done, fno ) ) {
 			continue;
 		}
-		assert( mr_list[i].file_number == i );
+		fdat_buf->setName( name );
+		if( !stream->read( fdat_buf ) ) {
+			setError( stream->lastError() );
+			ok = false;
+		} else {
+			ok = printMember( fno, done );
+		}
+	}
+	if( ok && *stream->lastError() != '\0' ) {
+		setError( stream->lastError() );
+		ok = false;
+	}
+
+	/* like a directory without the file */
+	for( int k = 0; k < mr_count && ok; k++ ) {
+		int i = mr_list[k].file_number;
+		if( isSelected( i ) && !is_skipped( done, i ) ) {
+			setError( "no fdat found" );
+			ok = false;
+		}
+	}
+	free( done );
+	return ok;
+}
+
+
+/* bytes read from data_fd at once */
+#define FD_CHUNK (1024 * 1024)
 
-		char puff[strlen(ms_dir) + strlen( mr_list[i].file_name) + 1];
-		char *file_path = puff;
-		strcpy( file_path, ms_dir );
-		strcpy( file_path + strlen(ms_dir), mr_list[i].file_name );
+/**
+ * Print the data file of data_fd while it arrives: the records of each read
+ * are printed at once, a pipe doesn't need to be complete before the first
+ * lines are out. Records beyond the (16 bit) header count are held until the
+ * end shows whether the count has wrapped, see FDat::headerRecords(). Tails
+ * need the whole file.
+ */
+bool Metastock::dumpFd() const
+{
+	const master_record *mr = &mr_list[0];
+	char pfx[MAX_SIZE_MR_STRING + 2];
+
+	if( !isSelected( mr->file_number ) ) {
+		return true;
+	}
+	dataPrefix( mr->file_number, pfx, NULL );
 
-		struct stat s;
-		int tmp = stat( file_path, &s );
-		if( tmp < 0 ) {
-			setError( file_path,  strerror(errno) );
+	if( print_tail > 0 ) {
+		fdat_buf->setName( mr->file_name );
+		if( fdat_buf->readFile( data_fd ) < 0 ) {
+			setError( mr->file_name, strerror(errno) );
 			return false;
 		}
-		if( !revert ) {
-			if( oldest_t > s.st_mtime ) {
-				mr_skip_list[i] = true;
+		return printFDat( mr->field_bitset, pfx );
+	}
+
+	int rl = count_bits( mr->field_bitset ) * 4;
+	long size = (FD_CHUNK / rl + 2) * rl;
+	char *buf = (char*) malloc( size );
+	/* bytes in buf: the header and the records not printed yet */
+	long len = 0;
+	int printed = 0;
+	bool ok = true;
+
+	for( ;; ) {
+		if( len == size ) {
+			size *= 2;
+			buf = (char*) realloc( buf, size );
+		}
+		ssize_t n = read( data_fd, buf + len, size - len );
+		if( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if( n < 0 ) {
+			setError( mr->file_name, strerror(errno) );
+			ok = false;
+			break;
+		}
+		if( n == 0 ) {
+			break;
+		}
+		len += n;
+		if( len < rl ) {
+			/* no header count yet */
+			continue;
+		}
+
+		int cnt = len / rl - 1;
+		if( cnt > FDat::headerCount( buf ) - printed ) {
+			cnt = FDat::headerCount( buf ) - printed;
+		}
+		if( cnt > 0 ) {
+			FDat datfile( buf, (cnt + 1) * (long)rl, mr->field_bitset, cnt );
+			if( datfile.print( pfx ) < 0 ) {
+				/* This is should only happen on WIN32 instead of SIGPIPE */
+				setError( "writing interrupted" );
+				ok = false;
+				break;
 			}
-		} else {
-			if( oldest_t <= s.st_mtime ) {
-				mr_skip_list[i] = true;
+			printed += cnt;
+			len -= (long)cnt * rl;
+			/* keep the header, move a partial record behind it */
+			memmove( buf + rl, buf + rl + (long)cnt * rl, len - rl );
+		}
+	}
+
+	if( ok && len < rl ) {
+		setError( mr->file_name, "unexpected end of file" );
+		ok = false;
+	} else if( ok ) {
+		long long file_size = (long long)printed * rl + len;
+		int cnt = FDat::headerRecords( buf, file_size, mr->field_bitset );
+		if( cnt < printed ) {
+			setError( "fdat file unusable", mr->file_name );
+			ok = false;
+		} else if( cnt > printed ) {
+			cnt -= printed;
+			FDat datfile( buf, (cnt + 1) * (long)rl, mr->field_bitset, cnt );
+			if( datfile.print( pfx ) < 0 ) {
+				setError( "writing interrupted" );
+				ok = false;
 			}
 		}
 	}
-	return true;
+	free( buf );
+	return ok;
 }
 
 
-bool Metastock::dumpSymbolInfo() const
+bool Metastock::dumpData( unsigned short n, unsigned char fields,
+	const char *pfx ) const
 {
-	char buf[MAX_SIZE_MR_STRING + 1];
-	int len;
+	fdat_buf->setName( findRecord( n )->file_name );
 
-	if( prnt_master_fields == 0 ) {
-		setError( "bad output format", "no symbol columns given" );
+	if( !fdat_buf->hasName() ) {
+		setError( "no fdat found" );
 		return false;
 	}
 
-	if( print_header ) {
-		len = mr_header_to_string( buf, prnt_master_fields, print_sep );
-		buf[len++] = '\n';
-		buf[len] = '\0';
-		fputs( buf, (FILE*)out );
-	}
-
-	for( int i = 1; i<mr_len; i++ ) {
-		if( mr_list[i].record_number != 0 && !mr_skip_list[i] ) {
-			assert( mr_list[i].file_number == i );
-			len = mr_record_to_string( buf, &mr_list[i],
-				prnt_master_fields, print_sep );
-			buf[len++] = '\n';
-			buf[len] = '\0';
-			fputs( buf, (FILE*)out );
+	if( print_tail > 0 ) {
+		/* the caches would need the whole file */
+		if( archive == NULL ) {
+			return streamFDat( n, fields, pfx );
 		}
+		return readFile( fdat_buf ) && printFDat( fields, pfx );
 	}
-	return true;
-}
-
 
-void Metastock::resize_mr_list( int new_len )
-{
-	mr_list = (master_record*) realloc( mr_list,
-		new_len * sizeof(master_record) );
-	mr_skip_list = (bool*) realloc( mr_skip_list,
-		new_len * sizeof(bool) );
+	if( out_cache != NULL ) {
+		return dumpCached( fields, pfx );
+	}
 
-	memset( mr_list + mr_len, '\0',
-		(new_len - mr_len) * sizeof(master_record) );
-	memset( mr_skip_list + mr_len, '\0',
-		(new_len - mr_len) * sizeof(bool) );
+	if( col_cache != NULL ) {
+		ms_columns cols;
+		if( col_cache->open( fdat_buf->constName(), fields, &cols ) ) {
+			int err = FDat::print( pfx, &cols );
+			col_cache->close();
+			if( err < 0 ) {
+				setError( "writing interrupted" );
+				return false;
+			}
+			return true;
+		}
+	}
 
-	mr_len = new_len;
-}
+	if( max_memory > 0 || dataSize( n ) > FDAT_STREAM_SIZE ) {
+		return streamFDat( n, fields, pfx );
+	}
 
+	if( ! readFile( fdat_buf ) ) {
+		return false;
+	}
 
-void Metastock::add_mr_list_datfile(  int datnum, const char* datname )
-{
-	if( datnum > max_dat_num ) {
-		max_dat_num = datnum;
+	if( ! printFDat( fields, pfx ) ) {
+		return false;
 	}
-	if( mr_len <= datnum ) {
-		/* increase by 128 instead of 1 to avoid some reallocs */
-		resize_mr_list(datnum + 128);
+
+	if( col_cache != NULL ) {
+		col_cache->rebuild( fdat_buf->constName(), fields,
+			fdat_buf->constBuf(), fdat_buf->len() );
 	}
-	strcpy( mr_list[datnum].file_name, datname );
-}
 
+	return true;
+}
 
 
-bool Metastock::dumpData() const
+/**
+ * Print the data file named by fdat_buf through out_cache. Only files whose
+ * cache entry is stale are read and formatted at all.
+ */
+bool Metastock::dumpCached( unsigned char fields, const char *pfx ) const
 {
-	char buf[256];
-	int len;
+	/* everything which makes a difference in the printed text */
+	char k[32 + strlen(pfx)];
+	int len = sprintf( k, "%016llx %u %s", FDat::printerHash(),
+		(unsigned int)fields, pfx );
+	unsigned long long key = fnv1a_hash( k, len );
 
-	if( prnt_data_fields == 0 && prnt_data_mr_fields == 0 ) {
-		setError( "bad output format", "no columns given" );
-		return false;
-	}
+	out_cache_state state = out_cache->open( fdat_buf->constName(), key );
 
-	if( print_header ) {
-		len = mr_header_to_string( buf, prnt_data_mr_fields, print_sep );
-		if( prnt_data_mr_fields != 0 && prnt_data_fields != 0 ) {
-			buf[len++] = print_sep;
-			buf[len] = '\0';
+	if( state != OC_HIT ) {
+		if( ! readFile( fdat_buf ) ) {
+			return false;
 		}
-		FDat::print_header( buf );
-	}
+		unsigned long long hash =
+			fnv1a_hash( fdat_buf->constBuf(), fdat_buf->len() );
 
-	for( int i = 1; i<mr_len; i++ ) {
-		if( mr_list[i].record_number != 0 && !mr_skip_list[i] ) {
-			assert( mr_list[i].file_number == i );
-			len = mr_record_to_string( buf, &mr_list[i],
-				prnt_data_mr_fields, print_sep );
-			if( prnt_data_mr_fields != 0 && prnt_data_fields != 0 ) {
-				buf[len++] = print_sep;
-				buf[len] = '\0';
+		if( state != OC_TOUCHED || !out_cache->refresh( hash ) ) {
+			FILE *tmp = out_cache->create();
+			if( tmp == NULL ) {
+				setError( "output cache", out_cache->lastError() );
+				return false;
+			}
+			FDat::set_outfile( tmp );
+			bool ok = printFDat( fields, pfx );
+			FDat::set_outfile( out );
+			if( !ok ) {
+				out_cache->abort();
+				return false;
 			}
-			if( !dumpData( i, mr_list[i].field_bitset, buf ) ) {
+			if( !out_cache->commit( hash ) ) {
+				setError( "output cache", out_cache->lastError() );
 				return false;
 			}
 		}
 	}
+
+	if( !out_cache->copyTo( (FILE*)out ) ) {
+		setError( "output cache", out_cache->lastError() );
+		return false;
+	}
 	return true;
 }
 
 
+struct fdat_slice
+{
+	const FDat *dat;
+	const char *pfx;
+	int first;
+	int last;
+	text_buf text;
+	PoolEvent done;
+};
 
-bool Metastock::dumpData( unsigned short n, unsigned char fields,
-	const char *pfx ) const
+static void format_slice( void *arg )
 {
-	fdat_buf->setName( mr_list[n].file_name );
+	fdat_slice *s = (fdat_slice*) arg;
+	s->dat->format( s->pfx, s->first, s->last, &s->text );
+	s->done.set();
+}
 
-	if( !fdat_buf->hasName() ) {
-		setError( "no fdat found" );
-		return false;
+/**
+ * Print a large data file by formatting record ranges on all threads, the
+ * slices are written in order as soon as they are done.
+ */
+bool Metastock::printSlices( const FDat &datfile, int cnt,
+	const char *pfx ) const
+{
+	if( pool == NULL ) {
+		pool = new ThreadPool( nthreads );
+	}
+	int len = FDat::sliceRecords( cnt, nthreads );
+	int n = (cnt + len - 1) / len;
+	fdat_slice *slices = new fdat_slice[n];
+
+	for( int i = 0; i < n; i++ ) {
+		fdat_slice *s = &slices[i];
+		s->dat = &datfile;
+		s->pfx = pfx;
+		s->first = i * len + 1;
+		s->last = i == n - 1 ? cnt : (i + 1) * len;
+		s->text.buf = NULL;
+		s->text.len = s->text.size = 0;
+		pool->submit( format_slice, s );
 	}
 
-	if( ! readFile( fdat_buf ) ) {
-		return false;
+	bool ok = true;
+	for( int i = 0; i < n; i++ ) {
+		slices[i].done.wait();
+		if( ok && FDat::write( &slices[i].text ) < 0 ) {
+			/* This is should only happen on WIN32 instead of SIGPIPE */
+			setError( "writing interrupted" );
+			ok = false;
+		}
+		free( slices[i].text.buf );
 	}
+	pool->wait();
+	delete[] slices;
+	fflush( (FILE*)out );
+	return ok;
+}
 
+
+bool Metastock::printFDat( unsigned char fields, const char *pfx ) const
+{
 	FDat datfile( fdat_buf->constBuf(), fdat_buf->len(), fields );
 // 	fprintf( stderr, "#%d: %d x %d bytes\n",
 // 		n, datfile.countRecords(), count_bits(fields) * 4 );
 
-	if( datfile.countRecords() < 0 ) {
+	int cnt = datfile.countRecords();
+	if( cnt < 0 ) {
 		setError( "fdat file unusable", fdat_buf->constName() );
 		return false;
 	}
+	if( print_tail > 0 && cnt > print_tail ) {
+		text_buf tb = { NULL, 0, 0 };
+		datfile.format( pfx, cnt - print_tail + 1, cnt, &tb );
+		int err = FDat::write( &tb );
+		free( tb.buf );
+		if( err < 0 || FDat::flush() != 0 ) {
+			setError( "writing interrupted" );
+			return false;
+		}
+		return true;
+	}
+	if( FDat::sliceRecords( cnt, nthreads ) < cnt ) {
+		return printSlices( datfile, cnt, pfx );
+	}
 	if( datfile.print( pfx ) < 0) {
 		/* This is should only happen on WIN32 instead of SIGPIPE */
 		setError( "writing interrupted" );
 		return false;
 	}
-
 	return true;
 }
 
 
+/* window used to print large files if memory is not limited */
+#define STREAM_WINDOW (64 * 1024 * 1024)
+
+/**
+ * Print data file number n through a window of whole records which fits into
+ * max_memory, so files of any size are printed in constant memory. With
+ * print_tail only the last records are read.
+ */
+bool Metastock::streamFDat( unsigned short n, unsigned char fields,
+	const char *pfx ) const
+{
+	FDatReader *r = openData( n );
+	if( r == NULL ) {
+		return false;
+	}
+	int rl = r->recordLength();
+	int first = 1;
+	if( print_tail > 0 && r->countRecords() > print_tail ) {
+		first = r->countRecords() - print_tail + 1;
+	}
+	r->seek( first );
+	long long k = (max_memory > 0 ? max_memory : STREAM_WINDOW) / rl - 1;
+	if( k > r->countRecords() - first + 1 ) {
+		k = r->countRecords() - first + 1;
+	}
+	char *buf = fdat_buf->reserve( (k + 1) * rl );
+
+	bool ok = true;
+	int cnt;
+	while( (cnt = r->read( buf, k )) > 0 ) {
+		FDat datfile( buf, (cnt + 1) * (long)rl, fields, cnt );
+		if( datfile.print( pfx ) < 0 ) {
+			/* This is should only happen on WIN32 instead of SIGPIPE */
+			setError( "writing interrupted" );
+			ok = false;
+			break;
+		}
+	}
+	if( cnt < 0 ) {
+		setError( findRecord( n )->file_name,
+			errno != 0 ? strerror(errno) : "unexpected end of file" );
+		ok = false;
+	}
+	delete r;
+	return ok;
+}
+
+
 bool Metastock::hasXMaster() const
 {
 	return( x_buf->hasName() );
@@ -38,8 +38,19 @@
 #ifndef METASTOCK_H
 #define METASTOCK_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 struct master_record;
 class FileBuf;
+class CompressOut;
+class ColCache;
+class OutCache;
+class MsArchive;
+class ArchiveStream;
+class FDat;
+class FDatReader;
+class ThreadPool;
 
 
 #define ERROR_LENGTH 256
@@ -53,37 +64,102 @@ class Metastock
 		bool hasXMaster() const;
 
 		bool set_outfile( const char *file );
+		bool set_compress( const char *spec );
+		bool closeOutput();
+		bool setThreads( int n );
+		bool setMaxMemory( const char *size );
+		long long maxMemory() const;
+		bool setIoOrder( const char *order );
+		bool setPageCache( const char *mode );
+		void resetSettings();
+		void setStats( bool stats );
 		bool setDir( const char* dir );
+		bool setDirLazy( const char* dir, int fdat, const char *symbol );
+		bool setDataFd( int fd, const char *spec, int fdat );
+		bool rescan();
+		bool setCacheDir( const char* dir );
+		bool setOutputCache( const char* dir );
 		bool set_field_sep( const char *sep );
 		void set_skip_header( int skipheader );
 		void set_out_format( int fmt_data );
 		bool set_out_format( const char *columns );
 		bool setForceFloat( bool opi, bool vol );
 		bool setPrintDateFrom( const char *date );
+		bool setTail( int records );
+		int tailRecords() const;
 
 		bool parseMasters();
 		void dumpMaster() const;
 		void dumpEMaster() const;
 		void dumpXMaster() const;
-		bool incudeFile( int f ) const;
+		bool includeFiles( const char *spec ) const;
+		bool includeSymbol( const char *symbol ) const;
+		bool includeSymbols( const char *file ) const;
+		bool includeRegex( const char *re ) const;
 		bool excludeFiles( const char *stamp ) const;
+		bool excludeUnchanged( const char *since ) const;
+		bool excludeSize( const char *min, const char *max ) const;
 		bool dumpSymbolInfo() const;
+		bool dumpInventory() const;
 		bool dumpData() const;
+		bool printDataHeader( const char *column ) const;
+		int dataPrefix( int fno, char *buf, const char *column ) const;
+		bool isSelected( int fno ) const;
+		const char* dirName() const;
+		int maxFileNumber() const;
+		const master_record* getRecord( int file_number ) const;
+		bool readData( int file_number, FileBuf *file_buf,
+			char *err = NULL ) const;
+		long long dataSize( int file_number ) const;
+		unsigned long long diskOrder( int file_number ) const;
+		void prefetchData( int file_number, int *ahead ) const;
+		FDatReader* openData( int file_number ) const;
+		bool mastersTime( long long *stamp ) const;
+		const char* masterName( int i ) const;
+		bool writeArchive( const char *file ) const;
+		bool extractFiles( const char *dir ) const;
 		const char* lastError() const;
 
 	private:
+		void beginSelection() const;
 		void printWarn( const char* e1, const char* e2 = "" ) const;
 		void setError( const char* e1, const char* e2 = "" ) const;
+		void putError( char *err, const char* e1, const char* e2 = "" ) const;
+		bool openDir( const char* dir );
 		bool findFiles();
-		bool readFile( FileBuf *file_buf ) const;
+		bool readStream();
+		bool findName( char *name ) const;
+		void addLazyRecord( const master_record *mr );
+		void addFile( const char *name, unsigned long long ino );
+		bool fileTime( const char *name, long long *mtime,
+			long *mtime_ns ) const;
+		int openFile( const char *name, char *err = NULL ) const;
+		void fileError( const char *name, char *err = NULL ) const;
+		bool statFiles() const;
+		bool readFile( FileBuf *file_buf, char *err = NULL ) const;
+		long long cachedBytes() const;
+		void printIoStats( double elapsed ) const;
 		bool readMasters();
-		void resize_mr_list( int new_len );
+		void resize_mr_index( int new_len );
+		master_record* findRecord( int file_number ) const;
+		master_record* addRecord( int file_number );
+		void sortRecords();
 		void add_mr_list_datfile( int datnum, const char* datname );
 		void format_incl( unsigned int fmt_data );
 		void format_excl( unsigned int fmt_data );
 		bool columns2bitset( const char *columns );
 		bool dumpData( unsigned short number, unsigned char fields,
 			const char *pfx) const;
+		bool dumpCached( unsigned char fields, const char *pfx ) const;
+		bool printFDat( unsigned char fields, const char *pfx ) const;
+		bool printMember( int fno, uint64_t *done ) const;
+		bool dumpStream() const;
+		bool scanStream() const;
+		bool dumpFd() const;
+		bool streamFDat( unsigned short number, unsigned char fields,
+			const char *pfx ) const;
+		bool printSlices( const FDat &datfile, int cnt,
+			const char *pfx ) const;
 
 		static bool print_header;
 		static char print_sep;
@@ -91,19 +167,45 @@ class Metastock
 		static unsigned char prnt_data_fields;
 		static unsigned short prnt_data_mr_fields;
 		int print_date_from;
+		int print_tail;
 
 		char *ms_dir;
+		MsArchive *archive;
+		ArchiveStream *stream;
+		/* data files of a stream read before its last master */
+		FileBuf **deferred;
+		int n_deferred;
+		mutable bool stream_read;
+		/* the only data file is read from this descriptor if >= 0 */
+		int data_fd;
 		FileBuf *m_buf;
 		FileBuf *e_buf;
 		FileBuf *x_buf;
 		FileBuf *fdat_buf;
+		ColCache *col_cache;
+		OutCache *out_cache;
+
+		int nthreads;
+		long long max_memory;
+		bool io_physical;
+		int page_cache;
+		bool io_report;
+		mutable ThreadPool *pool;
+		bool print_stats;
 
 		int max_dat_num;
-		int mr_len;
+		/* live records, sorted by file number after parsing the masters */
 		master_record *mr_list;
-		bool *mr_skip_list;
+		int mr_count;
+		int mr_size;
+		/* per file number: index into mr_list + 1 (0 if none), skipped bit */
+		int mr_len;
+		unsigned short *mr_index;
+		uint64_t *mr_skip_map;
+		mutable bool selecting;
 
 		void *out;
+		CompressOut *zout;
 
 		mutable char error[ERROR_LENGTH];
 };
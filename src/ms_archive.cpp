@@ -0,0 +1,1098 @@
+/*** ms_archive.cpp -- compressed archives of metastock directories
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "ms_archive.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "util.h"
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+# define USE_MMAP 1
+#endif
+
+#if defined HAVE_ZLIB_H && defined HAVE_LIBZ
+# include <zlib.h>
+# define USE_ZLIB 1
+#endif
+
+#if !defined O_BINARY
+# define O_BINARY 0
+#endif
+
+
+
+/* bump the last byte whenever the layout changes */
+#define ARC_MAGIC "ATEMARC\001"
+#define ARC_HEADER_LEN 16
+#define ARC_MEMBER_LEN 40
+
+enum arc_encoding {
+	ARC_STORE = 0,  /* raw bytes */
+	ARC_TABLE,      /* transposed records */
+	ARC_TABLE_Z,    /* transposed records, deflated */
+	ARC_SERIES      /* header record, encoded columns, raw trailer */
+};
+
+/* column mode byte, the low nibble gives the decimals of COL_DELTA/DOD */
+enum arc_column_mode {
+	COL_XOR = 0x00,   /* Gorilla XOR of the raw words */
+	COL_DELTA = 0x10, /* deltas of exact (scaled) integers, e.g. prices */
+	COL_DOD = 0x20    /* delta-of-delta of exact integers, e.g. dates */
+};
+
+#define MAX_DECIMALS 4
+
+struct arc_member
+{
+	char *name;
+	int encoding;
+	unsigned char fields;
+	int rec_len;
+	long long mtime;
+	long mtime_ns;
+	unsigned long long size;
+	const unsigned char *data;
+	unsigned long long data_len;
+};
+
+
+
+static inline int clz32( uint32_t x )
+{
+	assert( x != 0 );
+#if defined __GNUC__
+	return __builtin_clz( x );
+#else
+	int n = 0;
+	while( !(x & 0x80000000) ) {
+		x <<= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static inline int ctz32( uint32_t x )
+{
+	assert( x != 0 );
+#if defined __GNUC__
+	return __builtin_ctz( x );
+#else
+	int n = 0;
+	while( !(x & 1) ) {
+		x >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+
+/**
+ * Integer value of a MBF float if it is one which converts back to exactly
+ * the same bits, see readFloat() in ms_file.cpp for the format.
+ */
+static inline bool mbf_to_int( uint32_t w, int32_t *v )
+{
+	if( w == 0 ) {
+		*v = 0;
+		return true;
+	}
+	int e = w >> 24;
+	if( e < 129 || e > 129 + 23 ) {
+		return false;
+	}
+	int k = e - 129;
+	uint32_t m = w & 0x007fffff;
+	if( m & ((1 << (23 - k)) - 1) ) {
+		return false;
+	}
+	int32_t a = (0x00800000 | m) >> (23 - k);
+	*v = (w & 0x00800000) ? -a : a;
+	return true;
+}
+
+static inline uint32_t int_to_mbf( int32_t v )
+{
+	if( v == 0 ) {
+		return 0;
+	}
+	uint32_t s = v < 0 ? 0x00800000 : 0;
+	uint32_t a = v < 0 ? -v : v;
+	int k = 31 - clz32( a );
+	return ((uint32_t)(129 + k) << 24) | s | ((a << (23 - k)) & 0x007fffff);
+}
+
+
+
+
+static inline float mbf_to_float( uint32_t w )
+{
+	union {
+		uint32_t L;
+		float F;
+	} x;
+	uint32_t e = w & 0xff000000;
+	if( e == 0 ) {
+		return 0.0;
+	}
+	x.L = (((e - 0x02000000) & 0xff000000) >> 1) | ((w & 0x00800000) << 8)
+		| (w & 0x007fffff);
+	return x.F;
+}
+
+static inline uint32_t float_to_mbf( float f )
+{
+	union {
+		uint32_t L;
+		float F;
+	} x;
+	x.F = f;
+	uint32_t e = (x.L >> 23) & 0xff;
+	if( e == 0 || e > 253 ) {
+		/* zero, subnormals and huge values have no equivalent */
+		return 0;
+	}
+	return ((e + 2) << 24) | ((x.L >> 8) & 0x00800000) | (x.L & 0x007fffff);
+}
+
+static const double pow10_tab[MAX_DECIMALS + 1] = { 1, 10, 100, 1000, 10000 };
+
+/* the float the original software got from a decimal number */
+static inline uint32_t dec_to_mbf( int32_t v, int decimals )
+{
+	if( decimals == 0 ) {
+		return int_to_mbf( v );
+	}
+	return float_to_mbf( (float)((double)v / pow10_tab[decimals]) );
+}
+
+static inline bool mbf_to_dec( uint32_t w, int decimals, int32_t *v )
+{
+	if( decimals == 0 ) {
+		return mbf_to_int( w, v );
+	}
+	double x = (double)mbf_to_float( w ) * pow10_tab[decimals];
+	if( !(x > -2147483647.0 && x < 2147483647.0) ) {
+		return false;
+	}
+	*v = (int32_t)(x < 0 ? x - 0.5 : x + 0.5);
+	return dec_to_mbf( *v, decimals ) == w;
+}
+
+
+
+
+struct bit_writer
+{
+	unsigned char *buf;
+	unsigned long long len;
+	unsigned long long size;
+	uint64_t acc;
+	int n;
+};
+
+static void bw_init( bit_writer *bw )
+{
+	memset( bw, 0, sizeof(*bw) );
+}
+
+static inline void bw_put( bit_writer *bw, uint32_t bits, int count )
+{
+	if( bw->len + 8 > bw->size ) {
+		bw->size = 2 * bw->size + 4096;
+		bw->buf = (unsigned char*) realloc( bw->buf, bw->size );
+	}
+	bw->acc = (bw->acc << count) | bits;
+	bw->n += count;
+	while( bw->n >= 8 ) {
+		bw->n -= 8;
+		bw->buf[bw->len++] = (unsigned char)(bw->acc >> bw->n);
+	}
+}
+
+static void bw_flush( bit_writer *bw )
+{
+	if( bw->n > 0 ) {
+		bw_put( bw, 0, 8 - bw->n );
+	}
+}
+
+
+struct bit_reader
+{
+	const unsigned char *buf;
+	unsigned long long len;
+	unsigned long long pos; /* in bits */
+};
+
+static void br_init( bit_reader *br, const unsigned char *buf,
+	unsigned long long len )
+{
+	br->buf = buf;
+	br->len = len;
+	br->pos = 0;
+}
+
+/**
+ * The next (at least) 57 bits, MSB aligned. Reading behind the end gives
+ * zeros, checked by br_overrun() at the end.
+ */
+static inline uint64_t br_peek( const bit_reader *br )
+{
+	unsigned long long i = br->pos >> 3;
+	uint64_t w;
+	if( i + 8 <= br->len ) {
+#if defined __GNUC__ && !defined WORDS_BIGENDIAN
+		memcpy( &w, br->buf + i, 8 );
+		w = __builtin_bswap64( w );
+#else
+		w = 0;
+		for( int k = 0; k < 8; k++ ) {
+			w = (w << 8) | br->buf[i + k];
+		}
+#endif
+	} else {
+		w = 0;
+		for( int k = 0; k < 8; k++ ) {
+			w = (w << 8) | (i + k < br->len ? br->buf[i + k] : 0);
+		}
+	}
+	return w << (br->pos & 7);
+}
+
+/* the first count (0 to 32) bits of w */
+static inline uint32_t bits_of( uint64_t w, int count )
+{
+	return (uint32_t)((w >> (63 - count)) >> 1);
+}
+
+static inline uint32_t br_get( bit_reader *br, int count )
+{
+	uint32_t v = bits_of( br_peek( br ), count );
+	br->pos += count;
+	return v;
+}
+
+static inline bool br_overrun( const bit_reader *br )
+{
+	return br->pos > br->len * 8;
+}
+
+
+
+
+/* Gorilla style XOR encoding, the same for 32 bit words */
+static void enc_xor( bit_writer *bw, const unsigned char *p, int stride,
+	unsigned long long cnt )
+{
+	uint32_t prev = get_u32( p );
+	int lead = 33;
+	int trail = 0;
+
+	bw_put( bw, prev, 32 );
+	for( unsigned long long i = 1; i < cnt; i++ ) {
+		p += stride;
+		uint32_t v = get_u32( p );
+		uint32_t x = v ^ prev;
+		prev = v;
+		if( x == 0 ) {
+			bw_put( bw, 0, 1 );
+			continue;
+		}
+		int l = clz32( x );
+		int t = ctz32( x );
+		if( l >= lead && t >= trail ) {
+			/* fits into the previous window */
+			bw_put( bw, 2, 2 );
+			bw_put( bw, x >> trail, 32 - lead - trail );
+		} else {
+			int len = 32 - l - t;
+			bw_put( bw, 3, 2 );
+			bw_put( bw, l, 5 );
+			bw_put( bw, len - 1, 5 );
+			bw_put( bw, x >> t, len );
+			lead = l;
+			trail = t;
+		}
+	}
+}
+
+/* the reader is passed by value, so it can live in registers although
+   the stores through p may alias anything */
+static bool dec_xor( bit_reader state, unsigned char *p, int stride,
+	unsigned long long cnt )
+{
+	bit_reader *br = &state;
+	uint32_t prev = br_get( br, 32 );
+	/* the encoder never starts with '10', for broken input it's harmless */
+	int lead = 0;
+	int trail = 0;
+
+	put_u32( p, prev );
+	for( unsigned long long i = 1; i < cnt; i++ ) {
+		p += stride;
+		/* longest case is 2 + 5 + 5 + 32 bits, all in one peek */
+		uint64_t w = br_peek( br );
+		if( !(w >> 63) ) {
+			br->pos++;
+		} else {
+			if( (w >> 62) & 1 ) {
+				lead = bits_of( w << 2, 5 );
+				int len = bits_of( w << 7, 5 ) + 1;
+				trail = 32 - lead - len;
+				if( trail < 0 ) {
+					return false;
+				}
+				w <<= 12;
+				br->pos += 12;
+			} else {
+				w <<= 2;
+				br->pos += 2;
+			}
+			int len = 32 - lead - trail;
+			prev ^= bits_of( w, len ) << trail;
+			br->pos += len;
+		}
+		put_u32( p, prev );
+	}
+	return !br_overrun( br );
+}
+
+
+/**
+ * Column as exact integers, scaled by 10^decimals. Prices are usually
+ * decimal numbers and compress much better this way than by XOR.
+ */
+static bool col_to_ints( const unsigned char *p, int stride,
+	unsigned long long cnt, int decimals, int32_t *v )
+{
+	for( unsigned long long i = 0; i < cnt; i++ ) {
+		if( !mbf_to_dec( get_u32( p ), decimals, &v[i] ) ) {
+			return false;
+		}
+		p += stride;
+	}
+	return true;
+}
+
+/* delta (order 1) or delta-of-delta (order 2) encoding of integers */
+static void enc_ints( bit_writer *bw, const int32_t *v, unsigned long long cnt,
+	int order )
+{
+	int64_t prev_d = 0;
+
+	bw_put( bw, (uint32_t)v[0], 32 );
+	for( unsigned long long i = 1; i < cnt; i++ ) {
+		int64_t d = (int64_t)v[i] - v[i - 1];
+		int64_t z = d;
+		if( order == 2 ) {
+			z = d - prev_d;
+			prev_d = d;
+		}
+
+		if( z == 0 ) {
+			bw_put( bw, 0, 1 );
+		} else if( z >= -64 && z <= 63 ) {
+			bw_put( bw, 2, 2 );
+			bw_put( bw, (uint32_t)z & 0x7f, 7 );
+		} else if( z >= -256 && z <= 255 ) {
+			bw_put( bw, 6, 3 );
+			bw_put( bw, (uint32_t)z & 0x1ff, 9 );
+		} else if( z >= -2048 && z <= 2047 ) {
+			bw_put( bw, 14, 4 );
+			bw_put( bw, (uint32_t)z & 0xfff, 12 );
+		} else {
+			bw_put( bw, 15, 4 );
+			bw_put( bw, (uint32_t)z, 32 );
+		}
+	}
+}
+
+/* decoding of the prefix codes used by enc_ints() by their first 4 bits */
+struct int_bucket
+{
+	unsigned char prefix;
+	unsigned char bits;
+	uint32_t sign;
+};
+
+static const int_bucket int_buckets[16] = {
+	{1, 0, 0}, {1, 0, 0}, {1, 0, 0}, {1, 0, 0},
+	{1, 0, 0}, {1, 0, 0}, {1, 0, 0}, {1, 0, 0},
+	{2, 7, 0x40}, {2, 7, 0x40}, {2, 7, 0x40}, {2, 7, 0x40},
+	{3, 9, 0x100}, {3, 9, 0x100},
+	{4, 12, 0x800},
+	{4, 32, 0x80000000}
+};
+
+/* instantiated for each order and decimals == 0 or not, that keeps the
+   loop's variables in registers */
+template<int order, bool scaled>
+static bool dec_ints( bit_reader state, unsigned char *p, int stride,
+	unsigned long long cnt, int decimals )
+{
+	bit_reader *br = &state;
+	int64_t prev = (int32_t) br_get( br, 32 );
+	int64_t prev_d = 0;
+
+	put_u32( p, dec_to_mbf( (int32_t)prev, scaled ? decimals : 0 ) );
+	for( unsigned long long i = 1; i < cnt; i++ ) {
+		p += stride;
+		/* longest case is 4 + 32 bits, no branches for better pipelining */
+		uint64_t w = br_peek( br );
+		const int_bucket *b = &int_buckets[w >> 60];
+		uint32_t v = bits_of( w << b->prefix, b->bits );
+		br->pos += b->prefix + b->bits;
+		int32_t z = (int32_t)((v ^ b->sign) - b->sign);
+		if( order == 2 ) {
+			prev_d += z;
+			prev += prev_d;
+		} else {
+			prev += z;
+		}
+		if( prev <= INT32_MIN || prev > INT32_MAX ) {
+			return false;
+		}
+		put_u32( p, scaled ? dec_to_mbf( (int32_t)prev, decimals )
+			: int_to_mbf( (int32_t)prev ) );
+	}
+	return !br_overrun( br );
+}
+
+
+
+
+MsArchive::MsArchive() :
+	map( NULL ),
+	map_len( 0 ),
+	members( NULL ),
+	nmembers( 0 ),
+	decoded_files( 0 ),
+	decoded_bytes( 0 ),
+	elapsed( 0.0 )
+{
+	error[0] = '\0';
+}
+
+
+MsArchive::~MsArchive()
+{
+	for( int i = 0; i < nmembers; i++ ) {
+		free( members[i].name );
+	}
+	free( members );
+
+	if( map != NULL ) {
+#if defined USE_MMAP
+		munmap( map, map_len );
+#else
+		free( map );
+#endif
+	}
+}
+
+
+bool MsArchive::isArchive( const char *path )
+{
+	char magic[8];
+	int fd = ::open( path, O_RDONLY | O_BINARY );
+	if( fd < 0 ) {
+		return false;
+	}
+	bool ret = read_all( fd, magic, 8 ) && memcmp( magic, ARC_MAGIC, 8 ) == 0;
+	close( fd );
+	return ret;
+}
+
+
+bool MsArchive::open( const char *path )
+{
+	assert( map == NULL );
+
+	int fd = ::open( path, O_RDONLY | O_BINARY );
+	if( fd < 0 ) {
+		setError( path, strerror(errno) );
+		return false;
+	}
+	struct stat st;
+	if( fstat( fd, &st ) < 0 ) {
+		setError( path, strerror(errno) );
+		close( fd );
+		return false;
+	}
+	map_len = st.st_size;
+
+#if defined USE_MMAP
+	map = mmap( NULL, map_len, PROT_READ, MAP_SHARED, fd, 0 );
+	if( map == MAP_FAILED ) {
+		map = NULL;
+	}
+#else
+	map = malloc( map_len );
+	if( map != NULL && !read_all( fd, (char*)map, map_len ) ) {
+		free( map );
+		map = NULL;
+	}
+#endif
+	if( map == NULL ) {
+		setError( path, strerror(errno) );
+		close( fd );
+		return false;
+	}
+	close( fd );
+
+	const unsigned char *p = (const unsigned char*) map;
+	const unsigned char *end = p + map_len;
+	if( map_len < ARC_HEADER_LEN || memcmp( p, ARC_MAGIC, 8 ) != 0 ) {
+		setError( path, "not an atem archive" );
+		return false;
+	}
+	int cnt = get_u32( p + 8 );
+	p += ARC_HEADER_LEN;
+
+	members = (arc_member*) calloc( cnt > 0 ? cnt : 1, sizeof(arc_member) );
+	for( nmembers = 0; nmembers < cnt; nmembers++ ) {
+		if( (unsigned long long)(end - p) < ARC_MEMBER_LEN ) {
+			break;
+		}
+		arc_member *m = &members[nmembers];
+		int name_len = get_u16( p + 4 );
+		m->encoding = p[0];
+		m->fields = p[1];
+		m->rec_len = get_u16( p + 2 );
+		m->mtime = (long long) get_u64( p + 8 );
+		m->mtime_ns = get_u32( p + 16 );
+		m->size = get_u64( p + 24 );
+		m->data_len = get_u64( p + 32 );
+		p += ARC_MEMBER_LEN;
+
+		if( (unsigned long long)(end - p) < name_len + m->data_len ) {
+			break;
+		}
+		m->name = (char*) malloc( name_len + 1 );
+		memcpy( m->name, p, name_len );
+		m->name[name_len] = '\0';
+		p += name_len;
+		m->data = p;
+		p += m->data_len;
+	}
+
+	if( nmembers != cnt ) {
+		setError( path, "truncated archive" );
+		return false;
+	}
+	return true;
+}
+
+
+int MsArchive::countMembers() const
+{
+	return nmembers;
+}
+
+
+const char* MsArchive::memberName( int i ) const
+{
+	return members[i].name;
+}
+
+
+long long MsArchive::memberSize( int i ) const
+{
+	return members[i].size;
+}
+
+
+long long MsArchive::memberMtime( int i ) const
+{
+	return members[i].mtime;
+}
+
+
+int MsArchive::findMember( const char *name ) const
+{
+	for( int i = 0; i < nmembers; i++ ) {
+		if( strcmp( members[i].name, name ) == 0 ) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+static void untranspose( const unsigned char *src, unsigned char *dst,
+	int rec_len, unsigned long long size )
+{
+	unsigned long long cnt = size / rec_len;
+	for( int j = 0; j < rec_len; j++ ) {
+		unsigned char *d = dst + j;
+		for( unsigned long long i = 0; i < cnt; i++ ) {
+			*d = *src++;
+			d += rec_len;
+		}
+	}
+	memcpy( dst + cnt * rec_len, src, size - cnt * rec_len );
+}
+
+
+static bool decode_series( const unsigned char *src, unsigned long long len,
+	unsigned char *dst, int rec_len, unsigned long long size )
+{
+	const unsigned char *end = src + len;
+	unsigned long long hdr_len = size < (unsigned)rec_len ? size : rec_len;
+	unsigned long long cnt = (size - hdr_len) / rec_len;
+	unsigned long long trail_len = size - hdr_len - cnt * rec_len;
+
+	if( len < hdr_len ) {
+		return false;
+	}
+	memcpy( dst, src, hdr_len );
+	src += hdr_len;
+	dst += hdr_len;
+
+	for( int c = 0; cnt > 0 && c < rec_len / 4; c++ ) {
+		if( end - src < 5 ) {
+			return false;
+		}
+		int mode = src[0];
+		unsigned long long col_len = get_u32( src + 1 );
+		src += 5;
+		if( (unsigned long long)(end - src) < col_len ) {
+			return false;
+		}
+
+		bit_reader br;
+		br_init( &br, src, col_len );
+		bool ok;
+		int decimals = mode & 0x0f;
+		if( mode == COL_XOR ) {
+			ok = dec_xor( br, dst + 4 * c, rec_len, cnt );
+		} else if( decimals > MAX_DECIMALS ) {
+			ok = false;
+		} else if( (mode & 0xf0) == COL_DELTA ) {
+			ok = decimals != 0 ?
+				dec_ints<1, true>( br, dst + 4 * c, rec_len, cnt, decimals ) :
+				dec_ints<1, false>( br, dst + 4 * c, rec_len, cnt, 0 );
+		} else if( (mode & 0xf0) == COL_DOD ) {
+			ok = decimals != 0 ?
+				dec_ints<2, true>( br, dst + 4 * c, rec_len, cnt, decimals ) :
+				dec_ints<2, false>( br, dst + 4 * c, rec_len, cnt, 0 );
+		} else {
+			ok = false;
+		}
+		if( !ok ) {
+			return false;
+		}
+		src += col_len;
+	}
+
+	if( (unsigned long long)(end - src) != trail_len ) {
+		return false;
+	}
+	memcpy( dst + cnt * rec_len, src, trail_len );
+	return true;
+}
+
+
+/**
+ * Decode member i into buf which must have memberSize(i) bytes. Errors go to
+ * err (ERROR_LENGTH_ARC bytes) if given.
+ */
+bool MsArchive::extract( int i, char *buf, char *err )
+{
+	const arc_member *m = &members[i];
+	unsigned char *dst = (unsigned char*) buf;
+	bool ok = false;
+	double t = wall_time();
+
+	switch( m->encoding ) {
+	case ARC_STORE:
+		ok = m->data_len == m->size;
+		if( ok ) {
+			memcpy( dst, m->data, m->size );
+		}
+		break;
+	case ARC_TABLE:
+		ok = m->data_len == m->size && m->rec_len > 0;
+		if( ok ) {
+			untranspose( m->data, dst, m->rec_len, m->size );
+		}
+		break;
+	case ARC_TABLE_Z: {
+#if defined USE_ZLIB
+		unsigned char *tmp = (unsigned char*) malloc( m->size + 1 );
+		uLongf tmp_len = m->size;
+		ok = m->rec_len > 0
+			&& uncompress( tmp, &tmp_len, m->data, m->data_len ) == Z_OK
+			&& tmp_len == m->size;
+		if( ok ) {
+			untranspose( tmp, dst, m->rec_len, m->size );
+		}
+		free( tmp );
+#else
+		putError( err, m->name, "deflate not supported by this build" );
+		return false;
+#endif
+		break;
+	}
+	case ARC_SERIES:
+		ok = m->rec_len >= 4 && m->rec_len % 4 == 0
+			&& decode_series( m->data, m->data_len, dst, m->rec_len, m->size );
+		break;
+	}
+
+	if( !ok ) {
+		putError( err, m->name, "corrupt archive member" );
+		return false;
+	}
+	decoded_files++;
+	decoded_bytes += m->size;
+	elapsed += wall_time() - t;
+	return true;
+}
+
+
+void MsArchive::printStats( FILE *f ) const
+{
+	fprintf( f, "archive: %d files decoded, %llu bytes, %.3f s, %.1f MB/s\n",
+		decoded_files, decoded_bytes, elapsed,
+		elapsed > 0.0 ? decoded_bytes / elapsed / 1e6 : 0.0 );
+}
+
+
+const char* MsArchive::lastError() const
+{
+	return error;
+}
+
+
+void MsArchive::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_ARC, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_ARC, "%s: %s", e1, e2 );
+	}
+}
+
+
+void MsArchive::putError( char *err, const char* e1, const char* e2 ) const
+{
+	if( err == NULL ) {
+		setError( e1, e2 );
+	} else {
+		snprintf( err, ERROR_LENGTH_ARC, "%s: %s", e1, e2 );
+	}
+}
+
+
+
+
+MsArchiveWriter::MsArchiveWriter() :
+	out( NULL ),
+	path( NULL ),
+	enc( NULL ),
+	enc_len( 0 ),
+	enc_size( 0 ),
+	count( 0 ),
+	total_in( 0 ),
+	total_out( 0 ),
+	elapsed( 0.0 )
+{
+	error[0] = '\0';
+}
+
+
+MsArchiveWriter::~MsArchiveWriter()
+{
+	if( out != NULL ) {
+		/* not finished, don't leave broken archives */
+		fclose( out );
+		unlink( path );
+	}
+	free( path );
+	free( enc );
+}
+
+
+bool MsArchiveWriter::create( const char *_path )
+{
+	assert( out == NULL );
+	path = (char*) realloc( path, strlen(_path) + 1 );
+	strcpy( path, _path );
+
+	out = fopen( path, "wb" );
+	if( out == NULL ) {
+		setError( path, strerror(errno) );
+		return false;
+	}
+
+	/* member count is written by finish() */
+	unsigned char hdr[ARC_HEADER_LEN];
+	memset( hdr, 0, sizeof(hdr) );
+	memcpy( hdr, ARC_MAGIC, 8 );
+	if( fwrite( hdr, 1, sizeof(hdr), out ) != sizeof(hdr) ) {
+		setError( path, strerror(errno) );
+		return false;
+	}
+	total_out = sizeof(hdr);
+	elapsed = 0.0;
+	return true;
+}
+
+
+static void enc_reserve( char **enc, unsigned long long *enc_size,
+	unsigned long long size )
+{
+	if( size > *enc_size ) {
+		*enc_size = size;
+		*enc = (char*) realloc( *enc, size );
+	}
+}
+
+
+bool MsArchiveWriter::addTable( const char *name, int rec_len,
+	const char *buf, long long size, long long mtime, long mtime_ns )
+{
+	double t = wall_time();
+	assert( rec_len > 0 );
+	unsigned long long cnt = size / rec_len;
+
+	/* transposed is about 4 times smaller when deflated */
+	enc_reserve( &enc, &enc_size, size );
+	unsigned char *d = (unsigned char*) enc;
+	for( int j = 0; j < rec_len; j++ ) {
+		const char *s = buf + j;
+		for( unsigned long long i = 0; i < cnt; i++ ) {
+			*d++ = *s;
+			s += rec_len;
+		}
+	}
+	memcpy( d, buf + cnt * rec_len, size - cnt * rec_len );
+	enc_len = size;
+	int encoding = ARC_TABLE;
+
+#if defined USE_ZLIB
+	uLongf z_len = compressBound( size );
+	unsigned char *z = (unsigned char*) malloc( z_len );
+	if( compress2( z, &z_len, (const Bytef*)enc, size, 9 ) == Z_OK
+			&& z_len < (uLongf)size ) {
+		memcpy( enc, z, z_len );
+		enc_len = z_len;
+		encoding = ARC_TABLE_Z;
+	}
+	free( z );
+#endif
+
+	elapsed += wall_time() - t;
+	return writeMember( encoding, 0, rec_len, name, size, mtime, mtime_ns );
+}
+
+
+static void append( char **enc, unsigned long long *enc_len,
+	unsigned long long *enc_size, const void *data, unsigned long long len )
+{
+	if( *enc_len + len > *enc_size ) {
+		*enc_size = 2 * (*enc_len + len);
+		*enc = (char*) realloc( *enc, *enc_size );
+	}
+	memcpy( *enc + *enc_len, data, len );
+	*enc_len += len;
+}
+
+
+bool MsArchiveWriter::addSeries( const char *name, unsigned char fields,
+	const char *buf, long long size, long long mtime, long mtime_ns )
+{
+	double t = wall_time();
+
+	/* without master info we take the file as one column of words */
+	int rec_len = fields != 0 ? 4 * count_bits( fields ) : 4;
+	unsigned long long hdr_len = size < rec_len ? size : rec_len;
+	unsigned long long cnt = (size - hdr_len) / rec_len;
+	unsigned long long trail_len = size - hdr_len - cnt * rec_len;
+	const unsigned char *rec = (const unsigned char*) buf + hdr_len;
+
+	enc_len = 0;
+	append( &enc, &enc_len, &enc_size, buf, hdr_len );
+
+	bit_writer best, trial;
+	bw_init( &best );
+	bw_init( &trial );
+	int32_t *ints = (int32_t*) malloc( (cnt > 0 ? cnt : 1) * sizeof(int32_t) );
+	for( int c = 0; cnt > 0 && c < rec_len / 4; c++ ) {
+		const unsigned char *col = rec + 4 * c;
+		unsigned char hdr[5];
+
+		best.len = best.n = 0;
+		enc_xor( &best, col, rec_len, cnt );
+		bw_flush( &best );
+		hdr[0] = COL_XOR;
+
+		/* dates, times, volumes and most prices are exact decimals */
+		for( int dec = 0; dec <= MAX_DECIMALS; dec++ ) {
+			if( !col_to_ints( col, rec_len, cnt, dec, ints ) ) {
+				continue;
+			}
+			for( int order = 1; order <= 2; order++ ) {
+				trial.len = trial.n = 0;
+				enc_ints( &trial, ints, cnt, order );
+				bw_flush( &trial );
+				if( trial.len < best.len ) {
+					bit_writer tmp = best;
+					best = trial;
+					trial = tmp;
+					hdr[0] = (order == 1 ? COL_DELTA : COL_DOD) | dec;
+				}
+			}
+			break;
+		}
+
+		if( best.len > 0xffffffffULL ) {
+			free( ints );
+			free( best.buf );
+			free( trial.buf );
+			setError( name, "data file too large" );
+			return false;
+		}
+		put_u32( hdr + 1, best.len );
+		append( &enc, &enc_len, &enc_size, hdr, 5 );
+		append( &enc, &enc_len, &enc_size, best.buf, best.len );
+	}
+	free( ints );
+	free( best.buf );
+	free( trial.buf );
+	append( &enc, &enc_len, &enc_size, rec + cnt * rec_len, trail_len );
+
+	int encoding = ARC_SERIES;
+	if( enc_len >= (unsigned long long)size ) {
+		/* random junk, not a data file */
+		enc_len = 0;
+		append( &enc, &enc_len, &enc_size, buf, size );
+		encoding = ARC_STORE;
+	}
+
+	elapsed += wall_time() - t;
+	return writeMember( encoding, fields, rec_len, name, size, mtime,
+		mtime_ns );
+}
+
+
+bool MsArchiveWriter::writeMember( int encoding, unsigned char fields,
+	int rec_len, const char *name, long long size, long long mtime,
+	long mtime_ns )
+{
+	assert( out != NULL );
+	int name_len = strlen( name );
+	unsigned char hdr[ARC_MEMBER_LEN];
+	memset( hdr, 0, sizeof(hdr) );
+	hdr[0] = encoding;
+	hdr[1] = fields;
+	put_u16( hdr + 2, rec_len );
+	put_u16( hdr + 4, name_len );
+	put_u64( hdr + 8, mtime );
+	put_u32( hdr + 16, mtime_ns );
+	put_u64( hdr + 24, size );
+	put_u64( hdr + 32, enc_len );
+
+	if( fwrite( hdr, 1, sizeof(hdr), out ) != sizeof(hdr)
+			|| fwrite( name, 1, name_len, out ) != (size_t)name_len
+			|| fwrite( enc, 1, enc_len, out ) != enc_len ) {
+		setError( path, strerror(errno) );
+		return false;
+	}
+	count++;
+	total_in += size;
+	total_out += sizeof(hdr) + name_len + enc_len;
+	return true;
+}
+
+
+bool MsArchiveWriter::finish()
+{
+	assert( out != NULL );
+	unsigned char cnt[4];
+	put_u32( cnt, count );
+
+	bool ok = fseek( out, 8, SEEK_SET ) == 0
+		&& fwrite( cnt, 1, 4, out ) == 4;
+	if( fclose( out ) != 0 ) {
+		ok = false;
+	}
+	out = NULL;
+	if( !ok ) {
+		setError( path, strerror(errno) );
+		unlink( path );
+	}
+	return ok;
+}
+
+
+void MsArchiveWriter::printStats( FILE *f ) const
+{
+	fprintf( f, "archive: %d files, %llu -> %llu bytes, ratio %.2f, "
+		"%.3f s, %.1f MB/s\n", count, total_in, total_out,
+		total_out > 0 ? (double)total_in / total_out : 0.0, elapsed,
+		elapsed > 0.0 ? total_in / elapsed / 1e6 : 0.0 );
+}
+
+
+const char* MsArchiveWriter::lastError() const
+{
+	return error;
+}
+
+
+void MsArchiveWriter::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_ARC, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_ARC, "%s: %s", e1, e2 );
+	}
+}
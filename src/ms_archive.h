@@ -0,0 +1,138 @@
+/*** ms_archive.h -- compressed archives of metastock directories
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_MS_ARCHIVE_H
+#define ATEM_MS_ARCHIVE_H
+
+#include <stdio.h>
+
+struct arc_member;
+
+
+#define ERROR_LENGTH_ARC 256
+
+/**
+ * Single file archive of a metastock directory. Master files are stored as
+ * transposed records (all symbols' first byte, all second bytes, ...) which
+ * deflate compresses very well. Data files are split into columns, each is
+ * XOR encoded like the floats in Facebook's Gorilla paper, or if its values
+ * are exact decimals (dates, most prices) as deltas resp. delta-of-deltas of
+ * the scaled integers. Every member decodes to exactly the bytes of the
+ * original file.
+ */
+class MsArchive
+{
+	public:
+		MsArchive();
+		~MsArchive();
+
+		static bool isArchive( const char *path );
+
+		bool open( const char *path );
+		int countMembers() const;
+		const char* memberName( int i ) const;
+		long long memberSize( int i ) const;
+		long long memberMtime( int i ) const;
+		int findMember( const char *name ) const;
+		bool extract( int i, char *buf, char *err = NULL );
+
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+	private:
+		void setError( const char* e1, const char* e2 = "" ) const;
+		void putError( char *err, const char* e1, const char* e2 ) const;
+
+		void *map;
+		unsigned long long map_len;
+		arc_member *members;
+		int nmembers;
+
+		int decoded_files;
+		unsigned long long decoded_bytes;
+		double elapsed;
+
+		mutable char error[ERROR_LENGTH_ARC];
+};
+
+
+/**
+ * Writes an archive readable by MsArchive, members are added one by one.
+ * Master files go to addTable() with their record length, data files to
+ * addSeries() with the field bitset from the master files or 0 if unknown.
+ */
+class MsArchiveWriter
+{
+	public:
+		MsArchiveWriter();
+		~MsArchiveWriter();
+
+		bool create( const char *path );
+		bool addTable( const char *name, int rec_len, const char *buf,
+			long long size, long long mtime, long mtime_ns );
+		bool addSeries( const char *name, unsigned char fields,
+			const char *buf, long long size, long long mtime, long mtime_ns );
+		bool finish();
+
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+	private:
+		bool writeMember( int encoding, unsigned char fields, int rec_len,
+			const char *name, long long size, long long mtime, long mtime_ns );
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		FILE *out;
+		char *path;
+
+		/* encoded member */
+		char *enc;
+		unsigned long long enc_len;
+		unsigned long long enc_size;
+
+		int count;
+		unsigned long long total_in;
+		unsigned long long total_out;
+		double elapsed;
+
+		mutable char error[ERROR_LENGTH_ARC];
+};
+
+
+
+
+#endif
@@ -41,6 +41,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 
 #include "util.h"
@@ -945,7 +951,7 @@ int XMasterFile::fileNumber( int r ) const
 	const char *record = buf + (record_length * r);
 	int fileNumber = read_uint16( record, 65 );
 
-	assert( fileNumber > 255 );
+	assert( fileNumber > 0 );
 	return fileNumber;
 }
 
@@ -968,11 +974,26 @@ int XMasterFile::dataLength( int r ) const
 
 
 
-FDat::FDat( const char *_buf, int _size, unsigned char fields ) :
+FDat::FDat( const char *_buf, long _size, unsigned char fields ) :
 	field_bitset( fields ),
 	record_length( count_bits(fields) * 4 ),
 	buf( _buf ),
-	size( _size )
+	size( _size ),
+	records( -1 )
+{
+}
+
+/**
+ * Data file window as read by FDatReader, the header record is not used to
+ * count the records.
+ */
+FDat::FDat( const char *_buf, long _size, unsigned char fields,
+	int _records ) :
+	field_bitset( fields ),
+	record_length( count_bits(fields) * 4 ),
+	buf( _buf ),
+	size( _size ),
+	records( _records )
 {
 }
 
@@ -1005,14 +1026,46 @@ void FDat::setPrintDateFrom( int date )
 	print_date_from = date;
 }
 
-void FDat::setForceFloat( ms_data_field fld )
+/**
+ * Hash over all settings which change the printed text of a data file. Files
+ * printed with equal hashes (and equal symbol prefix) give identical text.
+ */
+unsigned long long FDat::printerHash()
+{
+	char s[64];
+	int len = snprintf( s, sizeof(s), "%d:%u:%d:%d:%d", (int)print_sep,
+		print_bitset, print_date_from, vol_ftoa == prc_ftoa,
+		opi_ftoa == prc_ftoa );
+	return fnv1a_hash( s, len );
+}
+
+
+/* smallest slice worth a job of its own, about 1 MB of text */
+#define MIN_SLICE_RECORDS 16384
+
+/**
+ * Number of records per slice if a data file of cnt records is formatted by
+ * nthreads in parallel. Small files are not split at all, large ones into
+ * about 4 slices per thread to balance the load.
+ */
+int FDat::sliceRecords( int cnt, int nthreads )
+{
+	if( nthreads <= 1 || cnt < 2 * MIN_SLICE_RECORDS ) {
+		return cnt > 0 ? cnt : 1;
+	}
+	int s = (cnt + 4 * nthreads - 1) / (4 * nthreads);
+	return s < MIN_SLICE_RECORDS ? MIN_SLICE_RECORDS : s;
+}
+
+
+void FDat::setForceFloat( ms_data_field fld, bool force )
 {
 	switch(fld) {
 	case D_OPI:
-		opi_ftoa = prc_ftoa;
+		opi_ftoa = force ? prc_ftoa : ftoa_prec_f0;
 		break;
 	case D_VOL:
-		vol_ftoa = prc_ftoa;
+		vol_ftoa = force ? prc_ftoa : ftoa_prec_f0;
 		break;
 	default:
 		/* maybe extend this switch if ever needed */
@@ -1033,10 +1086,11 @@ bool FDat::checkHeader() const
 int FDat::print( const char* header ) const
 {
 	const char *record = buf + record_length;
-	const char *end = buf + ((countRecords() + 1) * record_length);
+	const char *end = buf + ((countRecords() + 1) * (long)record_length);
 	assert( end - buf <= size );
 	char buf[512];
 	char *buf_p = buf;
+	ms_bar bar;
 
 	int h_size = strlen( header );
 	memcpy( buf, header, h_size );
@@ -1044,11 +1098,12 @@ int FDat::print( const char* header ) const
 
 	int err = 0;
 	while( record < end ) {
-		int len = record_to_string( record, buf_p );
+		readBar( record, &bar );
 		record += record_length;
-		if( len < 0) {
+		if( (field_bitset & D_DAT) && bar.date < print_date_from ) {
 			continue;
 		}
+		int len = bar_to_string( &bar, buf_p );
 		buf_p[len++] = '\n';
 		buf_p[len] = '\0';
 
@@ -1062,6 +1117,99 @@ int FDat::print( const char* header ) const
 }
 
 
+int FDat::print( const char* header, const ms_columns *cols )
+{
+	char buf[512];
+	char *buf_p = buf;
+	ms_bar bar;
+
+	int h_size = strlen( header );
+	memcpy( buf, header, h_size );
+	buf_p += h_size;
+
+	int err = 0;
+	for( int i = 0; i < cols->count; i++ ) {
+		bar.date = cols->date[i];
+		if( (cols->field_bitset & D_DAT) && bar.date < print_date_from ) {
+			continue;
+		}
+		bar.time = cols->time[i];
+		bar.open = cols->open[i];
+		bar.high = cols->high[i];
+		bar.low = cols->low[i];
+		bar.close = cols->close[i];
+		bar.volume = cols->volume[i];
+		bar.openint = cols->openint[i];
+
+		int len = bar_to_string( &bar, buf_p );
+		buf_p[len++] = '\n';
+		buf_p[len] = '\0';
+		err = fputs( buf, (FILE*)out );
+	}
+
+	fflush( (FILE*)out );
+	return err;
+}
+
+
+/**
+ * Like print() but append records first to last (1-based, inclusive) to tb
+ * instead of writing them to the output file. May be called concurrently.
+ */
+void FDat::format( const char* header, int first, int last,
+	text_buf *tb ) const
+{
+	assert( first >= 1 && last <= countRecords() );
+	const char *record = buf + (first * (long)record_length);
+	const char *end = buf + ((last + 1) * (long)record_length);
+	int h_size = strlen( header );
+	ms_bar bar;
+
+	/* 512 bytes per line are enough, see print() */
+	long need = tb->len + (last - first + 1) * (long)(h_size + 64) + 512;
+	if( tb->size < need ) {
+		tb->buf = (char*) realloc( tb->buf, need );
+		tb->size = need;
+	}
+
+	while( record < end ) {
+		readBar( record, &bar );
+		record += record_length;
+		if( (field_bitset & D_DAT) && bar.date < print_date_from ) {
+			continue;
+		}
+		if( tb->size - tb->len < h_size + 512 ) {
+			tb->size = 2 * tb->size + h_size + 512;
+			tb->buf = (char*) realloc( tb->buf, tb->size );
+		}
+		char *s = tb->buf + tb->len;
+		memcpy( s, header, h_size );
+		s += h_size;
+		int len = bar_to_string( &bar, s );
+		s[len++] = '\n';
+		tb->len += h_size + len;
+	}
+}
+
+
+/**
+ * Write text formatted by format() to the output file.
+ */
+int FDat::write( const text_buf *tb )
+{
+	if( fwrite( tb->buf, 1, tb->len, (FILE*)out ) != (size_t)tb->len ) {
+		return -1;
+	}
+	return 0;
+}
+
+
+int FDat::flush()
+{
+	return fflush( (FILE*)out );
+}
+
+
 void FDat::print_header( const char* symbol_header )
 {
 	char buf[512];
@@ -1095,40 +1243,48 @@ void FDat::print_header( const char* symbol_header )
 	}
 
 
-int FDat::record_to_string( const char *record, char *s ) const
+void FDat::readBar( const char *record, ms_bar *bar ) const
 {
 	int offset = 0;
-	char *begin = s;
 
-	int date, time;
-	float open, high , low, close, volume, openint;
-	date = time = 0;
-	open = high = low = close = volume = openint = DEFAULT_FLOAT;
+	bar->date = bar->time = 0;
+	bar->open = bar->high = bar->low = bar->close = bar->volume =
+		bar->openint = DEFAULT_FLOAT;
 
 	if( field_bitset & D_DAT ) {
-		date = floatToIntDate_YYY(readFloat(record, offset));
-		if( date < print_date_from ) {
-			return -1;
-		}
+		bar->date = floatToIntDate_YYY(readFloat(record, offset));
 		offset += 4;
 	}
 
-	READ_FIELD( time, D_TIM );
-	READ_FIELD( open, D_OPE );
-	READ_FIELD( high, D_HIG );
-	READ_FIELD( low, D_LOW );
-	READ_FIELD( close, D_CLO );
-	READ_FIELD( volume, D_VOL );
-	READ_FIELD( openint, D_OPI );
-
-	PRINT_FIELD( itodatestr, D_DAT, date );
-	PRINT_FIELD( itotimestr, D_TIM, time );
-	PRINT_FIELD( prc_ftoa, D_OPE, open );
-	PRINT_FIELD( prc_ftoa, D_HIG, high );
-	PRINT_FIELD( prc_ftoa, D_LOW, low );
-	PRINT_FIELD( prc_ftoa, D_CLO, close );
-	PRINT_FIELD( vol_ftoa, D_VOL, volume );
-	PRINT_FIELD( opi_ftoa, D_OPI, openint );
+	READ_FIELD( bar->time, D_TIM );
+	READ_FIELD( bar->open, D_OPE );
+	READ_FIELD( bar->high, D_HIG );
+	READ_FIELD( bar->low, D_LOW );
+	READ_FIELD( bar->close, D_CLO );
+	READ_FIELD( bar->volume, D_VOL );
+	READ_FIELD( bar->openint, D_OPI );
+}
+
+
+void FDat::getBar( int rnum, ms_bar *bar ) const
+{
+	assert( rnum > 0 && rnum <= countRecords() );
+	readBar( buf + rnum * (long)record_length, bar );
+}
+
+
+int FDat::bar_to_string( const ms_bar *bar, char *s )
+{
+	char *begin = s;
+
+	PRINT_FIELD( itodatestr, D_DAT, bar->date );
+	PRINT_FIELD( itotimestr, D_TIM, bar->time );
+	PRINT_FIELD( prc_ftoa, D_OPE, bar->open );
+	PRINT_FIELD( prc_ftoa, D_HIG, bar->high );
+	PRINT_FIELD( prc_ftoa, D_LOW, bar->low );
+	PRINT_FIELD( prc_ftoa, D_CLO, bar->close );
+	PRINT_FIELD( vol_ftoa, D_VOL, bar->volume );
+	PRINT_FIELD( opi_ftoa, D_OPI, bar->openint );
 
 	if( s != begin ) {
 		*(--s) = '\0';
@@ -1167,15 +1323,175 @@ int FDat::header_to_string( char *s )
 
 int FDat::countRecords() const
 {
+	if( records >= 0 ) {
+		return (records + 1) * (long)record_length <= size ? records : -1;
+	}
 	if( size < record_length ) {
 		return -1;
 	}
+	return headerRecords( buf, size, field_bitset );
+}
 
-	int cnt = read_uint16( buf, 2 ) - 1;
 
-	if( (cnt + 1) * record_length > size ) {
+/**
+ * Number of records stated by the header, i.e. modulo 65536 for large files.
+ */
+int FDat::headerCount( const char *header )
+{
+	return read_uint16( header, 2 ) - 1;
+}
+
+
+/**
+ * Number of records of a data file of file_size bytes, -1 if the file is too
+ * short to hold the records stated by its header. The header holds the
+ * number of records (plus one) as 16 bit value only. If the file is too
+ * large for that, the count is taken from the file size as long as it
+ * matches the wrapped header value.
+ */
+int FDat::headerRecords( const char *header, long long file_size,
+	unsigned char fields )
+{
+	int rl = count_bits(fields) * 4;
+	int cnt = headerCount( header );
+
+	if( (cnt + 1) * (long long)rl > file_size ) {
 		return -1;
 	}
 
+	long long in_file = file_size / rl - 1;
+	if( in_file > 0xFFFF - 1 && (in_file + 1) % 0x10000 == cnt + 1 ) {
+		if( in_file > INT_MAX ) {
+			return -1;
+		}
+		cnt = in_file;
+	}
+
 	return cnt;
 }
+
+
+/**
+ * Upper bound of the length of one line printed with this header (symbol
+ * prefix), see print().
+ */
+int FDat::maxLineLength( const char *header )
+{
+	return strlen( header ) + 512;
+}
+
+
+
+
+FDatReader::FDatReader( int _fd, unsigned char fields ) :
+	fd( _fd ),
+	record_length( count_bits(fields) * 4 ),
+	field_bitset( fields ),
+	count( -1 ),
+	done( 0 ),
+	size( 0 ),
+	mtime( 0.0 ),
+	drop_cache( false )
+{
+}
+
+FDatReader::~FDatReader()
+{
+	close( fd );
+}
+
+/**
+ * Read the header record, false if the file is not usable (errno is 0 if
+ * the file is just too short).
+ */
+bool FDatReader::open()
+{
+	struct stat st;
+	if( fstat( fd, &st ) < 0 ) {
+		return false;
+	}
+#if defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+	mtime = st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9;
+#else
+	mtime = st.st_mtime;
+#endif
+	size = st.st_size;
+	errno = 0;
+	if( record_length == 0 || st.st_size < record_length
+			|| !pread_all( fd, header, record_length, 0 ) ) {
+		return false;
+	}
+	count = FDat::headerRecords( header, st.st_size, field_bitset );
+	return count >= 0;
+}
+
+/* file size when opened */
+long long FDatReader::fileSize() const
+{
+	return size;
+}
+
+/* modification time when opened, seconds since the epoch */
+double FDatReader::modified() const
+{
+	return mtime;
+}
+
+int FDatReader::countRecords() const
+{
+	return count;
+}
+
+int FDatReader::recordLength() const
+{
+	return record_length;
+}
+
+/**
+ * Let the next read() start at record first (1-based).
+ */
+void FDatReader::seek( int first )
+{
+	done = first > 1 ? first - 1 : 0;
+}
+
+/**
+ * Read sequentially and drop what has been read from the page cache.
+ */
+void FDatReader::dropCache()
+{
+	drop_cache = true;
+#if defined HAVE_POSIX_FADVISE
+	posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+}
+
+/**
+ * Fill buf with the header record and the next (at most max_records)
+ * records. Returns the number of records read, 0 at the end and -1 on
+ * errors.
+ */
+int FDatReader::read( char *buf, int max_records )
+{
+	int n = count - done;
+	if( n > max_records ) {
+		n = max_records;
+	}
+	if( n <= 0 ) {
+		return 0;
+	}
+	memcpy( buf, header, record_length );
+	errno = 0;
+	if( !pread_all( fd, buf + record_length, (long)n * record_length,
+			(done + 1) * (long long)record_length ) ) {
+		return -1;
+	}
+#if defined HAVE_POSIX_FADVISE
+	if( drop_cache ) {
+		posix_fadvise( fd, (done + 1) * (long long)record_length,
+			(long long)n * record_length, POSIX_FADV_DONTNEED );
+	}
+#endif
+	done += n;
+	return n;
+}
@@ -38,6 +38,7 @@
 #ifndef ATEM_MS_FILE_H
 #define ATEM_MS_FILE_H
 
+#include "libatem.h"
 
 
 
@@ -110,6 +111,13 @@ struct master_record
 	char file_name[MAX_LEN_MR_FILENAME + 1];
 	int from_date;
 	int to_date;
+	/* inode from the directory scan, 0 if unknown */
+	unsigned long long file_ino;
+	/* data file metadata cached by Metastock::statFiles() */
+	bool has_stat;
+	long file_mtime_ns;
+	long long file_mtime;
+	long long file_size;
 };
 
 /* estimated maximum string length returned by mr_record_to_string()
@@ -131,6 +139,8 @@ class MasterFile
 	public:
 		MasterFile( const char *buf, int size );
 
+		static const int record_length = 53;
+
 		static bool checkHeader( const char* buf );
 		static bool checkRecord( const char* buf, int record  );
 
@@ -148,8 +158,6 @@ class MasterFile
 		void printHeader() const;
 		void printRecord( const char *record ) const;
 
-		static const int record_length = 53;
-
 		const char * const buf;
 		const int size;
 };
@@ -162,6 +170,8 @@ class EMasterFile
 	public:
 		EMasterFile( const char *buf, int size );
 
+		static const int record_length = 192;
+
 		static bool checkHeader( const char* buf );
 		static bool checkRecord( const char* buf, int record  );
 
@@ -180,8 +190,6 @@ class EMasterFile
 		void printHeader() const;
 		void printRecord( const char *record ) const;
 
-		static const int record_length = 192;
-
 		const char * const buf;
 		const int size;
 };
@@ -194,6 +202,8 @@ class XMasterFile
 	public:
 		XMasterFile( const char *buf, int size );
 
+		static const int record_length = 150;
+
 		static bool checkHeader( const char* buf );
 		static bool checkRecord( const char* buf, int record  );
 
@@ -211,36 +221,75 @@ class XMasterFile
 		void printHeader() const;
 		void printRecord( const char *record ) const;
 
-		static const int record_length = 150;
-
 		const char * const buf;
 		const int size;
 };
 
 
 
+typedef atem_bar ms_bar;
+
+/* a whole data file decoded column-wise, see ColCache */
+struct ms_columns
+{
+	int count;
+	unsigned char field_bitset;
+	const int *date;
+	const int *time;
+	const float *open;
+	const float *high;
+	const float *low;
+	const float *close;
+	const float *volume;
+	const float *openint;
+};
+
+
+/* growing text buffer filled by FDat::format() */
+struct text_buf
+{
+	char *buf;
+	long len;
+	long size;
+};
+
+
 typedef int (*ftoa_func)(char*, float);
 
 class FDat
 {
 	public:
-		FDat( const char *buf, int size, unsigned char fields );
+		FDat( const char *buf, long size, unsigned char fields );
+		FDat( const char *buf, long size, unsigned char fields, int records );
 
 		static bool checkHeader( const char* buf );
 		static bool checkRecord( const char* buf, int record  );
 		static void set_outfile( void *file );
 		static void initPrinter( char sep, unsigned int bitset );
 		static void setPrintDateFrom( int date );
-		static void setForceFloat( ms_data_field );
+		static void setForceFloat( ms_data_field, bool force );
 		static void print_header( const char* symbol_header );
+		static int write( const text_buf *tb );
+		static int flush();
+		static unsigned long long printerHash();
+		static int sliceRecords( int cnt, int nthreads );
+		static int headerCount( const char *header );
+		static int headerRecords( const char *header, long long file_size,
+			unsigned char fields );
+		static int maxLineLength( const char *header );
 
 		bool checkHeader() const;
 		int print( const char* header ) const;
+		static int print( const char* header, const ms_columns *cols );
+		void format( const char* header, int first, int last,
+			text_buf *tb ) const;
 		int countRecords() const;
+		void getBar( int rnum, ms_bar *bar ) const;
 
 	private:
 		static int header_to_string( char *s );
-		int record_to_string( const char *record, char *s ) const;
+		static int bar_to_string( const ms_bar *bar, char *s );
+		void readBar( const char *record, ms_bar *bar ) const;
 
 		static void *out;
 		static char print_sep;
@@ -254,7 +303,44 @@ class FDat
 		const int record_length;
 
 		const char * const buf;
-		const int size;
+		const long size;
+		const int records;
+};
+
+
+/**
+ * Reads a data file window by window instead of all at once. Each window
+ * starts with a copy of the header record followed by whole records, it can
+ * be printed by an FDat constructed with the number of records read.
+ */
+/* data files larger than this are always read window by window */
+#define FDAT_STREAM_SIZE (1LL << 30)
+
+class FDatReader
+{
+	public:
+		FDatReader( int fd, unsigned char fields );
+		~FDatReader();
+
+		bool open();
+		int countRecords() const;
+		int recordLength() const;
+		long long fileSize() const;
+		double modified() const;
+		void seek( int first );
+		void dropCache();
+		int read( char *buf, int max_records );
+
+	private:
+		const int fd;
+		const int record_length;
+		const unsigned char field_bitset;
+		int count;
+		int done;
+		long long size;
+		double mtime;
+		bool drop_cache;
+		char header[32];
 };
 
 
@@ -0,0 +1,431 @@
+/*** out_cache.cpp -- persistent cache of formatted output
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "out_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "util.h"
+
+#if defined HAVE_SENDFILE && defined HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
+#if defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+# define ST_MTIME_NS( _st_ ) ((_st_).st_mtim.tv_nsec)
+#else
+# define ST_MTIME_NS( _st_ ) 0
+#endif
+
+#if !defined O_BINARY
+# define O_BINARY 0
+#endif
+
+
+
+/* bump the last byte whenever the layout changes */
+#define TXT_MAGIC "ATEMTXT\001"
+
+#define COPY_BLCKSZ (256 * 1024)
+
+/* 64 bytes header followed by text_len bytes formatted text */
+struct txt_header
+{
+	char magic[8];
+	uint64_t key;
+	uint64_t src_size;
+	int64_t src_mtime;
+	int64_t src_mtime_ns;
+	uint64_t src_hash;
+	uint64_t text_len;
+	uint64_t reserved;
+};
+
+
+OutCache::OutCache() :
+	ms_dir( NULL ),
+	dir( NULL ),
+	path( NULL ),
+	tmp_path( NULL ),
+	fd( -1 ),
+	tmp( NULL ),
+	key( 0 ),
+	src_size( -1 ),
+	src_mtime( 0 ),
+	src_mtime_ns( 0 ),
+	src_hash( 0 ),
+	text_len( 0 ),
+	hits( 0 ),
+	misses( 0 ),
+	bytes_kernel( 0 ),
+	bytes_user( 0 )
+{
+	error[0] = '\0';
+}
+
+
+OutCache::~OutCache()
+{
+	abort();
+	closeEntry();
+	free( dir );
+	free( ms_dir );
+}
+
+
+bool OutCache::setDir( const char *cache_dir, const char *_ms_dir )
+{
+	free( dir );
+	dir = cache_subdir( cache_dir, _ms_dir );
+	if( dir == NULL ) {
+		setError( cache_dir, strerror(errno) );
+		return false;
+	}
+
+	ms_dir = (char*) realloc( ms_dir, strlen(_ms_dir) + 1 );
+	strcpy( ms_dir, _ms_dir );
+	return true;
+}
+
+
+void OutCache::closeEntry()
+{
+	if( fd >= 0 ) {
+		close( fd );
+		fd = -1;
+	}
+	free( path );
+	path = NULL;
+}
+
+
+/**
+ * Look up the entry for file_name printed with settings key. On OC_HIT the
+ * entry is ready for copyTo(). On OC_TOUCHED the caller should hash the
+ * source and try refresh(), otherwise create() a new entry.
+ */
+out_cache_state OutCache::open( const char *file_name, unsigned long long k )
+{
+	assert( tmp == NULL );
+	closeEntry();
+
+	char src[strlen(ms_dir) + strlen(file_name) + 1];
+	strcpy( src, ms_dir );
+	strcat( src, file_name );
+
+	size_t len = strlen( dir ) + strlen( file_name ) + 5;
+	path = (char*) malloc( len );
+	snprintf( path, len, "%s%s.txt", dir, file_name );
+	key = k;
+
+	struct stat st;
+	src_size = -1;
+	if( stat( src, &st ) < 0 ) {
+		misses++;
+		return OC_MISS;
+	}
+	src_size = st.st_size;
+	src_mtime = st.st_mtime;
+	src_mtime_ns = ST_MTIME_NS( st );
+
+	fd = ::open( path, O_RDONLY | O_BINARY );
+	if( fd < 0 ) {
+		misses++;
+		return OC_MISS;
+	}
+
+	txt_header hdr;
+	if( fstat( fd, &st ) < 0 || (size_t)st.st_size < sizeof(hdr)
+			|| !read_all( fd, (char*)&hdr, sizeof(hdr) )
+			|| memcmp( hdr.magic, TXT_MAGIC, 8 ) != 0
+			|| hdr.key != key
+			|| (long long)hdr.src_size != src_size
+			|| (size_t)st.st_size != sizeof(hdr) + hdr.text_len ) {
+		close( fd );
+		fd = -1;
+		misses++;
+		return OC_MISS;
+	}
+	text_len = hdr.text_len;
+	src_hash = hdr.src_hash;
+
+	if( hdr.src_mtime != src_mtime || hdr.src_mtime_ns != src_mtime_ns ) {
+		return OC_TOUCHED;
+	}
+	hits++;
+	return OC_HIT;
+}
+
+
+/**
+ * The source of an OC_TOUCHED entry has been hashed. If the content did not
+ * change we update the entry's mtime and it is ready for copyTo().
+ */
+bool OutCache::refresh( unsigned long long hash )
+{
+	assert( fd >= 0 );
+	if( hash != src_hash ) {
+		close( fd );
+		fd = -1;
+		misses++;
+		return false;
+	}
+
+	int wfd = ::open( path, O_WRONLY | O_BINARY );
+	if( wfd >= 0 ) {
+		txt_header hdr;
+		memset( &hdr, 0, sizeof(hdr) );
+		memcpy( hdr.magic, TXT_MAGIC, 8 );
+		hdr.key = key;
+		hdr.src_size = src_size;
+		hdr.src_mtime = src_mtime;
+		hdr.src_mtime_ns = src_mtime_ns;
+		hdr.src_hash = src_hash;
+		hdr.text_len = text_len;
+		/* failing is harmless, we would just check the hash again */
+		write_all( wfd, (const char*)&hdr, sizeof(hdr) );
+		close( wfd );
+	}
+	hits++;
+	return true;
+}
+
+
+/**
+ * Start a new entry for the file of the last open(). Everything printed to
+ * the returned stream until commit() becomes the entry's text.
+ */
+FILE* OutCache::create()
+{
+	assert( path != NULL && tmp == NULL );
+	if( fd >= 0 ) {
+		close( fd );
+		fd = -1;
+	}
+
+	/* pid avoids clashes with concurrent atem processes */
+	size_t len = strlen( path ) + 32;
+	tmp_path = (char*) malloc( len );
+	snprintf( tmp_path, len, "%s.%ld.tmp", path, (long)getpid() );
+
+	tmp = fopen( tmp_path, "w+b" );
+	if( tmp == NULL ) {
+		setError( tmp_path, strerror(errno) );
+		free( tmp_path );
+		tmp_path = NULL;
+		return NULL;
+	}
+
+	txt_header hdr;
+	memset( &hdr, 0, sizeof(hdr) );
+	fwrite( &hdr, 1, sizeof(hdr), tmp );
+	return tmp;
+}
+
+
+bool OutCache::commit( unsigned long long hash )
+{
+	assert( tmp != NULL );
+
+	txt_header hdr;
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, TXT_MAGIC, 8 );
+	hdr.key = key;
+	hdr.src_size = src_size;
+	hdr.src_mtime = src_mtime;
+	hdr.src_mtime_ns = src_mtime_ns;
+	hdr.src_hash = hash;
+
+	bool ok = fflush( tmp ) == 0;
+	long pos = ftell( tmp );
+	text_len = pos - (long)sizeof(hdr);
+	hdr.text_len = text_len;
+	ok = ok && pos >= (long)sizeof(hdr)
+		&& fseek( tmp, 0, SEEK_SET ) == 0
+		&& fwrite( &hdr, 1, sizeof(hdr), tmp ) == sizeof(hdr)
+		&& fflush( tmp ) == 0;
+
+	/* keep it open for copyTo(), even if renaming fails below */
+	if( ok ) {
+		fd = dup( fileno(tmp) );
+		ok = fd >= 0;
+	}
+	if( !ok ) {
+		setError( tmp_path, strerror(errno) );
+	}
+	fclose( tmp );
+	tmp = NULL;
+
+	/* without stat() of the source there is nothing to validate against */
+	if( !ok || src_size < 0 ) {
+		unlink( tmp_path );
+	} else {
+#if defined _WIN32
+		unlink( path );
+#endif
+		if( rename( tmp_path, path ) != 0 ) {
+			unlink( tmp_path );
+		}
+	}
+	free( tmp_path );
+	tmp_path = NULL;
+	return ok;
+}
+
+
+void OutCache::abort()
+{
+	if( tmp != NULL ) {
+		fclose( tmp );
+		tmp = NULL;
+		unlink( tmp_path );
+		free( tmp_path );
+		tmp_path = NULL;
+	}
+}
+
+
+bool OutCache::copyKernel( int out_fd, long long *done )
+{
+	long long left = text_len - *done;
+
+#if defined HAVE_COPY_FILE_RANGE
+	while( left > 0 ) {
+		off_t off = sizeof(txt_header) + *done;
+		ssize_t n = copy_file_range( fd, &off, out_fd, NULL, left, 0 );
+		if( n <= 0 ) {
+			break;
+		}
+		*done += n;
+		left -= n;
+	}
+#endif
+#if defined HAVE_SENDFILE && defined HAVE_SYS_SENDFILE_H
+	while( left > 0 ) {
+		off_t off = sizeof(txt_header) + *done;
+		ssize_t n = sendfile( out_fd, fd, &off, left );
+		if( n <= 0 ) {
+			break;
+		}
+		*done += n;
+		left -= n;
+	}
+#endif
+	(void) out_fd;
+	return left == 0;
+}
+
+
+/**
+ * Append the current entry's text to out and close the entry.
+ */
+bool OutCache::copyTo( FILE *out )
+{
+	assert( fd >= 0 );
+	long long done = 0;
+	bool ok = true;
+
+	if( fflush( out ) != 0 ) {
+		setError( "writing output", strerror(errno) );
+		closeEntry();
+		return false;
+	}
+
+	/* no fd behind streams like our compressor */
+	int out_fd = fileno( out );
+	if( out_fd >= 0 && copyKernel( out_fd, &done ) ) {
+		bytes_kernel += done;
+		closeEntry();
+		return true;
+	}
+	bytes_kernel += done;
+
+	/* fallback, whatever copyKernel() did not manage */
+	if( lseek( fd, sizeof(txt_header) + done, SEEK_SET ) < 0 ) {
+		ok = false;
+	}
+	char buf[COPY_BLCKSZ];
+	while( ok && done < text_len ) {
+		long long n = text_len - done;
+		if( n > COPY_BLCKSZ ) {
+			n = COPY_BLCKSZ;
+		}
+		if( !read_all( fd, buf, n ) || fwrite( buf, 1, n, out ) != (size_t)n ) {
+			ok = false;
+			break;
+		}
+		done += n;
+		bytes_user += n;
+	}
+	if( !ok ) {
+		setError( "copying cached output", strerror(errno) );
+	}
+	closeEntry();
+	return ok;
+}
+
+
+void OutCache::printStats( FILE *f ) const
+{
+	fprintf( f, "output cache: %d hits, %d misses, "
+		"%lld bytes copied in kernel, %lld bytes in user space\n",
+		hits, misses, bytes_kernel, bytes_user );
+}
+
+
+const char* OutCache::lastError() const
+{
+	return error;
+}
+
+
+void OutCache::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_OC, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_OC, "%s: %s", e1, e2 );
+	}
+}
@@ -0,0 +1,107 @@
+/*** out_cache.h -- persistent cache of formatted output
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_OUT_CACHE_H
+#define ATEM_OUT_CACHE_H
+
+#include <stdio.h>
+
+
+enum out_cache_state {
+	OC_MISS = 0,
+	OC_HIT,
+	OC_TOUCHED /* only mtime differs, content might be unchanged */
+};
+
+#define ERROR_LENGTH_OC 256
+
+/**
+ * Directory of already formatted text chunks, one per data file. An entry
+ * is keyed by size, mtime and content hash of the source file plus a hash of
+ * all active print settings. Valid entries are copied to the output using
+ * copy_file_range() or sendfile() if possible, so they never pass user space.
+ */
+class OutCache
+{
+	public:
+		OutCache();
+		~OutCache();
+
+		bool setDir( const char *cache_dir, const char *ms_dir );
+
+		out_cache_state open( const char *file_name, unsigned long long key );
+		bool refresh( unsigned long long src_hash );
+		FILE* create();
+		bool commit( unsigned long long src_hash );
+		void abort();
+		bool copyTo( FILE *out );
+
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+	private:
+		void closeEntry();
+		bool copyKernel( int out_fd, long long *done );
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		char *ms_dir;
+		char *dir;
+
+		/* entry of the last open() */
+		char *path;
+		char *tmp_path;
+		int fd;
+		FILE *tmp;
+		unsigned long long key;
+		long long src_size;
+		long long src_mtime;
+		long src_mtime_ns;
+		unsigned long long src_hash;
+		long long text_len;
+
+		int hits;
+		int misses;
+		long long bytes_kernel;
+		long long bytes_user;
+
+		mutable char error[ERROR_LENGTH_OC];
+};
+
+
+
+
+#endif
@@ -0,0 +1,697 @@
+/*** pipeline.cpp -- read, format and write stages connected by rings
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "pipeline.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "file_buf.h"
+#include "metastock.h"
+#include "ms_file.h"
+#include "ring.h"
+#include "thread_pool.h"
+#include "util.h"
+
+#if defined HAVE_PTHREAD
+# include <pthread.h>
+# include <sched.h>
+#endif
+
+
+
+/* a data file (or window of it) shared by its chunks, the last one frees it */
+struct pipe_file
+{
+	FileBuf *buf;
+	const char *data;
+	long size;
+	int records;
+	unsigned char fields;
+	long refs;
+	char pfx[MAX_SIZE_MR_STRING + 2];
+};
+
+struct pipe_chunk
+{
+	long seq;
+	pipe_file *file;
+	int first;
+	int last;
+	char *slot; /* buffer of the pool holding window and text */
+	text_buf text;
+	char error[ERROR_LENGTH_PIPE];
+};
+
+struct pipe_thread
+{
+	Pipeline *pl;
+	int k;
+};
+
+
+/* wait a bit for another stage, returns the seconds waited */
+static double backoff( int *spins )
+{
+	double t = wall_time();
+#if defined HAVE_PTHREAD
+	if( ++(*spins) < 64 ) {
+		sched_yield();
+	} else {
+		usleep( 100 );
+	}
+#endif
+	return wall_time() - t;
+}
+
+
+/* size range of the buffers if memory is limited */
+#define MIN_SLOT_SIZE (32 * 1024)
+#define MAX_SLOT_SIZE (4 * 1024 * 1024)
+
+Pipeline::Pipeline( int nthreads, long long max_memory, bool phys ) :
+	ms( NULL ),
+	physical( phys ),
+	nformat( nthreads > 0 ? nthreads : 1 ),
+	window( 2 * nformat + 2 ),
+	pool( NULL ),
+	to_format( NULL ),
+	to_write( NULL ),
+	in_flight( 0 ),
+	aborted( 0 ),
+	max_in_flight( 0 ),
+	chunks( 0 ),
+	batches( 0 ),
+	batch_files( 0 ),
+	read_busy( 0.0 ),
+	read_wait( 0.0 ),
+	format_busy( NULL ),
+	format_wait( NULL ),
+	write_busy( 0.0 ),
+	write_wait( 0.0 ),
+	elapsed( 0.0 )
+{
+	*error = '\0';
+	if( max_memory > 0 ) {
+		/* each chunk in flight needs one buffer, with a small budget there
+		   are less chunks and formatters than usual */
+		long long size = max_memory / window;
+		if( size < MIN_SLOT_SIZE ) {
+			size = MIN_SLOT_SIZE;
+		} else if( size > MAX_SLOT_SIZE ) {
+			size = MAX_SLOT_SIZE;
+		}
+		pool = new BufPool( max_memory, size );
+		int n = pool->buffers();
+		assert( n >= 1 );
+		if( nformat > n - 1 ) {
+			nformat = n > 1 ? n - 1 : 1;
+		}
+		if( window > n ) {
+			window = n;
+		}
+	}
+	/* in flight chunks plus end markers always fit into the rings */
+	to_format = (SpscRing**) malloc( nformat * sizeof(SpscRing*) );
+	for( int k = 0; k < nformat; k++ ) {
+		to_format[k] = new SpscRing( window + 1 );
+	}
+	to_write = new MpscRing( window + nformat );
+	format_busy = (double*) calloc( nformat, sizeof(double) );
+	format_wait = (double*) calloc( nformat, sizeof(double) );
+}
+
+
+Pipeline::~Pipeline()
+{
+	for( int k = 0; k < nformat; k++ ) {
+		delete to_format[k];
+	}
+	free( to_format );
+	delete to_write;
+	free( format_busy );
+	free( format_wait );
+	delete pool;
+}
+
+
+void* Pipeline::reader_main( void *arg )
+{
+	((Pipeline*) arg)->readFiles();
+	return NULL;
+}
+
+
+void* Pipeline::formatter_main( void *arg )
+{
+	pipe_thread *pt = (pipe_thread*) arg;
+	pt->pl->formatChunks( pt->k );
+	return NULL;
+}
+
+
+/**
+ * Pass chunk c to its formatter as soon as the number of chunks in flight
+ * allows it, NULL ends all formatters.
+ */
+void Pipeline::deal( pipe_chunk *c )
+{
+	int spins = 0;
+	if( c == NULL ) {
+		for( int k = 0; k < nformat; k++ ) {
+			while( !to_format[k]->push( NULL ) ) {
+				read_wait += backoff( &spins );
+			}
+		}
+		return;
+	}
+
+	while( ring_load( &in_flight ) >= window ) {
+		read_wait += backoff( &spins );
+	}
+	long n = ring_add( &in_flight, 1 );
+	if( n > max_in_flight ) {
+		max_in_flight = n;
+	}
+	c->seq = chunks++;
+	while( !to_format[c->seq % nformat]->push( c ) ) {
+		read_wait += backoff( &spins );
+	}
+}
+
+
+/* pass an error to the writer, it reports it after all previous files */
+void Pipeline::dealError( const char *e1, const char *e2 )
+{
+	pipe_chunk *c = (pipe_chunk*) calloc( 1, sizeof(pipe_chunk) );
+	if( e2 == NULL ) {
+		snprintf( c->error, ERROR_LENGTH_PIPE, "%s", e1 );
+	} else {
+		snprintf( c->error, ERROR_LENGTH_PIPE, "%s: %s", e1, e2 );
+	}
+	deal( c );
+}
+
+
+/* records per window of large files if memory is not limited */
+#define STREAM_RECORDS (256 * 1024)
+
+/**
+ * Reader stage for one file if memory is limited or the file is large. The
+ * file is read window by window, each window makes one chunk. With a memory
+ * limit windows are read into buffers of the pool and the text goes into the
+ * same buffer behind the records.
+ */
+bool Pipeline::streamFile( int fno )
+{
+	double t = wall_time();
+	FDatReader *r = ms->openData( fno );
+	if( r == NULL ) {
+		read_busy += wall_time() - t;
+		dealError( ms->lastError() );
+		return false;
+	}
+	pipe_file proto;
+	memset( &proto, 0, sizeof(proto) );
+	proto.fields = ms->getRecord( fno )->field_bitset;
+	ms->dataPrefix( fno, proto.pfx, NULL );
+	int rl = r->recordLength();
+	int max = STREAM_RECORDS;
+	if( pool != NULL ) {
+		max = (pool->bufSize() - 512 - rl)
+			/ (rl + FDat::maxLineLength( proto.pfx ));
+	}
+	assert( max > 0 );
+	read_busy += wall_time() - t;
+
+	bool ok = true;
+	while( !ring_load( &aborted ) ) {
+		char *slot = NULL;
+		FileBuf *fb = NULL;
+		char *data;
+		if( pool != NULL ) {
+			t = wall_time();
+			data = slot = pool->get();
+			read_wait += wall_time() - t;
+		} else {
+			fb = new FileBuf();
+			data = fb->reserve( (long)(max + 1) * rl );
+		}
+
+		t = wall_time();
+		int n = r->read( data, max );
+		read_busy += wall_time() - t;
+		if( n <= 0 ) {
+			if( slot != NULL ) {
+				pool->put( slot );
+			}
+			delete fb;
+			if( n < 0 ) {
+				dealError( ms->getRecord( fno )->file_name, errno != 0
+					? strerror(errno) : "unexpected end of file" );
+				ok = false;
+			}
+			break;
+		}
+
+		pipe_file *f = new pipe_file;
+		*f = proto;
+		f->buf = fb;
+		f->data = data;
+		f->size = (n + 1) * (long)rl;
+		f->records = n;
+		f->refs = 1;
+		pipe_chunk *c = (pipe_chunk*) calloc( 1, sizeof(pipe_chunk) );
+		c->file = f;
+		c->first = 1;
+		c->last = n;
+		if( slot != NULL ) {
+			c->slot = slot;
+			c->text.buf = slot + f->size;
+			c->text.size = pool->bufSize() - f->size;
+		}
+		deal( c );
+	}
+	delete r;
+	return ok;
+}
+
+
+/**
+ * Read data file fno as a whole. Returns its number of records or -1 with
+ * the error text in err.
+ */
+int Pipeline::loadFile( int fno, pipe_file **fp, char *err )
+{
+	pipe_file *f = new pipe_file;
+	f->buf = new FileBuf();
+	f->records = -1;
+	f->fields = ms->getRecord( fno )->field_bitset;
+	ms->dataPrefix( fno, f->pfx, NULL );
+
+	int cnt = -1;
+	bool ok = ms->readData( fno, f->buf, err );
+	if( ok ) {
+		f->data = f->buf->constBuf();
+		f->size = f->buf->len();
+		cnt = FDat( f->data, f->size, f->fields ).countRecords();
+	}
+	if( cnt < 0 ) {
+		if( ok ) {
+			snprintf( err, ERROR_LENGTH_PIPE, "fdat file unusable: %s",
+				f->buf->constName() );
+		}
+		delete f->buf;
+		delete f;
+		return -1;
+	}
+	*fp = f;
+	return cnt;
+}
+
+
+/* slice a loaded file of cnt records into chunks */
+void Pipeline::dealFile( pipe_file *f, int cnt )
+{
+	int len = FDat::sliceRecords( cnt, nformat );
+	int n = cnt > len ? (cnt + len - 1) / len : 1;
+	f->refs = n;
+
+	for( int i = 0; i < n; i++ ) {
+		pipe_chunk *c = (pipe_chunk*) calloc( 1, sizeof(pipe_chunk) );
+		c->file = f;
+		c->first = i * len + 1;
+		c->last = i == n - 1 ? cnt : (i + 1) * len;
+		deal( c );
+	}
+}
+
+
+/* limits of a batch of files read in physical order */
+#define BATCH_FILES 1024
+#define BATCH_BYTES (256LL * 1024 * 1024)
+
+/* file of a batch */
+struct pipe_read
+{
+	int fno;
+	unsigned long long offset;
+	unsigned long long ino;
+	pipe_file *file;
+	int cnt;
+	char error[ERROR_LENGTH_PIPE];
+};
+
+static int cmp_disk_order( const void *a, const void *b )
+{
+	const pipe_read *ra = *(const pipe_read* const*) a;
+	const pipe_read *rb = *(const pipe_read* const*) b;
+	if( ra->offset != rb->offset ) {
+		return ra->offset < rb->offset ? -1 : 1;
+	}
+	if( ra->ino != rb->ino ) {
+		return ra->ino < rb->ino ? -1 : 1;
+	}
+	return ra->fno - rb->fno;
+}
+
+/**
+ * Reader stage for the whole (not streamed) files starting at fno with
+ * physical io order. A batch of files is read ahead sorted by position on
+ * disk, then dealt in file number order, so the writer needs no other
+ * reordering than for the chunks. Returns the file number to go on with
+ * or -1 on error.
+ */
+int Pipeline::readBatch( int fno )
+{
+	double t = wall_time();
+	pipe_read *batch = (pipe_read*) malloc( BATCH_FILES * sizeof(pipe_read) );
+	pipe_read **order = (pipe_read**) malloc( BATCH_FILES * sizeof(pipe_read*) );
+	int n = 0;
+	long long bytes = 0;
+	int max = ms->maxFileNumber();
+	for( ; fno <= max && n < BATCH_FILES && bytes < BATCH_BYTES; fno++ ) {
+		if( !ms->isSelected( fno ) ) {
+			continue;
+		}
+		long long size = ms->dataSize( fno );
+		if( size > FDAT_STREAM_SIZE ) {
+			break;
+		}
+		pipe_read *r = &batch[n];
+		r->fno = fno;
+		r->offset = ms->diskOrder( fno );
+		r->ino = ms->getRecord( fno )->file_ino;
+		r->file = NULL;
+		r->cnt = -1;
+		*r->error = '\0';
+		order[n++] = r;
+		bytes += size > 0 ? size : 0;
+	}
+	qsort( order, n, sizeof(pipe_read*), cmp_disk_order );
+	for( int i = 0; i < n && !ring_load( &aborted ); i++ ) {
+		order[i]->cnt = loadFile( order[i]->fno, &order[i]->file,
+			order[i]->error );
+	}
+	read_busy += wall_time() - t;
+	batches++;
+	batch_files += n;
+
+	for( int i = 0; i < n; i++ ) {
+		pipe_read *r = &batch[i];
+		if( fno >= 0 && r->file != NULL ) {
+			dealFile( r->file, r->cnt );
+			continue;
+		}
+		if( fno >= 0 ) {
+			/* the first failed file ends the batch, no matter if it has
+			   been read first */
+			if( !ring_load( &aborted ) ) {
+				dealError( r->error );
+			}
+			fno = -1;
+		}
+		if( r->file != NULL ) {
+			delete r->file->buf;
+			delete r->file;
+		}
+	}
+	free( order );
+	free( batch );
+	return fno;
+}
+
+
+/* reader stage */
+void Pipeline::readFiles()
+{
+	int max = ms->maxFileNumber();
+	int fno = 1;
+	int ahead = 0;
+	while( fno <= max ) {
+		if( !ms->isSelected( fno ) ) {
+			fno++;
+			continue;
+		}
+		if( ring_load( &aborted ) ) {
+			break;
+		}
+		ms->prefetchData( fno, &ahead );
+		if( pool != NULL || ms->dataSize( fno ) > FDAT_STREAM_SIZE ) {
+			if( !streamFile( fno ) ) {
+				break;
+			}
+			fno++;
+			continue;
+		}
+		if( physical ) {
+			fno = readBatch( fno );
+			if( fno < 0 ) {
+				break;
+			}
+			continue;
+		}
+
+		double t = wall_time();
+		char err[ERROR_LENGTH_PIPE];
+		pipe_file *f;
+		int cnt = loadFile( fno, &f, err );
+		read_busy += wall_time() - t;
+		if( cnt < 0 ) {
+			dealError( err );
+			break;
+		}
+		dealFile( f, cnt );
+		fno++;
+	}
+	deal( NULL );
+}
+
+
+/* formatter stage k */
+void Pipeline::formatChunks( int k )
+{
+	int spins = 0;
+	while( true ) {
+		void *p;
+		if( !to_format[k]->pop( &p ) ) {
+			format_wait[k] += backoff( &spins );
+			continue;
+		}
+		spins = 0;
+		pipe_chunk *c = (pipe_chunk*) p;
+		if( c != NULL && c->file != NULL ) {
+			double t = wall_time();
+			pipe_file *f = c->file;
+			if( !ring_load( &aborted ) && c->first <= c->last ) {
+				FDat datfile( f->data, f->size, f->fields, f->records );
+				datfile.format( f->pfx, c->first, c->last, &c->text );
+			}
+			if( ring_add( &f->refs, -1 ) == 0 ) {
+				delete f->buf;
+				delete f;
+			}
+			c->file = NULL;
+			format_busy[k] += wall_time() - t;
+		}
+		while( !to_write->push( c ) ) {
+			format_wait[k] += backoff( &spins );
+		}
+		if( c == NULL ) {
+			break;
+		}
+	}
+}
+
+
+/* writer stage, chunks are written ordered by their sequence number */
+bool Pipeline::writeChunks()
+{
+	pipe_chunk **slots = (pipe_chunk**) calloc( window, sizeof(pipe_chunk*) );
+	long next = 0;
+	int ended = 0;
+	int spins = 0;
+	bool ok = true;
+
+	while( ended < nformat ) {
+		void *p;
+		if( !to_write->pop( &p ) ) {
+			write_wait += backoff( &spins );
+			continue;
+		}
+		spins = 0;
+		if( p == NULL ) {
+			ended++;
+			continue;
+		}
+		pipe_chunk *c = (pipe_chunk*) p;
+		slots[c->seq % window] = c;
+
+		double t = wall_time();
+		while( (c = slots[next % window]) != NULL ) {
+			if( ok && *c->error != '\0' ) {
+				setError( c->error );
+				ok = false;
+			} else if( ok && FDat::write( &c->text ) < 0 ) {
+				setError( "writing interrupted" );
+				ok = false;
+			}
+			if( !ok ) {
+				ring_store( &aborted, 1 );
+			}
+			if( c->slot != NULL ) {
+				pool->put( c->slot );
+			} else {
+				free( c->text.buf );
+			}
+			free( c );
+			slots[next % window] = NULL;
+			next++;
+			ring_add( &in_flight, -1 );
+		}
+		write_busy += wall_time() - t;
+	}
+	free( slots );
+	return ok;
+}
+
+
+/**
+ * Print the time series of all selected files of ms.
+ */
+bool Pipeline::run( const Metastock *m )
+{
+#if defined HAVE_PTHREAD && defined HAVE_ATOMIC_BUILTINS
+	ms = m;
+	double t = wall_time();
+
+	pthread_t reader;
+	pthread_t *formatters = (pthread_t*) malloc( nformat * sizeof(pthread_t) );
+	pipe_thread *args = (pipe_thread*) malloc( nformat * sizeof(pipe_thread) );
+	int started = 0;
+	for( ; started < nformat; started++ ) {
+		args[started].pl = this;
+		args[started].k = started;
+		if( pthread_create( &formatters[started], NULL, formatter_main,
+				&args[started] ) != 0 ) {
+			break;
+		}
+	}
+	bool ok = started == nformat
+		&& pthread_create( &reader, NULL, reader_main, this ) == 0;
+	if( !ok ) {
+		/* end the formatters we have got */
+		setError( "pipeline", "can't create threads" );
+		for( int k = 0; k < started; k++ ) {
+			to_format[k]->push( NULL );
+		}
+		for( int k = 0; k < started; k++ ) {
+			pthread_join( formatters[k], NULL );
+		}
+	} else {
+		ok = writeChunks();
+		pthread_join( reader, NULL );
+		for( int k = 0; k < nformat; k++ ) {
+			pthread_join( formatters[k], NULL );
+		}
+	}
+	free( formatters );
+	free( args );
+
+	elapsed = wall_time() - t;
+	return ok;
+#else
+	(void) m;
+	setError( "pipeline", "not supported" );
+	return false;
+#endif
+}
+
+
+static double percent( double part, double total )
+{
+	return total > 0.0 ? 100.0 * part / total : 0.0;
+}
+
+/**
+ * Utilization per stage, busy time relative to the elapsed time (of all
+ * threads of the stage). The stage which is busy most is the bottleneck.
+ */
+void Pipeline::printStats( FILE *f ) const
+{
+	double fbusy = 0.0;
+	double fwait = 0.0;
+	for( int k = 0; k < nformat; k++ ) {
+		fbusy += format_busy[k];
+		fwait += format_wait[k];
+	}
+	fprintf( f, "pipeline: %ld chunks, %d formatters, max %ld of %d in "
+		"flight, %.3f s\n", chunks, nformat, max_in_flight, window, elapsed );
+	fprintf( f, "pipeline: read %.1f%% busy %.1f%% blocked, "
+		"format %.1f%% busy %.1f%% idle, write %.1f%% busy %.1f%% idle\n",
+		percent( read_busy, elapsed ), percent( read_wait, elapsed ),
+		percent( fbusy, elapsed * nformat ), percent( fwait, elapsed * nformat ),
+		percent( write_busy, elapsed ), percent( write_wait, elapsed ) );
+	if( pool != NULL ) {
+		fprintf( f, "pipeline: max %d of %d buffers of %ld bytes used\n",
+			pool->maxUsed(), pool->buffers(), pool->bufSize() );
+	}
+	if( physical ) {
+		fprintf( f, "pipeline: %ld files read in physical order, %ld "
+			"batches\n", batch_files, batches );
+	}
+}
+
+
+const char* Pipeline::lastError() const
+{
+	return error;
+}
+
+
+void Pipeline::setError( const char* e1, const char* e2 ) const
+{
+	if( e2 == NULL || *e2 == '\0' ) {
+		snprintf( error, ERROR_LENGTH_PIPE, "%s", e1);
+	} else {
+		snprintf( error, ERROR_LENGTH_PIPE, "%s: %s", e1, e2 );
+	}
+}
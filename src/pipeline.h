@@ -0,0 +1,117 @@
+/*** pipeline.h -- read, format and write stages connected by rings
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_PIPELINE_H
+#define ATEM_PIPELINE_H
+
+#include <stdio.h>
+
+class Metastock;
+class SpscRing;
+class MpscRing;
+class BufPool;
+struct pipe_chunk;
+struct pipe_file;
+
+
+#define ERROR_LENGTH_PIPE 256
+
+/**
+ * Converts the selected data files of a directory in three stages. One
+ * reader thread reads the files and deals record slices (chunks) to the
+ * formatter threads, each through its own SPSC ring. The formatters hand
+ * the text to the writer (the calling thread) through one MPSC ring, the
+ * writer restores the order. The number of chunks in flight is limited,
+ * so the reader blocks if formatters or writer can't keep up. With a memory
+ * limit files are read window by window into the buffers of a BufPool.
+ * With physical order batches of files are read by their position on disk.
+ */
+class Pipeline
+{
+	public:
+		Pipeline( int nthreads, long long max_memory = 0,
+			bool physical = false );
+		~Pipeline();
+
+		bool run( const Metastock *ms );
+		void printStats( FILE *f ) const;
+		const char* lastError() const;
+
+	private:
+		static void* reader_main( void *arg );
+		static void* formatter_main( void *arg );
+		void readFiles();
+		bool streamFile( int fno );
+		int loadFile( int fno, pipe_file **fp, char *err );
+		void dealFile( pipe_file *f, int cnt );
+		int readBatch( int fno );
+		void formatChunks( int k );
+		bool writeChunks();
+		void deal( pipe_chunk *c );
+		void dealError( const char *e1, const char *e2 = NULL );
+		void setError( const char* e1, const char* e2 = "" ) const;
+
+		const Metastock *ms;
+		bool physical;
+		int nformat;
+		int window;
+		BufPool *pool;
+		SpscRing **to_format;
+		MpscRing *to_write;
+		long in_flight;
+		long aborted;
+		long max_in_flight;
+		long chunks;
+		long batches;
+		long batch_files;
+
+		/* seconds busy resp. waiting per stage */
+		double read_busy;
+		double read_wait;
+		double *format_busy;
+		double *format_wait;
+		double write_busy;
+		double write_wait;
+		double elapsed;
+
+		mutable char error[ERROR_LENGTH_PIPE];
+};
+
+
+
+
+#endif
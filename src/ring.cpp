@@ -0,0 +1,166 @@
+/*** ring.cpp -- bounded lock-free rings of pointers
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "ring.h"
+
+#include <stdlib.h>
+
+
+
+static long round_pow2( int size )
+{
+	long n = 2;
+	while( n < size ) {
+		n *= 2;
+	}
+	return n;
+}
+
+
+SpscRing::SpscRing( int size ) :
+	slots( NULL ),
+	mask( round_pow2(size) - 1 ),
+	head( 0 ),
+	tail( 0 )
+{
+	slots = (void**) calloc( mask + 1, sizeof(void*) );
+}
+
+
+SpscRing::~SpscRing()
+{
+	free( slots );
+}
+
+
+/**
+ * Append p, false if the ring is full. Producer thread only.
+ */
+bool SpscRing::push( void *p )
+{
+	long t = tail;
+	if( t - ring_load( &head ) > mask ) {
+		return false;
+	}
+	slots[t & mask] = p;
+	ring_store( &tail, t + 1 );
+	return true;
+}
+
+
+/**
+ * Take the oldest pointer, false if the ring is empty. Consumer thread only.
+ */
+bool SpscRing::pop( void **p )
+{
+	long h = head;
+	if( h == ring_load( &tail ) ) {
+		return false;
+	}
+	*p = slots[h & mask];
+	ring_store( &head, h + 1 );
+	return true;
+}
+
+
+
+
+struct mpsc_cell
+{
+	long seq;
+	void *data;
+};
+
+
+MpscRing::MpscRing( int size ) :
+	cells( NULL ),
+	mask( round_pow2(size) - 1 ),
+	head( 0 ),
+	tail( 0 )
+{
+	cells = (mpsc_cell*) malloc( (mask + 1) * sizeof(mpsc_cell) );
+	for( long i = 0; i <= mask; i++ ) {
+		cells[i].seq = i;
+		cells[i].data = NULL;
+	}
+}
+
+
+MpscRing::~MpscRing()
+{
+	free( cells );
+}
+
+
+/**
+ * Append p, false if the ring is full. Any thread. A producer reserves a
+ * cell by moving tail, the cell's sequence publishes the data.
+ */
+bool MpscRing::push( void *p )
+{
+	long pos = ring_load( &tail );
+	while( true ) {
+		mpsc_cell *c = &cells[pos & mask];
+		long dif = ring_load( &c->seq ) - pos;
+		if( dif == 0 ) {
+			if( ring_cas( &tail, pos, pos + 1 ) ) {
+				c->data = p;
+				ring_store( &c->seq, pos + 1 );
+				return true;
+			}
+		} else if( dif < 0 ) {
+			return false;
+		}
+		pos = ring_load( &tail );
+	}
+}
+
+
+/**
+ * Take the oldest pointer, false if the ring is empty. Consumer thread only.
+ */
+bool MpscRing::pop( void **p )
+{
+	mpsc_cell *c = &cells[head & mask];
+	if( ring_load( &c->seq ) != head + 1 ) {
+		return false;
+	}
+	*p = c->data;
+	ring_store( &c->seq, head + mask + 1 );
+	head++;
+	return true;
+}
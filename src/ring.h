@@ -0,0 +1,142 @@
+/*** ring.h -- bounded lock-free rings of pointers
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_RING_H
+#define ATEM_RING_H
+
+#include "config.h"
+
+
+/* the few atomic operations we need, plain accesses without threads */
+#if defined HAVE_ATOMIC_BUILTINS
+inline long ring_load( const long *p )
+{
+	return __atomic_load_n( p, __ATOMIC_ACQUIRE );
+}
+inline void ring_store( long *p, long v )
+{
+	__atomic_store_n( p, v, __ATOMIC_RELEASE );
+}
+inline long ring_add( long *p, long v )
+{
+	return __atomic_add_fetch( p, v, __ATOMIC_ACQ_REL );
+}
+inline bool ring_cas( long *p, long expected, long v )
+{
+	return __atomic_compare_exchange_n( p, &expected, v, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE );
+}
+#else
+inline long ring_load( const long *p )
+{
+	return *p;
+}
+inline void ring_store( long *p, long v )
+{
+	*p = v;
+}
+inline long ring_add( long *p, long v )
+{
+	return *p += v;
+}
+inline bool ring_cas( long *p, long expected, long v )
+{
+	if( *p != expected ) {
+		return false;
+	}
+	*p = v;
+	return true;
+}
+#endif
+
+/* keep producer and consumer positions on different cache lines */
+#define RING_PAD 64
+
+
+/**
+ * Bounded lock-free FIFO of pointers for one producer and one consumer
+ * thread. The size is rounded up to a power of two.
+ */
+class SpscRing
+{
+	public:
+		SpscRing( int size );
+		~SpscRing();
+
+		bool push( void *p );
+		bool pop( void **p );
+
+	private:
+		void **slots;
+		long mask;
+		char pad0[RING_PAD];
+		long head;
+		char pad1[RING_PAD];
+		long tail;
+		char pad2[RING_PAD];
+};
+
+
+struct mpsc_cell;
+
+/**
+ * Bounded lock-free FIFO of pointers for many producers and one consumer,
+ * each cell carries a sequence number telling whether it's free or filled.
+ */
+class MpscRing
+{
+	public:
+		MpscRing( int size );
+		~MpscRing();
+
+		bool push( void *p );
+		bool pop( void **p );
+
+	private:
+		mpsc_cell *cells;
+		long mask;
+		char pad0[RING_PAD];
+		long head;
+		char pad1[RING_PAD];
+		long tail;
+		char pad2[RING_PAD];
+};
+
+
+
+
+#endif
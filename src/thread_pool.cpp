@@ -0,0 +1,709 @@
+/*** thread_pool.cpp -- simple worker thread pool
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#if defined HAVE_PTHREAD
+# include <pthread.h>
+#endif
+
+
+
+int ThreadPool::onlineCpus()
+{
+#if defined _SC_NPROCESSORS_ONLN
+	long n = sysconf( _SC_NPROCESSORS_ONLN );
+	if( n > 0 ) {
+		return (int) n;
+	}
+#endif
+	return 1;
+}
+
+
+#if defined HAVE_PTHREAD
+
+struct pool_job
+{
+	pool_job_func func;
+	void *arg;
+	pool_job *next;
+};
+
+struct pool_impl
+{
+	pthread_mutex_t mtx;
+	pthread_cond_t cond_job;
+	pthread_cond_t cond_idle;
+	pool_job *head;
+	pool_job *tail;
+	int pending; /* queued plus running */
+	bool quit;
+	pthread_t *tids;
+};
+
+
+static void* pool_worker( void *p )
+{
+	pool_impl *pi = (pool_impl*) p;
+
+	pthread_mutex_lock( &pi->mtx );
+	while( true ) {
+		while( pi->head == NULL && !pi->quit ) {
+			pthread_cond_wait( &pi->cond_job, &pi->mtx );
+		}
+		if( pi->head == NULL ) {
+			break;
+		}
+		pool_job *job = pi->head;
+		pi->head = job->next;
+		if( pi->head == NULL ) {
+			pi->tail = NULL;
+		}
+		pthread_mutex_unlock( &pi->mtx );
+
+		job->func( job->arg );
+		free( job );
+
+		pthread_mutex_lock( &pi->mtx );
+		pi->pending--;
+		pthread_cond_broadcast( &pi->cond_idle );
+	}
+	pthread_mutex_unlock( &pi->mtx );
+	return NULL;
+}
+
+
+ThreadPool::ThreadPool( int n ) :
+	impl( NULL ),
+	nthreads( n > 0 ? n : 1 )
+{
+	impl = new pool_impl;
+	pthread_mutex_init( &impl->mtx, NULL );
+	pthread_cond_init( &impl->cond_job, NULL );
+	pthread_cond_init( &impl->cond_idle, NULL );
+	impl->head = impl->tail = NULL;
+	impl->pending = 0;
+	impl->quit = false;
+	impl->tids = (pthread_t*) malloc( nthreads * sizeof(pthread_t) );
+
+	for( int i = 0; i < nthreads; i++ ) {
+		if( pthread_create( &impl->tids[i], NULL, pool_worker, impl ) != 0 ) {
+			/* run with what we got, at least submit() works inline */
+			nthreads = i;
+			break;
+		}
+	}
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	pthread_mutex_lock( &impl->mtx );
+	impl->quit = true;
+	pthread_cond_broadcast( &impl->cond_job );
+	pthread_mutex_unlock( &impl->mtx );
+
+	for( int i = 0; i < nthreads; i++ ) {
+		pthread_join( impl->tids[i], NULL );
+	}
+	assert( impl->head == NULL );
+
+	free( impl->tids );
+	pthread_cond_destroy( &impl->cond_idle );
+	pthread_cond_destroy( &impl->cond_job );
+	pthread_mutex_destroy( &impl->mtx );
+	delete impl;
+}
+
+
+void ThreadPool::submit( pool_job_func func, void *arg )
+{
+	if( nthreads == 0 ) {
+		func( arg );
+		return;
+	}
+
+	pool_job *job = (pool_job*) malloc( sizeof(pool_job) );
+	job->func = func;
+	job->arg = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock( &impl->mtx );
+	if( impl->tail != NULL ) {
+		impl->tail->next = job;
+	} else {
+		impl->head = job;
+	}
+	impl->tail = job;
+	impl->pending++;
+	pthread_cond_signal( &impl->cond_job );
+	pthread_mutex_unlock( &impl->mtx );
+}
+
+
+/**
+ * Block until at most max_pending jobs are queued or running, 0 means until
+ * all jobs are done.
+ */
+void ThreadPool::wait( int max_pending )
+{
+	pthread_mutex_lock( &impl->mtx );
+	while( impl->pending > max_pending ) {
+		pthread_cond_wait( &impl->cond_idle, &impl->mtx );
+	}
+	pthread_mutex_unlock( &impl->mtx );
+}
+
+
+
+
+struct steal_deque
+{
+	pthread_mutex_t mtx;
+	int head;
+	int tail;
+	int *jobs;
+};
+
+struct steal_worker
+{
+	steal_impl *si;
+	int id;
+	int steals;
+};
+
+struct steal_impl
+{
+	pool_job *jobs;
+	int njobs;
+	int size;
+	steal_deque *deques;
+	steal_worker *workers;
+	pthread_t *tids;
+	int ndeques;
+	int started;
+};
+
+
+static int steal_take( steal_deque *dq, bool front )
+{
+	int j = -1;
+	pthread_mutex_lock( &dq->mtx );
+	if( dq->head < dq->tail ) {
+		j = front ? dq->jobs[dq->head++] : dq->jobs[--dq->tail];
+	}
+	pthread_mutex_unlock( &dq->mtx );
+	return j;
+}
+
+static void* steal_run( void *p )
+{
+	steal_worker *w = (steal_worker*) p;
+	steal_impl *si = w->si;
+	int n = si->ndeques;
+
+	while( true ) {
+		int j = steal_take( &si->deques[w->id], true );
+		for( int v = 1; j < 0 && v < n; v++ ) {
+			j = steal_take( &si->deques[(w->id + v) % n], false );
+			if( j >= 0 ) {
+				w->steals++;
+			}
+		}
+		if( j < 0 ) {
+			/* no job creates new jobs, so we are done */
+			break;
+		}
+		si->jobs[j].func( si->jobs[j].arg );
+	}
+	return NULL;
+}
+
+
+StealPool::StealPool( int n ) :
+	impl( NULL ),
+	nthreads( n > 0 ? n : 1 )
+{
+	impl = new steal_impl;
+	impl->jobs = NULL;
+	impl->njobs = impl->size = 0;
+	impl->deques = (steal_deque*) calloc( nthreads, sizeof(steal_deque) );
+	impl->workers = (steal_worker*) calloc( nthreads, sizeof(steal_worker) );
+	impl->tids = (pthread_t*) malloc( nthreads * sizeof(pthread_t) );
+	impl->ndeques = 0;
+	impl->started = 0;
+	for( int i = 0; i < nthreads; i++ ) {
+		pthread_mutex_init( &impl->deques[i].mtx, NULL );
+		impl->workers[i].si = impl;
+		impl->workers[i].id = i;
+	}
+}
+
+
+StealPool::~StealPool()
+{
+	wait();
+	for( int i = 0; i < nthreads; i++ ) {
+		pthread_mutex_destroy( &impl->deques[i].mtx );
+		free( impl->deques[i].jobs );
+	}
+	free( impl->deques );
+	free( impl->workers );
+	free( impl->tids );
+	free( impl->jobs );
+	delete impl;
+}
+
+
+void StealPool::add( pool_job_func func, void *arg )
+{
+	assert( impl->ndeques == 0 );
+	if( impl->njobs == impl->size ) {
+		impl->size = impl->size * 2 + 16;
+		impl->jobs = (pool_job*) realloc( impl->jobs,
+			impl->size * sizeof(pool_job) );
+	}
+	impl->jobs[impl->njobs].func = func;
+	impl->jobs[impl->njobs].arg = arg;
+	impl->jobs[impl->njobs].next = NULL;
+	impl->njobs++;
+}
+
+
+/**
+ * Deal all added jobs to the workers and start them, returns immediately.
+ */
+void StealPool::start()
+{
+	assert( impl->ndeques == 0 );
+	int n = nthreads < impl->njobs ? nthreads : impl->njobs;
+	for( int i = 0; i < n; i++ ) {
+		steal_deque *dq = &impl->deques[i];
+		dq->jobs = (int*) realloc( dq->jobs,
+			(impl->njobs / n + 1) * sizeof(int) );
+		dq->head = dq->tail = 0;
+		for( int j = i; j < impl->njobs; j += n ) {
+			dq->jobs[dq->tail++] = j;
+		}
+	}
+
+	/* jobs of workers which could not be started get stolen */
+	impl->ndeques = n;
+	while( impl->started < n ) {
+		if( pthread_create( &impl->tids[impl->started], NULL, steal_run,
+				&impl->workers[impl->started] ) != 0 ) {
+			break;
+		}
+		impl->started++;
+	}
+	if( impl->started == 0 && n > 0 ) {
+		/* no threads at all, run everything here */
+		steal_run( &impl->workers[0] );
+	}
+}
+
+
+/**
+ * Block until all jobs are done. Jobs may be added and started again.
+ */
+void StealPool::wait()
+{
+	for( int i = 0; i < impl->started; i++ ) {
+		pthread_join( impl->tids[i], NULL );
+	}
+	impl->ndeques = 0;
+	impl->started = 0;
+	impl->njobs = 0;
+}
+
+
+int StealPool::steals() const
+{
+	int n = 0;
+	for( int i = 0; i < nthreads; i++ ) {
+		n += impl->workers[i].steals;
+	}
+	return n;
+}
+
+
+
+
+PoolMutex::PoolMutex() :
+	impl( NULL )
+{
+	pthread_mutex_t *m = new pthread_mutex_t;
+	pthread_mutex_init( m, NULL );
+	impl = m;
+}
+
+PoolMutex::~PoolMutex()
+{
+	pthread_mutex_t *m = (pthread_mutex_t*) impl;
+	pthread_mutex_destroy( m );
+	delete m;
+}
+
+void PoolMutex::lock()
+{
+	pthread_mutex_lock( (pthread_mutex_t*) impl );
+}
+
+void PoolMutex::unlock()
+{
+	pthread_mutex_unlock( (pthread_mutex_t*) impl );
+}
+
+
+
+
+struct event_impl
+{
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+};
+
+PoolEvent::PoolEvent() :
+	impl( NULL ),
+	done( false )
+{
+	event_impl *ei = new event_impl;
+	pthread_mutex_init( &ei->mtx, NULL );
+	pthread_cond_init( &ei->cond, NULL );
+	impl = ei;
+}
+
+PoolEvent::~PoolEvent()
+{
+	event_impl *ei = (event_impl*) impl;
+	pthread_cond_destroy( &ei->cond );
+	pthread_mutex_destroy( &ei->mtx );
+	delete ei;
+}
+
+void PoolEvent::reset()
+{
+	done = false;
+}
+
+void PoolEvent::set()
+{
+	event_impl *ei = (event_impl*) impl;
+	pthread_mutex_lock( &ei->mtx );
+	done = true;
+	pthread_cond_broadcast( &ei->cond );
+	pthread_mutex_unlock( &ei->mtx );
+}
+
+void PoolEvent::wait()
+{
+	event_impl *ei = (event_impl*) impl;
+	pthread_mutex_lock( &ei->mtx );
+	while( !done ) {
+		pthread_cond_wait( &ei->cond, &ei->mtx );
+	}
+	pthread_mutex_unlock( &ei->mtx );
+}
+
+
+
+
+BufPool::BufPool( long long budget, long size ) :
+	impl( NULL ),
+	buf_size( size ),
+	nbufs( budget / size ),
+	used( 0 ),
+	max_used( 0 ),
+	nfree( 0 ),
+	free_bufs( (char**) malloc( nbufs * sizeof(char*) ) )
+{
+	event_impl *ei = new event_impl;
+	pthread_mutex_init( &ei->mtx, NULL );
+	pthread_cond_init( &ei->cond, NULL );
+	impl = ei;
+}
+
+BufPool::~BufPool()
+{
+	event_impl *ei = (event_impl*) impl;
+	assert( used == 0 );
+	for( int i = 0; i < nfree; i++ ) {
+		free( free_bufs[i] );
+	}
+	free( free_bufs );
+	pthread_cond_destroy( &ei->cond );
+	pthread_mutex_destroy( &ei->mtx );
+	delete ei;
+}
+
+char* BufPool::get()
+{
+	event_impl *ei = (event_impl*) impl;
+	pthread_mutex_lock( &ei->mtx );
+	while( used >= nbufs ) {
+		pthread_cond_wait( &ei->cond, &ei->mtx );
+	}
+	char *buf = take();
+	pthread_mutex_unlock( &ei->mtx );
+	return buf;
+}
+
+void BufPool::put( char *buf )
+{
+	event_impl *ei = (event_impl*) impl;
+	pthread_mutex_lock( &ei->mtx );
+	give( buf );
+	pthread_cond_signal( &ei->cond );
+	pthread_mutex_unlock( &ei->mtx );
+}
+
+int BufPool::maxUsed() const
+{
+	event_impl *ei = (event_impl*) impl;
+	pthread_mutex_lock( &ei->mtx );
+	int n = max_used;
+	pthread_mutex_unlock( &ei->mtx );
+	return n;
+}
+
+
+#else /* no pthreads, everything runs inline */
+
+struct steal_impl
+{
+	pool_job_func *funcs;
+	void **args;
+	int njobs;
+};
+
+StealPool::StealPool( int ) :
+	impl( new steal_impl ),
+	nthreads( 1 )
+{
+	impl->funcs = NULL;
+	impl->args = NULL;
+	impl->njobs = 0;
+}
+
+StealPool::~StealPool()
+{
+	free( impl->funcs );
+	free( impl->args );
+	delete impl;
+}
+
+void StealPool::add( pool_job_func func, void *arg )
+{
+	impl->funcs = (pool_job_func*) realloc( impl->funcs,
+		(impl->njobs + 1) * sizeof(pool_job_func) );
+	impl->args = (void**) realloc( impl->args,
+		(impl->njobs + 1) * sizeof(void*) );
+	impl->funcs[impl->njobs] = func;
+	impl->args[impl->njobs] = arg;
+	impl->njobs++;
+}
+
+void StealPool::start()
+{
+	for( int i = 0; i < impl->njobs; i++ ) {
+		impl->funcs[i]( impl->args[i] );
+	}
+	impl->njobs = 0;
+}
+
+void StealPool::wait()
+{
+}
+
+int StealPool::steals() const
+{
+	return 0;
+}
+
+
+ThreadPool::ThreadPool( int ) :
+	impl( NULL ),
+	nthreads( 0 )
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+}
+
+void ThreadPool::submit( pool_job_func func, void *arg )
+{
+	func( arg );
+}
+
+void ThreadPool::wait( int )
+{
+}
+
+
+PoolMutex::PoolMutex() :
+	impl( NULL )
+{
+}
+
+PoolMutex::~PoolMutex()
+{
+}
+
+void PoolMutex::lock()
+{
+}
+
+void PoolMutex::unlock()
+{
+}
+
+
+PoolEvent::PoolEvent() :
+	impl( NULL ),
+	done( false )
+{
+}
+
+PoolEvent::~PoolEvent()
+{
+}
+
+void PoolEvent::reset()
+{
+	done = false;
+}
+
+void PoolEvent::set()
+{
+	done = true;
+}
+
+void PoolEvent::wait()
+{
+	assert( done );
+}
+
+
+BufPool::BufPool( long long budget, long size ) :
+	impl( NULL ),
+	buf_size( size ),
+	nbufs( budget / size ),
+	used( 0 ),
+	max_used( 0 ),
+	nfree( 0 ),
+	free_bufs( (char**) malloc( nbufs * sizeof(char*) ) )
+{
+}
+
+BufPool::~BufPool()
+{
+	assert( used == 0 );
+	for( int i = 0; i < nfree; i++ ) {
+		free( free_bufs[i] );
+	}
+	free( free_bufs );
+}
+
+char* BufPool::get()
+{
+	/* nobody could ever put a buffer back */
+	assert( used < nbufs );
+	return take();
+}
+
+void BufPool::put( char *buf )
+{
+	give( buf );
+}
+
+int BufPool::maxUsed() const
+{
+	return max_used;
+}
+
+#endif
+
+
+/* take a free buffer, the caller made sure there is one */
+char* BufPool::take()
+{
+	used++;
+	if( used > max_used ) {
+		max_used = used;
+	}
+	if( nfree > 0 ) {
+		return free_bufs[--nfree];
+	}
+	return (char*) malloc( buf_size );
+}
+
+void BufPool::give( char *buf )
+{
+	assert( used > 0 && nfree < nbufs );
+	used--;
+	free_bufs[nfree++] = buf;
+}
+
+long BufPool::bufSize() const
+{
+	return buf_size;
+}
+
+int BufPool::buffers() const
+{
+	return nbufs;
+}
+
+
+int ThreadPool::threads() const
+{
+	return nthreads;
+}
+
+
+int StealPool::threads() const
+{
+	return nthreads;
+}
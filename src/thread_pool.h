@@ -0,0 +1,164 @@
+/*** thread_pool.h -- simple worker thread pool
+ *
+ * Copyright (C) 2013 Ruediger Meier
+ *
+ * Author:  Ruediger Meier <sweet_f_a@gmx.de>
+ *
+ * This file is part of atem.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the author nor the names of any contributors
+ *    may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ ***/
+
+#ifndef ATEM_THREAD_POOL_H
+#define ATEM_THREAD_POOL_H
+
+
+
+
+typedef void (*pool_job_func)( void *arg );
+
+struct pool_impl;
+struct steal_impl;
+
+/**
+ * Fixed size pool of worker threads running submitted jobs in FIFO order.
+ * Without pthreads support jobs are simply executed within submit().
+ */
+class ThreadPool
+{
+	public:
+		ThreadPool( int nthreads );
+		~ThreadPool();
+
+		static int onlineCpus();
+
+		int threads() const;
+		void submit( pool_job_func func, void *arg );
+		void wait( int max_pending = 0 );
+
+	private:
+		pool_impl *impl;
+		int nthreads;
+};
+
+
+/**
+ * Runs a fixed set of jobs on worker threads which own one deque each. Jobs
+ * are dealt round-robin in the order of add(). Workers take their own jobs
+ * from the front and steal from the back of the others when idle, so the
+ * most expensive jobs should be added first.
+ */
+class StealPool
+{
+	public:
+		StealPool( int nthreads );
+		~StealPool();
+
+		int threads() const;
+		void add( pool_job_func func, void *arg );
+		void start();
+		void wait();
+		int steals() const;
+
+	private:
+		steal_impl *impl;
+		int nthreads;
+};
+
+
+/**
+ * Plain mutex, a no-op without pthreads.
+ */
+class PoolMutex
+{
+	public:
+		PoolMutex();
+		~PoolMutex();
+
+		void lock();
+		void unlock();
+
+	private:
+		void *impl;
+};
+
+
+/**
+ * One-shot completion flag a submitter can block on.
+ */
+class PoolEvent
+{
+	public:
+		PoolEvent();
+		~PoolEvent();
+
+		void reset();
+		void set();
+		void wait();
+
+	private:
+		void *impl;
+		bool done;
+};
+
+
+/**
+ * Memory budget split into equal sized buffers. get() blocks until one of
+ * them is free, so the users of a pool never hold more than the budget.
+ * Buffers are allocated on first use and kept until the pool is deleted.
+ */
+class BufPool
+{
+	public:
+		BufPool( long long budget, long buf_size );
+		~BufPool();
+
+		long bufSize() const;
+		int buffers() const;
+		int maxUsed() const;
+		char* get();
+		void put( char *buf );
+
+	private:
+		char* take();
+		void give( char *buf );
+
+		void *impl;
+		const long buf_size;
+		const int nbufs;
+		int used;
+		int max_used;
+		int nfree;
+		char **free_bufs;
+};
+
+
+
+
+#endif
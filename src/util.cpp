@@ -37,10 +37,21 @@
 
 #include "util.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "config.h"
 
+#if defined _WIN32
+# include <io.h>
+#endif
+
 
 #if defined FAST_PRINTING
 	#define itoa_int32 itoa
@@ -73,6 +84,28 @@ int ftoa_prec_f0(char *s, float f )
 
 
 
+/**
+ * Parse YYYY-MM-DD into YYYYMMDD, -1 on error.
+ */
+int str2date( const char* s)
+{
+	int y, m, d;
+	y = m = d = 0;
+
+	int ret = sscanf( s, "%d-%d-%d", &y, &m, &d );
+
+	if( ret != 3 ) {
+		return -1;
+	}
+
+	if( !(y>=0 && y<=9999) ||  !(m>=1 && m<=12 ) || !(d>=1 && d<=31) ) {
+		return -1;
+	}
+
+	return 10000 * y + 100 * m + d;
+}
+
+
 int itodatestr( char *s, unsigned int n )
 {
 	if( n <= 0 || n >= 100000000 ) {
@@ -157,3 +190,156 @@ int itotimestr( char *s, unsigned int n )
 #endif
 	return 8;
 }
+
+
+double wall_time()
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+long long parse_size( const char *s )
+{
+	char *end;
+	errno = 0;
+	long long n = strtoll( s, &end, 10 );
+	if( end == s || n < 0 || errno != 0 ) {
+		return -1;
+	}
+	int shift = 0;
+	switch( *end ) {
+	case 'k': case 'K':
+		shift = 10;
+		break;
+	case 'm': case 'M':
+		shift = 20;
+		break;
+	case 'g': case 'G':
+		shift = 30;
+		break;
+	case '\0':
+		return n;
+	default:
+		return -1;
+	}
+	if( end[1] != '\0' || n > (LLONG_MAX >> shift) ) {
+		return -1;
+	}
+	return n << shift;
+}
+
+
+unsigned long long fnv1a_hash( const char *buf, unsigned long len )
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	const unsigned char *cp = (const unsigned char*) buf;
+	const unsigned char *end = cp + len;
+	while( cp < end ) {
+		h ^= *cp++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+bool read_all( int fd, char *buf, unsigned long len )
+{
+	while( len > 0 ) {
+		ssize_t n = read( fd, buf, len );
+		if( n <= 0 ) {
+			if( n < 0 && errno == EINTR ) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+
+bool pread_all( int fd, char *buf, unsigned long len, long long off )
+{
+	while( len > 0 ) {
+		ssize_t n = pread( fd, buf, len, off );
+		if( n <= 0 ) {
+			if( n < 0 && errno == EINTR ) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return true;
+}
+
+
+bool write_all( int fd, const char *buf, unsigned long len )
+{
+	while( len > 0 ) {
+		ssize_t n = write( fd, buf, len );
+		if( n < 0 ) {
+			if( errno == EINTR ) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+
+int make_dir( const char *path )
+{
+#if defined _WIN32
+	int ret = mkdir( path );
+#else
+	int ret = mkdir( path, 0777 );
+#endif
+	if( ret < 0 && errno == EEXIST ) {
+		return 0;
+	}
+	return ret;
+}
+
+
+/**
+ * Entries of different metastock directories are kept apart in
+ * sub directories named by a hash of the real directory path.
+ */
+char* cache_subdir( const char *cache_dir, const char *ms_dir )
+{
+	const char *key = ms_dir;
+#if defined HAVE_REALPATH
+	char *real = realpath( ms_dir, NULL );
+	if( real != NULL ) {
+		key = real;
+	}
+#endif
+	unsigned long long h = fnv1a_hash( key, strlen(key) );
+#if defined HAVE_REALPATH
+	free( real );
+#endif
+
+	if( make_dir( cache_dir ) < 0 ) {
+		return NULL;
+	}
+
+	size_t len = strlen( cache_dir ) + 1 + 16 + 2;
+	char *dir = (char*) malloc( len );
+	snprintf( dir, len, "%s/%016llx/", cache_dir, h );
+	if( make_dir( dir ) < 0 ) {
+		int e = errno;
+		free( dir );
+		errno = e;
+		return NULL;
+	}
+	return dir;
+}
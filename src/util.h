@@ -38,6 +38,7 @@
 #ifndef ATEM_UTILS_H
 #define ATEM_UTILS_H
 
+#include <stdint.h>
 
 
 
@@ -69,16 +70,75 @@ inline int trim_end( char *dst, const char *src, int len )
 }
 
 
+/* little endian integers of file formats (archive, catalog) */
+inline uint16_t get_u16( const unsigned char *p )
+{
+	return p[0] | (p[1] << 8);
+}
+
+inline uint32_t get_u32( const unsigned char *p )
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+		| ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline uint64_t get_u64( const unsigned char *p )
+{
+	return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+inline void put_u16( unsigned char *p, uint16_t v )
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+inline void put_u32( unsigned char *p, uint32_t v )
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+inline void put_u64( unsigned char *p, uint64_t v )
+{
+	put_u32( p, (uint32_t)v );
+	put_u32( p + 4, (uint32_t)(v >> 32) );
+}
+
+
 
 extern int itoa( char *s, int n );
 extern int ltoa( char *s, long n );
 
 extern int itodatestr( char *s, unsigned int n );
 extern int itotimestr( char *s, unsigned int n );
+extern int str2date( const char *s );
 
 extern int ftoa(char *s, float f );
 extern int ftoa_prec_f0(char *s, float f );
 
+/* wall clock seconds, only useful for differences */
+extern double wall_time();
+
+/* bytes given as number with optional suffix K, M or G, -1 if invalid */
+extern long long parse_size( const char *s );
+
+/* 64 bit FNV-1a hash */
+extern unsigned long long fnv1a_hash( const char *buf, unsigned long len );
+
+/* read(2)/write(2) until len bytes are done, false on error or EOF */
+extern bool read_all( int fd, char *buf, unsigned long len );
+extern bool write_all( int fd, const char *buf, unsigned long len );
+extern bool pread_all( int fd, char *buf, unsigned long len, long long off );
+
+/* mkdir(2) which does not fail if the directory exists already */
+extern int make_dir( const char *path );
+
+/* create and return (malloc'ed) per metastock directory cache path */
+extern char* cache_subdir( const char *cache_dir, const char *ms_dir );
+
 
 
 
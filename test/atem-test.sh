@@ -97,6 +97,49 @@ ts_sha1sum()
 	return 0
 }
 
+## ts_fdat SRC OUT COUNT [sparse]
+## Write data file OUT of COUNT copies of the only record of data file SRC.
+## The header counts COUNT + 1 modulo 65536 like metastock does. If sparse,
+## all records but the last one are left zero and are not actually written.
+ts_fdat()
+{
+	local src="${1}"
+	local out="${2}"
+	local count="${3}"
+	local rl=$(( `wc -c < "${src}"` / 2 ))
+	local n=$(( (count + 1) % 65536 ))
+	local k=1
+
+	{
+		head -c 2 "${src}"
+		printf "\\`printf %03o $((n % 256))`\\`printf %03o $((n / 256))`"
+		head -c ${rl} "${src}" | tail -c $((rl - 4))
+	} > "${out}" || return 1
+
+	if test "${4}" = "sparse"; then
+		truncate -s $((count * rl)) "${out}" || return 1
+		tail -c ${rl} "${src}" >> "${out}"
+		return
+	fi
+	tail -c ${rl} "${src}" > "${out}.rec"
+	while test ${k} -lt ${count}; do
+		cat "${out}.rec" "${out}.rec" > "${out}.rec2"
+		mv "${out}.rec2" "${out}.rec"
+		k=$((k * 2))
+	done
+	head -c $((count * rl)) "${out}.rec" >> "${out}"
+	rm -f "${out}.rec"
+}
+
+## ts_skip REASON
+## Skip the test, e.g. if it is too expensive to run by default.
+ts_skip()
+{
+	echo "skipped: ${1}"
+	rm -rf "${TS_TMPDIR}"
+	exit 77
+}
+
 tsp_create_env()
 {
 	TS_TMPDIR="`basename "${testfile}"`.tmpd"